@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -33,37 +34,16 @@
 #include "disk-io.h"
 #include "transaction.h"
 #include "utils.h"
+#include "volumes.h"
+#include "metadump.h"
 #include "version.h"
 
-
-#define HEADER_MAGIC		0xbd5c25e27295668bULL
-#define MAX_PENDING_SIZE	(256 * 1024)
-#define BLOCK_SIZE		1024
-#define BLOCK_MASK		(BLOCK_SIZE - 1)
-
-#define COMPRESS_NONE		0
-#define COMPRESS_ZLIB		1
-
-struct meta_cluster_item {
-	__le64 bytenr;
-	__le32 size;
-} __attribute__ ((__packed__));
-
-struct meta_cluster_header {
-	__le64 magic;
-	__le64 bytenr;
-	__le32 nritems;
-	u8 compress;
-} __attribute__ ((__packed__));
-
-/* cluster header + index items + buffers */
-struct meta_cluster {
-	struct meta_cluster_header header;
-	struct meta_cluster_item items[];
-} __attribute__ ((__packed__));
-
-#define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
-			   sizeof(struct meta_cluster_item))
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64	_IOR(0x12,114,size_t)
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD	_IO(0x12,119)
+#endif
 
 struct async_work {
 	struct list_head list;
@@ -93,7 +73,20 @@ struct metadump_struct {
 	u64 pending_start;
 	u64 pending_size;
 
+	/* seekable index written after the last cluster */
+	struct meta_index_item *index;
+	u64 index_nr;
+	u64 index_alloc;
+
+	/*
+	 * delta dumps skip tree blocks that are not newer than
+	 * base_generation and are already in the base image
+	 */
+	struct metadump_image *base;
+	u64 base_generation;
+
 	int compress_level;
+	int write_index;
 	int done;
 };
 
@@ -109,19 +102,13 @@ struct mdrestore_struct {
 	struct list_head list;
 	size_t num_items;
 
+	/* written last, once every tree block is on disk */
+	u8 *super;
+
 	int compress_method;
 	int done;
 };
 
-static void csum_block(u8 *buf, size_t len)
-{
-	char result[BTRFS_CRC32_SIZE];
-	u32 crc = ~(u32)0;
-	crc = crc32c(crc, buf + BTRFS_CSUM_SIZE, len - BTRFS_CSUM_SIZE);
-	btrfs_csum_final(crc, result);
-	memcpy(buf, result, BTRFS_CRC32_SIZE);
-}
-
 /*
  * zero inline extents and csum items
  */
@@ -188,7 +175,78 @@ static void copy_buffer(u8 *dst, struct extent_buffer *src)
 			sizeof(struct btrfs_key_ptr) * nritems;
 		memset(dst + size, 0, src->len - size);
 	}
-	csum_block(dst, src->len);
+	metadump_csum_block(dst, src->len);
+}
+
+/*
+ * read one tree block straight from disk, trying every mirror.  This
+ * bypasses the extent buffer cache so that it is safe to call from the
+ * dump workers while the main thread walks the extent tree.
+ */
+static int read_block_mirrors(struct btrfs_root *root,
+			      struct extent_buffer *eb)
+{
+	struct btrfs_mapping_tree *map_tree = &root->fs_info->mapping_tree;
+	struct btrfs_multi_bio *multi = NULL;
+	u16 csum_size = btrfs_super_csum_size(&root->fs_info->super_copy);
+	u64 length;
+	int num_copies;
+	int mirror_num;
+	int ret;
+
+	num_copies = btrfs_num_copies(map_tree, eb->start, eb->len);
+	for (mirror_num = 1; mirror_num <= num_copies; mirror_num++) {
+		length = eb->len;
+		ret = btrfs_map_block(map_tree, READ, eb->start, &length,
+				      &multi, mirror_num);
+		if (ret)
+			break;
+		eb->fd = multi->stripes[0].dev->fd;
+		eb->dev_bytenr = multi->stripes[0].physical;
+		kfree(multi);
+		multi = NULL;
+
+		ret = read_extent_from_disk(eb);
+		if (ret == 0 && btrfs_header_bytenr(eb) == eb->start &&
+		    csum_tree_block_size(eb, csum_size, 1) == 0)
+			return 0;
+	}
+	fprintf(stderr, "unable to read tree block %llu\n",
+		(unsigned long long)eb->start);
+	return -EIO;
+}
+
+/*
+ * fill the buffer of a pending range with sanitized copies of its tree
+ * blocks
+ */
+static int read_metadata(struct metadump_struct *md, struct async_work *async)
+{
+	struct extent_buffer *eb;
+	u32 blocksize = md->root->nodesize;
+	u64 start = async->start;
+	u64 size = async->size;
+	size_t offset = 0;
+	int ret = 0;
+
+	eb = malloc(sizeof(*eb) + blocksize);
+	if (!eb)
+		return -ENOMEM;
+
+	while (size > 0) {
+		memset(eb, 0, sizeof(*eb));
+		eb->start = start;
+		eb->len = min_t(u64, blocksize, size);
+		ret = read_block_mirrors(md->root, eb);
+		if (ret)
+			break;
+		copy_buffer(async->buffer + offset, eb);
+		start += eb->len;
+		offset += eb->len;
+		size -= eb->len;
+	}
+	free(eb);
+	return ret;
 }
 
 static void *dump_worker(void *data)
@@ -210,6 +268,9 @@ static void *dump_worker(void *data)
 		list_del_init(&async->list);
 		pthread_mutex_unlock(&md->mutex);
 
+		ret = read_metadata(md, async);
+		BUG_ON(ret);
+
 		if (md->compress_level > 0) {
 			u8 *orig = async->buffer;
 
@@ -247,7 +308,8 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level)
+			 FILE *out, int num_threads, int compress_level,
+			 int write_index)
 {
 	int i, ret;
 
@@ -260,6 +322,7 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	md->out = out;
 	md->pending_start = (u64)-1;
 	md->compress_level = compress_level;
+	md->write_index = write_index;
 	md->cluster = calloc(1, BLOCK_SIZE);
 	if (!md->cluster)
 		return -ENOMEM;
@@ -295,6 +358,7 @@ static void metadump_destroy(struct metadump_struct *md)
 	pthread_mutex_destroy(&md->mutex);
 	free(md->threads);
 	free(md->cluster);
+	free(md->index);
 }
 
 static int write_zero(FILE *out, size_t size)
@@ -303,12 +367,34 @@ static int write_zero(FILE *out, size_t size)
 	return fwrite(zero, size, 1, out);
 }
 
+static int add_index_item(struct metadump_struct *md,
+			  struct async_work *async, u64 offset)
+{
+	struct meta_index_item *item;
+
+	if (md->index_nr == md->index_alloc) {
+		u64 alloc = md->index_alloc ? md->index_alloc * 2 : 1024;
+
+		item = realloc(md->index, alloc * sizeof(*item));
+		if (!item)
+			return -ENOMEM;
+		md->index = item;
+		md->index_alloc = alloc;
+	}
+	item = md->index + md->index_nr++;
+	item->bytenr = cpu_to_le64(async->start);
+	item->offset = cpu_to_le64(offset);
+	item->size = cpu_to_le32(async->size);
+	item->bufsize = cpu_to_le32(async->bufsize);
+	return 0;
+}
+
 static int write_buffers(struct metadump_struct *md, u64 *next)
 {
 	struct meta_cluster_header *header = &md->cluster->header;
 	struct meta_cluster_item *item;
 	struct async_work *async;
-	u64 bytenr = 0;
+	u64 bytenr = le64_to_cpu(header->bytenr);
 	u32 nritems = 0;
 	int ret;
 
@@ -339,12 +425,16 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	BUG_ON(ret != 1);
 
 	/* write buffers */
-	bytenr += le64_to_cpu(header->bytenr) + BLOCK_SIZE;
+	bytenr += BLOCK_SIZE;
 	while (!list_empty(&md->ordered)) {
 		async = list_entry(md->ordered.next, struct async_work,
 				   ordered);
 		list_del_init(&async->ordered);
 
+		if (md->write_index) {
+			ret = add_index_item(md, async, bytenr);
+			BUG_ON(ret);
+		}
 		bytenr += async->bufsize;
 		ret = fwrite(async->buffer, async->bufsize, 1, md->out);
 		BUG_ON(ret != 1);
@@ -366,14 +456,61 @@ out:
 	return 0;
 }
 
+/*
+ * write the index of all buffers and the footer pointing to it, this has
+ * to be called after the last cluster is written
+ */
+static int write_metadump_index(struct metadump_struct *md)
+{
+	struct btrfs_super_block *super = &md->root->fs_info->super_copy;
+	struct meta_index_header header;
+	struct meta_index_footer footer;
+	u64 bytenr = le64_to_cpu(md->cluster->header.bytenr);
+	u64 index_bytenr = bytenr;
+	int ret;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = cpu_to_le64(INDEX_MAGIC);
+	header.bytenr = cpu_to_le64(index_bytenr);
+	header.nritems = cpu_to_le64(md->index_nr);
+	header.generation = cpu_to_le64(btrfs_super_generation(super));
+	header.base_generation = cpu_to_le64(md->base_generation);
+	header.compress = md->compress_level > 0 ?
+			  COMPRESS_ZLIB : COMPRESS_NONE;
+
+	ret = fwrite(&header, sizeof(header), 1, md->out);
+	BUG_ON(ret != 1);
+	bytenr += sizeof(header);
+
+	if (md->index_nr) {
+		ret = fwrite(md->index, sizeof(*md->index), md->index_nr,
+			     md->out);
+		BUG_ON(ret != md->index_nr);
+		bytenr += sizeof(*md->index) * md->index_nr;
+	}
+
+	if (bytenr & BLOCK_MASK) {
+		size_t size = BLOCK_SIZE - (bytenr & BLOCK_MASK);
+
+		bytenr += size;
+		ret = write_zero(md->out, size);
+		BUG_ON(ret != 1);
+	}
+
+	memset(&footer, 0, sizeof(footer));
+	footer.magic = cpu_to_le64(INDEX_MAGIC);
+	footer.index_bytenr = cpu_to_le64(index_bytenr);
+	ret = fwrite(&footer, sizeof(footer), 1, md->out);
+	BUG_ON(ret != 1);
+	ret = write_zero(md->out, BLOCK_SIZE - sizeof(footer));
+	BUG_ON(ret != 1);
+	return 0;
+}
+
 static int flush_pending(struct metadump_struct *md, int done)
 {
 	struct async_work *async = NULL;
-	struct extent_buffer *eb;
-	u64 blocksize = md->root->nodesize;
 	u64 start;
-	u64 size;
-	size_t offset;
 	int ret;
 
 	if (md->pending_size) {
@@ -385,18 +522,18 @@ static int flush_pending(struct metadump_struct *md, int done)
 		async->size = md->pending_size;
 		async->bufsize = async->size;
 		async->buffer = malloc(async->bufsize);
+		if (!async->buffer) {
+			free(async);
+			return -ENOMEM;
+		}
 
-		offset = 0;
-		start = async->start;
-		size = async->size;
-		while (size > 0) {
-			eb = read_tree_block(md->root, start, blocksize, 0);
-			BUG_ON(!eb);
-			copy_buffer(async->buffer + offset, eb);
-			free_extent_buffer(eb);
-			start += blocksize;
-			offset += blocksize;
-			size -= blocksize;
+		/*
+		 * with worker threads the blocks are read in parallel by
+		 * dump_worker, the ordered list keeps the output in order
+		 */
+		if (!md->num_threads) {
+			ret = read_metadata(md, async);
+			BUG_ON(ret);
 		}
 
 		md->pending_start = (u64)-1;
@@ -409,7 +546,7 @@ static int flush_pending(struct metadump_struct *md, int done)
 	if (async) {
 		list_add_tail(&async->ordered, &md->ordered);
 		md->num_items++;
-		if (md->compress_level > 0) {
+		if (md->num_threads) {
 			list_add_tail(&async->list, &md->list);
 			pthread_cond_signal(&md->cond);
 		} else {
@@ -425,6 +562,20 @@ static int flush_pending(struct metadump_struct *md, int done)
 	return 0;
 }
 
+/*
+ * decide whether a tree block with the given generation has to go into a
+ * delta dump
+ */
+static int want_block(struct metadump_struct *md, u64 start, u64 size,
+		      u64 generation)
+{
+	if (!md->base_generation || generation > md->base_generation)
+		return 1;
+	if (md->base && !metadump_has_range(md->base, start, size))
+		return 1;
+	return 0;
+}
+
 static int add_metadata(u64 start, u64 size, struct metadump_struct *md)
 {
 	int ret;
@@ -435,175 +586,212 @@ static int add_metadata(u64 start, u64 size, struct metadump_struct *md)
 			return ret;
 		md->pending_start = start;
 	}
-	readahead_tree_block(md->root, start, size, 0);
 	md->pending_size += size;
 	return 0;
 }
 
 #ifdef BTRFS_COMPAT_EXTENT_TREE_V0
-static int is_tree_block(struct btrfs_root *extent_root,
-			 struct btrfs_path *path, u64 bytenr)
+static int is_tree_block(struct btrfs_root *extent_root, u64 bytenr,
+			 u64 num_bytes)
 {
 	struct extent_buffer *leaf;
+	struct btrfs_path path;
 	struct btrfs_key key;
 	u64 ref_objectid;
 	int ret;
 
-	leaf = path->nodes[0];
+	btrfs_init_path(&path);
+	key.objectid = bytenr;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = num_bytes;
+	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	BUG_ON(ret != 0);
+
+	leaf = path.nodes[0];
+	ret = 0;
 	while (1) {
 		struct btrfs_extent_ref_v0 *ref_item;
-		path->slots[0]++;
-		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(extent_root, path);
+		path.slots[0]++;
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(extent_root, &path);
 			BUG_ON(ret < 0);
-			if (ret > 0)
+			if (ret > 0) {
+				ret = 0;
 				break;
-			leaf = path->nodes[0];
+			}
+			leaf = path.nodes[0];
 		}
-		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.objectid != bytenr)
 			break;
 		if (key.type != BTRFS_EXTENT_REF_V0_KEY)
 			continue;
-		ref_item = btrfs_item_ptr(leaf, path->slots[0],
+		ref_item = btrfs_item_ptr(leaf, path.slots[0],
 					  struct btrfs_extent_ref_v0);
 		ref_objectid = btrfs_ref_objectid_v0(leaf, ref_item);
 		if (ref_objectid < BTRFS_FIRST_FREE_OBJECTID)
-			return 1;
+			ret = 1;
 		break;
 	}
-	return 0;
+	btrfs_release_path(extent_root, &path);
+	return ret;
 }
 #endif
 
+/*
+ * open the base image of a delta dump, it has to be an indexed image of
+ * the same filesystem
+ */
+static struct metadump_image *open_base_image(const char *base_name,
+					      struct btrfs_root *root)
+{
+	struct btrfs_super_block super;
+	struct metadump_image *base;
+	int fd;
+
+	fd = open(base_name, O_RDONLY);
+	if (fd < 0) {
+		perror("unable to open base image");
+		return NULL;
+	}
+	base = metadump_open(fd);
+	close(fd);
+	if (!base) {
+		fprintf(stderr, "%s is not an indexed metadump image\n",
+			base_name);
+		return NULL;
+	}
+	if (metadump_read_super(base, &super) ||
+	    memcmp(super.fsid, root->fs_info->fsid, BTRFS_FSID_SIZE)) {
+		fprintf(stderr, "%s is not an image of this filesystem\n",
+			base_name);
+		metadump_close(base);
+		return NULL;
+	}
+	return base;
+}
+
 static int create_metadump(const char *input, FILE *out, int num_threads,
-			   int compress_level)
+			   int compress_level, int write_index,
+			   const char *base_name, u64 base_generation)
 {
 	struct btrfs_root *root;
 	struct btrfs_root *extent_root;
-	struct btrfs_path *path;
+	struct btrfs_cursor cursor;
 	struct extent_buffer *leaf;
 	struct btrfs_extent_item *ei;
 	struct btrfs_key key;
+	struct btrfs_key keys[64];
+	int slots[64];
 	struct metadump_struct metadump;
 	u64 bytenr;
 	u64 num_bytes;
+	int nr;
+	int i;
 	int ret;
 
 	root = open_ctree(input, 0, 0);
 	BUG_ON(root->nodesize != root->leafsize);
 
 	ret = metadump_init(&metadump, root, out, num_threads,
-			    compress_level);
+			    compress_level, write_index);
 	BUG_ON(ret);
 
+	if (base_name) {
+		metadump.base = open_base_image(base_name, root);
+		if (!metadump.base) {
+			metadump_destroy(&metadump);
+			close_ctree(root);
+			return 1;
+		}
+		if (base_generation == (u64)-1)
+			base_generation = metadump_generation(metadump.base);
+		/*
+		 * a delta base only holds the blocks that changed, whether a
+		 * block is missing from it tells us nothing
+		 */
+		if (metadump_base_generation(metadump.base)) {
+			metadump_close(metadump.base);
+			metadump.base = NULL;
+		}
+	}
+	if (base_generation != (u64)-1) {
+		metadump.base_generation = base_generation;
+		metadump.write_index = 1;
+	}
+
 	ret = add_metadata(BTRFS_SUPER_INFO_OFFSET, 4096, &metadump);
 	BUG_ON(ret);
 
 	extent_root = root->fs_info->extent_root;
-	path = btrfs_alloc_path();
 
 	bytenr = BTRFS_SUPER_INFO_OFFSET + 4096;
 	key.objectid = bytenr;
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	key.offset = 0;
-
-	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
-	BUG_ON(ret < 0);
-
-	while (1) {
-		leaf = path->nodes[0];
-		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(extent_root, path);
-			BUG_ON(ret < 0);
-			if (ret > 0)
-				break;
-			leaf = path->nodes[0];
-		}
-
-		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
-		if (key.objectid < bytenr ||
-		    key.type != BTRFS_EXTENT_ITEM_KEY) {
-			path->slots[0]++;
-			continue;
-		}
-
-		bytenr = key.objectid;
-		num_bytes = key.offset;
-
-		if (btrfs_item_size_nr(leaf, path->slots[0]) > sizeof(*ei)) {
-			ei = btrfs_item_ptr(leaf, path->slots[0],
-					    struct btrfs_extent_item);
-			if (btrfs_extent_flags(leaf, ei) &
-			    BTRFS_EXTENT_FLAG_TREE_BLOCK) {
-				ret = add_metadata(bytenr, num_bytes,
-						   &metadump);
-				BUG_ON(ret);
-			}
-		} else {
+	btrfs_cursor_init(&cursor, extent_root, &key, NULL,
+			  BTRFS_EXTENT_ITEM_KEY, BTRFS_CURSOR_READA);
+
+	while ((nr = btrfs_cursor_next_batch(&cursor, keys, slots,
+					     ARRAY_SIZE(keys))) > 0) {
+		leaf = cursor.path.nodes[0];
+		for (i = 0; i < nr; i++) {
+			if (keys[i].objectid < bytenr)
+				continue;
+
+			bytenr = keys[i].objectid;
+			num_bytes = keys[i].offset;
+
+			if (btrfs_item_size_nr(leaf, slots[i]) > sizeof(*ei)) {
+				ei = btrfs_item_ptr(leaf, slots[i],
+						    struct btrfs_extent_item);
+				if ((btrfs_extent_flags(leaf, ei) &
+				     BTRFS_EXTENT_FLAG_TREE_BLOCK) &&
+				    want_block(&metadump, bytenr, num_bytes,
+					btrfs_extent_generation(leaf, ei))) {
+					ret = add_metadata(bytenr, num_bytes,
+							   &metadump);
+					BUG_ON(ret);
+				}
+			} else {
 #ifdef BTRFS_COMPAT_EXTENT_TREE_V0
-			if (is_tree_block(extent_root, path, bytenr)) {
-				ret = add_metadata(bytenr, num_bytes,
-						   &metadump);
-				BUG_ON(ret);
-			}
+				if (is_tree_block(extent_root, bytenr,
+						  num_bytes)) {
+					ret = add_metadata(bytenr, num_bytes,
+							   &metadump);
+					BUG_ON(ret);
+				}
 #else
-			BUG_ON(1);
+				BUG_ON(1);
 #endif
+			}
+			bytenr += num_bytes;
 		}
-		bytenr += num_bytes;
 	}
+	BUG_ON(nr < 0);
+	btrfs_cursor_release(&cursor);
 
 	ret = flush_pending(&metadump, 1);
 	BUG_ON(ret);
 
+	if (metadump.write_index) {
+		ret = write_metadump_index(&metadump);
+		BUG_ON(ret);
+	}
+
+	metadump_close(metadump.base);
 	metadump_destroy(&metadump);
 
-	btrfs_free_path(path);
 	ret = close_ctree(root);
 	return 0;
 }
 
-static void update_super(u8 *buffer)
-{
-	struct btrfs_super_block *super = (struct btrfs_super_block *)buffer;
-	struct btrfs_chunk *chunk;
-	struct btrfs_disk_key *key;
-	u32 sectorsize = btrfs_super_sectorsize(super);
-	u64 flags = btrfs_super_flags(super);
-
-	flags |= BTRFS_SUPER_FLAG_METADUMP;
-	btrfs_set_super_flags(super, flags);
-
-	key = (struct btrfs_disk_key *)(super->sys_chunk_array);
-	chunk = (struct btrfs_chunk *)(super->sys_chunk_array +
-				       sizeof(struct btrfs_disk_key));
-
-	btrfs_set_disk_key_objectid(key, BTRFS_FIRST_CHUNK_TREE_OBJECTID);
-	btrfs_set_disk_key_type(key, BTRFS_CHUNK_ITEM_KEY);
-	btrfs_set_disk_key_offset(key, 0);
-
-	btrfs_set_stack_chunk_length(chunk, (u64)-1);
-	btrfs_set_stack_chunk_owner(chunk, BTRFS_EXTENT_TREE_OBJECTID);
-	btrfs_set_stack_chunk_stripe_len(chunk, 64 * 1024);
-	btrfs_set_stack_chunk_type(chunk, BTRFS_BLOCK_GROUP_SYSTEM);
-	btrfs_set_stack_chunk_io_align(chunk, sectorsize);
-	btrfs_set_stack_chunk_io_width(chunk, sectorsize);
-	btrfs_set_stack_chunk_sector_size(chunk, sectorsize);
-	btrfs_set_stack_chunk_num_stripes(chunk, 1);
-	btrfs_set_stack_chunk_sub_stripes(chunk, 0);
-	chunk->stripe.devid = super->dev_item.devid;
-	chunk->stripe.offset = cpu_to_le64(0);
-	memcpy(chunk->stripe.dev_uuid, super->dev_item.uuid, BTRFS_UUID_SIZE);
-	btrfs_set_super_sys_array_size(super, sizeof(*key) + sizeof(*chunk));
-	csum_block(buffer, 4096);
-}
-
 static void *restore_worker(void *data)
 {
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
 	struct async_work *async;
 	size_t size;
+	u64 start;
 	u8 *buffer;
 	u8 *outbuf;
 	int outfd;
@@ -637,11 +825,30 @@ static void *restore_worker(void *data)
 			size = async->bufsize;
 		}
 
-		if (async->start == BTRFS_SUPER_INFO_OFFSET)
-			update_super(outbuf);
+		/*
+		 * hold the super block back so that an interrupted restore
+		 * never looks like a valid filesystem
+		 */
+		start = async->start;
+		if (start == BTRFS_SUPER_INFO_OFFSET) {
+			u8 *super = malloc(BTRFS_SUPER_INFO_SIZE);
+
+			BUG_ON(!super);
+			memcpy(super, outbuf, BTRFS_SUPER_INFO_SIZE);
+			pthread_mutex_lock(&mdres->mutex);
+			mdres->super = super;
+			pthread_mutex_unlock(&mdres->mutex);
+
+			outbuf += BTRFS_SUPER_INFO_SIZE;
+			start += BTRFS_SUPER_INFO_SIZE;
+			size -= BTRFS_SUPER_INFO_SIZE;
+		}
 
-		ret = pwrite64(outfd, outbuf, size, async->start);
-		BUG_ON(ret != size);
+		/* gaps between the buffers are left as holes */
+		if (size) {
+			ret = pwrite64(outfd, outbuf, size, start);
+			BUG_ON(ret != size);
+		}
 
 		pthread_mutex_lock(&mdres->mutex);
 		mdres->num_items--;
@@ -709,7 +916,6 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
-	BUG_ON(mdres->num_items);
 	mdres->compress_method = header->compress;
 
 	bytenr = le64_to_cpu(header->bytenr) + BLOCK_SIZE;
@@ -742,10 +948,13 @@ static int add_cluster(struct meta_cluster *cluster,
 	return 0;
 }
 
-static int wait_for_worker(struct mdrestore_struct *mdres)
+/*
+ * wait until at most max_items buffers are still queued or being written
+ */
+static int wait_for_worker(struct mdrestore_struct *mdres, size_t max_items)
 {
 	pthread_mutex_lock(&mdres->mutex);
-	while (mdres->num_items > 0) {
+	while (mdres->num_items > max_items) {
 		struct timespec ts = {
 			.tv_sec = 0,
 			.tv_nsec = 10000000,
@@ -758,7 +967,43 @@ static int wait_for_worker(struct mdrestore_struct *mdres)
 	return 0;
 }
 
-static int restore_metadump(const char *input, FILE *out, int num_threads)
+static int write_super(struct mdrestore_struct *mdres)
+{
+	int ret;
+
+	if (!mdres->super) {
+		fprintf(stderr, "no super block in metadump image\n");
+		return 1;
+	}
+	metadump_update_super(mdres->super);
+	ret = pwrite64(fileno(mdres->out), mdres->super,
+		       BTRFS_SUPER_INFO_SIZE, BTRFS_SUPER_INFO_OFFSET);
+	if (ret != BTRFS_SUPER_INFO_SIZE) {
+		perror("unable to write super block");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * only tree blocks are written during restore, on block devices discard
+ * the old contents so they don't show through in the gaps
+ */
+static void discard_target(int fd)
+{
+	struct stat st;
+	u64 range[2] = { 0, 0 };
+
+	if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+		return;
+	if (ioctl(fd, BLKGETSIZE64, &range[1]) < 0)
+		return;
+	/* errors are ignored, discard is only an optimization */
+	ioctl(fd, BLKDISCARD, &range);
+}
+
+static int restore_metadump(const char *input, FILE *out, int num_threads,
+			    int delta)
 {
 	struct meta_cluster *cluster;
 	struct meta_cluster_header *header;
@@ -780,6 +1025,9 @@ static int restore_metadump(const char *input, FILE *out, int num_threads)
 	cluster = malloc(BLOCK_SIZE);
 	BUG_ON(!cluster);
 
+	if (!delta)
+		discard_target(fileno(out));
+
 	ret = mdresotre_init(&mdrestore, in, out, num_threads);
 	BUG_ON(ret);
 
@@ -789,6 +1037,12 @@ static int restore_metadump(const char *input, FILE *out, int num_threads)
 			break;
 
 		header = &cluster->header;
+		/* the index of a seekable image follows the last cluster */
+		if (le64_to_cpu(header->magic) == INDEX_MAGIC &&
+		    le64_to_cpu(header->bytenr) == bytenr) {
+			ret = 0;
+			break;
+		}
 		if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
 		    le64_to_cpu(header->bytenr) != bytenr) {
 			fprintf(stderr, "bad header in metadump image\n");
@@ -797,22 +1051,160 @@ static int restore_metadump(const char *input, FILE *out, int num_threads)
 		ret = add_cluster(cluster, &mdrestore, &bytenr);
 		BUG_ON(ret);
 
-		wait_for_worker(&mdrestore);
+		/*
+		 * buffers are written out of order at their final offsets,
+		 * keep at most one more cluster in flight while reading
+		 */
+		wait_for_worker(&mdrestore, ITEMS_PER_CLUSTER);
 	}
 
+	wait_for_worker(&mdrestore, 0);
+	ret = write_super(&mdrestore);
+
 	mdresotre_destroy(&mdrestore);
+	free(mdrestore.super);
 	free(cluster);
 	if (in != stdin)
 		fclose(in);
 	return ret;
 }
 
+struct image_info {
+	u64 generation;
+	u64 base_generation;
+	u8 fsid[BTRFS_FSID_SIZE];
+	int valid;
+};
+
+static int read_image_info(const char *name, struct image_info *info)
+{
+	struct btrfs_super_block super;
+	struct metadump_image *image;
+	int fd;
+	int ret = 0;
+
+	memset(info, 0, sizeof(*info));
+	if (!strcmp(name, "-"))
+		return 0;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open %s\n", name);
+		return 1;
+	}
+	if (!metadump_probe(fd)) {
+		fprintf(stderr, "%s is not a metadump image\n", name);
+		close(fd);
+		return 1;
+	}
+	image = metadump_open(fd);
+	if (!image) {
+		/* a full image without index, the super block is up front */
+		if (metadump_scan_super(fd, &super)) {
+			fprintf(stderr, "no super block in %s\n", name);
+			ret = 1;
+		} else {
+			info->valid = 1;
+			info->generation = btrfs_super_generation(&super);
+			memcpy(info->fsid, super.fsid, BTRFS_FSID_SIZE);
+		}
+		close(fd);
+		return ret;
+	}
+	close(fd);
+
+	if (metadump_read_super(image, &super)) {
+		fprintf(stderr, "no super block in %s\n", name);
+		ret = 1;
+	} else {
+		info->valid = 1;
+		info->generation = metadump_generation(image);
+		info->base_generation = metadump_base_generation(image);
+		memcpy(info->fsid, super.fsid, BTRFS_FSID_SIZE);
+	}
+	metadump_close(image);
+	return ret;
+}
+
+/*
+ * check that every delta image applies on top of what is restored before
+ * it.  When the first image is a delta it is applied to the filesystem
+ * that was already restored to target, *append is set in that case.
+ */
+static int check_restore_chain(char **sources, int nr, const char *target,
+			       int *append)
+{
+	struct btrfs_super_block super;
+	struct image_info info;
+	struct image_info prev;
+	int fd;
+	int i;
+
+	*append = 0;
+	memset(&prev, 0, sizeof(prev));
+	for (i = 0; i < nr; i++) {
+		if (read_image_info(sources[i], &info))
+			return 1;
+
+		if (i == 0 && info.base_generation) {
+			fd = open(target, O_RDONLY);
+			if (fd < 0 || btrfs_read_dev_super(fd, &super,
+						BTRFS_SUPER_INFO_OFFSET)) {
+				fprintf(stderr, "%s is a delta image but %s "
+					"holds no restored filesystem\n",
+					sources[i], target);
+				if (fd >= 0)
+					close(fd);
+				return 1;
+			}
+			close(fd);
+			prev.valid = 1;
+			prev.generation = btrfs_super_generation(&super);
+			memcpy(prev.fsid, super.fsid, BTRFS_FSID_SIZE);
+			*append = 1;
+		} else if (i > 0 && !info.base_generation) {
+			fprintf(stderr, "%s is not a delta image\n",
+				sources[i]);
+			return 1;
+		}
+
+		if (info.base_generation) {
+			if (!prev.valid) {
+				fprintf(stderr, "can't check %s against an "
+					"image read from stdin\n", sources[i]);
+				return 1;
+			}
+			if (memcmp(info.fsid, prev.fsid, BTRFS_FSID_SIZE)) {
+				fprintf(stderr, "%s is from a different "
+					"filesystem\n", sources[i]);
+				return 1;
+			}
+			if (info.base_generation > prev.generation) {
+				fprintf(stderr, "%s needs generation %llu, "
+					"only %llu is restored\n", sources[i],
+					(unsigned long long)info.base_generation,
+					(unsigned long long)prev.generation);
+				return 1;
+			}
+		}
+		prev = info;
+	}
+	return 0;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr, "usage: btrfs-image [options] source target\n");
+	fprintf(stderr, "       btrfs-image -r [options] image [delta...] "
+		"target\n");
 	fprintf(stderr, "\t-r      \trestore metadump image\n");
 	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9)\n");
 	fprintf(stderr, "\t-t value\tnumber of threads (1 ~ 32)\n");
+	fprintf(stderr, "\t-i      \twrite a seekable index\n");
+	fprintf(stderr, "\t-d base \tonly dump blocks changed since image "
+		"base\n");
+	fprintf(stderr, "\t-g value\tonly dump blocks newer than "
+		"generation\n");
 	exit(1);
 }
 
@@ -820,20 +1212,34 @@ int main(int argc, char *argv[])
 {
 	char *source;
 	char *target;
+	char *base_name = NULL;
+	u64 base_generation = (u64)-1;
 	int num_threads = 0;
 	int compress_level = 0;
+	int write_index = 0;
 	int create = 1;
+	int append = 0;
 	int ret;
+	int i;
 	FILE *out;
 
 	while (1) {
-		int c = getopt(argc, argv, "rc:t:");
+		int c = getopt(argc, argv, "rc:t:id:g:");
 		if (c < 0)
 			break;
 		switch (c) {
 		case 'r':
 			create = 0;
 			break;
+		case 'i':
+			write_index = 1;
+			break;
+		case 'd':
+			base_name = optarg;
+			break;
+		case 'g':
+			base_generation = strtoull(optarg, NULL, 10);
+			break;
 		case 't':
 			num_threads = atoi(optarg);
 			if (num_threads <= 0 || num_threads > 32)
@@ -850,32 +1256,45 @@ int main(int argc, char *argv[])
 	}
 
 	argc = argc - optind;
-	if (argc != 2)
+	if (argc < 2 || (create && argc != 2))
+		print_usage();
+	if (!create && (base_name || base_generation != (u64)-1))
 		print_usage();
 	source = argv[optind];
-	target = argv[optind + 1];
+	target = argv[optind + argc - 1];
+
+	if (!create && check_restore_chain(argv + optind, argc - 1, target,
+					   &append))
+		exit(1);
 
 	if (create && !strcmp(target, "-")) {
 		out = stdout;
 	} else {
-		out = fopen(target, "w+");
+		out = fopen(target, append ? "r+" : "w+");
 		if (!out) {
 			perror("unable to create target file");
 			exit(1);
 		}
 	}
 
-	if (num_threads == 0 && compress_level > 0) {
+	if (num_threads == 0) {
 		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 		if (num_threads <= 0)
 			num_threads = 1;
 	}
 
-	if (create)
+	if (create) {
 		ret = create_metadump(source, out, num_threads,
-				      compress_level);
-	else
-		ret = restore_metadump(source, out, 1);
+				      compress_level, write_index,
+				      base_name, base_generation);
+	} else {
+		for (i = 0; i < argc - 1; i++) {
+			ret = restore_metadump(argv[optind + i], out,
+					       num_threads, append || i > 0);
+			if (ret)
+				break;
+		}
+	}
 
 	if (out == stdout)
 		fflush(out);
@@ -131,12 +131,20 @@ static struct Command commands[] = {
 	  "The filesystem must be unmounted.\n"
 	},
 	{ do_scrub_start, -1,
-	  "scrub start", "[-Bdqr] <path>|<device>\n"
+	  "scrub start", "[-Bdoqr] [-m <file>] [-b <rate>] [-s <size>] "
+		"[-j <n>]\n"
+		"<path>|<device>\n"
 		"Start a new scrub.",
 		"\n-B  do not background\n"
 		"-d  stats per device (-B only)\n"
+		"-m  write Prometheus metrics to <file>\n"
+		"-o  scrub an unmounted <device> offline\n"
 		"-q  quiet\n"
 		"-r  read only mode\n"
+		"-b  scrub at most <rate> bytes per second and device\n"
+		"-s  scrub <size> bytes of a device per ioctl (default 1G\n"
+		"    with -b), backing off when the disk is busy\n"
+		"-j  scrub at most <n> devices at once\n"
 	},
 	{ do_scrub_cancel, 1,
 	  "scrub cancel", "<path>|<device>\n"
@@ -144,14 +152,17 @@ static struct Command commands[] = {
 	  NULL
 	},
 	{ do_scrub_resume, -1,
-	  "scrub resume", "[-Bdqr] <path>|<device>\n"
+	  "scrub resume", "[-Bdqr] [-b <rate>] [-s <size>] [-j <n>]\n"
+		"<path>|<device>\n"
 		"Resume previously canceled or interrupted scrub.",
 	  NULL
 	},
 	{ do_scrub_status, -1,
-	  "scrub status", "[-d] <path>|<device>\n"
+	  "scrub status", "[-d] [--rate] <path>|<device>\n"
 		"Show status of running or finished scrub.",
-	  NULL
+		"\n-d      stats per device\n"
+		"--rate  throughput history of the last scrub, every\n"
+		"        sample with -R\n"
 	},
 	{ do_scan, 999, 
 	  "device scan", "[<device>...]\n"
@@ -117,15 +117,24 @@ int open_file_or_dir(const char *fname)
 	return fd;
 }
 
-static u64 parse_size(char *s)
+/*
+ * parses a number with an optional k/m/g/b suffix into @size.  returns
+ * -EINVAL if @s isn't a number, has trailing garbage or overflows.
+ */
+int parse_size(const char *s, u64 *size)
 {
-	int len = strlen(s);
-	char c;
+	char *end;
+	u64 val;
 	u64 mult = 1;
 
-	if (!isdigit(s[len - 1])) {
-		c = tolower(s[len - 1]);
-		switch (c) {
+	if (!isdigit(s[0]))
+		return -EINVAL;
+	errno = 0;
+	val = strtoull(s, &end, 10);
+	if (errno)
+		return -EINVAL;
+	if (*end) {
+		switch (tolower(*end)) {
 		case 'g':
 			mult *= 1024;
 		case 'm':
@@ -135,12 +144,15 @@ static u64 parse_size(char *s)
 		case 'b':
 			break;
 		default:
-			fprintf(stderr, "Unknown size descriptor %c\n", c);
-			exit(1);
+			return -EINVAL;
 		}
-		s[len - 1] = '\0';
+		++end;
 	}
-	return atoll(s) * mult;
+	if (*end || val > (u64)-1 / mult)
+		return -EINVAL;
+
+	*size = val * mult;
+	return 0;
 }
 
 static int parse_compress_type(char *s)
@@ -162,6 +174,7 @@ int do_defrag(int ac, char **av)
 	u64 start = 0;
 	u64 len = (u64)-1;
 	u32 thresh = 0;
+	u64 size;
 	int i;
 	int errors = 0;
 	int ret = 0;
@@ -191,15 +204,19 @@ int do_defrag(int ac, char **av)
 			verbose = 1;
 			break;
 		case 's':
-			start = parse_size(optarg);
+			if (parse_size(optarg, &start))
+				goto bad_size;
 			fancy_ioctl = 1;
 			break;
 		case 'l':
-			len = parse_size(optarg);
+			if (parse_size(optarg, &len))
+				goto bad_size;
 			fancy_ioctl = 1;
 			break;
 		case 't':
-			thresh = parse_size(optarg);
+			if (parse_size(optarg, &size) || size > (u32)-1)
+				goto bad_size;
+			thresh = size;
 			fancy_ioctl = 1;
 			break;
 		default:
@@ -265,6 +282,11 @@ int do_defrag(int ac, char **av)
 
 	free(av);
 	return errors + 20;
+
+bad_size:
+	fprintf(stderr, "Invalid size '%s' for defragment\n", optarg);
+	free(av);
+	return 1;
 }
 
 int do_find_newer(int argc, char **argv)
@@ -2720,7 +2720,7 @@ static int check_extents(struct btrfs_root *root)
 	struct cache_tree pending;
 	struct cache_tree reada;
 	struct cache_tree nodes;
-	struct btrfs_path path;
+	struct btrfs_cursor cursor;
 	struct btrfs_key key;
 	struct btrfs_key found_key;
 	int ret;
@@ -2728,7 +2728,6 @@ static int check_extents(struct btrfs_root *root)
 	struct block_info *bits;
 	int bits_nr;
 	struct extent_buffer *leaf;
-	int slot;
 	struct btrfs_root_item ri;
 
 	cache_tree_init(&extent_cache);
@@ -2752,42 +2751,29 @@ static int check_extents(struct btrfs_root *root)
 			    &extent_cache, &pending, &seen, &reada, &nodes,
 			    &root->fs_info->chunk_root->root_key);
 
-	btrfs_init_path(&path);
 	key.offset = 0;
 	key.objectid = 0;
 	btrfs_set_key_type(&key, BTRFS_ROOT_ITEM_KEY);
-	ret = btrfs_search_slot(NULL, root->fs_info->tree_root,
-					&key, &path, 0, 0);
-	BUG_ON(ret < 0);
-	while(1) {
-		leaf = path.nodes[0];
-		slot = path.slots[0];
-		if (slot >= btrfs_header_nritems(path.nodes[0])) {
-			ret = btrfs_next_leaf(root, &path);
-			if (ret != 0)
-				break;
-			leaf = path.nodes[0];
-			slot = path.slots[0];
-		}
-		btrfs_item_key_to_cpu(leaf, &found_key, path.slots[0]);
-		if (btrfs_key_type(&found_key) == BTRFS_ROOT_ITEM_KEY) {
-			unsigned long offset;
-			struct extent_buffer *buf;
-
-			offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
-			read_extent_buffer(leaf, &ri, offset, sizeof(ri));
-			buf = read_tree_block(root->fs_info->tree_root,
-					      btrfs_root_bytenr(&ri),
-					      btrfs_level_size(root,
-					       btrfs_root_level(&ri)), 0);
-			add_root_to_pending(buf, bits, bits_nr, &extent_cache,
-					    &pending, &seen, &reada, &nodes,
-					    &found_key);
-			free_extent_buffer(buf);
-		}
-		path.slots[0]++;
+	btrfs_cursor_init(&cursor, root->fs_info->tree_root, &key, NULL,
+			  BTRFS_ROOT_ITEM_KEY, BTRFS_CURSOR_READA);
+	while ((ret = btrfs_cursor_next(&cursor, &found_key)) == 0) {
+		unsigned long offset;
+		struct extent_buffer *buf;
+
+		leaf = cursor.path.nodes[0];
+		offset = btrfs_item_ptr_offset(leaf, cursor.path.slots[0]);
+		read_extent_buffer(leaf, &ri, offset, sizeof(ri));
+		buf = read_tree_block(root->fs_info->tree_root,
+				      btrfs_root_bytenr(&ri),
+				      btrfs_level_size(root,
+				       btrfs_root_level(&ri)), 0);
+		add_root_to_pending(buf, bits, bits_nr, &extent_cache,
+				    &pending, &seen, &reada, &nodes,
+				    &found_key);
+		free_extent_buffer(buf);
 	}
-	btrfs_release_path(root, &path);
+	BUG_ON(ret < 0);
+	btrfs_cursor_release(&cursor);
 	while(1) {
 		ret = run_next_block(root, bits, bits_nr, &last, &pending,
 				     &seen, &reada, &nodes, &extent_cache);
@@ -29,6 +29,7 @@
 #include <sys/acl.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include <linux/fs.h>
 #include "kerncompat.h"
@@ -44,6 +45,10 @@
 
 #define INO_OFFSET (BTRFS_FIRST_FREE_OBJECTID - EXT2_ROOT_INO)
 #define STRIPE_LEN (64 * 1024)
+#define CSUM_READ_SIZE (1024 * 1024)
+#define CONVERT_BATCH_SIZE (256 * 1024 * 1024)
+#define CONVERT_MAX_READERS 8
+#define CONVERT_MAX_PENDING 256
 #define EXT2_IMAGE_SUBVOL_OBJECTID BTRFS_FIRST_FREE_OBJECTID
 
 /*
@@ -114,23 +119,91 @@ static int ext2_free_block(ext2_filsys fs, u64 block)
 	return 0;
 }
 
+/* blocks of the ext2 bitmap fetched per call, a multiple of 64 */
+#define FREE_SCAN_BLOCKS	(256 * 1024)
+#define FREE_SCAN_RANGES	1024
+
+static void flush_free_ranges(struct btrfs_root *root,
+			      struct extent_range *ranges, int *nr)
+{
+	int ret;
+
+	if (!*nr)
+		return;
+	ret = set_extent_bits_ranges(&root->fs_info->free_space_cache,
+				     ranges, *nr, EXTENT_DIRTY, 0);
+	BUG_ON(ret);
+	*nr = 0;
+}
+
+/*
+ * walk the ext2 block bitmap a 64 bit word at a time and seed the free
+ * space cache with every maximal run of free blocks.  Words that are all
+ * used or all free are skipped in one step, so the cost is in the number
+ * of runs rather than the number of blocks.
+ */
 static int cache_free_extents(struct btrfs_root *root, ext2_filsys ext2_fs)
 
 {
 	int i, ret = 0;
-	blk_t block;
 	u64 bytenr;
 	u64 blocksize = ext2_fs->blocksize;
-
-	block = ext2_fs->super->s_first_data_block;
-	for (; block < ext2_fs->super->s_blocks_count; block++) {
-		if (ext2fs_fast_test_block_bitmap(ext2_fs->block_map, block))
-			continue;
-		bytenr = block * blocksize;
-		ret = set_extent_dirty(&root->fs_info->free_space_cache,
-				       bytenr, bytenr + blocksize - 1, 0);
+	u64 first = ext2_fs->super->s_first_data_block;
+	u64 total = ext2_fs->super->s_blocks_count;
+	u64 block;
+	u64 run_start = (u64)-1;
+	struct extent_range *ranges;
+	int nr = 0;
+	__le64 *bitmap;
+
+	bitmap = malloc(FREE_SCAN_BLOCKS / 8);
+	ranges = malloc(sizeof(*ranges) * FREE_SCAN_RANGES);
+	BUG_ON(!bitmap || !ranges);
+
+	for (block = first; block < total; block += FREE_SCAN_BLOCKS) {
+		u64 num = min_t(u64, FREE_SCAN_BLOCKS, total - block);
+		u64 pos = 0;
+
+		ret = ext2fs_get_block_bitmap_range(ext2_fs->block_map,
+						    block, num, bitmap);
 		BUG_ON(ret);
+
+		while (pos < num) {
+			u64 word = le64_to_cpu(bitmap[pos / 64]);
+			u64 mask = ~0ULL << (pos % 64);
+			u64 bits;
+
+			/* look for the next used block inside a run */
+			if (run_start != (u64)-1)
+				bits = word & mask;
+			else
+				bits = ~word & mask;
+			if (!bits) {
+				pos = (pos | 63) + 1;
+				continue;
+			}
+			pos = (pos & ~63ULL) + __builtin_ctzll(bits);
+			if (pos >= num)
+				break;
+			if (run_start == (u64)-1) {
+				run_start = block + pos;
+				continue;
+			}
+			ranges[nr].start = run_start * blocksize;
+			ranges[nr].end = (block + pos) * blocksize - 1;
+			run_start = (u64)-1;
+			if (++nr == FREE_SCAN_RANGES)
+				flush_free_ranges(root, ranges, &nr);
+		}
+	}
+	if (run_start != (u64)-1) {
+		ranges[nr].start = run_start * blocksize;
+		ranges[nr].end = total * blocksize - 1;
+		nr++;
 	}
+	flush_free_ranges(root, ranges, &nr);
+	free(ranges);
+	free(bitmap);
 
 	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
@@ -147,8 +220,8 @@ static int cache_free_extents(struct btrfs_root *root, ext2_filsys ext2_fs)
 	return 0;
 }
 
-static int custom_alloc_extent(struct btrfs_root *root, u64 num_bytes,
-			       u64 hint_byte, struct btrfs_key *ins)
+static int find_free_extent_range(struct btrfs_root *root, u64 num_bytes,
+				  u64 hint_byte, struct btrfs_key *ins)
 {
 	u64 start;
 	u64 end;
@@ -196,10 +269,20 @@ static int custom_alloc_extent(struct btrfs_root *root, u64 num_bytes,
 		return 0;
 	}
 fail:
-	fprintf(stderr, "not enough free space\n");
 	return -ENOSPC;
 }
 
+static int custom_alloc_extent(struct btrfs_root *root, u64 num_bytes,
+			       u64 hint_byte, struct btrfs_key *ins)
+{
+	int ret;
+
+	ret = find_free_extent_range(root, num_bytes, hint_byte, ins);
+	if (ret)
+		fprintf(stderr, "not enough free space\n");
+	return ret;
+}
+
 static int intersect_with_sb(u64 bytenr, u64 num_bytes)
 {
 	int i;
@@ -228,8 +311,7 @@ struct btrfs_extent_ops extent_ops = {
 };
 
 struct dir_iterate_data {
-	struct btrfs_trans_handle *trans;
-	struct btrfs_root *root;
+	struct btrfs_item_batch *batch;
 	struct btrfs_inode_item *inode;
 	u64 objectid;
 	u64 index_cnt;
@@ -279,17 +361,17 @@ static int dir_iterate_proc(ext2_ino_t dir, int entry,
 
 	file_type = dirent->file_type;
 	BUG_ON(file_type > EXT2_FT_SYMLINK);
-	ret = btrfs_insert_dir_item(idata->trans, idata->root,
-				    dirent->name, dirent->name_len,
-				    idata->objectid, &location,
-				    filetype_conversion_table[file_type],
-				    idata->index_cnt);
+	ret = btrfs_batch_insert_dir_item(idata->batch,
+					  dirent->name, dirent->name_len,
+					  idata->objectid, &location,
+					  filetype_conversion_table[file_type],
+					  idata->index_cnt);
 	if (ret)
 		goto fail;
-	ret = btrfs_insert_inode_ref(idata->trans, idata->root,
-				     dirent->name, dirent->name_len,
-				     objectid, idata->objectid,
-				     idata->index_cnt);
+	ret = btrfs_batch_insert_inode_ref(idata->batch,
+					   dirent->name, dirent->name_len,
+					   objectid, idata->objectid,
+					   idata->index_cnt);
 	if (ret)
 		goto fail;
 	idata->index_cnt++;
@@ -302,16 +384,14 @@ fail:
 	return BLOCK_ABORT;
 }
 
-static int create_dir_entries(struct btrfs_trans_handle *trans,
-			      struct btrfs_root *root, u64 objectid,
+static int create_dir_entries(struct btrfs_item_batch *batch, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
 			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
 {
 	int ret;
 	errcode_t err;
 	struct dir_iterate_data data = {
-		.trans		= trans,
-		.root		= root,
+		.batch		= batch,
 		.inode		= btrfs_inode,
 		.objectid	= objectid,
 		.index_cnt	= 2,
@@ -325,8 +405,8 @@ static int create_dir_entries(struct btrfs_trans_handle *trans,
 		goto error;
 	ret = data.errcode;
 	if (ret == 0 && data.parent == objectid) {
-		ret = btrfs_insert_inode_ref(trans, root, "..", 2,
-					     objectid, objectid, 0);
+		ret = btrfs_batch_insert_inode_ref(batch, "..", 2,
+						   objectid, objectid, 0);
 	}
 	return ret;
 error:
@@ -349,89 +429,116 @@ fail:
 		ret = -1;
 	return ret;
 }
+
 /*
- * Record a file extent. Do all the required works, such as inserting
- * file extent item, inserting extent item and backref item into extent
- * tree and updating block accounting.
+ * copy_inodes reads the inodes on a pool of reader threads, every
+ * reader has its own ext2fs handle since libext2fs isn't thread safe.
+ * A reader collects the items of an inode in job->batch and the data
+ * extents it points to in job->extents, the main thread then adds the
+ * extents to the extent and csum trees in inode order.  The block
+ * groups don't change while the inodes are copied, the readers look
+ * them up in a copy so they never touch the block group cache.
  */
-static int record_file_extent(struct btrfs_trans_handle *trans,
-			      struct btrfs_root *root, u64 objectid,
-			      struct btrfs_inode_item *inode,
-			      u64 file_pos, u64 disk_bytenr,
-			      u64 num_bytes, int checksum)
-{
-	int ret;
-	struct btrfs_fs_info *info = root->fs_info;
-	struct btrfs_root *extent_root = info->extent_root;
-	struct extent_buffer *leaf;
-	struct btrfs_file_extent_item *fi;
-	struct btrfs_key ins_key;
-	struct btrfs_path path;
-	struct btrfs_extent_item *ei;
-	u32 blocksize = root->sectorsize;
-	u64 nbytes;
+struct convert_bg {
+	u64 start;
+	u64 end;
+};
 
-	if (disk_bytenr == 0) {
-		ret = btrfs_insert_file_extent(trans, root, objectid,
-						file_pos, disk_bytenr,
-						num_bytes, num_bytes);
-		return ret;
-	}
+struct convert_extent {
+	u64 file_pos;
+	u64 disk_bytenr;
+	u64 num_bytes;
+	char *csums;
+};
 
-	btrfs_init_path(&path);
+struct convert_ctl {
+	struct btrfs_root *root;
+	int datacsum;
+	int packing;
+	int noxattr;
+
+	struct convert_bg *bgs;
+	int nr_bgs;
+
+	int num_readers;
+	struct convert_reader *readers;
+	int stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct list_head todo;
+};
 
-	if (checksum) {
-		u64 offset;
-		char *buffer;
+struct convert_reader {
+	struct convert_ctl *ctl;
+	ext2_filsys ext2_fs;
+	pthread_t thread;
+};
 
-		ret = -ENOMEM;
-		buffer = malloc(blocksize);
-		if (!buffer)
-			goto fail;
-		for (offset = 0; offset < num_bytes; offset += blocksize) {
-			ret = read_disk_extent(root, disk_bytenr + offset,
-						blocksize, buffer);
-			if (ret)
-				break;
-			ret = btrfs_csum_file_block(trans,
-						    root->fs_info->csum_root,
-						    disk_bytenr + num_bytes,
-						    disk_bytenr + offset,
-						    buffer, blocksize);
-			if (ret)
-				break;
-		}
-		free(buffer);
+struct convert_job {
+	struct list_head list;
+	struct list_head pending;
+	struct convert_ctl *ctl;
+	ext2_ino_t ext2_ino;
+	struct ext2_inode ext2_inode;
+	u64 objectid;
+	struct btrfs_item_batch batch;
+	struct convert_extent *extents;
+	int nr_extents;
+	int max_extents;
+	int done;
+	int ret;
+};
+
+static int csum_disk_extent(struct btrfs_root *root, u64 disk_bytenr,
+			    u64 num_bytes, char *csums)
+{
+	u16 csum_size = btrfs_super_csum_size(&root->fs_info->super_copy);
+	u32 blocksize = root->sectorsize;
+	u64 offset;
+	u64 len;
+	u64 i;
+	u32 crc;
+	char *buffer;
+	int ret = 0;
+
+	len = min_t(u64, num_bytes, CSUM_READ_SIZE);
+	buffer = malloc(len);
+	if (!buffer)
+		return -ENOMEM;
+	for (offset = 0; offset < num_bytes; offset += len) {
+		len = min_t(u64, num_bytes - offset, CSUM_READ_SIZE);
+		ret = read_disk_extent(root, disk_bytenr + offset,
+					len, buffer);
 		if (ret)
-			goto fail;
+			break;
+		for (i = 0; i < len; i += blocksize) {
+			crc = btrfs_csum_data(root, buffer + i,
+					      ~(u32)0, blocksize);
+			btrfs_csum_final(crc, csums + csum_size *
+					 ((offset + i) / blocksize));
+		}
 	}
+	free(buffer);
+	return ret;
+}
 
-	ins_key.objectid = objectid;
-	ins_key.offset = file_pos;
-	btrfs_set_key_type(&ins_key, BTRFS_EXTENT_DATA_KEY);
-	ret = btrfs_insert_empty_item(trans, root, &path, &ins_key,
-				      sizeof(*fi));
-	if (ret)
-		goto fail;
-	leaf = path.nodes[0];
-	fi = btrfs_item_ptr(leaf, path.slots[0],
-			    struct btrfs_file_extent_item);
-	btrfs_set_file_extent_generation(leaf, fi, trans->transid);
-	btrfs_set_file_extent_type(leaf, fi, BTRFS_FILE_EXTENT_REG);
-	btrfs_set_file_extent_disk_bytenr(leaf, fi, disk_bytenr);
-	btrfs_set_file_extent_disk_num_bytes(leaf, fi, num_bytes);
-	btrfs_set_file_extent_offset(leaf, fi, 0);
-	btrfs_set_file_extent_num_bytes(leaf, fi, num_bytes);
-	btrfs_set_file_extent_ram_bytes(leaf, fi, num_bytes);
-	btrfs_set_file_extent_compression(leaf, fi, 0);
-	btrfs_set_file_extent_encryption(leaf, fi, 0);
-	btrfs_set_file_extent_other_encoding(leaf, fi, 0);
-	btrfs_mark_buffer_dirty(leaf);
-
-	nbytes = btrfs_stack_inode_nbytes(inode) + num_bytes;
-	btrfs_set_stack_inode_nbytes(inode, nbytes);
+/*
+ * insert the extent item and the backref of a data extent and update
+ * the block accounting
+ */
+static int record_extent_ref(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, u64 objectid,
+			     u64 file_pos, u64 disk_bytenr, u64 num_bytes)
+{
+	int ret;
+	struct btrfs_root *extent_root = root->fs_info->extent_root;
+	struct extent_buffer *leaf;
+	struct btrfs_key ins_key;
+	struct btrfs_path path;
+	struct btrfs_extent_item *ei;
 
-	btrfs_release_path(root, &path);
+	btrfs_init_path(&path);
 
 	ins_key.objectid = disk_bytenr;
 	ins_key.offset = num_bytes;
@@ -470,8 +577,135 @@ fail:
 	return ret;
 }
 
+static int job_add_extent(struct convert_job *job, u64 file_pos,
+			  u64 disk_bytenr, u64 num_bytes, char *csums)
+{
+	struct convert_extent *extents;
+	int max;
+
+	if (job->nr_extents == job->max_extents) {
+		max = max(job->max_extents * 2, 4);
+		extents = realloc(job->extents, max * sizeof(*extents));
+		if (!extents)
+			return -ENOMEM;
+		job->extents = extents;
+		job->max_extents = max;
+	}
+	job->extents[job->nr_extents].file_pos = file_pos;
+	job->extents[job->nr_extents].disk_bytenr = disk_bytenr;
+	job->extents[job->nr_extents].num_bytes = num_bytes;
+	job->extents[job->nr_extents].csums = csums;
+	job->nr_extents++;
+	return 0;
+}
+
+/*
+ * Record a file extent. Do all the required works, such as inserting
+ * file extent item, inserting extent item and backref item into extent
+ * tree and updating block accounting.  When job isn't NULL the file
+ * extent item goes into the job's batch and the extent tree and csum
+ * updates are left to the main thread, trans isn't used then.
+ */
+static int record_file_extent(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root,
+			      struct convert_job *job, u64 objectid,
+			      struct btrfs_inode_item *inode,
+			      u64 file_pos, u64 disk_bytenr,
+			      u64 num_bytes, int checksum)
+{
+	int ret;
+	struct btrfs_fs_info *info = root->fs_info;
+	struct extent_buffer *leaf;
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key ins_key;
+	struct btrfs_path path;
+	u32 blocksize = root->sectorsize;
+	u16 csum_size = btrfs_super_csum_size(&info->super_copy);
+	char *csums = NULL;
+	u64 nbytes;
+
+	if (disk_bytenr == 0) {
+		if (job)
+			return btrfs_batch_insert_file_extent(&job->batch,
+							      objectid,
+							      file_pos, 0,
+							      num_bytes,
+							      num_bytes);
+		ret = btrfs_insert_file_extent(trans, root, objectid,
+						file_pos, disk_bytenr,
+						num_bytes, num_bytes);
+		return ret;
+	}
+
+	btrfs_init_path(&path);
+
+	if (checksum) {
+		csums = malloc(num_bytes / blocksize * csum_size);
+		if (!csums)
+			return -ENOMEM;
+		ret = csum_disk_extent(root, disk_bytenr, num_bytes, csums);
+		if (!ret && !job)
+			ret = btrfs_csum_file_blocks(trans, info->csum_root,
+						     disk_bytenr, num_bytes,
+						     csums);
+		if (ret || !job) {
+			free(csums);
+			csums = NULL;
+		}
+		if (ret)
+			goto fail;
+	}
+
+	if (job) {
+		ret = btrfs_batch_insert_file_extent(&job->batch, objectid,
+						     file_pos, disk_bytenr,
+						     num_bytes, num_bytes);
+		if (!ret)
+			ret = job_add_extent(job, file_pos, disk_bytenr,
+					     num_bytes, csums);
+		if (ret) {
+			free(csums);
+			goto fail;
+		}
+	} else {
+		ins_key.objectid = objectid;
+		ins_key.offset = file_pos;
+		btrfs_set_key_type(&ins_key, BTRFS_EXTENT_DATA_KEY);
+		ret = btrfs_insert_empty_item(trans, root, &path, &ins_key,
+					      sizeof(*fi));
+		if (ret)
+			goto fail;
+		leaf = path.nodes[0];
+		fi = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_file_extent_item);
+		btrfs_set_file_extent_generation(leaf, fi, trans->transid);
+		btrfs_set_file_extent_type(leaf, fi, BTRFS_FILE_EXTENT_REG);
+		btrfs_set_file_extent_disk_bytenr(leaf, fi, disk_bytenr);
+		btrfs_set_file_extent_disk_num_bytes(leaf, fi, num_bytes);
+		btrfs_set_file_extent_offset(leaf, fi, 0);
+		btrfs_set_file_extent_num_bytes(leaf, fi, num_bytes);
+		btrfs_set_file_extent_ram_bytes(leaf, fi, num_bytes);
+		btrfs_set_file_extent_compression(leaf, fi, 0);
+		btrfs_set_file_extent_encryption(leaf, fi, 0);
+		btrfs_set_file_extent_other_encoding(leaf, fi, 0);
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(root, &path);
+	}
+
+	nbytes = btrfs_stack_inode_nbytes(inode) + num_bytes;
+	btrfs_set_stack_inode_nbytes(inode, nbytes);
+
+	if (!job)
+		ret = record_extent_ref(trans, root, objectid, file_pos,
+					disk_bytenr, num_bytes);
+fail:
+	btrfs_release_path(root, &path);
+	return ret;
+}
+
 static int record_file_blocks(struct btrfs_trans_handle *trans,
-			      struct btrfs_root *root, u64 objectid,
+			      struct btrfs_root *root,
+			      struct convert_job *job, u64 objectid,
 			      struct btrfs_inode_item *inode,
 			      u64 file_block, u64 disk_block,
 			      u64 num_blocks, int checksum)
@@ -479,13 +713,14 @@ static int record_file_blocks(struct btrfs_trans_handle *trans,
 	u64 file_pos = file_block * root->sectorsize;
 	u64 disk_bytenr = disk_block * root->sectorsize;
 	u64 num_bytes = num_blocks * root->sectorsize;
-	return record_file_extent(trans, root, objectid, inode, file_pos,
-				  disk_bytenr, num_bytes, checksum);
+	return record_file_extent(trans, root, job, objectid, inode,
+				  file_pos, disk_bytenr, num_bytes, checksum);
 }
 
 struct blk_iterate_data {
 	struct btrfs_trans_handle *trans;
 	struct btrfs_root *root;
+	struct convert_job *job;
 	struct btrfs_inode_item *inode;
 	u64 objectid;
 	u64 first_block;
@@ -496,6 +731,25 @@ struct blk_iterate_data {
 	int errcode;
 };
 
+static u64 block_group_end(struct convert_ctl *ctl, u64 bytenr)
+{
+	int low = 0;
+	int high = ctl->nr_bgs;
+	int mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (bytenr < ctl->bgs[mid].start)
+			high = mid;
+		else if (bytenr >= ctl->bgs[mid].end)
+			low = mid + 1;
+		else
+			return ctl->bgs[mid].end;
+	}
+	BUG_ON(1);
+	return 0;
+}
+
 static int block_iterate_proc(ext2_filsys ext2_fs,
 			      u64 disk_block, u64 file_block,
 		              struct blk_iterate_data *idata)
@@ -514,7 +768,8 @@ static int block_iterate_proc(ext2_filsys ext2_fs,
 	    (file_block > idata->first_block + idata->num_blocks) ||
 	    (disk_block != idata->disk_block + idata->num_blocks)) {
 		if (idata->num_blocks > 0) {
-			ret = record_file_blocks(trans, root, idata->objectid,
+			ret = record_file_blocks(trans, root, idata->job,
+					idata->objectid,
 					idata->inode, idata->first_block,
 					idata->disk_block, idata->num_blocks,
 					idata->checksum);
@@ -524,7 +779,8 @@ static int block_iterate_proc(ext2_filsys ext2_fs,
 			idata->num_blocks = 0;
 		}
 		if (file_block > idata->first_block) {
-			ret = record_file_blocks(trans, root, idata->objectid,
+			ret = record_file_blocks(trans, root, idata->job,
+					idata->objectid,
 					idata->inode, idata->first_block,
 					0, file_block - idata->first_block,
 					idata->checksum);
@@ -535,6 +791,8 @@ static int block_iterate_proc(ext2_filsys ext2_fs,
 		if (sb_region) {
 			bytenr += STRIPE_LEN - 1;
 			bytenr &= ~((u64)STRIPE_LEN - 1);
+		} else if (idata->job) {
+			bytenr = block_group_end(idata->job->ctl, bytenr);
 		} else {
 			cache = btrfs_lookup_block_group(root->fs_info, bytenr);
 			BUG_ON(!cache);
@@ -565,7 +823,8 @@ static int __block_iterate_proc(ext2_filsys fs, blk_t *blocknr,
  * traverse file's data blocks, record these data blocks as file extents.
  */
 static int create_file_extents(struct btrfs_trans_handle *trans,
-			       struct btrfs_root *root, u64 objectid,
+			       struct btrfs_root *root,
+			       struct convert_job *job, u64 objectid,
 			       struct btrfs_inode_item *btrfs_inode,
 			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
 			       int datacsum, int packing)
@@ -579,6 +838,7 @@ static int create_file_extents(struct btrfs_trans_handle *trans,
 	struct blk_iterate_data data = {
 		.trans		= trans,
 		.root		= root,
+		.job		= job,
 		.inode		= btrfs_inode,
 		.objectid	= objectid,
 		.first_block	= 0,
@@ -609,25 +869,27 @@ static int create_file_extents(struct btrfs_trans_handle *trans,
 			goto fail;
 		if (num_bytes > inode_size)
 			num_bytes = inode_size;
-		ret = btrfs_insert_inline_extent(trans, root, objectid,
-						 0, buffer, num_bytes);
+		ret = btrfs_batch_insert_inline_extent(&job->batch, objectid,
+						       0, buffer, num_bytes);
 		if (ret)
 			goto fail;
 		nbytes = btrfs_stack_inode_nbytes(btrfs_inode) + num_bytes;
 		btrfs_set_stack_inode_nbytes(btrfs_inode, nbytes);
 	} else if (data.num_blocks > 0) {
-		ret = record_file_blocks(trans, root, objectid, btrfs_inode,
-					 data.first_block, data.disk_block,
-					 data.num_blocks, data.checksum);
+		ret = record_file_blocks(trans, root, job, objectid,
+					 btrfs_inode, data.first_block,
+					 data.disk_block, data.num_blocks,
+					 data.checksum);
 		if (ret)
 			goto fail;
 	}
 	data.first_block += data.num_blocks;
 	last_block = (inode_size + sectorsize - 1) / sectorsize;
 	if (last_block > data.first_block) {
-		ret = record_file_blocks(trans, root, objectid, btrfs_inode,
-					 data.first_block, 0, last_block -
-					 data.first_block, data.checksum);
+		ret = record_file_blocks(trans, root, job, objectid,
+					 btrfs_inode, data.first_block, 0,
+					 last_block - data.first_block,
+					 data.checksum);
 	}
 fail:
 	if (buffer)
@@ -639,7 +901,8 @@ error:
 }
 
 static int create_symbol_link(struct btrfs_trans_handle *trans,
-			      struct btrfs_root *root, u64 objectid,
+			      struct btrfs_root *root,
+			      struct convert_job *job, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
 			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
 			      struct ext2_inode *ext2_inode)
@@ -649,16 +912,16 @@ static int create_symbol_link(struct btrfs_trans_handle *trans,
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
 	if (ext2fs_inode_data_blocks(ext2_fs, ext2_inode)) {
 		btrfs_set_stack_inode_size(btrfs_inode, inode_size + 1);
-		ret = create_file_extents(trans, root, objectid, btrfs_inode,
-					  ext2_fs, ext2_ino, 1, 1);
+		ret = create_file_extents(trans, root, job, objectid,
+					  btrfs_inode, ext2_fs, ext2_ino, 1, 1);
 		btrfs_set_stack_inode_size(btrfs_inode, inode_size);
 		return ret;
 	}
 
 	pathname = (char *)&(ext2_inode->i_block[0]);
 	BUG_ON(pathname[inode_size] != 0);
-	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-					 pathname, inode_size + 1);
+	ret = btrfs_batch_insert_inline_extent(&job->batch, objectid, 0,
+					       pathname, inode_size + 1);
 	btrfs_set_stack_inode_nbytes(btrfs_inode, inode_size + 1);
 	return ret;
 }
@@ -826,8 +1089,8 @@ static char *xattr_prefix_table[] = {
 	[6] =	"security.",
 };
 
-static int copy_single_xattr(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root, u64 objectid,
+static int copy_single_xattr(struct btrfs_root *root,
+			     struct btrfs_item_batch *batch, u64 objectid,
 			     struct ext2_ext_attr_entry *entry,
 			     const void *data, u32 datalen)
 {
@@ -865,16 +1128,16 @@ static int copy_single_xattr(struct btrfs_trans_handle *trans,
 			objectid - INO_OFFSET, name_len, namebuf);
 		goto out;
 	}
-	ret = btrfs_insert_xattr_item(trans, root, namebuf, name_len,
-				      data, datalen, objectid);
+	ret = btrfs_batch_insert_xattr_item(batch, namebuf, name_len,
+					    data, datalen, objectid);
 out:
 	if (databuf)
 		free(databuf);
 	return ret;
 }
 
-static int copy_extended_attrs(struct btrfs_trans_handle *trans,
-			       struct btrfs_root *root, u64 objectid,
+static int copy_extended_attrs(struct btrfs_root *root,
+			       struct btrfs_item_batch *batch, u64 objectid,
 			       struct btrfs_inode_item *btrfs_inode,
 			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
 {
@@ -934,7 +1197,7 @@ static int copy_extended_attrs(struct btrfs_trans_handle *trans,
 			data = (void *)EXT2_XATTR_IFIRST(ext2_inode) +
 				entry->e_value_offs;
 			datalen = entry->e_value_size;
-			ret = copy_single_xattr(trans, root, objectid,
+			ret = copy_single_xattr(root, batch, objectid,
 						entry, data, datalen);
 			if (ret)
 				goto out;
@@ -968,7 +1231,7 @@ static int copy_extended_attrs(struct btrfs_trans_handle *trans,
 			goto out;
 		data = buffer + entry->e_value_offs;
 		datalen = entry->e_value_size;
-		ret = copy_single_xattr(trans, root, objectid,
+		ret = copy_single_xattr(root, batch, objectid,
 					entry, data, datalen);
 		if (ret)
 			goto out;
@@ -1042,16 +1305,17 @@ static int copy_inode_item(struct btrfs_inode_item *dst,
 /*
  * copy a single inode. do all the required works, such as cloning
  * inode item, creating file extents and creating directory entries.
+ * Runs on the reader threads, everything goes into the job.
  */
-static int copy_single_inode(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root, u64 objectid,
-			     ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			     struct ext2_inode *ext2_inode,
+static int copy_single_inode(struct btrfs_root *root,
+			     struct convert_job *job, ext2_filsys ext2_fs,
 			     int datacsum, int packing, int noxattr)
 {
 	int ret;
-	struct btrfs_key inode_key;
 	struct btrfs_inode_item btrfs_inode;
+	struct ext2_inode *ext2_inode = &job->ext2_inode;
+	ext2_ino_t ext2_ino = job->ext2_ino;
+	u64 objectid = job->objectid;
 
 	if (ext2_inode->i_links_count == 0)
 		return 0;
@@ -1065,16 +1329,18 @@ static int copy_single_inode(struct btrfs_trans_handle *trans,
 
 	switch (ext2_inode->i_mode & S_IFMT) {
 	case S_IFREG:
-		ret = create_file_extents(trans, root, objectid, &btrfs_inode,
-					ext2_fs, ext2_ino, datacsum, packing);
+		ret = create_file_extents(NULL, root, job, objectid,
+					  &btrfs_inode, ext2_fs, ext2_ino,
+					  datacsum, packing);
 		break;
 	case S_IFDIR:
-		ret = create_dir_entries(trans, root, objectid, &btrfs_inode,
+		ret = create_dir_entries(&job->batch, objectid, &btrfs_inode,
 					 ext2_fs, ext2_ino);
 		break;
 	case S_IFLNK:
-		ret = create_symbol_link(trans, root, objectid, &btrfs_inode,
-					 ext2_fs, ext2_ino, ext2_inode);
+		ret = create_symbol_link(NULL, root, job, objectid,
+					 &btrfs_inode, ext2_fs, ext2_ino,
+					 ext2_inode);
 		break;
 	default:
 		ret = 0;
@@ -1084,15 +1350,12 @@ static int copy_single_inode(struct btrfs_trans_handle *trans,
 		return ret;
 
 	if (!noxattr) {
-		ret = copy_extended_attrs(trans, root, objectid, &btrfs_inode,
-					  ext2_fs, ext2_ino);
+		ret = copy_extended_attrs(root, &job->batch, objectid,
+					  &btrfs_inode, ext2_fs, ext2_ino);
 		if (ret)
 			return ret;
 	}
-	inode_key.objectid = objectid;
-	inode_key.offset = 0;
-	btrfs_set_key_type(&inode_key, BTRFS_INODE_ITEM_KEY);
-	ret = btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
+	ret = btrfs_batch_insert_inode(&job->batch, objectid, &btrfs_inode);
 	return ret;
 }
 
@@ -1119,19 +1382,176 @@ fail:
 		ret = -1;
 	return ret;
 }
+static void free_job(struct convert_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nr_extents; i++)
+		free(job->extents[i].csums);
+	free(job->extents);
+	btrfs_item_batch_release(&job->batch);
+	free(job);
+}
+
+static void *reader_thread(void *data)
+{
+	struct convert_reader *reader = data;
+	struct convert_ctl *ctl = reader->ctl;
+	struct convert_job *job;
+
+	pthread_mutex_lock(&ctl->mutex);
+	while (1) {
+		while (!ctl->stop && list_empty(&ctl->todo))
+			pthread_cond_wait(&ctl->work_cond, &ctl->mutex);
+		if (ctl->stop)
+			break;
+		job = list_entry(ctl->todo.next, struct convert_job, list);
+		list_del_init(&job->list);
+		pthread_mutex_unlock(&ctl->mutex);
+
+		job->ret = copy_single_inode(ctl->root, job, reader->ext2_fs,
+					     ctl->datacsum, ctl->packing,
+					     ctl->noxattr);
+
+		pthread_mutex_lock(&ctl->mutex);
+		job->done = 1;
+		pthread_cond_broadcast(&ctl->done_cond);
+	}
+	pthread_mutex_unlock(&ctl->mutex);
+	return NULL;
+}
+
+static void stop_readers(struct convert_ctl *ctl)
+{
+	int i;
+
+	pthread_mutex_lock(&ctl->mutex);
+	ctl->stop = 1;
+	pthread_cond_broadcast(&ctl->work_cond);
+	pthread_mutex_unlock(&ctl->mutex);
+	for (i = 0; i < ctl->num_readers; i++) {
+		pthread_join(ctl->readers[i].thread, NULL);
+		ext2fs_close(ctl->readers[i].ext2_fs);
+	}
+	free(ctl->readers);
+	free(ctl->bgs);
+	pthread_mutex_destroy(&ctl->mutex);
+	pthread_cond_destroy(&ctl->work_cond);
+	pthread_cond_destroy(&ctl->done_cond);
+}
+
+static int start_readers(struct convert_ctl *ctl, const char *devname)
+{
+	struct btrfs_fs_info *fs_info = ctl->root->fs_info;
+	struct btrfs_block_group_cache *cache;
+	struct convert_reader *reader;
+	errcode_t err;
+	long cpus;
+	u64 start = 0;
+	int ret;
+
+	pthread_mutex_init(&ctl->mutex, NULL);
+	pthread_cond_init(&ctl->work_cond, NULL);
+	pthread_cond_init(&ctl->done_cond, NULL);
+	INIT_LIST_HEAD(&ctl->todo);
+
+	while ((cache = btrfs_lookup_first_block_group(fs_info, start))) {
+		if (ctl->nr_bgs % 64 == 0) {
+			struct convert_bg *bgs;
+
+			bgs = realloc(ctl->bgs, (ctl->nr_bgs + 64) *
+				      sizeof(*bgs));
+			if (!bgs)
+				return -ENOMEM;
+			ctl->bgs = bgs;
+		}
+		ctl->bgs[ctl->nr_bgs].start = cache->key.objectid;
+		ctl->bgs[ctl->nr_bgs].end = cache->key.objectid +
+					     cache->key.offset;
+		start = ctl->bgs[ctl->nr_bgs].end;
+		ctl->nr_bgs++;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = min_t(long, max_t(long, cpus, 1), CONVERT_MAX_READERS);
+	ctl->readers = calloc(cpus, sizeof(*ctl->readers));
+	if (!ctl->readers)
+		return -ENOMEM;
+
+	while (ctl->num_readers < cpus) {
+		reader = ctl->readers + ctl->num_readers;
+		reader->ctl = ctl;
+		err = ext2fs_open(devname, 0, 0, 0, unix_io_manager,
+				  &reader->ext2_fs);
+		if (err) {
+			fprintf(stderr, "ext2fs_open: %s\n",
+				error_message(err));
+			return -1;
+		}
+		ret = pthread_create(&reader->thread, NULL, reader_thread,
+				     reader);
+		if (ret) {
+			ext2fs_close(reader->ext2_fs);
+			return -ret;
+		}
+		ctl->num_readers++;
+	}
+	return 0;
+}
+
+/*
+ * add the extents a reader found to the extent and csum trees and
+ * move the items of the inode into the fs tree batch
+ */
+static int commit_job(struct btrfs_trans_handle *trans,
+		      struct btrfs_root *root,
+		      struct btrfs_item_batch *batch,
+		      struct convert_job *job)
+{
+	struct btrfs_root *csum_root = root->fs_info->csum_root;
+	struct convert_extent *extent;
+	int ret = job->ret;
+	int i;
+
+	for (i = 0; i < job->nr_extents && !ret; i++) {
+		extent = job->extents + i;
+		if (extent->csums)
+			ret = btrfs_csum_file_blocks(trans, csum_root,
+						     extent->disk_bytenr,
+						     extent->num_bytes,
+						     extent->csums);
+		if (!ret)
+			ret = record_extent_ref(trans, root, job->objectid,
+						extent->file_pos,
+						extent->disk_bytenr,
+						extent->num_bytes);
+	}
+	if (!ret)
+		ret = btrfs_item_batch_splice(batch, &job->batch);
+	return ret;
+}
+
 /*
- * scan ext2's inode bitmap and copy all used inodes.
+ * scan ext2's inode bitmap and copy all used inodes.  The main thread
+ * scans the inode table and commits the inodes in order while the
+ * readers work ahead of it.
  */
 static int copy_inodes(struct btrfs_root *root, ext2_filsys ext2_fs,
-		       int datacsum, int packing, int noxattr)
+		       const char *devname, int datacsum, int packing,
+		       int noxattr)
 {
 	int ret;
-	errcode_t err;
+	int nr_pending = 0;
+	int scan_done = 0;
+	errcode_t err = 0;
 	ext2_inode_scan ext2_scan;
 	struct ext2_inode ext2_inode;
 	ext2_ino_t ext2_ino;
-	u64 objectid;
 	struct btrfs_trans_handle *trans;
+	struct btrfs_item_batch batch;
+	struct convert_ctl ctl;
+	struct convert_job *job;
+	struct list_head pending;
 
 	trans = btrfs_start_transaction(root, 1);
 	if (!trans)
@@ -1141,36 +1561,116 @@ static int copy_inodes(struct btrfs_root *root, ext2_filsys ext2_fs,
 		fprintf(stderr, "ext2fs_open_inode_scan: %s\n", error_message(err));
 		return -1;
 	}
-	while (!(err = ext2fs_get_next_inode(ext2_scan, &ext2_ino,
-					     &ext2_inode))) {
-		/* no more inodes */
-		if (ext2_ino == 0)
-			break;
-		/* skip special inode in ext2fs */
-		if (ext2_ino < EXT2_GOOD_OLD_FIRST_INO &&
-		    ext2_ino != EXT2_ROOT_INO)
-			continue;
-		objectid = ext2_ino + INO_OFFSET;
-		ret = copy_single_inode(trans, root,
-					objectid, ext2_fs, ext2_ino,
-					&ext2_inode, datacsum, packing,
-					noxattr);
-		if (ret)
-			return ret;
-		if (trans->blocks_used >= 4096) {
-			ret = btrfs_commit_transaction(trans, root);
-			BUG_ON(ret);
-			trans = btrfs_start_transaction(root, 1);
-			BUG_ON(!trans);
-		}
-	}
-	if (err) {
-		fprintf(stderr, "ext2fs_get_next_inode: %s\n", error_message(err));
-		return -1;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.root = root;
+	ctl.datacsum = datacsum;
+	ctl.packing = packing;
+	ctl.noxattr = noxattr;
+	ret = start_readers(&ctl, devname);
+	if (ret) {
+		fprintf(stderr, "unable to start the inode readers\n");
+		stop_readers(&ctl);
+		return ret;
 	}
-	ret = btrfs_commit_transaction(trans, root);
-	BUG_ON(ret);
+	INIT_LIST_HEAD(&pending);
+
+	/*
+	 * the fs tree items are collected in a batch and the tree is
+	 * bulk loaded from it, the extent and csum trees are still
+	 * updated as we go
+	 */
+	btrfs_item_batch_init(&batch, trans->transid);
+	while (1) {
+		/* keep the readers busy */
+		while (!scan_done && nr_pending < CONVERT_MAX_PENDING) {
+			err = ext2fs_get_next_inode(ext2_scan, &ext2_ino,
+						    &ext2_inode);
+			/* no more inodes */
+			if (err || ext2_ino == 0) {
+				scan_done = 1;
+				break;
+			}
+			/* skip special inode in ext2fs */
+			if (ext2_ino < EXT2_GOOD_OLD_FIRST_INO &&
+			    ext2_ino != EXT2_ROOT_INO)
+				continue;
+			if (ext2_inode.i_links_count == 0)
+				continue;
+
+			job = calloc(1, sizeof(*job));
+			if (!job) {
+				ret = -ENOMEM;
+				goto fail;
+			}
+			job->ctl = &ctl;
+			job->ext2_ino = ext2_ino;
+			job->ext2_inode = ext2_inode;
+			job->objectid = ext2_ino + INO_OFFSET;
+			btrfs_item_batch_init(&job->batch, trans->transid);
+			list_add_tail(&job->pending, &pending);
+			nr_pending++;
+
+			pthread_mutex_lock(&ctl.mutex);
+			list_add_tail(&job->list, &ctl.todo);
+			pthread_cond_signal(&ctl.work_cond);
+			pthread_mutex_unlock(&ctl.mutex);
+		}
+		if (list_empty(&pending))
+			break;
+
+		/* the oldest inode goes in next */
+		job = list_entry(pending.next, struct convert_job, pending);
+		pthread_mutex_lock(&ctl.mutex);
+		while (!job->done)
+			pthread_cond_wait(&ctl.done_cond, &ctl.mutex);
+		pthread_mutex_unlock(&ctl.mutex);
+
+		list_del(&job->pending);
+		nr_pending--;
+		ret = commit_job(trans, root, &batch, job);
+		free_job(job);
+		if (ret)
+			goto fail;
+
+		if (batch.bytes >= CONVERT_BATCH_SIZE) {
+			ret = btrfs_item_batch_load(trans, root, &batch,
+						    BTRFS_BULK_LOAD_FILL);
+			BUG_ON(ret);
+			ret = btrfs_commit_transaction(trans, root);
+			BUG_ON(ret);
+			trans = btrfs_start_transaction(root, 1);
+			BUG_ON(!trans);
+			btrfs_item_batch_init(&batch, trans->transid);
+		} else if (trans->blocks_used >= 4096) {
+			ret = btrfs_commit_transaction(trans, root);
+			BUG_ON(ret);
+			trans = btrfs_start_transaction(root, 1);
+			BUG_ON(!trans);
+		}
+	}
+	stop_readers(&ctl);
+	ext2fs_close_inode_scan(ext2_scan);
+	if (err) {
+		fprintf(stderr, "ext2fs_get_next_inode: %s\n", error_message(err));
+		btrfs_item_batch_release(&batch);
+		return -1;
+	}
+	ret = btrfs_item_batch_load(trans, root, &batch, BTRFS_BULK_LOAD_FILL);
+	BUG_ON(ret);
+	ret = btrfs_commit_transaction(trans, root);
+	BUG_ON(ret);
 
+	return ret;
+fail:
+	stop_readers(&ctl);
+	ext2fs_close_inode_scan(ext2_scan);
+	while (!list_empty(&pending)) {
+		job = list_entry(pending.next, struct convert_job, pending);
+		list_del(&job->pending);
+		free_job(job);
+	}
+	btrfs_item_batch_release(&batch);
 	return ret;
 }
 
@@ -1214,7 +1714,7 @@ static int create_image_file_range(struct btrfs_trans_handle *trans,
 		}
 	}
 	if (data.num_blocks > 0) {
-		ret = record_file_blocks(trans, root, objectid, inode,
+		ret = record_file_blocks(trans, root, NULL, objectid, inode,
 					 data.first_block, data.disk_block,
 					 data.num_blocks, 0);
 		if (ret)
@@ -1222,7 +1722,7 @@ static int create_image_file_range(struct btrfs_trans_handle *trans,
 		data.first_block += data.num_blocks;
 	}
 	if (last_block > data.first_block) {
-		ret = record_file_blocks(trans, root, objectid, inode,
+		ret = record_file_blocks(trans, root, NULL, objectid, inode,
 					 data.first_block, 0, last_block -
 					 data.first_block, 0);
 		if (ret)
@@ -1291,7 +1791,7 @@ static int create_ext2_image(struct btrfs_root *root, ext2_filsys ext2_fs,
 				       sectorsize);
 		if (ret)
 			goto fail;
-		ret = record_file_extent(trans, root, objectid,
+		ret = record_file_extent(trans, root, NULL, objectid,
 					 &btrfs_inode, last_byte,
 					 key.objectid, sectorsize, 0);
 		if (ret)
@@ -1352,8 +1852,9 @@ next:
 			if (ret)
 				goto fail;
 		}
-		ret = record_file_extent(trans, root, objectid, &btrfs_inode,
-					 bytenr, bytenr, num_bytes, 0);
+		ret = record_file_extent(trans, root, NULL, objectid,
+					 &btrfs_inode, bytenr, bytenr,
+					 num_bytes, 0);
 		if (ret)
 			goto fail;
 		last_byte = bytenr + num_bytes;
@@ -1900,221 +2401,132 @@ fail:
 	return ret;
 }
 
-static int relocate_one_reference(struct btrfs_trans_handle *trans,
-				  struct btrfs_root *root,
-				  u64 extent_start, u64 extent_size,
-				  struct btrfs_key *extent_key,
-				  struct extent_io_tree *reloc_tree)
-{
-	struct extent_buffer *leaf;
-	struct btrfs_file_extent_item *fi;
-	struct btrfs_key key;
-	struct btrfs_path path;
-	struct btrfs_inode_item inode;
-	struct blk_iterate_data data;
+struct reloc_piece {
 	u64 bytenr;
 	u64 num_bytes;
-	u64 cur_offset;
-	u64 new_pos;
-	u64 nbytes;
-	u64 sector_end;
-	u32 sectorsize = root->sectorsize;
-	unsigned long ptr;
-	int datacsum;
-	int fd;
-	int ret;
-
-	btrfs_init_path(&path);
-	ret = btrfs_search_slot(trans, root, extent_key, &path, -1, 1);
-	if (ret)
-		goto fail;
-
-	leaf = path.nodes[0];
-	fi = btrfs_item_ptr(leaf, path.slots[0],
-			    struct btrfs_file_extent_item);
-	BUG_ON(btrfs_file_extent_offset(leaf, fi) > 0);
-	if (extent_start != btrfs_file_extent_disk_bytenr(leaf, fi) ||
-	    extent_size != btrfs_file_extent_disk_num_bytes(leaf, fi)) {
-		ret = 1;
-		goto fail;
-	}
-
-	bytenr = extent_start + btrfs_file_extent_offset(leaf, fi);
-	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
-
-	ret = btrfs_del_item(trans, root, &path);
-	if (ret)
-		goto fail;
-
-	ret = btrfs_free_extent(trans, root, extent_start, extent_size, 0,
-				root->root_key.objectid,
-				extent_key->objectid, extent_key->offset);
-	if (ret)
-		goto fail;
-
-	btrfs_release_path(root, &path);
-
-	key.objectid = extent_key->objectid;
-	key.offset = 0;
-	key.type =  BTRFS_INODE_ITEM_KEY;
-	ret = btrfs_lookup_inode(trans, root, &path, &key, 0);
-	if (ret)
-		goto fail;
+};
 
-	leaf = path.nodes[0];
-	ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
-	read_extent_buffer(leaf, &inode, ptr, sizeof(inode));
-	btrfs_release_path(root, &path);
+/* a data extent to move and where its contents went */
+struct reloc_extent {
+	u64 bytenr;
+	u64 num_bytes;
+	int csum;
+	int used;
+	int nr_pieces;
+	struct reloc_piece *pieces;
+};
 
-	BUG_ON(num_bytes & (sectorsize - 1));
-	nbytes = btrfs_stack_inode_nbytes(&inode) - num_bytes;
-	btrfs_set_stack_inode_nbytes(&inode, nbytes);
-	datacsum = !(btrfs_stack_inode_flags(&inode) & BTRFS_INODE_NODATASUM);
+struct reloc_ref {
+	u64 root;
+	u64 objectid;
+	u64 offset;
+	int extent;
+};
 
-	data = (struct blk_iterate_data) {
-		.trans		= trans,
-		.root		= root,
-		.inode		= &inode,
-		.objectid	= extent_key->objectid,
-		.first_block	= extent_key->offset / sectorsize,
-		.disk_block	= 0,
-		.num_blocks	= 0,
-		.boundary	= (u64)-1,
-		.checksum	= datacsum,
-		.errcode	= 0,
-	};
+struct reloc_ctl {
+	struct reloc_extent *extents;
+	int nr_extents;
+	int max_extents;
+	struct reloc_ref *refs;
+	int nr_refs;
+	int max_refs;
+};
 
-	cur_offset = extent_key->offset;
-	while (num_bytes > 0) {
-		sector_end = bytenr + sectorsize - 1;
-		if (test_range_bit(reloc_tree, bytenr, sector_end,
-				   EXTENT_LOCKED, 1)) {
-			ret = get_state_private(reloc_tree, bytenr, &new_pos);
-			BUG_ON(ret);
-		} else {
-			ret = custom_alloc_extent(root, sectorsize, 0, &key);
-			if (ret)
-				goto fail;
-			new_pos = key.objectid;
+static void reloc_ctl_release(struct reloc_ctl *rc)
+{
+	int i;
 
-			if (cur_offset == extent_key->offset) {
-				fd = root->fs_info->fs_devices->latest_bdev;
-				readahead(fd, bytenr, num_bytes);
-			}
-			ret = copy_disk_extent(root, new_pos, bytenr,
-					       sectorsize);
-			if (ret)
-				goto fail;
-			ret = set_extent_bits(reloc_tree, bytenr, sector_end,
-					      EXTENT_LOCKED, GFP_NOFS);
-			BUG_ON(ret);
-			ret = set_state_private(reloc_tree, bytenr, new_pos);
-			BUG_ON(ret);
-		}
+	for (i = 0; i < rc->nr_extents; i++)
+		free(rc->extents[i].pieces);
+	free(rc->extents);
+	free(rc->refs);
+	memset(rc, 0, sizeof(*rc));
+}
 
-		ret = block_iterate_proc(NULL, new_pos / sectorsize,
-					 cur_offset / sectorsize, &data);
-		if (ret & BLOCK_ABORT) {
-			ret = data.errcode;
-			goto fail;
-		}
+static int reloc_ref_cmp(const void *a, const void *b)
+{
+	const struct reloc_ref *ra = a;
+	const struct reloc_ref *rb = b;
+
+	if (ra->root != rb->root)
+		return ra->root < rb->root ? -1 : 1;
+	if (ra->objectid != rb->objectid)
+		return ra->objectid < rb->objectid ? -1 : 1;
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+	return 0;
+}
 
-		cur_offset += sectorsize;
-		bytenr += sectorsize;
-		num_bytes -= sectorsize;
-	}
+static int reloc_add_extent(struct reloc_ctl *rc, u64 bytenr, u64 num_bytes)
+{
+	struct reloc_extent *extents;
+	int max;
 
-	if (data.num_blocks > 0) {
-		ret = record_file_blocks(trans, root,
-					 extent_key->objectid, &inode,
-					 data.first_block, data.disk_block,
-					 data.num_blocks, datacsum);
-		if (ret)
-			goto fail;
+	if (rc->nr_extents == rc->max_extents) {
+		max = max(rc->max_extents * 2, 16);
+		extents = realloc(rc->extents, max * sizeof(*extents));
+		if (!extents)
+			return -ENOMEM;
+		rc->extents = extents;
+		rc->max_extents = max;
 	}
+	memset(rc->extents + rc->nr_extents, 0, sizeof(*extents));
+	rc->extents[rc->nr_extents].bytenr = bytenr;
+	rc->extents[rc->nr_extents].num_bytes = num_bytes;
+	rc->nr_extents++;
+	return 0;
+}
 
-	key.objectid = extent_key->objectid;
-	key.offset = 0;
-	key.type =  BTRFS_INODE_ITEM_KEY;
-	ret = btrfs_lookup_inode(trans, root, &path, &key, 1);
-	if (ret)
-		goto fail;
-
-	leaf = path.nodes[0];
-	ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
-	write_extent_buffer(leaf, &inode, ptr, sizeof(inode));
-	btrfs_mark_buffer_dirty(leaf);
-	btrfs_release_path(root, &path);
+static int reloc_add_ref(struct reloc_ctl *rc, u64 root, u64 objectid,
+			 u64 offset)
+{
+	struct reloc_ref *refs;
+	int max;
 
-fail:
-	btrfs_release_path(root, &path);
-	return ret;
+	if (rc->nr_refs == rc->max_refs) {
+		max = max(rc->max_refs * 2, 16);
+		refs = realloc(rc->refs, max * sizeof(*refs));
+		if (!refs)
+			return -ENOMEM;
+		rc->refs = refs;
+		rc->max_refs = max;
+	}
+	rc->refs[rc->nr_refs].root = root;
+	rc->refs[rc->nr_refs].objectid = objectid;
+	rc->refs[rc->nr_refs].offset = offset;
+	rc->refs[rc->nr_refs].extent = rc->nr_extents - 1;
+	rc->nr_refs++;
+	return 0;
 }
 
-static int relocate_extents_range(struct btrfs_root *fs_root,
-				  struct btrfs_root *ext2_root,
-				  u64 start_byte, u64 end_byte)
+/*
+ * collect the data extents that start in [start_byte, end_byte) and
+ * every reference to them from a single walk of the extent tree
+ */
+static int collect_reloc_extents(struct btrfs_root *extent_root,
+				 u64 start_byte, u64 end_byte,
+				 struct reloc_ctl *rc)
 {
-	struct btrfs_fs_info *info = fs_root->fs_info;
-	struct btrfs_root *extent_root = info->extent_root;
-	struct btrfs_root *cur_root = NULL;
-	struct btrfs_trans_handle *trans;
 	struct btrfs_extent_data_ref *dref;
 	struct btrfs_extent_inline_ref *iref;
 	struct btrfs_extent_item *ei;
 	struct extent_buffer *leaf;
 	struct btrfs_key key;
-	struct btrfs_key extent_key;
 	struct btrfs_path path;
-	struct extent_io_tree reloc_tree;
 	unsigned long ptr;
 	unsigned long end;
-	u64 cur_byte;
-	u64 num_bytes;
-	u64 ref_root;
-	u64 num_extents;
-	int pass = 0;
+	int type;
 	int ret;
 
 	btrfs_init_path(&path);
-	extent_io_tree_init(&reloc_tree);
-
 	key.objectid = start_byte;
 	key.offset = 0;
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
 	if (ret < 0)
 		goto fail;
-	if (ret > 0) {
-		ret = btrfs_previous_item(extent_root, &path, 0,
-					  BTRFS_EXTENT_ITEM_KEY);
-		if (ret < 0)
-			goto fail;
-		if (ret == 0) {
-			leaf = path.nodes[0];
-			btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
-			if (key.objectid + key.offset > start_byte)
-				start_byte = key.objectid;
-		}
-	}
-	btrfs_release_path(extent_root, &path);
-again:
-	cur_root = (pass % 2 == 0) ? ext2_root : fs_root;
-	num_extents = 0;
 
-	trans = btrfs_start_transaction(cur_root, 1);
-	BUG_ON(!trans);
-
-	cur_byte = start_byte;
 	while (1) {
-		key.objectid = cur_byte;
-		key.offset = 0;
-		key.type = BTRFS_EXTENT_ITEM_KEY;
-		ret = btrfs_search_slot(trans, extent_root,
-					&key, &path, 0, 0);
-		if (ret < 0)
-			goto fail;
-next:
 		leaf = path.nodes[0];
 		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
 			ret = btrfs_next_leaf(extent_root, &path);
@@ -2126,80 +2538,403 @@ next:
 		}
 
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
-		if (key.objectid < cur_byte ||
+		if (key.objectid >= end_byte)
+			break;
+		if (key.objectid < start_byte ||
 		    key.type != BTRFS_EXTENT_ITEM_KEY) {
 			path.slots[0]++;
-			goto next;
+			continue;
 		}
-		if (key.objectid >= end_byte)
-			break;
-
-		num_extents++;
 
-		cur_byte = key.objectid;
-		num_bytes = key.offset;
 		ei = btrfs_item_ptr(leaf, path.slots[0],
 				    struct btrfs_extent_item);
 		BUG_ON(!(btrfs_extent_flags(leaf, ei) &
 			 BTRFS_EXTENT_FLAG_DATA));
+		ret = reloc_add_extent(rc, key.objectid, key.offset);
+		if (ret)
+			goto fail;
 
 		ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
 		end = ptr + btrfs_item_size_nr(leaf, path.slots[0]);
-
 		ptr += sizeof(struct btrfs_extent_item);
-
 		while (ptr < end) {
 			iref = (struct btrfs_extent_inline_ref *)ptr;
-			key.type = btrfs_extent_inline_ref_type(leaf, iref);
-			BUG_ON(key.type != BTRFS_EXTENT_DATA_REF_KEY);
+			type = btrfs_extent_inline_ref_type(leaf, iref);
+			BUG_ON(type != BTRFS_EXTENT_DATA_REF_KEY);
 			dref = (struct btrfs_extent_data_ref *)(&iref->offset);
-			ref_root = btrfs_extent_data_ref_root(leaf, dref);
-			extent_key.objectid =
-				btrfs_extent_data_ref_objectid(leaf, dref);
-			extent_key.offset =
-				btrfs_extent_data_ref_offset(leaf, dref);
-			extent_key.type = BTRFS_EXTENT_DATA_KEY;
 			BUG_ON(btrfs_extent_data_ref_count(leaf, dref) != 1);
+			ret = reloc_add_ref(rc,
+				btrfs_extent_data_ref_root(leaf, dref),
+				btrfs_extent_data_ref_objectid(leaf, dref),
+				btrfs_extent_data_ref_offset(leaf, dref));
+			if (ret)
+				goto fail;
+			ptr += btrfs_extent_inline_ref_size(type);
+		}
+		path.slots[0]++;
+	}
+	ret = 0;
+fail:
+	btrfs_release_path(extent_root, &path);
+	return ret;
+}
 
-			if (ref_root == cur_root->root_key.objectid)
-				break;
+/* returns 1 if the data at bytenr has checksums */
+static int extent_has_csums(struct btrfs_root *root, u64 bytenr)
+{
+	struct btrfs_root *csum_root = root->fs_info->csum_root;
+	struct btrfs_csum_item *item;
+	struct btrfs_path path;
 
-			ptr += btrfs_extent_inline_ref_size(key.type);
+	btrfs_init_path(&path);
+	item = btrfs_lookup_csum(NULL, csum_root, &path, bytenr, 0);
+	btrfs_release_path(csum_root, &path);
+	return !IS_ERR(item);
+}
+
+/*
+ * give the extent a new home and copy its data there once, using as few
+ * pieces and as large reads and writes as the free space allows
+ */
+static int copy_reloc_extent(struct btrfs_root *root,
+			     struct reloc_extent *re, char *buffer)
+{
+	struct btrfs_fs_devices *fs_devs = root->fs_info->fs_devices;
+	struct reloc_piece *pieces;
+	struct btrfs_key key;
+	u64 offset = 0;
+	u64 want = re->num_bytes;
+	u64 done;
+	u64 len;
+	int max_pieces = 0;
+	int ret;
+
+	BUG_ON(re->num_bytes & (root->sectorsize - 1));
+	while (offset < re->num_bytes) {
+		want = min(want, re->num_bytes - offset);
+		ret = find_free_extent_range(root, want, 0, &key);
+		if (ret == -ENOSPC && want > root->sectorsize) {
+			want = (want / 2 + root->sectorsize - 1) &
+				~((u64)root->sectorsize - 1);
+			continue;
+		}
+		if (ret) {
+			fprintf(stderr, "not enough free space\n");
+			return ret;
 		}
 
-		if (ptr >= end) {
-			path.slots[0]++;
-			goto next;
+		if (re->nr_pieces == max_pieces) {
+			max_pieces = max(max_pieces * 2, 1);
+			pieces = realloc(re->pieces,
+					 max_pieces * sizeof(*pieces));
+			if (!pieces)
+				return -ENOMEM;
+			re->pieces = pieces;
+		}
+		re->pieces[re->nr_pieces].bytenr = key.objectid;
+		re->pieces[re->nr_pieces].num_bytes = want;
+		re->nr_pieces++;
+
+		for (done = 0; done < want; done += len) {
+			len = min_t(u64, want - done, CSUM_READ_SIZE);
+			ret = pread(fs_devs->latest_bdev, buffer, len,
+				    re->bytenr + offset + done);
+			if (ret != len)
+				return -EIO;
+			ret = pwrite(fs_devs->latest_bdev, buffer, len,
+				     key.objectid + done);
+			if (ret != len)
+				return -EIO;
+		}
+		offset += want;
+	}
+	return 0;
+}
+
+/* hand the new home of an extent nobody moved to back to the allocator */
+static void release_reloc_extent(struct btrfs_root *root,
+				 struct reloc_extent *re)
+{
+	int i;
+
+	for (i = 0; i < re->nr_pieces; i++)
+		set_extent_dirty(&root->fs_info->free_space_cache,
+				 re->pieces[i].bytenr,
+				 re->pieces[i].bytenr +
+				 re->pieces[i].num_bytes - 1, 0);
+}
+
+static int csum_reloc_extent(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, struct reloc_extent *re)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	u16 csum_size = btrfs_super_csum_size(&info->super_copy);
+	struct reloc_piece *piece;
+	char *csums;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < re->nr_pieces && !ret; i++) {
+		piece = re->pieces + i;
+		csums = malloc(piece->num_bytes / root->sectorsize * csum_size);
+		if (!csums)
+			return -ENOMEM;
+		ret = csum_disk_extent(root, piece->bytenr, piece->num_bytes,
+				       csums);
+		if (!ret)
+			ret = btrfs_csum_file_blocks(trans, info->csum_root,
+						     piece->bytenr,
+						     piece->num_bytes, csums);
+		free(csums);
+	}
+	return ret;
+}
+
+/*
+ * find the file extent item for key, reusing the leaf path already
+ * points to when the key is in it.  Returns 0 with path->slots[0] at the
+ * item, 1 if there is no such item.
+ */
+static int reloc_find_item(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, struct btrfs_path *path,
+			   struct btrfs_key *key)
+{
+	struct extent_buffer *leaf = path->nodes[0];
+	struct btrfs_key found;
+	u32 nritems;
+	int slot;
+
+	if (leaf) {
+		nritems = btrfs_header_nritems(leaf);
+		if (nritems > 0)
+			btrfs_item_key_to_cpu(leaf, &found, nritems - 1);
+		if (nritems > 0 && btrfs_comp_cpu_keys(key, &found) <= 0) {
+			for (slot = path->slots[0]; slot < nritems; slot++) {
+				btrfs_item_key_to_cpu(leaf, &found, slot);
+				if (btrfs_comp_cpu_keys(&found, key) >= 0)
+					break;
+			}
+			path->slots[0] = slot;
+			return btrfs_comp_cpu_keys(&found, key) ? 1 : 0;
 		}
+		btrfs_release_path(root, path);
+	}
+	return btrfs_search_slot(trans, root, key, path, 0, 1);
+}
 
-		ret = relocate_one_reference(trans, cur_root, cur_byte,
-					     num_bytes, &extent_key,
-					     &reloc_tree);
+/*
+ * point the references of one root at the new copies.  The refs are
+ * sorted by key, so the file extent items are rewritten in place while
+ * walking each leaf once, only extents that had to be split insert new
+ * items.
+ */
+static int relocate_root_refs(struct btrfs_root *root, struct reloc_ctl *rc,
+			      struct reloc_ref *refs, int nr)
+{
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_trans_handle *trans;
+	struct extent_buffer *leaf;
+	struct reloc_extent *re;
+	struct reloc_piece *piece;
+	struct btrfs_key key;
+	struct btrfs_path path;
+	u64 file_pos;
+	int i, j;
+	int ret = 0;
+
+	btrfs_init_path(&path);
+	trans = btrfs_start_transaction(root, 1);
+	BUG_ON(!trans);
+
+	for (i = 0; i < nr; i++) {
+		re = rc->extents + refs[i].extent;
+		if (!re->nr_pieces)
+			continue;
+
+		key.objectid = refs[i].objectid;
+		key.type = BTRFS_EXTENT_DATA_KEY;
+		key.offset = refs[i].offset;
+		ret = reloc_find_item(trans, root, &path, &key);
 		if (ret < 0)
 			goto fail;
+		if (ret > 0)
+			continue;
 
-		cur_byte += num_bytes;
-		btrfs_release_path(extent_root, &path);
+		leaf = path.nodes[0];
+		fi = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_file_extent_item);
+		if (btrfs_file_extent_type(leaf, fi) != BTRFS_FILE_EXTENT_REG ||
+		    btrfs_file_extent_disk_bytenr(leaf, fi) != re->bytenr ||
+		    btrfs_file_extent_disk_num_bytes(leaf, fi) !=
+		    re->num_bytes)
+			continue;
+		BUG_ON(btrfs_file_extent_offset(leaf, fi) > 0);
+		BUG_ON(btrfs_file_extent_num_bytes(leaf, fi) !=
+		       re->num_bytes);
+
+		piece = re->pieces;
+		btrfs_set_file_extent_disk_bytenr(leaf, fi, piece->bytenr);
+		btrfs_set_file_extent_disk_num_bytes(leaf, fi,
+						     piece->num_bytes);
+		btrfs_set_file_extent_num_bytes(leaf, fi, piece->num_bytes);
+		btrfs_set_file_extent_ram_bytes(leaf, fi, piece->num_bytes);
+		btrfs_set_file_extent_generation(leaf, fi, trans->transid);
+		btrfs_mark_buffer_dirty(leaf);
+		if (re->nr_pieces > 1)
+			btrfs_release_path(root, &path);
+
+		file_pos = refs[i].offset;
+		for (j = 0; j < re->nr_pieces; j++) {
+			piece = re->pieces + j;
+			if (j > 0) {
+				ret = btrfs_insert_file_extent(trans, root,
+						refs[i].objectid, file_pos,
+						piece->bytenr,
+						piece->num_bytes,
+						piece->num_bytes);
+				if (ret)
+					goto fail;
+			}
+			ret = record_extent_ref(trans, root, refs[i].objectid,
+						file_pos, piece->bytenr,
+						piece->num_bytes);
+			if (ret)
+				goto fail;
+			file_pos += piece->num_bytes;
+		}
+
+		if (re->csum && !re->used) {
+			ret = csum_reloc_extent(trans, root, re);
+			if (ret)
+				goto fail;
+		}
+		re->used = 1;
+
+		ret = btrfs_free_extent(trans, root, re->bytenr,
+					re->num_bytes, 0,
+					root->root_key.objectid,
+					refs[i].objectid, refs[i].offset);
+		if (ret)
+			goto fail;
 
 		if (trans->blocks_used >= 4096) {
-			ret = btrfs_commit_transaction(trans, cur_root);
+			btrfs_release_path(root, &path);
+			ret = btrfs_commit_transaction(trans, root);
 			BUG_ON(ret);
-			trans = btrfs_start_transaction(cur_root, 1);
+			trans = btrfs_start_transaction(root, 1);
 			BUG_ON(!trans);
 		}
 	}
-	btrfs_release_path(cur_root, &path);
+	ret = 0;
+fail:
+	btrfs_release_path(root, &path);
+	if (!ret) {
+		ret = btrfs_commit_transaction(trans, root);
+		BUG_ON(ret);
+	}
+	return ret;
+}
 
-	ret = btrfs_commit_transaction(trans, cur_root);
-	BUG_ON(ret);
+/*
+ * move the data extents in [start_byte, end_byte) elsewhere.  All the
+ * references to an extent are collected first so its data is copied
+ * only once, then each root's file extent items are updated in key
+ * order.
+ */
+static int relocate_extents_range(struct btrfs_root *fs_root,
+				  struct btrfs_root *ext2_root,
+				  u64 start_byte, u64 end_byte)
+{
+	struct btrfs_fs_info *info = fs_root->fs_info;
+	struct btrfs_root *extent_root = info->extent_root;
+	struct btrfs_root *roots[2] = { ext2_root, fs_root };
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	struct btrfs_path path;
+	struct reloc_ctl rc;
+	char *buffer = NULL;
+	int pass = 0;
+	int first, last;
+	int i;
+	int ret;
+
+	btrfs_init_path(&path);
+	memset(&rc, 0, sizeof(rc));
+
+	key.objectid = start_byte;
+	key.offset = 0;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto fail;
+	if (ret > 0) {
+		ret = btrfs_previous_item(extent_root, &path, 0,
+					  BTRFS_EXTENT_ITEM_KEY);
+		if (ret < 0)
+			goto fail;
+		if (ret == 0) {
+			leaf = path.nodes[0];
+			btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+			if (key.objectid + key.offset > start_byte)
+				start_byte = key.objectid;
+		}
+	}
+	btrfs_release_path(extent_root, &path);
 
-	if (num_extents > 0 && pass++ < 16)
-		goto again;
+	ret = posix_memalign((void **)&buffer, fs_root->sectorsize,
+			     CSUM_READ_SIZE);
+	if (ret) {
+		buffer = NULL;
+		ret = -ENOMEM;
+		goto fail;
+	}
+again:
+	ret = collect_reloc_extents(extent_root, start_byte, end_byte, &rc);
+	if (ret)
+		goto fail;
+	if (rc.nr_extents == 0)
+		goto fail;
+	if (pass++ >= 16) {
+		ret = -1;
+		goto fail;
+	}
 
-	ret = (num_extents > 0) ? -1 : 0;
+	for (i = 0; i < rc.nr_extents; i++) {
+		rc.extents[i].csum = extent_has_csums(fs_root,
+						      rc.extents[i].bytenr);
+		ret = copy_reloc_extent(fs_root, rc.extents + i, buffer);
+		if (ret)
+			goto fail;
+	}
+
+	qsort(rc.refs, rc.nr_refs, sizeof(*rc.refs), reloc_ref_cmp);
+	for (i = 0; i < 2; i++) {
+		for (first = 0; first < rc.nr_refs; first++) {
+			if (rc.refs[first].root == roots[i]->root_key.objectid)
+				break;
+		}
+		for (last = first; last < rc.nr_refs; last++) {
+			if (rc.refs[last].root != roots[i]->root_key.objectid)
+				break;
+		}
+		if (first == last)
+			continue;
+		ret = relocate_root_refs(roots[i], &rc, rc.refs + first,
+					 last - first);
+		if (ret)
+			goto fail;
+	}
+
+	for (i = 0; i < rc.nr_extents; i++) {
+		if (!rc.extents[i].used)
+			release_reloc_extent(fs_root, rc.extents + i);
+	}
+	reloc_ctl_release(&rc);
+	goto again;
 fail:
-	btrfs_release_path(cur_root, &path);
-	extent_io_tree_cleanup(&reloc_tree);
+	btrfs_release_path(extent_root, &path);
+	reloc_ctl_release(&rc);
+	free(buffer);
 	return ret;
 }
 
@@ -2408,7 +3143,7 @@ int do_convert(const char *devname, int datacsum, int packing, int noxattr)
 		goto fail;
 	}
 	printf("creating btrfs metadata.\n");
-	ret = copy_inodes(root, ext2_fs, datacsum, packing, noxattr);
+	ret = copy_inodes(root, ext2_fs, devname, datacsum, packing, noxattr);
 	if (ret) {
 		fprintf(stderr, "error during copy_inodes %d\n", ret);
 		goto fail;
@@ -2452,6 +3187,7 @@ int do_convert(const char *devname, int datacsum, int packing, int noxattr)
 		fprintf(stderr, "unable to open ctree\n");
 		goto fail;
 	}
+	btrfs_start_caching(root->fs_info, 0);
 	/* move chunk tree into system chunk. */
 	ret = fixup_chunk_mapping(root);
 	if (ret) {
@@ -2551,6 +3287,7 @@ int do_rollback(const char *devname, int force)
 		fprintf(stderr, "unable to open ctree\n");
 		goto fail;
 	}
+	btrfs_start_caching(root->fs_info, 0);
 	ret = may_rollback(root);
 	if (ret < 0) {
 		fprintf(stderr, "unable to do rollback\n");
@@ -406,6 +406,23 @@ int btrfs_comp_keys(struct btrfs_disk_key *disk, struct btrfs_key *k2)
 	return 0;
 }
 
+int btrfs_comp_cpu_keys(struct btrfs_key *k1, struct btrfs_key *k2)
+{
+	if (k1->objectid > k2->objectid)
+		return 1;
+	if (k1->objectid < k2->objectid)
+		return -1;
+	if (k1->type > k2->type)
+		return 1;
+	if (k1->type < k2->type)
+		return -1;
+	if (k1->offset > k2->offset)
+		return 1;
+	if (k1->offset < k2->offset)
+		return -1;
+	return 0;
+}
+
 
 #if 0
 int btrfs_realloc_node(struct btrfs_trans_handle *trans,
@@ -701,6 +718,34 @@ static int noinline check_block(struct btrfs_root *root,
 	return check_node(root, path, level);
 }
 
+/*
+ * returns 1 if the disk key sorts before key.  Most of the time the
+ * objectids differ and decide it, so the type and offset are only
+ * looked at when they have to be.
+ */
+static inline int disk_key_less(struct btrfs_disk_key *disk,
+				struct btrfs_key *key)
+{
+	u64 objectid = le64_to_cpu(disk->objectid);
+
+	if (objectid != key->objectid)
+		return objectid < key->objectid;
+	if (disk->type != key->type)
+		return disk->type < key->type;
+	return le64_to_cpu(disk->offset) < key->offset;
+}
+
+static inline int disk_key_equal(struct btrfs_disk_key *disk,
+				 struct btrfs_key *key)
+{
+	return le64_to_cpu(disk->objectid) == key->objectid &&
+	       disk->type == key->type &&
+	       le64_to_cpu(disk->offset) == key->offset;
+}
+
+/* below this many candidates a linear scan beats more halving */
+#define BIN_SEARCH_LINEAR 16
+
 /*
  * search for key in the extent_buffer.  The items start at offset p,
  * and they are item_size apart.  There are 'max' items in p.
@@ -710,38 +755,59 @@ static int noinline check_block(struct btrfs_root *root,
  * the array.
  *
  * slot may point to max if the key is bigger than all of the keys
+ *
+ * This is a lower bound search: the halving step only picks the next
+ * base, which the compiler turns into a conditional move, and the last
+ * few candidates are scanned in order.  It is always inlined with a
+ * constant item_size, so leaves and nodes each get their own copy.
  */
-static int generic_bin_search(struct extent_buffer *eb, unsigned long p,
-			      int item_size, struct btrfs_key *key,
-			      int max, int *slot)
+static inline __attribute__((always_inline))
+int generic_bin_search(struct extent_buffer *eb, unsigned long p,
+		       int item_size, struct btrfs_key *key,
+		       int max, int *slot)
 {
+	char *base = eb->data + p;
 	int low = 0;
-	int high = max;
-	int mid;
-	int ret;
-	unsigned long offset;
-	struct btrfs_disk_key *tmp;
-
-	while(low < high) {
-		mid = (low + high) / 2;
-		offset = p + mid * item_size;
-
-		tmp = (struct btrfs_disk_key *)(eb->data + offset);
-		ret = btrfs_comp_keys(tmp, key);
-
-		if (ret < 0)
-			low = mid + 1;
-		else if (ret > 0)
-			high = mid;
-		else {
-			*slot = mid;
-			return 0;
-		}
+	int n = max;
+	int half;
+
+	while (n > BIN_SEARCH_LINEAR) {
+		half = n / 2;
+		low = disk_key_less((struct btrfs_disk_key *)
+				    (base + (low + half - 1) * item_size),
+				    key) ? low + half : low;
+		n -= half;
 	}
+	for (; n > 0; n--, low++) {
+		if (!disk_key_less((struct btrfs_disk_key *)
+				   (base + low * item_size), key))
+			break;
+	}
+
 	*slot = low;
+	if (low < max &&
+	    disk_key_equal((struct btrfs_disk_key *)(base + low * item_size),
+			   key))
+		return 0;
 	return 1;
 }
 
+static int leaf_bin_search(struct extent_buffer *eb, struct btrfs_key *key,
+			   int *slot)
+{
+	return generic_bin_search(eb, offsetof(struct btrfs_leaf, items),
+				  sizeof(struct btrfs_item), key,
+				  btrfs_header_nritems(eb), slot);
+}
+
+static int node_bin_search(struct extent_buffer *eb, struct btrfs_key *key,
+			   int *slot)
+{
+	return generic_bin_search(eb, offsetof(struct btrfs_node, ptrs),
+				  sizeof(struct btrfs_key_ptr), key,
+				  btrfs_header_nritems(eb), slot);
+}
+
 /*
  * simple bin_search frontend that does the right thing for
  * leaves vs nodes
@@ -749,20 +815,9 @@ static int generic_bin_search(struct extent_buffer *eb, unsigned long p,
 static int bin_search(struct extent_buffer *eb, struct btrfs_key *key,
 		      int level, int *slot)
 {
-	if (level == 0) {
-		return generic_bin_search(eb,
-					  offsetof(struct btrfs_leaf, items),
-					  sizeof(struct btrfs_item),
-					  key, btrfs_header_nritems(eb),
-					  slot);
-	} else {
-		return generic_bin_search(eb,
-					  offsetof(struct btrfs_node, ptrs),
-					  sizeof(struct btrfs_key_ptr),
-					  key, btrfs_header_nritems(eb),
-					  slot);
-	}
-	return -1;
+	if (level == 0)
+		return leaf_bin_search(eb, key, slot);
+	return node_bin_search(eb, key, slot);
 }
 
 struct extent_buffer *read_node_slot(struct btrfs_root *root,
@@ -1090,28 +1145,34 @@ static int noinline push_nodes_for_insert(struct btrfs_trans_handle *trans,
 }
 
 /*
- * readahead one full node of leaves
+ * readahead leaves out of the level 1 node in the path.  How many slots
+ * we look at is fs_info->reada_window: it doubles every time a walk in
+ * slot order lands on a leaf we already started readahead on, and is
+ * halved whenever the walk jumps somewhere else.
  */
 void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 			     int level, int slot, u64 objectid)
 {
+	struct btrfs_fs_info *info = root->fs_info;
 	struct extent_buffer *node;
+	struct extent_buffer *eb;
 	struct btrfs_disk_key disk_key;
-	u32 nritems;
+	u64 bytenr[BTRFS_READA_MAX];
 	u64 search;
-	u64 lowest_read;
-	u64 highest_read;
-	u64 nread = 0;
-	int direction = path->reada;
-	struct extent_buffer *eb;
-	u32 nr;
+	u32 nritems;
 	u32 blocksize;
+	u32 window;
 	u32 nscan = 0;
+	u32 nr;
+	int direction = path->reada;
+	int sequential;
+	int hit;
+	int nread = 0;
 
 	if (level != 1)
 		return;
 
-	if (!path->nodes[level])
+	if (!path->nodes[level] || info->metadump)
 		return;
 
 	node = path->nodes[level];
@@ -1123,45 +1184,56 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 		return;
 	}
 
-	highest_read = search;
-	lowest_read = search;
-
 	nritems = btrfs_header_nritems(node);
+	if (node->start == info->reada_node)
+		sequential = slot == info->reada_slot + (direction < 0 ? -1 : 1);
+	else
+		sequential = slot == (direction < 0 ? nritems - 1 : 0);
+	hit = test_range_bit(&info->reada_tree, search,
+			     search + blocksize - 1, EXTENT_DIRTY, 1);
+
+	window = info->reada_window;
+	if (sequential && hit)
+		window = min_t(u32, window * 2, BTRFS_READA_MAX);
+	else if (!sequential)
+		window = max_t(u32, window / 2, BTRFS_READA_MIN);
+	info->reada_window = window;
+	info->reada_node = node->start;
+	info->reada_slot = slot;
+
+	if (path->reada < 2)
+		window = min_t(u32, window, BTRFS_READA_MAX / 4);
+
 	nr = slot;
-	while(1) {
+	while (nscan < window) {
 		if (direction < 0) {
 			if (nr == 0)
 				break;
 			nr--;
-		} else if (direction > 0) {
+		} else {
 			nr++;
 			if (nr >= nritems)
 				break;
 		}
+		nscan++;
 		if (path->reada < 0 && objectid) {
 			btrfs_node_key(node, &disk_key, nr);
 			if (btrfs_disk_key_objectid(&disk_key) != objectid)
 				break;
 		}
 		search = btrfs_node_blockptr(node, nr);
-		if ((search >= lowest_read && search <= highest_read) ||
-		    (search < lowest_read && lowest_read - search <= 32768) ||
-		    (search > highest_read && search - highest_read <= 32768)) {
-			readahead_tree_block(root, search, blocksize,
-				     btrfs_node_ptr_generation(node, nr));
-			nread += blocksize;
+		if (test_range_bit(&info->reada_tree, search,
+				   search + blocksize - 1, EXTENT_DIRTY, 1))
+			continue;
+		eb = btrfs_find_tree_block(root, search, blocksize);
+		if (eb) {
+			free_extent_buffer(eb);
+			continue;
 		}
-		nscan++;
-		if (path->reada < 2 && (nread > (256 * 1024) || nscan > 32))
-			break;
-		if(nread > (1024 * 1024) || nscan > 128)
-			break;
-
-		if (search < lowest_read)
-			lowest_read = search;
-		if (search > highest_read)
-			highest_read = search;
+		bytenr[nread++] = search;
 	}
+	if (nread)
+		readahead_tree_blocks(root, bytenr, nread, blocksize);
 }
 
 /*
@@ -1270,6 +1342,143 @@ again:
 	return 1;
 }
 
+/*
+ * returns 1 if a search for key starting at the root would pass through
+ * p->nodes[level].  The node's key range is bounded by the keys next to
+ * its slot in the lowest parents where those exist.
+ */
+static int path_covers_key(struct btrfs_path *p, int level, int top,
+			   struct btrfs_key *key)
+{
+	struct btrfs_key node_key;
+	int l;
+
+	for (l = level + 1; l <= top; l++) {
+		if (p->slots[l] > 0) {
+			btrfs_node_key_to_cpu(p->nodes[l], &node_key,
+					      p->slots[l]);
+			if (btrfs_comp_cpu_keys(key, &node_key) < 0)
+				return 0;
+			break;
+		}
+	}
+	for (l = level + 1; l <= top; l++) {
+		if (p->slots[l] + 1 < btrfs_header_nritems(p->nodes[l])) {
+			btrfs_node_key_to_cpu(p->nodes[l], &node_key,
+					      p->slots[l] + 1);
+			if (btrfs_comp_cpu_keys(key, &node_key) >= 0)
+				return 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * returns 1 if balance_level would not touch any node of the path, which
+ * is what a deleting search does on its way down
+ */
+static int path_is_balanced(struct btrfs_root *root, struct btrfs_path *p,
+			    int top)
+{
+	int level;
+
+	for (level = 1; level < top; level++) {
+		if (btrfs_header_nritems(p->nodes[level]) <=
+		    BTRFS_NODEPTRS_PER_BLOCK(root) / 4)
+			return 0;
+	}
+	return top == 0 || btrfs_header_nritems(p->nodes[top]) != 1;
+}
+
+/*
+ * btrfs_search_slot for callers that look up increasing keys and keep
+ * their path between calls.  If p still describes a path from the root,
+ * the search restarts from the lowest node in it whose key range covers
+ * key, so a key in the same leaf costs a single bin_search and one in a
+ * neighbouring leaf only reads that leaf.  Otherwise p is released and
+ * the search starts from the root as usual.
+ *
+ * COW searches start from the root unless key is in the current leaf and
+ * the whole path was already COWed in this transaction.  Searches that
+ * insert or delete also need the leaf to have room for ins_len, or the
+ * nodes above it to be left alone by balance_level, so that the plain
+ * search would not have changed the tree either.
+ */
+int btrfs_search_slot_finger(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, struct btrfs_key *key,
+			     struct btrfs_path *p, int ins_len, int cow)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct extent_buffer *b;
+	int level;
+	int top;
+	int slot;
+	int ret;
+
+	if (!p->nodes[0] || p->lowest_level)
+		goto full;
+
+	for (top = 0; top < BTRFS_MAX_LEVEL - 1 && p->nodes[top + 1]; top++) {
+		/* a deleted pointer leaves its stale copy past nritems */
+		if (p->slots[top + 1] >=
+		    btrfs_header_nritems(p->nodes[top + 1]))
+			goto full;
+		if (btrfs_node_blockptr(p->nodes[top + 1], p->slots[top + 1]) !=
+		    p->nodes[top]->start)
+			goto full;
+	}
+	if (p->nodes[top] != root->node)
+		goto full;
+	if (cow) {
+		for (level = 0; level <= top; level++) {
+			if (should_cow_block(trans, root, p->nodes[level]))
+				goto full;
+		}
+	}
+
+	for (level = 0; level < top; level++) {
+		if (path_covers_key(p, level, top, key))
+			break;
+	}
+	if (level > 0 && cow)
+		goto full;
+	if (ins_len > 0 && ins_len > btrfs_leaf_free_space(root, p->nodes[0]))
+		goto full;
+	if (ins_len < 0 && !path_is_balanced(root, p, top))
+		goto full;
+
+	if (level == 0)
+		info->finger_leaf_hits++;
+	else
+		info->finger_node_hits++;
+
+	for (; level > 0; level--) {
+		b = p->nodes[level];
+		ret = bin_search(b, key, level, &slot);
+		if (ret && slot > 0)
+			slot -= 1;
+		p->slots[level] = slot;
+		if (p->reada)
+			reada_for_search(root, p, level, slot, key->objectid);
+		b = read_node_slot(root, b, slot);
+		if (!b)
+			return -EIO;
+		free_extent_buffer(p->nodes[level - 1]);
+		p->nodes[level - 1] = b;
+		ret = check_block(root, p, level - 1);
+		if (ret)
+			return -1;
+	}
+	ret = bin_search(p->nodes[0], key, 0, &slot);
+	p->slots[0] = slot;
+	return ret;
+full:
+	info->finger_misses++;
+	btrfs_release_path(root, p);
+	return btrfs_search_slot(trans, root, key, p, ins_len, cow);
+}
+
 /*
  * adjust the pointers going up the tree, starting at level
  * making sure the right key of each node is points to 'key'.
@@ -2937,6 +3146,150 @@ int btrfs_next_leaf(struct btrfs_root *root, struct btrfs_path *path)
 	return 0;
 }
 
+/*
+ * set up a cursor over the items of root between min_key and max_key,
+ * both inclusive.  A NULL max_key means up to the end of the tree and
+ * type BTRFS_CURSOR_ANY_TYPE returns items of every type.  reada is how
+ * many leaves ahead of the current one are prefetched, 0 turns it off.
+ */
+void btrfs_cursor_init(struct btrfs_cursor *c, struct btrfs_root *root,
+		       struct btrfs_key *min_key, struct btrfs_key *max_key,
+		       int type, int reada)
+{
+	memset(c, 0, sizeof(*c));
+	btrfs_init_path(&c->path);
+	c->root = root;
+	c->min_key = *min_key;
+	if (max_key) {
+		c->max_key = *max_key;
+	} else {
+		c->max_key.objectid = (u64)-1;
+		c->max_key.type = (u8)-1;
+		c->max_key.offset = (u64)-1;
+	}
+	c->type = type;
+	c->reada = reada;
+	c->reada_node = (u64)-1;
+}
+
+void btrfs_cursor_release(struct btrfs_cursor *c)
+{
+	btrfs_release_path(c->root, &c->path);
+}
+
+/*
+ * keep the next c->reada leaves after the current one in flight.  Only
+ * the parent of the current leaf is looked at, so the window restarts
+ * whenever the cursor moves on to the next parent.
+ */
+static void cursor_reada(struct btrfs_cursor *c)
+{
+	struct extent_buffer *node = c->path.nodes[1];
+	struct btrfs_key key;
+	u32 blocksize;
+	u32 nritems;
+	int slot;
+	int last;
+
+	if (!c->reada || !node)
+		return;
+
+	if (node->start != c->reada_node) {
+		c->reada_node = node->start;
+		c->reada_slot = c->path.slots[1];
+	}
+	nritems = btrfs_header_nritems(node);
+	last = min_t(int, c->path.slots[1] + c->reada, nritems - 1);
+	blocksize = btrfs_level_size(c->root, 0);
+	for (slot = c->reada_slot + 1; slot <= last; slot++) {
+		btrfs_node_key_to_cpu(node, &key, slot);
+		if (btrfs_comp_cpu_keys(&key, &c->max_key) > 0)
+			break;
+		readahead_tree_block(c->root, btrfs_node_blockptr(node, slot),
+				     blocksize,
+				     btrfs_node_ptr_generation(node, slot));
+		c->reada_slot = slot;
+	}
+}
+
+/*
+ * return up to max of the next items in keys and slots, all from the
+ * leaf at c->path.nodes[0], which stays valid until the next call.
+ * c->path.slots[0] is left at the last one returned.  Returns the
+ * number of items, 0 once the cursor is past max_key and < 0 on errors.
+ */
+int btrfs_cursor_next_batch(struct btrfs_cursor *c, struct btrfs_key *keys,
+			    int *slots, int max)
+{
+	struct btrfs_path *path = &c->path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	int nr = 0;
+	int ret;
+
+	if (c->done)
+		return 0;
+	if (!c->started) {
+		c->started = 1;
+		ret = btrfs_search_slot(NULL, c->root, &c->min_key, path,
+					0, 0);
+		if (ret < 0)
+			return ret;
+		cursor_reada(c);
+	} else {
+		path->slots[0]++;
+	}
+
+	while (nr < max) {
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			if (nr > 0)
+				break;
+			ret = btrfs_next_leaf(c->root, path);
+			if (ret < 0)
+				return ret;
+			if (ret > 0) {
+				c->done = 1;
+				break;
+			}
+			cursor_reada(c);
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if (btrfs_comp_cpu_keys(&key, &c->max_key) > 0) {
+			c->done = 1;
+			break;
+		}
+		if (c->type == BTRFS_CURSOR_ANY_TYPE || key.type == c->type) {
+			keys[nr] = key;
+			slots[nr] = path->slots[0];
+			nr++;
+			if (nr == max)
+				break;
+		}
+		path->slots[0]++;
+	}
+	if (nr > 0)
+		path->slots[0] = slots[nr - 1];
+	return nr;
+}
+
+/*
+ * step to the next item, the caller finds it at c->path.nodes[0] and
+ * c->path.slots[0].  Returns 0 if there is one, 1 at the end and < 0 on
+ * errors.
+ */
+int btrfs_cursor_next(struct btrfs_cursor *c, struct btrfs_key *key)
+{
+	int slot;
+	int ret;
+
+	ret = btrfs_cursor_next_batch(c, key, &slot, 1);
+	if (ret < 0)
+		return ret;
+	return ret ? 0 : 1;
+}
+
 int btrfs_previous_item(struct btrfs_root *root,
 			struct btrfs_path *path, u64 min_objectid,
 			int type)
@@ -2961,3 +3314,796 @@ int btrfs_previous_item(struct btrfs_root *root,
 	return 1;
 }
 
+
+/*
+ * bulk loading builds a whole tree bottom up from a stream of items in
+ * key order.  Leaves take items until they reach the fill factor or the
+ * next item does not fit, and are then handed to the level above, so
+ * each level is allocated front to back and every new block is written
+ * once.  A subtree of the old tree that the stream leaves unchanged can
+ * be linked into the new tree as it is, see bulk_adopt_block().
+ */
+struct bulk_level {
+	struct extent_buffer *eb;
+	u32 nritems;
+	u32 data_end;
+	u64 blocks;
+};
+
+struct btrfs_bulk_load {
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	u32 leaf_fill;
+	u32 node_fill;
+	u64 hint;
+	int have_last;
+	struct btrfs_key last;
+	struct bulk_level levels[BTRFS_MAX_LEVEL];
+
+	/* blocks of the old tree reused by the new one, in key order */
+	u64 *adopted;
+	u64 nr_adopted;
+	u64 max_adopted;
+	u64 drop_pos;
+};
+
+static struct extent_buffer *bulk_alloc_block(struct btrfs_bulk_load *bl,
+					      int level,
+					      struct btrfs_disk_key *key)
+{
+	struct btrfs_root *root = bl->root;
+	struct btrfs_trans_handle *trans = bl->trans;
+	struct extent_buffer *eb;
+
+	eb = btrfs_alloc_free_block(trans, root,
+				    btrfs_level_size(root, level),
+				    root->root_key.objectid, key, level,
+				    bl->hint, 0);
+	if (IS_ERR(eb))
+		return eb;
+
+	memset_extent_buffer(eb, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_level(eb, level);
+	btrfs_set_header_bytenr(eb, eb->start);
+	btrfs_set_header_generation(eb, trans->transid);
+	btrfs_set_header_backref_rev(eb, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(eb, root->root_key.objectid);
+	write_extent_buffer(eb, root->fs_info->fsid,
+			    (unsigned long)btrfs_header_fsid(eb),
+			    BTRFS_FSID_SIZE);
+	write_extent_buffer(eb, root->fs_info->chunk_tree_uuid,
+			    (unsigned long)btrfs_header_chunk_tree_uuid(eb),
+			    BTRFS_UUID_SIZE);
+	bl->hint = eb->start + eb->len;
+	return eb;
+}
+
+static int bulk_add_ptr(struct btrfs_bulk_load *bl, int level,
+			struct btrfs_disk_key *key, u64 bytenr,
+			u64 generation);
+
+/* close the current block of a level and link it into the level above */
+static int bulk_finish_block(struct btrfs_bulk_load *bl, int level)
+{
+	struct bulk_level *l = &bl->levels[level];
+	struct extent_buffer *eb = l->eb;
+	struct btrfs_disk_key key;
+	u32 nritems = l->nritems;
+	int ret;
+
+	if (level + 1 >= BTRFS_MAX_LEVEL)
+		return -EOVERFLOW;
+
+	btrfs_set_header_nritems(eb, nritems);
+	btrfs_mark_buffer_dirty(eb);
+	if (level == 0)
+		btrfs_item_key(eb, &key, 0);
+	else
+		btrfs_node_key(eb, &key, 0);
+
+	l->eb = NULL;
+	l->nritems = 0;
+	ret = bulk_add_ptr(bl, level + 1, &key, eb->start,
+			   bl->trans->transid);
+	if (ret) {
+		/* keep it where bulk_abort() finds it */
+		l->eb = eb;
+		l->nritems = nritems;
+		return ret;
+	}
+	l->blocks++;
+	free_extent_buffer(eb);
+	return 0;
+}
+
+static int bulk_add_ptr(struct btrfs_bulk_load *bl, int level,
+			struct btrfs_disk_key *key, u64 bytenr,
+			u64 generation)
+{
+	struct bulk_level *l = &bl->levels[level];
+	int ret;
+
+	if (l->eb && l->nritems >= bl->node_fill) {
+		ret = bulk_finish_block(bl, level);
+		if (ret)
+			return ret;
+	}
+	if (!l->eb) {
+		l->eb = bulk_alloc_block(bl, level, key);
+		if (IS_ERR(l->eb)) {
+			ret = PTR_ERR(l->eb);
+			l->eb = NULL;
+			return ret;
+		}
+	}
+	btrfs_set_node_key(l->eb, key, l->nritems);
+	btrfs_set_node_blockptr(l->eb, l->nritems, bytenr);
+	btrfs_set_node_ptr_generation(l->eb, l->nritems, generation);
+	l->nritems++;
+	return 0;
+}
+
+/*
+ * returns 1 if the leaf being filled is less than half way to the fill
+ * factor.  Closing it now to adopt a block would leave it mostly empty.
+ */
+static int bulk_leaf_is_small(struct btrfs_bulk_load *bl)
+{
+	struct bulk_level *l = &bl->levels[0];
+	u32 used;
+
+	if (!l->eb)
+		return 0;
+	used = l->nritems * sizeof(struct btrfs_item) +
+	       BTRFS_LEAF_DATA_SIZE(bl->root) - l->data_end;
+	return used < bl->leaf_fill / 2;
+}
+
+/*
+ * link the block at bytenr of the old tree, which holds the next items in
+ * key order, into the new tree as it is.  The partial blocks below its
+ * level are closed first, so the new tree may get a few small blocks at
+ * the edges of every adopted subtree.
+ */
+static int bulk_adopt_block(struct btrfs_bulk_load *bl, int level,
+			    struct btrfs_disk_key *key, u64 bytenr,
+			    u64 generation)
+{
+	u64 *adopted;
+	u64 max;
+	int i;
+	int ret;
+
+	if (level + 1 >= BTRFS_MAX_LEVEL)
+		return -EOVERFLOW;
+	if (bl->nr_adopted == bl->max_adopted) {
+		max = max_t(u64, bl->max_adopted * 2, 16);
+		adopted = realloc(bl->adopted, max * sizeof(*adopted));
+		if (!adopted)
+			return -ENOMEM;
+		bl->adopted = adopted;
+		bl->max_adopted = max;
+	}
+	for (i = 0; i <= level; i++) {
+		if (!bl->levels[i].eb)
+			continue;
+		ret = bulk_finish_block(bl, i);
+		if (ret)
+			return ret;
+	}
+	ret = bulk_add_ptr(bl, level + 1, key, bytenr, generation);
+	if (ret)
+		return ret;
+	bl->levels[level].blocks++;
+	bl->adopted[bl->nr_adopted++] = bytenr;
+	return 0;
+}
+
+/*
+ * start bulk loading into root.  fill is the percentage of every leaf
+ * and node to use, the rest is left for later modifications.  Nothing
+ * touches root until btrfs_bulk_load_finish() swaps in the new tree.
+ */
+struct btrfs_bulk_load *btrfs_bulk_load_start(struct btrfs_trans_handle *trans,
+					      struct btrfs_root *root,
+					      int fill)
+{
+	struct btrfs_bulk_load *bl;
+
+	if (fill <= 0 || fill > 100)
+		return ERR_PTR(-EINVAL);
+
+	bl = kzalloc(sizeof(*bl), GFP_NOFS);
+	if (!bl)
+		return ERR_PTR(-ENOMEM);
+	bl->trans = trans;
+	bl->root = root;
+	bl->hint = root->node->start;
+	bl->leaf_fill = (u64)BTRFS_LEAF_DATA_SIZE(root) * fill / 100;
+	bl->node_fill = BTRFS_NODEPTRS_PER_BLOCK(root) * fill / 100;
+	bl->node_fill = max_t(u32, bl->node_fill, 2);
+	return bl;
+}
+
+/*
+ * append one item, keys have to be strictly increasing
+ */
+int btrfs_bulk_load_add(struct btrfs_bulk_load *bl, struct btrfs_key *key,
+			void *data, u32 data_size)
+{
+	struct btrfs_root *root = bl->root;
+	struct bulk_level *l = &bl->levels[0];
+	struct btrfs_disk_key disk_key;
+	struct btrfs_item *item;
+	u32 used;
+	int ret;
+
+	if (bl->have_last && btrfs_comp_cpu_keys(key, &bl->last) <= 0)
+		return -EINVAL;
+	if (sizeof(*item) + data_size > BTRFS_LEAF_DATA_SIZE(root))
+		return -EOVERFLOW;
+
+	btrfs_cpu_key_to_disk(&disk_key, key);
+	if (l->eb) {
+		used = l->nritems * sizeof(*item) +
+		       BTRFS_LEAF_DATA_SIZE(root) - l->data_end;
+		if (used >= bl->leaf_fill ||
+		    used + sizeof(*item) + data_size >
+		    BTRFS_LEAF_DATA_SIZE(root)) {
+			ret = bulk_finish_block(bl, 0);
+			if (ret)
+				return ret;
+		}
+	}
+	if (!l->eb) {
+		l->eb = bulk_alloc_block(bl, 0, &disk_key);
+		if (IS_ERR(l->eb)) {
+			ret = PTR_ERR(l->eb);
+			l->eb = NULL;
+			return ret;
+		}
+		l->data_end = BTRFS_LEAF_DATA_SIZE(root);
+	}
+
+	l->data_end -= data_size;
+	item = btrfs_item_nr(l->eb, l->nritems);
+	btrfs_set_item_key(l->eb, &disk_key, l->nritems);
+	btrfs_set_item_offset(l->eb, item, l->data_end);
+	btrfs_set_item_size(l->eb, item, data_size);
+	write_extent_buffer(l->eb, data, btrfs_leaf_data(l->eb) + l->data_end,
+			    data_size);
+	l->nritems++;
+
+	bl->last = *key;
+	bl->have_last = 1;
+	return 0;
+}
+
+/*
+ * free the old tree, except for the blocks the new one adopted.  Those
+ * are met in the same key order they were adopted in.  Leaves are freed
+ * without reading them.
+ */
+static int bulk_drop_tree(struct btrfs_bulk_load *bl, struct extent_buffer *eb)
+{
+	struct btrfs_root *root = bl->root;
+	struct extent_buffer *child;
+	int level = btrfs_header_level(eb);
+	u32 nritems = btrfs_header_nritems(eb);
+	u64 bytenr;
+	u32 i;
+	int ret;
+
+	for (i = 0; level > 0 && i < nritems; i++) {
+		bytenr = btrfs_node_blockptr(eb, i);
+		if (bl->drop_pos < bl->nr_adopted &&
+		    bl->adopted[bl->drop_pos] == bytenr) {
+			bl->drop_pos++;
+			continue;
+		}
+		if (level == 1) {
+			ret = btrfs_free_extent(bl->trans, root, bytenr,
+						btrfs_level_size(root, 0), 0,
+						root->root_key.objectid, 0, 0);
+			if (ret)
+				return ret;
+			continue;
+		}
+		child = read_node_slot(root, eb, i);
+		if (!child)
+			return -EIO;
+		ret = bulk_drop_tree(bl, child);
+		free_extent_buffer(child);
+		if (ret)
+			return ret;
+	}
+	return btrfs_free_extent(bl->trans, root, eb->start, eb->len, 0,
+				 root->root_key.objectid, level, 0);
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	u64 ua = *(const u64 *)a;
+	u64 ub = *(const u64 *)b;
+
+	if (ua < ub)
+		return -1;
+	return ua > ub;
+}
+
+/* free a block built by the loader and the new blocks below it */
+static int bulk_free_new(struct btrfs_bulk_load *bl, struct extent_buffer *eb)
+{
+	struct btrfs_root *root = bl->root;
+	struct extent_buffer *child;
+	int level = btrfs_header_level(eb);
+	u32 nritems = btrfs_header_nritems(eb);
+	u64 bytenr;
+	u32 i;
+	int ret;
+
+	for (i = 0; level > 0 && i < nritems; i++) {
+		bytenr = btrfs_node_blockptr(eb, i);
+		if (bsearch(&bytenr, bl->adopted, bl->nr_adopted,
+			    sizeof(u64), u64_cmp))
+			continue;
+		child = read_node_slot(root, eb, i);
+		if (!child)
+			return -EIO;
+		ret = bulk_free_new(bl, child);
+		free_extent_buffer(child);
+		if (ret)
+			return ret;
+	}
+	clean_tree_block(bl->trans, root, eb);
+	return btrfs_free_extent(bl->trans, root, eb->start, eb->len, 0,
+				 root->root_key.objectid, level, 0);
+}
+
+/*
+ * give back every block allocated so far.  The partial block of each
+ * level, together with the finished blocks below it, covers them all.
+ * The old tree is left alone.  bl is freed.
+ */
+static int bulk_abort(struct btrfs_bulk_load *bl)
+{
+	struct bulk_level *l;
+	int level;
+	int ret;
+	int err = 0;
+
+	qsort(bl->adopted, bl->nr_adopted, sizeof(u64), u64_cmp);
+	for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+		l = &bl->levels[level];
+		if (!l->eb)
+			continue;
+		btrfs_set_header_nritems(l->eb, l->nritems);
+		ret = bulk_free_new(bl, l->eb);
+		if (ret)
+			err = ret;
+		free_extent_buffer(l->eb);
+	}
+	free(bl->adopted);
+	kfree(bl);
+	return err;
+}
+
+/* returns 1 if any level above this one has a partial block */
+static int bulk_levels_above(struct btrfs_bulk_load *bl, int level)
+{
+	for (level++; level < BTRFS_MAX_LEVEL; level++) {
+		if (bl->levels[level].eb)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * close the partial blocks on every level, free the old tree and make
+ * the new one the root of the tree.  bl is freed in any case.  If
+ * closing the blocks fails they are given back and the old tree stays.
+ * If freeing the old tree fails it is half gone and the transaction
+ * has to be aborted.
+ */
+int btrfs_bulk_load_finish(struct btrfs_bulk_load *bl)
+{
+	struct btrfs_root *root = bl->root;
+	struct bulk_level *l;
+	struct extent_buffer *old;
+	struct extent_buffer *node = NULL;
+	struct btrfs_disk_key key;
+	int level;
+	int ret = 0;
+
+	for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+		l = &bl->levels[level];
+		if (!bulk_levels_above(bl, level)) {
+			if (!l->eb)
+				break;
+			if (l->blocks == 0) {
+				/* the only block on the top level is the root */
+				btrfs_set_header_nritems(l->eb, l->nritems);
+				node = l->eb;
+				l->eb = NULL;
+				break;
+			}
+		}
+		if (!l->eb)
+			continue;
+		ret = bulk_finish_block(bl, level);
+		if (ret) {
+			bulk_abort(bl);
+			return ret;
+		}
+	}
+
+	if (!node) {
+		/* nothing was added, the new tree is a single empty leaf */
+		memset(&key, 0, sizeof(key));
+		node = bulk_alloc_block(bl, 0, &key);
+		if (IS_ERR(node)) {
+			bulk_abort(bl);
+			return PTR_ERR(node);
+		}
+	}
+	btrfs_mark_buffer_dirty(node);
+
+	old = root->node;
+	ret = bulk_drop_tree(bl, old);
+	if (ret) {
+		free_extent_buffer(node);
+		goto out;
+	}
+	root->node = node;
+	free_extent_buffer(old);
+	add_root_to_dirty_list(root);
+out:
+	for (level = 0; level < BTRFS_MAX_LEVEL; level++)
+		free_extent_buffer(bl->levels[level].eb);
+	free(bl->adopted);
+	kfree(bl);
+	return ret;
+}
+
+/*
+ * an item batch collects items in any order, sorts them and bulk loads
+ * them together with the items already in the tree.  Items with the same
+ * key are merged for the types that pack several entries into one item.
+ */
+#define BATCH_CHUNK_SIZE	(1024 * 1024)
+#define BATCH_CHUNK_MIN		4096
+
+/* chunks start small and double up to BATCH_CHUNK_SIZE */
+struct btrfs_batch_chunk {
+	struct btrfs_batch_chunk *next;
+	u32 used;
+	u32 size;
+	char data[];
+};
+
+void btrfs_item_batch_init(struct btrfs_item_batch *batch, u64 transid)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->transid = transid;
+}
+
+void btrfs_item_batch_release(struct btrfs_item_batch *batch)
+{
+	struct btrfs_batch_chunk *chunk;
+
+	while (batch->chunks) {
+		chunk = batch->chunks;
+		batch->chunks = chunk->next;
+		free(chunk);
+	}
+	free(batch->items);
+	batch->items = NULL;
+	batch->nr = 0;
+	batch->max = 0;
+	batch->bytes = 0;
+}
+
+/*
+ * returns a zeroed buffer of data_size bytes that becomes the item data
+ */
+void *btrfs_item_batch_add(struct btrfs_item_batch *batch,
+			   struct btrfs_key *key, u32 data_size)
+{
+	struct btrfs_batch_chunk *chunk = batch->chunks;
+	struct btrfs_batch_item *item;
+	u32 size;
+	u64 max;
+	void *ptr;
+
+	if (data_size > BATCH_CHUNK_SIZE)
+		return NULL;
+	if (batch->nr == batch->max) {
+		max = max_t(u64, batch->max * 2, 16);
+		item = realloc(batch->items, max * sizeof(*item));
+		if (!item)
+			return NULL;
+		batch->items = item;
+		batch->max = max;
+	}
+	if (!chunk || chunk->used + data_size > chunk->size) {
+		size = chunk ? min_t(u32, chunk->size * 2, BATCH_CHUNK_SIZE) :
+			       BATCH_CHUNK_MIN;
+		size = max(size, data_size);
+		chunk = malloc(sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		chunk->used = 0;
+		chunk->size = size;
+		chunk->next = batch->chunks;
+		batch->chunks = chunk;
+	}
+	ptr = chunk->data + chunk->used;
+	chunk->used += (data_size + 7) & ~7;
+	memset(ptr, 0, data_size);
+
+	item = batch->items + batch->nr;
+	item->key = *key;
+	item->data = ptr;
+	item->size = data_size;
+	item->seq = ++batch->seq;
+	batch->nr++;
+	batch->bytes += data_size;
+	return ptr;
+}
+
+/*
+ * move every item of src behind the items of dst, src is left empty
+ */
+int btrfs_item_batch_splice(struct btrfs_item_batch *dst,
+			    struct btrfs_item_batch *src)
+{
+	struct btrfs_batch_chunk *tail;
+	struct btrfs_batch_item *item;
+	u64 max;
+	u64 i;
+
+	if (dst->nr + src->nr > dst->max) {
+		max = max_t(u64, dst->max * 2, dst->nr + src->nr);
+		item = realloc(dst->items, max * sizeof(*item));
+		if (!item)
+			return -ENOMEM;
+		dst->items = item;
+		dst->max = max;
+	}
+	for (i = 0; i < src->nr; i++) {
+		item = dst->items + dst->nr++;
+		*item = src->items[i];
+		item->seq = ++dst->seq;
+	}
+	dst->bytes += src->bytes;
+
+	/* the data moves along, dst keeps allocating from its own chunk */
+	if (src->chunks) {
+		tail = src->chunks;
+		while (tail->next)
+			tail = tail->next;
+		if (dst->chunks) {
+			tail->next = dst->chunks->next;
+			dst->chunks->next = src->chunks;
+		} else {
+			dst->chunks = src->chunks;
+		}
+		src->chunks = NULL;
+	}
+	btrfs_item_batch_release(src);
+	return 0;
+}
+
+static int batch_item_cmp(const void *a, const void *b)
+{
+	const struct btrfs_batch_item *ia = a;
+	const struct btrfs_batch_item *ib = b;
+	int ret;
+
+	ret = btrfs_comp_cpu_keys((struct btrfs_key *)&ia->key,
+				  (struct btrfs_key *)&ib->key);
+	if (ret)
+		return ret;
+	if (ia->seq < ib->seq)
+		return -1;
+	return ia->seq > ib->seq;
+}
+
+/*
+ * state for merging a sorted batch with the items already in a tree on
+ * their way into the bulk loader
+ */
+struct batch_merge {
+	struct btrfs_bulk_load *bl;
+	struct btrfs_root *root;
+	struct btrfs_item_batch *batch;
+	u64 pos;
+	char *merged;
+};
+
+/*
+ * add the item with this key.  It is made of the tree item at slot of
+ * leaf, if there is a leaf, followed by the batch items with the same key.
+ */
+static int batch_merge_key(struct batch_merge *m, struct btrfs_key *key,
+			   struct extent_buffer *leaf, int slot)
+{
+	struct btrfs_item_batch *batch = m->batch;
+	struct btrfs_batch_item *item;
+	u64 end;
+	u32 size = 0;
+
+	for (end = m->pos; end < batch->nr; end++) {
+		if (btrfs_comp_cpu_keys(&batch->items[end].key, key))
+			break;
+	}
+	if (leaf && end == m->pos) {
+		size = btrfs_item_size_nr(leaf, slot);
+		read_extent_buffer(leaf, m->merged,
+				   btrfs_item_ptr_offset(leaf, slot), size);
+		return btrfs_bulk_load_add(m->bl, key, m->merged, size);
+	}
+	if (!leaf && end == m->pos + 1) {
+		item = batch->items + m->pos++;
+		return btrfs_bulk_load_add(m->bl, key, item->data, item->size);
+	}
+
+	if (key->type != BTRFS_DIR_ITEM_KEY &&
+	    key->type != BTRFS_XATTR_ITEM_KEY &&
+	    key->type != BTRFS_INODE_REF_KEY)
+		return -EEXIST;
+	if (leaf) {
+		size = btrfs_item_size_nr(leaf, slot);
+		read_extent_buffer(leaf, m->merged,
+				   btrfs_item_ptr_offset(leaf, slot), size);
+	}
+	for (; m->pos < end; m->pos++) {
+		item = batch->items + m->pos;
+		if (size + item->size > BTRFS_LEAF_DATA_SIZE(m->root))
+			return -EOVERFLOW;
+		memcpy(m->merged + size, item->data, item->size);
+		size += item->size;
+	}
+	return btrfs_bulk_load_add(m->bl, key, m->merged, size);
+}
+
+/* add the batch items before hi, or all of them if hi is NULL */
+static int batch_merge_until(struct batch_merge *m, struct btrfs_key *hi)
+{
+	struct btrfs_item_batch *batch = m->batch;
+	struct btrfs_key key;
+	int ret;
+
+	while (m->pos < batch->nr) {
+		key = batch->items[m->pos].key;
+		if (hi && btrfs_comp_cpu_keys(&key, hi) >= 0)
+			break;
+		ret = batch_merge_key(m, &key, NULL, 0);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int batch_merge_leaf(struct batch_merge *m, struct extent_buffer *leaf,
+			    struct btrfs_key *hi)
+{
+	struct btrfs_key key;
+	u32 nritems = btrfs_header_nritems(leaf);
+	u32 i;
+	int ret;
+
+	for (i = 0; i < nritems; i++) {
+		btrfs_item_key_to_cpu(leaf, &key, i);
+		ret = batch_merge_until(m, &key);
+		if (ret)
+			return ret;
+		ret = batch_merge_key(m, &key, leaf, i);
+		if (ret)
+			return ret;
+	}
+	return batch_merge_until(m, hi);
+}
+
+/*
+ * walk the part of the tree below node that holds keys before hi.  A
+ * child whose key range gets no batch items is adopted by the new tree
+ * without reading it, only the leaves that change are copied.  If the
+ * leaf being filled is still small the next old leaf is copied into it
+ * rather than adopted, so a change doesn't leave a near empty leaf.
+ */
+static int batch_merge_node(struct batch_merge *m, struct extent_buffer *node,
+			    struct btrfs_key *hi)
+{
+	struct btrfs_item_batch *batch = m->batch;
+	struct extent_buffer *child;
+	struct btrfs_disk_key disk_key;
+	struct btrfs_key child_hi;
+	struct btrfs_key *next;
+	int level = btrfs_header_level(node);
+	u32 nritems = btrfs_header_nritems(node);
+	u32 i;
+	int ret;
+
+	for (i = 0; i < nritems; i++) {
+		next = hi;
+		if (i + 1 < nritems) {
+			btrfs_node_key_to_cpu(node, &child_hi, i + 1);
+			next = &child_hi;
+		}
+		if ((m->pos == batch->nr ||
+		     (next && btrfs_comp_cpu_keys(&batch->items[m->pos].key,
+						  next) >= 0)) &&
+		    !bulk_leaf_is_small(m->bl)) {
+			btrfs_node_key(node, &disk_key, i);
+			ret = bulk_adopt_block(m->bl, level - 1, &disk_key,
+					btrfs_node_blockptr(node, i),
+					btrfs_node_ptr_generation(node, i));
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		child = read_node_slot(m->root, node, i);
+		if (!child)
+			return -EIO;
+		if (level == 1)
+			ret = batch_merge_leaf(m, child, next);
+		else
+			ret = batch_merge_node(m, child, next);
+		free_extent_buffer(child);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * sort the batch, merge it with the items of root and replace root with
+ * a bulk loaded tree.  The old tree is walked in key order next to the
+ * batch.  Subtrees the batch doesn't touch move over to the new tree as
+ * they are, so loading a batch that only adds to part of the key space
+ * reads and writes only that part.  The batch is empty afterwards.
+ */
+int btrfs_item_batch_load(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root,
+			  struct btrfs_item_batch *batch, int fill)
+{
+	struct batch_merge m;
+	struct extent_buffer *node = root->node;
+	int ret;
+
+	if (batch->nr == 0)
+		return 0;
+
+	qsort(batch->items, batch->nr, sizeof(*batch->items), batch_item_cmp);
+
+	memset(&m, 0, sizeof(m));
+	m.root = root;
+	m.batch = batch;
+	m.merged = malloc(BTRFS_LEAF_DATA_SIZE(root));
+	if (!m.merged) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	m.bl = btrfs_bulk_load_start(trans, root, fill);
+	if (IS_ERR(m.bl)) {
+		ret = PTR_ERR(m.bl);
+		goto out;
+	}
+
+	if (btrfs_header_level(node) == 0)
+		ret = batch_merge_leaf(&m, node, NULL);
+	else
+		ret = batch_merge_node(&m, node, NULL);
+	if (ret) {
+		/* the old tree is untouched, give back the new blocks */
+		bulk_abort(m.bl);
+		goto out;
+	}
+	ret = btrfs_bulk_load_finish(m.bl);
+out:
+	free(m.merged);
+	btrfs_item_batch_release(batch);
+	return ret;
+}
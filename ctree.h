@@ -678,6 +678,13 @@ struct btrfs_space_info {
 	struct list_head list;
 };
 
+/*
+ * the free space of a block group is indexed by size as well as by
+ * offset.  Bucket 0 has everything below 8K, bucket n has the ranges
+ * from 4K << n up to 8K << n, and the last one everything bigger.
+ */
+#define BTRFS_FREE_SPACE_BUCKETS 32
+
 struct btrfs_block_group_cache {
 	struct cache_extent cache;
 	struct btrfs_key key;
@@ -687,6 +694,27 @@ struct btrfs_block_group_cache {
 	u64 flags;
 	int cached;
 	int ro;
+
+	/* one tree of free ranges per bucket, ordered by offset */
+	struct cache_tree free_space[BTRFS_FREE_SPACE_BUCKETS];
+	/* bit n is set when bucket n isn't empty */
+	u32 free_space_buckets;
+
+	/* the BLOCK_GROUP_* type bits it is indexed with */
+	int index_bits;
+};
+
+/*
+ * block groups sorted by start offset.  fs_info keeps one index of all
+ * groups for btrfs_lookup_block_group and one per type for
+ * btrfs_find_block_group.
+ */
+#define BTRFS_BLOCK_GROUP_TYPES 3
+
+struct btrfs_block_group_index {
+	struct btrfs_block_group_cache **groups;
+	int nr;
+	int alloc;
 };
 
 struct btrfs_extent_ops {
@@ -698,6 +726,9 @@ struct btrfs_extent_ops {
 
 struct btrfs_device;
 struct btrfs_fs_devices;
+struct metadump_image;
+struct btrfs_caching_ctl;
+
 struct btrfs_fs_info {
 	u8 fsid[BTRFS_FSID_SIZE];
 	u8 chunk_tree_uuid[BTRFS_UUID_SIZE];
@@ -716,9 +747,13 @@ struct btrfs_fs_info {
 	struct extent_io_tree extent_cache;
 	struct extent_io_tree free_space_cache;
 	struct extent_io_tree block_group_cache;
+	struct btrfs_block_group_index block_groups;
+	struct btrfs_block_group_index block_group_types[BTRFS_BLOCK_GROUP_TYPES];
 	struct extent_io_tree pinned_extents;
 	struct extent_io_tree pending_del;
 	struct extent_io_tree extent_ins;
+	/* reference updates waiting for the commit, by extent bytenr */
+	struct cache_tree delayed_refs;
 
 	/* logical->physical extent mapping */
 	struct btrfs_mapping_tree mapping_tree;
@@ -748,6 +783,30 @@ struct btrfs_fs_info {
 	struct list_head space_info;
 	int system_allocs;
 	int readonly;
+
+	/* tree blocks come from an indexed btrfs-image dump */
+	struct metadump_image *metadump;
+
+	/* how often btrfs_search_slot_finger could reuse the old path */
+	u64 finger_leaf_hits;
+	u64 finger_node_hits;
+	u64 finger_misses;
+
+	/* block group caching threads, see btrfs_start_caching */
+	struct btrfs_caching_ctl *caching;
+
+	/*
+	 * adaptive readahead for reada_for_search.  reada_tree has every
+	 * block we started readahead on that wasn't read yet, reada_node
+	 * and reada_slot are where the last call looked at.
+	 */
+	struct extent_io_tree reada_tree;
+	u32 reada_window;
+	u64 reada_node;
+	int reada_slot;
+	u64 reada_issued;
+	u64 reada_hits;
+	u64 reada_misses;
 };
 
 /*
@@ -1626,6 +1685,8 @@ BTRFS_SETGET_STACK_FUNCS(stack_file_extent_generation, struct btrfs_file_extent_
 		   generation, 64);
 BTRFS_SETGET_FUNCS(file_extent_disk_num_bytes, struct btrfs_file_extent_item,
 		   disk_num_bytes, 64);
+BTRFS_SETGET_STACK_FUNCS(stack_file_extent_disk_num_bytes, struct btrfs_file_extent_item,
+		   disk_num_bytes, 64);
 BTRFS_SETGET_FUNCS(file_extent_offset, struct btrfs_file_extent_item,
 		  offset, 64);
 BTRFS_SETGET_STACK_FUNCS(stack_file_extent_offset, struct btrfs_file_extent_item,
@@ -1687,10 +1748,19 @@ static inline u32 btrfs_level_size(struct btrfs_root *root, int level) {
 /* extent-tree.c */
 int btrfs_extent_post_op(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *root);
+int btrfs_run_delayed_refs(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root);
+void btrfs_free_delayed_refs(struct btrfs_fs_info *info);
 int btrfs_copy_pinned(struct btrfs_root *root, struct extent_io_tree *copy);
+extern struct extent_io_ops btrfs_free_space_ops;
+int btrfs_start_caching(struct btrfs_fs_info *info, int num_threads);
+void btrfs_stop_caching(struct btrfs_fs_info *info);
 struct btrfs_block_group_cache *btrfs_lookup_block_group(struct
 							 btrfs_fs_info *info,
 							 u64 bytenr);
+struct btrfs_block_group_cache *btrfs_lookup_first_block_group(struct
+						       btrfs_fs_info *info,
+						       u64 bytenr);
 struct btrfs_block_group_cache *btrfs_find_block_group(struct btrfs_root *root,
 						 struct btrfs_block_group_cache
 						 *hint, u64 search_start,
@@ -1747,6 +1817,10 @@ int btrfs_update_block_group(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root, u64 bytenr, u64 num,
 			     int alloc, int mark_free);
 /* ctree.c */
+/* number of slots reada_for_search looks at */
+#define BTRFS_READA_MIN 8
+#define BTRFS_READA_INIT 32
+#define BTRFS_READA_MAX 256
 void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 			     int level, int slot, u64 objectid);
 struct extent_buffer *read_node_slot(struct btrfs_root *root,
@@ -1755,6 +1829,7 @@ int btrfs_previous_item(struct btrfs_root *root,
 			struct btrfs_path *path, u64 min_objectid,
 			int type);
 int btrfs_comp_keys(struct btrfs_disk_key *disk, struct btrfs_key *k2);
+int btrfs_comp_cpu_keys(struct btrfs_key *k1, struct btrfs_key *k2);
 int btrfs_cow_block(struct btrfs_trans_handle *trans,
 		    struct btrfs_root *root, struct extent_buffer *buf,
 		    struct extent_buffer *parent, int parent_slot,
@@ -1783,6 +1858,9 @@ int btrfs_split_item(struct btrfs_trans_handle *trans,
 int btrfs_search_slot(struct btrfs_trans_handle *trans, struct btrfs_root
 		      *root, struct btrfs_key *key, struct btrfs_path *p, int
 		      ins_len, int cow);
+int btrfs_search_slot_finger(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, struct btrfs_key *key,
+			     struct btrfs_path *p, int ins_len, int cow);
 int btrfs_realloc_node(struct btrfs_trans_handle *trans,
 		       struct btrfs_root *root, struct extent_buffer *parent,
 		       int start_slot, int cache_only, u64 *last_ret,
@@ -1803,6 +1881,76 @@ static inline int btrfs_del_item(struct btrfs_trans_handle *trans,
 
 int btrfs_insert_item(struct btrfs_trans_handle *trans, struct btrfs_root
 		      *root, struct btrfs_key *key, void *data, u32 data_size);
+
+/* fill factor mkfs and convert use when bulk loading trees */
+#define BTRFS_BULK_LOAD_FILL	90
+
+struct btrfs_bulk_load;
+struct btrfs_bulk_load *btrfs_bulk_load_start(struct btrfs_trans_handle *trans,
+					      struct btrfs_root *root,
+					      int fill);
+int btrfs_bulk_load_add(struct btrfs_bulk_load *bl, struct btrfs_key *key,
+			void *data, u32 data_size);
+int btrfs_bulk_load_finish(struct btrfs_bulk_load *bl);
+
+/*
+ * forward iterator over the items of a tree from min_key to max_key,
+ * optionally only those of one type.  Sibling leaves are prefetched
+ * from the parent node up to reada leaves ahead of the current one.
+ */
+struct btrfs_cursor {
+	struct btrfs_root *root;
+	struct btrfs_path path;
+	struct btrfs_key min_key;
+	struct btrfs_key max_key;
+	int type;
+	int reada;
+	int started;
+	int done;
+
+	/* sibling leaves up to this slot of this node were prefetched */
+	u64 reada_node;
+	int reada_slot;
+};
+
+#define BTRFS_CURSOR_ANY_TYPE	(-1)
+#define BTRFS_CURSOR_READA	16
+
+void btrfs_cursor_init(struct btrfs_cursor *c, struct btrfs_root *root,
+		       struct btrfs_key *min_key, struct btrfs_key *max_key,
+		       int type, int reada);
+void btrfs_cursor_release(struct btrfs_cursor *c);
+int btrfs_cursor_next(struct btrfs_cursor *c, struct btrfs_key *key);
+int btrfs_cursor_next_batch(struct btrfs_cursor *c, struct btrfs_key *keys,
+			    int *slots, int max);
+
+struct btrfs_batch_item {
+	struct btrfs_key key;
+	u32 size;
+	u64 seq;
+	void *data;
+};
+
+struct btrfs_batch_chunk;
+struct btrfs_item_batch {
+	u64 transid;
+	u64 nr;
+	u64 max;
+	u64 seq;
+	u64 bytes;
+	struct btrfs_batch_item *items;
+	struct btrfs_batch_chunk *chunks;
+};
+
+void btrfs_item_batch_init(struct btrfs_item_batch *batch, u64 transid);
+void btrfs_item_batch_release(struct btrfs_item_batch *batch);
+void *btrfs_item_batch_add(struct btrfs_item_batch *batch,
+			   struct btrfs_key *key, u32 data_size);
+int btrfs_item_batch_splice(struct btrfs_item_batch *dst,
+			    struct btrfs_item_batch *src);
+int btrfs_item_batch_load(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root,
+			  struct btrfs_item_batch *batch, int fill);
 int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
 			     struct btrfs_path *path,
@@ -1870,6 +2018,12 @@ int btrfs_insert_xattr_item(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root, const char *name,
 			    u16 name_len, const void *data, u16 data_len,
 			    u64 dir);
+int btrfs_batch_insert_dir_item(struct btrfs_item_batch *batch,
+				const char *name, int name_len, u64 dir,
+				struct btrfs_key *location, u8 type, u64 index);
+int btrfs_batch_insert_xattr_item(struct btrfs_item_batch *batch,
+				  const char *name, u16 name_len,
+				  const void *data, u16 data_len, u64 dir);
 struct btrfs_dir_item *btrfs_lookup_xattr(struct btrfs_trans_handle *trans,
 					  struct btrfs_root *root,
 					  struct btrfs_path *path, u64 dir,
@@ -1896,6 +2050,12 @@ int btrfs_insert_empty_inode(struct btrfs_trans_handle *trans,
 int btrfs_insert_inode(struct btrfs_trans_handle *trans, struct btrfs_root
 		       *root, u64 objectid, struct btrfs_inode_item
 		       *inode_item);
+int btrfs_batch_insert_inode_ref(struct btrfs_item_batch *batch,
+				 const char *name, int name_len,
+				 u64 inode_objectid, u64 ref_objectid,
+				 u64 index);
+int btrfs_batch_insert_inode(struct btrfs_item_batch *batch, u64 objectid,
+			     struct btrfs_inode_item *inode_item);
 int btrfs_lookup_inode(struct btrfs_trans_handle *trans, struct btrfs_root
 		       *root, struct btrfs_path *path,
 		       struct btrfs_key *location, int mod);
@@ -1911,6 +2071,12 @@ int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 				struct btrfs_root *root, u64 objectid,
 				u64 offset, char *buffer, size_t size);
+int btrfs_batch_insert_file_extent(struct btrfs_item_batch *batch,
+				   u64 objectid, u64 pos, u64 offset,
+				   u64 disk_num_bytes, u64 num_bytes);
+int btrfs_batch_insert_inline_extent(struct btrfs_item_batch *batch,
+				     u64 objectid, u64 offset,
+				     char *buffer, size_t size);
 int btrfs_lookup_file_extent(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
 			     struct btrfs_path *path, u64 objectid,
@@ -1918,6 +2084,9 @@ int btrfs_lookup_file_extent(struct btrfs_trans_handle *trans,
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 alloc_end,
 			  u64 bytenr, char *data, size_t len);
+int btrfs_csum_file_blocks(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, u64 bytenr,
+			   u64 num_bytes, char *csums);
 struct btrfs_csum_item *btrfs_lookup_csum(struct btrfs_trans_handle *trans,
 					  struct btrfs_root *root,
 					  struct btrfs_path *path,
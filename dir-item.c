@@ -175,6 +175,73 @@ out:
 	return 0;
 }
 
+static void fill_batch_dir_item(struct btrfs_dir_item *dir_item,
+				struct btrfs_key *location, u64 transid,
+				u8 type, const char *name, u16 name_len,
+				const void *data, u16 data_len)
+{
+	btrfs_cpu_key_to_disk(&dir_item->location, location);
+	dir_item->transid = cpu_to_le64(transid);
+	dir_item->type = type;
+	dir_item->name_len = cpu_to_le16(name_len);
+	dir_item->data_len = cpu_to_le16(data_len);
+	memcpy(dir_item + 1, name, name_len);
+	if (data_len)
+		memcpy((char *)(dir_item + 1) + name_len, data, data_len);
+}
+
+/*
+ * batch versions of btrfs_insert_dir_item and btrfs_insert_xattr_item,
+ * the items end up in the tree with btrfs_item_batch_load
+ */
+int btrfs_batch_insert_dir_item(struct btrfs_item_batch *batch,
+				const char *name, int name_len, u64 dir,
+				struct btrfs_key *location, u8 type, u64 index)
+{
+	struct btrfs_dir_item *dir_item;
+	struct btrfs_key key;
+	u32 data_size = sizeof(*dir_item) + name_len;
+
+	key.objectid = dir;
+	btrfs_set_key_type(&key, BTRFS_DIR_ITEM_KEY);
+	key.offset = btrfs_name_hash(name, name_len);
+	dir_item = btrfs_item_batch_add(batch, &key, data_size);
+	if (!dir_item)
+		return -ENOMEM;
+	fill_batch_dir_item(dir_item, location, batch->transid, type,
+			    name, name_len, NULL, 0);
+
+	btrfs_set_key_type(&key, BTRFS_DIR_INDEX_KEY);
+	key.offset = index;
+	dir_item = btrfs_item_batch_add(batch, &key, data_size);
+	if (!dir_item)
+		return -ENOMEM;
+	fill_batch_dir_item(dir_item, location, batch->transid, type,
+			    name, name_len, NULL, 0);
+	return 0;
+}
+
+int btrfs_batch_insert_xattr_item(struct btrfs_item_batch *batch,
+				  const char *name, u16 name_len,
+				  const void *data, u16 data_len, u64 dir)
+{
+	struct btrfs_dir_item *dir_item;
+	struct btrfs_key key, location;
+
+	key.objectid = dir;
+	btrfs_set_key_type(&key, BTRFS_XATTR_ITEM_KEY);
+	key.offset = btrfs_name_hash(name, name_len);
+	dir_item = btrfs_item_batch_add(batch, &key, sizeof(*dir_item) +
+					name_len + data_len);
+	if (!dir_item)
+		return -ENOMEM;
+
+	memset(&location, 0, sizeof(location));
+	fill_batch_dir_item(dir_item, &location, batch->transid,
+			    BTRFS_FT_XATTR, name, name_len, data, data_len);
+	return 0;
+}
+
 struct btrfs_dir_item *btrfs_lookup_dir_item(struct btrfs_trans_handle *trans,
 					     struct btrfs_root *root,
 					     struct btrfs_path *path, u64 dir,
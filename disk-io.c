@@ -34,6 +34,7 @@
 #include "crc32c.h"
 #include "utils.h"
 #include "print-tree.h"
+#include "metadump.h"
 
 static int close_all_devices(struct btrfs_fs_info *fs_info);
 
@@ -124,30 +125,132 @@ struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 				   blocksize);
 }
 
+/* requests per device in one readahead batch when sysfs doesn't say */
+#define READA_DEPTH		64
+/* the most we merge into a single readahead call */
+#define READA_RUN_MAX		(1024 * 1024)
+
+struct reada_io {
+	struct btrfs_device *device;
+	u64 physical;
+	u64 bytenr;
+};
+
+static int reada_io_cmp(const void *a, const void *b)
+{
+	const struct reada_io *ra = a;
+	const struct reada_io *rb = b;
+
+	if (ra->device->devid < rb->device->devid)
+		return -1;
+	if (ra->device->devid > rb->device->devid)
+		return 1;
+	if (ra->physical < rb->physical)
+		return -1;
+	if (ra->physical > rb->physical)
+		return 1;
+	return 0;
+}
+
+static void reada_run(struct btrfs_device *device, u64 start, u64 end)
+{
+	device->total_ios++;
+	readahead(device->fd, start, end - start);
+}
+
+/*
+ * start readahead on nr tree blocks.  The blocks are sorted by device and
+ * physical offset so neighbours go down in one readahead call, and each
+ * device gets at most its queue depth worth of calls.  Every block we
+ * start is recorded in fs_info->reada_tree so read_tree_block can tell
+ * how much of it was used.  Returns the number of blocks started.
+ */
+int readahead_tree_blocks(struct btrfs_root *root, u64 *bytenr, int nr,
+			  u32 blocksize)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_multi_bio *multi;
+	struct btrfs_device *device = NULL;
+	struct reada_io *io;
+	u64 length;
+	u64 start = 0;
+	u64 end = 0;
+	u32 depth = 0;
+	u32 queued = 0;
+	int issued = 0;
+	int ret;
+	int i;
+
+	if (info->metadump || nr <= 0)
+		return 0;
+
+	io = malloc(nr * sizeof(*io));
+	if (!io)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		length = blocksize;
+		multi = NULL;
+		ret = btrfs_map_block(&info->mapping_tree, READ, bytenr[i],
+				      &length, &multi, 0);
+		BUG_ON(ret);
+		io[i].device = multi->stripes[0].dev;
+		io[i].physical = multi->stripes[0].physical;
+		io[i].bytenr = bytenr[i];
+		kfree(multi);
+	}
+	qsort(io, nr, sizeof(*io), reada_io_cmp);
+
+	for (i = 0; i < nr; i++) {
+		if (io[i].device == device && end > start &&
+		    io[i].physical == end && end - start < READA_RUN_MAX) {
+			end += blocksize;
+		} else {
+			if (end > start)
+				reada_run(device, start, end);
+			start = end = 0;
+			if (io[i].device != device) {
+				device = io[i].device;
+				depth = device->reada_depth ? : READA_DEPTH;
+				queued = 0;
+			}
+			if (queued >= depth)
+				continue;
+			queued++;
+			start = io[i].physical;
+			end = start + blocksize;
+		}
+		set_extent_dirty(&info->reada_tree, io[i].bytenr,
+				 io[i].bytenr + blocksize - 1, GFP_NOFS);
+		issued++;
+	}
+	if (end > start)
+		reada_run(device, start, end);
+
+	info->reada_issued += issued;
+	free(io);
+	return issued;
+}
+
 int readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			 u64 parent_transid)
 {
-	int ret;
 	struct extent_buffer *eb;
-	u64 length;
-	struct btrfs_multi_bio *multi = NULL;
-	struct btrfs_device *device;
+
+	if (root->fs_info->metadump)
+		return 0;
 
 	eb = btrfs_find_tree_block(root, bytenr, blocksize);
 	if (eb && btrfs_buffer_uptodate(eb, parent_transid)) {
 		free_extent_buffer(eb);
 		return 0;
 	}
+	free_extent_buffer(eb);
 
-	length = blocksize;
-	ret = btrfs_map_block(&root->fs_info->mapping_tree, READ,
-			      bytenr, &length, &multi, 0);
-	BUG_ON(ret);
-	device = multi->stripes[0].dev;
-	device->total_ios++;
-	blocksize = min(blocksize, (u32)(64 * 1024));
-	readahead(device->fd, multi->stripes[0].physical, blocksize);
-	kfree(multi);
+	if (test_range_bit(&root->fs_info->reada_tree, bytenr,
+			   bytenr + blocksize - 1, EXTENT_DIRTY, 1))
+		return 0;
+	readahead_tree_blocks(root, &bytenr, 1, blocksize);
 	return 0;
 }
 
@@ -203,6 +306,31 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 	if (btrfs_buffer_uptodate(eb, parent_transid))
 		return eb;
 
+	if (root->fs_info->metadump) {
+		ret = metadump_read(root->fs_info->metadump, eb->start,
+				    eb->data, eb->len);
+		if (ret == 0 && check_tree_block(root, eb) == 0 &&
+		    csum_tree_block(root, eb, 1) == 0 &&
+		    verify_parent_transid(eb->tree, eb, parent_transid, 0)
+		    == 0) {
+			btrfs_set_buffer_uptodate(eb);
+			return eb;
+		}
+		printk("Couldn't read block %Lu from metadump image\n",
+		       bytenr);
+		free_extent_buffer(eb);
+		return NULL;
+	}
+
+	if (test_range_bit(&root->fs_info->reada_tree, bytenr,
+			   bytenr + blocksize - 1, EXTENT_DIRTY, 1)) {
+		clear_extent_dirty(&root->fs_info->reada_tree, bytenr,
+				   bytenr + blocksize - 1, GFP_NOFS);
+		root->fs_info->reada_hits++;
+	} else {
+		root->fs_info->reada_misses++;
+	}
+
 	length = blocksize;
 	while (1) {
 		ret = btrfs_map_block(&root->fs_info->mapping_tree, READ,
@@ -320,6 +448,7 @@ static int update_cowonly_root(struct btrfs_trans_handle *trans,
 	u64 old_root_bytenr;
 	struct btrfs_root *tree_root = root->fs_info->tree_root;
 
+	btrfs_run_delayed_refs(trans, root);
 	btrfs_write_dirty_block_groups(trans, root);
 	while(1) {
 		old_root_bytenr = btrfs_root_bytenr(&root->root_item);
@@ -334,6 +463,7 @@ static int update_cowonly_root(struct btrfs_trans_handle *trans,
 					&root->root_key,
 					&root->root_item);
 		BUG_ON(ret);
+		btrfs_run_delayed_refs(trans, root);
 		btrfs_write_dirty_block_groups(trans, root);
 	}
 	return 0;
@@ -354,7 +484,10 @@ static int commit_tree_roots(struct btrfs_trans_handle *trans,
 	btrfs_cow_block(trans, fs_info->tree_root, eb, NULL, 0, &eb);
 	free_extent_buffer(eb);
 
-	while(!list_empty(&fs_info->dirty_cowonly_roots)) {
+	while(1) {
+		btrfs_run_delayed_refs(trans, fs_info->tree_root);
+		if (list_empty(&fs_info->dirty_cowonly_roots))
+			break;
 		next = fs_info->dirty_cowonly_roots.next;
 		list_del_init(next);
 		root = list_entry(next, struct btrfs_root, dirty_list);
@@ -397,6 +530,10 @@ int btrfs_commit_transaction(struct btrfs_trans_handle *trans,
 	int ret = 0;
 	struct btrfs_fs_info *fs_info = root->fs_info;
 
+	/* before the root item below picks up the used bytes */
+	ret = btrfs_run_delayed_refs(trans, root);
+	BUG_ON(ret);
+
 	if (root->commit_root == root->node)
 		goto commit_tree;
 
@@ -623,14 +760,39 @@ struct btrfs_root *__open_ctree_fd(int fp, const char *path, u64 sb_bytenr,
 	int ret;
 	struct btrfs_super_block *disk_super;
 	struct btrfs_fs_devices *fs_devices = NULL;
+	struct btrfs_super_block metadump_super;
+	struct metadump_image *metadump = NULL;
 	u64 total_devs;
 	u64 features;
 
 	if (sb_bytenr == 0)
 		sb_bytenr = BTRFS_SUPER_INFO_OFFSET;
 
-	ret = btrfs_scan_one_device(fp, path, &fs_devices,
-				    &total_devs, sb_bytenr);
+	/*
+	 * indexed btrfs-image dumps can be opened read-only in place, tree
+	 * blocks are then decompressed from the image on demand
+	 */
+	if (!writes && metadump_probe(fp)) {
+		metadump = metadump_open(fp);
+		if (!metadump) {
+			fprintf(stderr, "metadump image has no index, restore "
+				"it with btrfs-image -r first\n");
+			goto out;
+		}
+		if (metadump_base_generation(metadump)) {
+			fprintf(stderr, "%s is a delta metadump image, restore "
+				"it on top of its base first\n", path);
+			goto out;
+		}
+		ret = metadump_read_super(metadump, &metadump_super);
+		if (!ret)
+			ret = btrfs_scan_metadump_device(path, &metadump_super,
+							 &fs_devices,
+							 &total_devs);
+	} else {
+		ret = btrfs_scan_one_device(fp, path, &fs_devices,
+					    &total_devs, sb_bytenr);
+	}
 
 	if (ret) {
 		fprintf(stderr, "No valid Btrfs found on %s\n", path);
@@ -652,13 +814,18 @@ struct btrfs_root *__open_ctree_fd(int fp, const char *path, u64 sb_bytenr,
 
 	if (!writes)
 		fs_info->readonly = 1;
+	fs_info->metadump = metadump;
 
 	extent_io_tree_init(&fs_info->extent_cache);
 	extent_io_tree_init(&fs_info->free_space_cache);
+	fs_info->free_space_cache.ops = &btrfs_free_space_ops;
 	extent_io_tree_init(&fs_info->block_group_cache);
 	extent_io_tree_init(&fs_info->pinned_extents);
 	extent_io_tree_init(&fs_info->pending_del);
 	extent_io_tree_init(&fs_info->extent_ins);
+	cache_tree_init(&fs_info->delayed_refs);
+	extent_io_tree_init(&fs_info->reada_tree);
+	fs_info->reada_window = BTRFS_READA_INIT;
 	cache_tree_init(&fs_info->fs_root_cache);
 
 	cache_tree_init(&fs_info->mapping_tree.cache_tree);
@@ -680,7 +847,10 @@ struct btrfs_root *__open_ctree_fd(int fp, const char *path, u64 sb_bytenr,
 
 	fs_info->super_bytenr = sb_bytenr;
 	disk_super = &fs_info->super_copy;
-	if (use_earliest_bdev) {
+	if (metadump) {
+		memcpy(disk_super, &metadump_super, sizeof(*disk_super));
+		ret = 0;
+	} else if (use_earliest_bdev) {
 		ret = btrfs_read_dev_super(fs_devices->earliest_bdev,
 					   disk_super, sb_bytenr);
 	} else {
@@ -832,7 +1002,9 @@ out_cleanup:
 	extent_io_tree_cleanup(&fs_info->pinned_extents);
 	extent_io_tree_cleanup(&fs_info->pending_del);
 	extent_io_tree_cleanup(&fs_info->extent_ins);
+	extent_io_tree_cleanup(&fs_info->reada_tree);
 out:
+	metadump_close(metadump);
 	free(tree_root);
 	free(extent_root);
 	free(chunk_root);
@@ -930,10 +1102,14 @@ struct btrfs_root *open_ctree_broken(int fd, const char *device)
 
 	extent_io_tree_init(&fs_info->extent_cache);
 	extent_io_tree_init(&fs_info->free_space_cache);
+	fs_info->free_space_cache.ops = &btrfs_free_space_ops;
 	extent_io_tree_init(&fs_info->block_group_cache);
 	extent_io_tree_init(&fs_info->pinned_extents);
 	extent_io_tree_init(&fs_info->pending_del);
 	extent_io_tree_init(&fs_info->extent_ins);
+	cache_tree_init(&fs_info->delayed_refs);
+	extent_io_tree_init(&fs_info->reada_tree);
+	fs_info->reada_window = BTRFS_READA_INIT;
 	cache_tree_init(&fs_info->fs_root_cache);
 
 	cache_tree_init(&fs_info->mapping_tree.cache_tree);
@@ -1025,6 +1201,7 @@ out_cleanup:
 	extent_io_tree_cleanup(&fs_info->pinned_extents);
 	extent_io_tree_cleanup(&fs_info->pending_del);
 	extent_io_tree_cleanup(&fs_info->extent_ins);
+	extent_io_tree_cleanup(&fs_info->reada_tree);
 out:
 	free(tree_root);
 	free(extent_root);
@@ -1221,6 +1398,7 @@ int close_ctree(struct btrfs_root *root)
 		write_ctree_super(trans, root);
 		btrfs_free_transaction(root, trans);
 	}
+	btrfs_free_delayed_refs(fs_info);
 	btrfs_free_block_groups(fs_info);
 
 	free_fs_roots(fs_info);
@@ -1243,12 +1421,14 @@ int close_ctree(struct btrfs_root *root)
 	}
 
 	close_all_devices(fs_info);
+	metadump_close(fs_info->metadump);
 	extent_io_tree_cleanup(&fs_info->extent_cache);
 	extent_io_tree_cleanup(&fs_info->free_space_cache);
 	extent_io_tree_cleanup(&fs_info->block_group_cache);
 	extent_io_tree_cleanup(&fs_info->pinned_extents);
 	extent_io_tree_cleanup(&fs_info->pending_del);
 	extent_io_tree_cleanup(&fs_info->extent_ins);
+	extent_io_tree_cleanup(&fs_info->reada_tree);
 
 	free(fs_info->tree_root);
 	free(fs_info->extent_root);
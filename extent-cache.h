@@ -54,6 +54,6 @@ static inline void free_cache_extent(struct cache_extent *pe)
 	free(pe);
 }
 
-struct cache_extent *alloc_pending_extent(u64 start, u64 size);
+struct cache_extent *alloc_cache_extent(u64 start, u64 size);
 
 #endif
@@ -16,8 +16,13 @@
  * Boston, MA 021110-1307, USA.
  */
 
+#define _XOPEN_SOURCE 600
+#define __USE_XOPEN2K
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
 #include "ctree.h"
@@ -46,13 +51,41 @@ struct pending_extent_op {
 	int level;
 };
 
+/*
+ * delayed extent reference updates.  btrfs_inc_extent_ref and
+ * btrfs_free_extent only record the change in memory, one delayed_ref
+ * for every backref that changes, hung off a delayed_ref_head for the
+ * extent.  An add and a drop of the same backref cancel out, so an
+ * update that is undone within the transaction never reaches the extent
+ * tree.  btrfs_run_delayed_refs applies what is left in bytenr order when
+ * the transaction commits.
+ */
+struct delayed_ref_head {
+	/* start and size of the extent */
+	struct cache_extent cache;
+	struct list_head refs;
+	/* sum of ref_mod over all refs, for btrfs_lookup_extent_info */
+	int ref_mod;
+};
+
+struct delayed_ref {
+	struct list_head list;
+	/* the root the update came from, for its root item accounting */
+	struct btrfs_root *root;
+	u64 parent;
+	u64 root_objectid;
+	u64 owner;
+	u64 offset;
+	int ref_mod;
+};
+
 static int alloc_reserved_tree_block(struct btrfs_trans_handle *trans,
 				     struct btrfs_root *root,
 				     u64 root_objectid, u64 generation,
 				     u64 flags, struct btrfs_disk_key *key,
 				     int level, struct btrfs_key *ins);
 static int __free_extent(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *root,
+			 struct btrfs_root *root, struct btrfs_path *path,
 			 u64 bytenr, u64 num_bytes, u64 parent,
 			 u64 root_objectid, u64 owner_objectid,
 			 u64 owner_offset, int refs_to_drop);
@@ -86,15 +119,521 @@ static int remove_sb_from_cache(struct btrfs_root *root,
 	return 0;
 }
 
+/*
+ * parallel block group caching.  btrfs_start_caching collects the leaves
+ * of the committed extent tree and hands every uncached block group,
+ * with the leaves that cover it, to a pool of threads.  The threads read
+ * those leaves with pread into private buffers and turn the extent
+ * items into free ranges.  They never touch the extent buffer cache or
+ * anything else the rest of the code uses, so all cache_block_group has
+ * to do is copy the ranges of a finished group into free_space_cache.
+ *
+ * A group no thread has picked up yet is scanned by the caller straight
+ * away.  If a leaf was rewritten since we collected it the group is
+ * scanned through the tree like before.
+ */
+enum {
+	CACHING_QUEUED,
+	CACHING_RUNNING,
+	CACHING_DONE,
+	CACHING_FAILED,
+};
+
+struct caching_leaf {
+	/* first key in the leaf, from its parent */
+	struct btrfs_key key;
+	u64 bytenr;
+	u64 generation;
+	u64 physical;
+	int fd;
+};
+
+struct caching_group {
+	struct btrfs_block_group_cache *cache;
+	int first_leaf;
+	int nr_leaves;
+	int state;
+	struct extent_range *ranges;
+	int nr_ranges;
+	int alloc_ranges;
+};
+
+struct btrfs_caching_ctl {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int num_threads;
+
+	u32 leafsize;
+	u16 csum_size;
+
+	struct caching_leaf *leaves;
+	int nr_leaves;
+	int alloc_leaves;
+
+	struct caching_group *groups;
+	int nr_groups;
+	int next_group;
+	int nr_finished;
+	int stop;
+};
+
+static int caching_add_range(struct caching_group *g, u64 start, u64 end)
+{
+	struct extent_range *ranges;
+	int alloc;
+
+	if (g->nr_ranges == g->alloc_ranges) {
+		alloc = g->alloc_ranges ? g->alloc_ranges * 2 : 64;
+		ranges = realloc(g->ranges, alloc * sizeof(*ranges));
+		if (!ranges)
+			return -ENOMEM;
+		g->ranges = ranges;
+		g->alloc_ranges = alloc;
+	}
+	g->ranges[g->nr_ranges].start = start;
+	g->ranges[g->nr_ranges].end = end;
+	g->nr_ranges++;
+	return 0;
+}
+
+static int caching_read_leaf(struct btrfs_caching_ctl *ctl,
+			     struct caching_leaf *leaf,
+			     struct extent_buffer *eb)
+{
+	char result[BTRFS_CSUM_SIZE];
+	u32 crc = ~(u32)0;
+	ssize_t ret;
+
+	ret = pread64(leaf->fd, eb->data, ctl->leafsize, leaf->physical);
+	if (ret != ctl->leafsize)
+		return -EIO;
+
+	crc = crc32c(crc, eb->data + BTRFS_CSUM_SIZE,
+		     ctl->leafsize - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(crc, result);
+	if (memcmp(eb->data, result, ctl->csum_size))
+		return -EIO;
+
+	/* the block was freed and reused after we looked at the parent */
+	if (btrfs_header_bytenr(eb) != leaf->bytenr ||
+	    btrfs_header_generation(eb) != leaf->generation ||
+	    btrfs_header_level(eb) != 0)
+		return -EAGAIN;
+	return 0;
+}
+
+/*
+ * the same walk cache_block_group does through the tree, over the
+ * leaves we collected for this group
+ */
+static int caching_scan_group(struct btrfs_caching_ctl *ctl,
+			      struct caching_group *g)
+{
+	struct btrfs_block_group_cache *cache = g->cache;
+	struct extent_buffer *eb;
+	struct btrfs_key key;
+	struct btrfs_key min_key;
+	u64 group_end = cache->key.objectid + cache->key.offset;
+	u64 last;
+	u32 nritems;
+	int ret = 0;
+	int i;
+	int slot;
+
+	eb = malloc(sizeof(*eb) + ctl->leafsize);
+	if (!eb)
+		return -ENOMEM;
+	memset(eb, 0, sizeof(*eb));
+	eb->len = ctl->leafsize;
+
+	last = max_t(u64, cache->key.objectid, BTRFS_SUPER_INFO_OFFSET);
+	min_key.objectid = last;
+	min_key.type = BTRFS_EXTENT_ITEM_KEY;
+	min_key.offset = 0;
+
+	for (i = 0; i < g->nr_leaves; i++) {
+		ret = caching_read_leaf(ctl, ctl->leaves + g->first_leaf + i,
+					eb);
+		if (ret)
+			goto out;
+
+		nritems = btrfs_header_nritems(eb);
+		for (slot = 0; slot < nritems; slot++) {
+			btrfs_item_key_to_cpu(eb, &key, slot);
+			if (key.objectid >= group_end)
+				goto done;
+			if (key.type != BTRFS_EXTENT_ITEM_KEY ||
+			    btrfs_comp_cpu_keys(&key, &min_key) < 0)
+				continue;
+			if (key.objectid > last) {
+				ret = caching_add_range(g, last,
+							key.objectid - 1);
+				if (ret)
+					goto out;
+			}
+			last = key.objectid + key.offset;
+		}
+	}
+done:
+	if (group_end > last)
+		ret = caching_add_range(g, last, group_end - 1);
+out:
+	free(eb);
+	return ret;
+}
+
+static void caching_run_group(struct btrfs_caching_ctl *ctl,
+			      struct caching_group *g)
+{
+	int ret;
+
+	ret = caching_scan_group(ctl, g);
+
+	pthread_mutex_lock(&ctl->mutex);
+	g->state = ret ? CACHING_FAILED : CACHING_DONE;
+	pthread_cond_broadcast(&ctl->cond);
+	pthread_mutex_unlock(&ctl->mutex);
+}
+
+static void *caching_worker(void *data)
+{
+	struct btrfs_caching_ctl *ctl = data;
+	struct caching_group *g;
+
+	while (1) {
+		pthread_mutex_lock(&ctl->mutex);
+		while (ctl->next_group < ctl->nr_groups &&
+		       ctl->groups[ctl->next_group].state != CACHING_QUEUED)
+			ctl->next_group++;
+		if (ctl->stop || ctl->next_group >= ctl->nr_groups) {
+			pthread_mutex_unlock(&ctl->mutex);
+			break;
+		}
+		g = ctl->groups + ctl->next_group++;
+		g->state = CACHING_RUNNING;
+		pthread_mutex_unlock(&ctl->mutex);
+
+		caching_run_group(ctl, g);
+	}
+	return NULL;
+}
+
+static int caching_add_leaf(struct btrfs_root *root,
+			    struct btrfs_caching_ctl *ctl,
+			    struct btrfs_key *key, u64 bytenr, u64 generation)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct caching_leaf *leaf;
+	u64 length = ctl->leafsize;
+	int alloc;
+	int ret;
+
+	if (ctl->nr_leaves == ctl->alloc_leaves) {
+		alloc = ctl->alloc_leaves ? ctl->alloc_leaves * 2 : 1024;
+		leaf = realloc(ctl->leaves, alloc * sizeof(*leaf));
+		if (!leaf)
+			return -ENOMEM;
+		ctl->leaves = leaf;
+		ctl->alloc_leaves = alloc;
+	}
+
+	ret = btrfs_map_block(&root->fs_info->mapping_tree, READ, bytenr,
+			      &length, &multi, 0);
+	if (ret)
+		return ret;
+
+	leaf = ctl->leaves + ctl->nr_leaves++;
+	leaf->key = *key;
+	leaf->bytenr = bytenr;
+	leaf->generation = generation;
+	leaf->fd = multi->stripes[0].dev->fd;
+	leaf->physical = multi->stripes[0].physical;
+	kfree(multi);
+	return 0;
+}
+
+static int caching_collect_leaves(struct btrfs_root *root,
+				  struct btrfs_caching_ctl *ctl,
+				  struct extent_buffer *node)
+{
+	struct extent_buffer *child;
+	struct btrfs_key key;
+	u64 *bytenr;
+	u32 nritems = btrfs_header_nritems(node);
+	u32 blocksize;
+	int level = btrfs_header_level(node);
+	int ret = 0;
+	int i;
+
+	if (level == 1) {
+		for (i = 0; i < nritems; i++) {
+			btrfs_node_key_to_cpu(node, &key, i);
+			ret = caching_add_leaf(root, ctl, &key,
+					btrfs_node_blockptr(node, i),
+					btrfs_node_ptr_generation(node, i));
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	blocksize = btrfs_level_size(root, level - 1);
+	bytenr = malloc(nritems * sizeof(*bytenr));
+	if (bytenr) {
+		for (i = 0; i < nritems; i++)
+			bytenr[i] = btrfs_node_blockptr(node, i);
+		readahead_tree_blocks(root, bytenr, nritems, blocksize);
+		free(bytenr);
+	}
+
+	for (i = 0; i < nritems; i++) {
+		child = read_tree_block(root, btrfs_node_blockptr(node, i),
+					blocksize,
+					btrfs_node_ptr_generation(node, i));
+		if (!child)
+			return -EIO;
+		ret = caching_collect_leaves(root, ctl, child);
+		free_extent_buffer(child);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* index of the last leaf that can hold key */
+static int caching_find_leaf(struct btrfs_caching_ctl *ctl,
+			     struct btrfs_key *key)
+{
+	int low = 0;
+	int high = ctl->nr_leaves;
+	int mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (btrfs_comp_cpu_keys(&ctl->leaves[mid].key, key) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return max(low - 1, 0);
+}
+
+static int caching_add_groups(struct btrfs_fs_info *info,
+			      struct btrfs_caching_ctl *ctl)
+{
+	struct btrfs_block_group_cache *cache;
+	struct caching_group *g;
+	struct btrfs_key key;
+	int alloc = 0;
+	int last_leaf;
+
+	cache = btrfs_lookup_first_block_group(info, 0);
+	while (cache) {
+		if (cache->cached)
+			goto next;
+
+		if (ctl->nr_groups == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			g = realloc(ctl->groups, alloc * sizeof(*g));
+			if (!g)
+				return -ENOMEM;
+			ctl->groups = g;
+		}
+		g = ctl->groups + ctl->nr_groups++;
+		memset(g, 0, sizeof(*g));
+		g->cache = cache;
+		g->state = CACHING_QUEUED;
+
+		key.objectid = max_t(u64, cache->key.objectid,
+				     BTRFS_SUPER_INFO_OFFSET);
+		key.type = BTRFS_EXTENT_ITEM_KEY;
+		key.offset = 0;
+		g->first_leaf = caching_find_leaf(ctl, &key);
+
+		key.objectid = cache->key.objectid + cache->key.offset - 1;
+		key.type = (u8)-1;
+		key.offset = (u64)-1;
+		last_leaf = caching_find_leaf(ctl, &key);
+		g->nr_leaves = last_leaf - g->first_leaf + 1;
+next:
+		cache = btrfs_lookup_first_block_group(info,
+				cache->key.objectid + cache->key.offset);
+	}
+	return 0;
+}
+
+static void caching_free(struct btrfs_caching_ctl *ctl)
+{
+	int i;
+
+	for (i = 0; i < ctl->nr_groups; i++)
+		free(ctl->groups[i].ranges);
+	free(ctl->groups);
+	free(ctl->leaves);
+	free(ctl->threads);
+	kfree(ctl);
+}
+
+/*
+ * start caching every block group in the background with num_threads
+ * threads, or one per cpu if num_threads is 0.  This has to be called
+ * before anything changes the extent tree.
+ */
+int btrfs_start_caching(struct btrfs_fs_info *info, int num_threads)
+{
+	struct btrfs_root *root = info->extent_root;
+	struct btrfs_caching_ctl *ctl;
+	int ret;
+	int i;
+
+	if (info->caching || info->running_transaction || info->metadump ||
+	    btrfs_header_level(root->node) == 0)
+		return 0;
+
+	ctl = kzalloc(sizeof(*ctl), GFP_NOFS);
+	if (!ctl)
+		return -ENOMEM;
+	ctl->leafsize = root->leafsize;
+	ctl->csum_size = btrfs_super_csum_size(&info->super_copy);
+
+	ret = caching_collect_leaves(root, ctl, root->node);
+	if (ret)
+		goto fail;
+	ret = caching_add_groups(info, ctl);
+	if (ret)
+		goto fail;
+	if (!ctl->nr_groups) {
+		caching_free(ctl);
+		return 0;
+	}
+
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = max(min(num_threads, ctl->nr_groups), 1);
+	ctl->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!ctl->threads) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	pthread_mutex_init(&ctl->mutex, NULL);
+	pthread_cond_init(&ctl->cond, NULL);
+	for (i = 0; i < num_threads; i++) {
+		/* whatever no thread picks up is done by cache_block_group */
+		if (pthread_create(ctl->threads + i, NULL, caching_worker, ctl))
+			break;
+		ctl->num_threads++;
+	}
+	info->caching = ctl;
+	return 0;
+fail:
+	caching_free(ctl);
+	return ret;
+}
+
+/*
+ * tell the caching threads to stop after the groups they are working
+ * on and wait for them.  Groups that weren't cached yet go back to the
+ * normal scan.
+ */
+void btrfs_stop_caching(struct btrfs_fs_info *info)
+{
+	struct btrfs_caching_ctl *ctl = info->caching;
+	int i;
+
+	if (!ctl)
+		return;
+
+	pthread_mutex_lock(&ctl->mutex);
+	ctl->stop = 1;
+	pthread_mutex_unlock(&ctl->mutex);
+	for (i = 0; i < ctl->num_threads; i++)
+		pthread_join(ctl->threads[i], NULL);
+
+	pthread_mutex_destroy(&ctl->mutex);
+	pthread_cond_destroy(&ctl->cond);
+	caching_free(ctl);
+	info->caching = NULL;
+}
+
+static struct caching_group *
+caching_find_group(struct btrfs_caching_ctl *ctl,
+		   struct btrfs_block_group_cache *cache)
+{
+	struct caching_group *g;
+	int low = 0;
+	int high = ctl->nr_groups;
+	int mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		g = ctl->groups + mid;
+		if (g->cache->key.objectid < cache->key.objectid)
+			low = mid + 1;
+		else if (g->cache->key.objectid > cache->key.objectid)
+			high = mid;
+		else
+			return g;
+	}
+	return NULL;
+}
+
+/*
+ * fill in free space for block_group from the caching threads.
+ * Returns 0 if the group is cached now, anything else means the caller
+ * has to scan the tree itself.
+ */
+static int cache_block_group_parallel(struct btrfs_root *root,
+				      struct btrfs_block_group_cache *cache)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_caching_ctl *ctl = info->caching;
+	struct caching_group *g;
+	int ret = -EIO;
+
+	g = caching_find_group(ctl, cache);
+	if (!g)
+		return -ENOENT;
+
+	pthread_mutex_lock(&ctl->mutex);
+	if (g->state == CACHING_QUEUED) {
+		g->state = CACHING_RUNNING;
+		pthread_mutex_unlock(&ctl->mutex);
+		caching_run_group(ctl, g);
+		pthread_mutex_lock(&ctl->mutex);
+	}
+	while (g->state == CACHING_RUNNING)
+		pthread_cond_wait(&ctl->cond, &ctl->mutex);
+	pthread_mutex_unlock(&ctl->mutex);
+
+	if (g->state == CACHING_DONE) {
+		ret = set_extent_bits_ranges(&info->free_space_cache,
+					     g->ranges, g->nr_ranges,
+					     EXTENT_DIRTY, GFP_NOFS);
+		if (!ret) {
+			remove_sb_from_cache(root, cache);
+			cache->cached = 1;
+		}
+	}
+	free(g->ranges);
+	g->ranges = NULL;
+	g->nr_ranges = 0;
+	g->state = CACHING_FAILED;
+
+	if (++ctl->nr_finished == ctl->nr_groups)
+		btrfs_stop_caching(info);
+	return ret;
+}
+
 static int cache_block_group(struct btrfs_root *root,
 			     struct btrfs_block_group_cache *block_group)
 {
-	struct btrfs_path *path;
+	struct btrfs_cursor cursor;
 	int ret;
 	struct btrfs_key key;
-	struct extent_buffer *leaf;
+	struct btrfs_key max_key;
 	struct extent_io_tree *free_space_cache;
-	int slot;
 	u64 last;
 	u64 hole_size;
 
@@ -107,125 +646,388 @@ static int cache_block_group(struct btrfs_root *root,
 	if (block_group->cached)
 		return 0;
 
-	path = btrfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
+	if (root->fs_info->caching &&
+	    cache_block_group_parallel(root, block_group) == 0)
+		return 0;
 
-	path->reada = 2;
 	last = max_t(u64, block_group->key.objectid, BTRFS_SUPER_INFO_OFFSET);
 	key.objectid = last;
 	key.offset = 0;
 	btrfs_set_key_type(&key, BTRFS_EXTENT_ITEM_KEY);
-	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	max_key.objectid = block_group->key.objectid +
+			   block_group->key.offset - 1;
+	max_key.type = (u8)-1;
+	max_key.offset = (u64)-1;
+	btrfs_cursor_init(&cursor, root, &key, &max_key,
+			  BTRFS_EXTENT_ITEM_KEY, BTRFS_CURSOR_READA);
+
+	while ((ret = btrfs_cursor_next(&cursor, &key)) == 0) {
+		if (key.objectid > last) {
+			hole_size = key.objectid - last;
+			set_extent_dirty(free_space_cache, last,
+					 last + hole_size - 1,
+					 GFP_NOFS);
+		}
+		last = key.objectid + key.offset;
+	}
 	if (ret < 0)
 		goto err;
 
-	while(1) {
-		leaf = path->nodes[0];
-		slot = path->slots[0];
-		if (slot >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(root, path);
-			if (ret < 0)
-				goto err;
-			if (ret == 0) {
-				continue;
-			} else {
-				break;
-			}
-		}
-		btrfs_item_key_to_cpu(leaf, &key, slot);
-		if (key.objectid < block_group->key.objectid) {
-			goto next;
+	if (block_group->key.objectid +
+	    block_group->key.offset > last) {
+		hole_size = block_group->key.objectid +
+			block_group->key.offset - last;
+		set_extent_dirty(free_space_cache, last,
+				 last + hole_size - 1, GFP_NOFS);
+	}
+	remove_sb_from_cache(root, block_group);
+	block_group->cached = 1;
+err:
+	btrfs_cursor_release(&cursor);
+	return 0;
+}
+
+static const int block_group_type_bits[BTRFS_BLOCK_GROUP_TYPES] = {
+	BLOCK_GROUP_DATA, BLOCK_GROUP_METADATA, BLOCK_GROUP_SYSTEM,
+};
+
+/*
+ * index of the first group in index that ends at or after bytenr,
+ * index->nr if there is none
+ */
+static int block_group_index_search(struct btrfs_block_group_index *index,
+				    u64 bytenr)
+{
+	struct btrfs_block_group_cache *cache;
+	int low = 0;
+	int high = index->nr;
+	int mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		cache = index->groups[mid];
+		if (cache->key.objectid + cache->key.offset <= bytenr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static int block_group_index_insert(struct btrfs_block_group_index *index,
+				    struct btrfs_block_group_cache *cache)
+{
+	struct btrfs_block_group_cache **groups;
+	int alloc;
+	int slot;
+
+	if (index->nr == index->alloc) {
+		alloc = index->alloc ? index->alloc * 2 : 64;
+		groups = realloc(index->groups, alloc * sizeof(*groups));
+		if (!groups)
+			return -ENOMEM;
+		index->groups = groups;
+		index->alloc = alloc;
+	}
+
+	/* block groups are mostly added in order */
+	slot = index->nr;
+	if (slot && index->groups[slot - 1]->key.objectid >
+		    cache->key.objectid) {
+		slot = block_group_index_search(index, cache->key.objectid);
+		memmove(index->groups + slot + 1, index->groups + slot,
+			(index->nr - slot) * sizeof(*index->groups));
+	}
+	index->groups[slot] = cache;
+	index->nr++;
+	return 0;
+}
+
+/*
+ * add cache to the block group index under the BLOCK_GROUP_* bits it
+ * has in block_group_cache
+ */
+static int block_group_index_add(struct btrfs_fs_info *info,
+				 struct btrfs_block_group_cache *cache,
+				 int bits)
+{
+	int ret;
+	int i;
+
+	cache->index_bits = bits;
+	ret = block_group_index_insert(&info->block_groups, cache);
+	if (ret)
+		return ret;
+	for (i = 0; i < BTRFS_BLOCK_GROUP_TYPES; i++) {
+		if (!(bits & block_group_type_bits[i]))
+			continue;
+		ret = block_group_index_insert(info->block_group_types + i,
+					       cache);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void block_group_index_release(struct btrfs_fs_info *info)
+{
+	int i;
+
+	free(info->block_groups.groups);
+	memset(&info->block_groups, 0, sizeof(info->block_groups));
+	for (i = 0; i < BTRFS_BLOCK_GROUP_TYPES; i++) {
+		free(info->block_group_types[i].groups);
+		memset(info->block_group_types + i, 0,
+		       sizeof(info->block_group_types[i]));
+	}
+}
+
+/*
+ * the index to scan for groups with any of the type bits in bits set.
+ * Unless bits is a single type the caller has to check index_bits.
+ */
+static struct btrfs_block_group_index *
+block_group_index_for(struct btrfs_fs_info *info, int bits)
+{
+	int i;
+
+	for (i = 0; i < BTRFS_BLOCK_GROUP_TYPES; i++) {
+		if (bits == block_group_type_bits[i])
+			return info->block_group_types + i;
+	}
+	return &info->block_groups;
+}
+
+struct btrfs_block_group_cache *btrfs_lookup_first_block_group(struct
+						       btrfs_fs_info *info,
+						       u64 bytenr)
+{
+	struct btrfs_block_group_index *index = &info->block_groups;
+	int slot;
+
+	bytenr = max_t(u64, bytenr,
+		       BTRFS_SUPER_INFO_OFFSET + BTRFS_SUPER_INFO_SIZE);
+	slot = block_group_index_search(index, bytenr);
+	if (slot >= index->nr)
+		return NULL;
+	return index->groups[slot];
+}
+
+struct btrfs_block_group_cache *btrfs_lookup_block_group(struct
+							 btrfs_fs_info *info,
+							 u64 bytenr)
+{
+	struct btrfs_block_group_index *index = &info->block_groups;
+	struct btrfs_block_group_cache *block_group;
+	int slot;
+
+	slot = block_group_index_search(index, bytenr);
+	if (slot >= index->nr)
+		return NULL;
+
+	block_group = index->groups[slot];
+	if (block_group->key.objectid <= bytenr && bytenr <
+	    block_group->key.objectid + block_group->key.offset)
+		return block_group;
+	return NULL;
+}
+
+static int free_space_bucket(u64 size)
+{
+	int bucket;
+
+	if (size < 8192)
+		return 0;
+	bucket = 63 - __builtin_clzll(size) - 12;
+	return min(bucket, BTRFS_FREE_SPACE_BUCKETS - 1);
+}
+
+static void free_space_add(struct btrfs_block_group_cache *cache,
+			   u64 start, u64 size)
+{
+	struct cache_extent *pe;
+	int bucket = free_space_bucket(size);
+	int ret;
+
+	pe = alloc_cache_extent(start, size);
+	BUG_ON(!pe);
+	ret = insert_existing_cache_extent(&cache->free_space[bucket], pe);
+	BUG_ON(ret);
+	cache->free_space_buckets |= 1U << bucket;
+}
+
+static void free_space_del(struct btrfs_block_group_cache *cache,
+			   u64 start, u64 size)
+{
+	struct cache_extent *pe;
+	int bucket = free_space_bucket(size);
+
+	pe = find_cache_extent(&cache->free_space[bucket], start, 1);
+	BUG_ON(!pe || pe->start != start || pe->size != size);
+	remove_cache_extent(&cache->free_space[bucket], pe);
+	free_cache_extent(pe);
+	if (cache_tree_empty(&cache->free_space[bucket]))
+		cache->free_space_buckets &= ~(1U << bucket);
+}
+
+/*
+ * a free range can span block groups, every group gets the part of it
+ * that is inside the group.
+ */
+static void free_space_update(struct btrfs_fs_info *info, u64 start, u64 end,
+			      int add)
+{
+	struct btrfs_block_group_cache *cache;
+	u64 group_end;
+	u64 cur_start;
+	u64 cur_end;
+
+	cache = btrfs_lookup_first_block_group(info, start);
+	while (cache && cache->key.objectid <= end) {
+		group_end = cache->key.objectid + cache->key.offset - 1;
+		cur_start = max(start, cache->key.objectid);
+		cur_end = min(end, group_end);
+		if (cur_start <= cur_end) {
+			if (add)
+				free_space_add(cache, cur_start,
+					       cur_end + 1 - cur_start);
+			else
+				free_space_del(cache, cur_start,
+					       cur_end + 1 - cur_start);
 		}
-		if (key.objectid >= block_group->key.objectid +
-		    block_group->key.offset) {
+		if (group_end >= end)
 			break;
-		}
-
-		if (btrfs_key_type(&key) == BTRFS_EXTENT_ITEM_KEY) {
-			if (key.objectid > last) {
-				hole_size = key.objectid - last;
-				set_extent_dirty(free_space_cache, last,
-						 last + hole_size - 1,
-						 GFP_NOFS);
-			}
-			last = key.objectid + key.offset;
-		}
-next:
-		path->slots[0]++;
+		cache = btrfs_lookup_first_block_group(info, group_end + 1);
 	}
+}
 
-	if (block_group->key.objectid +
-	    block_group->key.offset > last) {
-		hole_size = block_group->key.objectid +
-			block_group->key.offset - last;
-		set_extent_dirty(free_space_cache, last,
-				 last + hole_size - 1, GFP_NOFS);
-	}
-	remove_sb_from_cache(root, block_group);
-	block_group->cached = 1;
-err:
-	btrfs_free_path(path);
-	return 0;
+static void free_space_link_state(struct extent_io_tree *tree,
+				  struct extent_state *state)
+{
+	struct btrfs_fs_info *info;
+
+	if (!(state->state & EXTENT_DIRTY))
+		return;
+	info = container_of(tree, struct btrfs_fs_info, free_space_cache);
+	free_space_update(info, state->start, state->end, 1);
 }
 
-struct btrfs_block_group_cache *btrfs_lookup_first_block_group(struct
-						       btrfs_fs_info *info,
-						       u64 bytenr)
+static void free_space_unlink_state(struct extent_io_tree *tree,
+				    struct extent_state *state)
 {
-	struct extent_io_tree *block_group_cache;
-	struct btrfs_block_group_cache *block_group = NULL;
-	u64 ptr;
+	struct btrfs_fs_info *info;
+
+	if (!(state->state & EXTENT_DIRTY))
+		return;
+	info = container_of(tree, struct btrfs_fs_info, free_space_cache);
+	free_space_update(info, state->start, state->end, 0);
+}
+
+/* keeps the per block group size index in sync with free_space_cache */
+struct extent_io_ops btrfs_free_space_ops = {
+	.link_state = free_space_link_state,
+	.unlink_state = free_space_unlink_state,
+};
+
+/*
+ * index the free space a new block group already has, anything that
+ * shows up later comes in through btrfs_free_space_ops
+ */
+static void free_space_index_init(struct btrfs_fs_info *info,
+				  struct btrfs_block_group_cache *cache)
+{
+	u64 group_end = cache->key.objectid + cache->key.offset - 1;
+	u64 last = cache->key.objectid;
 	u64 start;
 	u64 end;
+	int i;
 	int ret;
 
-	bytenr = max_t(u64, bytenr,
-		       BTRFS_SUPER_INFO_OFFSET + BTRFS_SUPER_INFO_SIZE);
-	block_group_cache = &info->block_group_cache;
-	ret = find_first_extent_bit(block_group_cache,
-				    bytenr, &start, &end,
-				    BLOCK_GROUP_DATA | BLOCK_GROUP_METADATA |
-				    BLOCK_GROUP_SYSTEM);
-	if (ret) {
-		return NULL;
+	for (i = 0; i < BTRFS_FREE_SPACE_BUCKETS; i++)
+		cache_tree_init(&cache->free_space[i]);
+	cache->free_space_buckets = 0;
+
+	while (last <= group_end) {
+		ret = find_first_extent_bit(&info->free_space_cache, last,
+					    &start, &end, EXTENT_DIRTY);
+		if (ret || start > group_end)
+			break;
+		start = max(start, cache->key.objectid);
+		free_space_add(cache, start, min(end, group_end) + 1 - start);
+		if (end >= group_end)
+			break;
+		last = end + 1;
 	}
-	ret = get_state_private(block_group_cache, start, &ptr);
-	if (ret)
-		return NULL;
+}
 
-	block_group = (struct btrfs_block_group_cache *)(unsigned long)ptr;
-	return block_group;
+static void free_space_index_release(struct btrfs_block_group_cache *cache)
+{
+	struct cache_extent *pe;
+	int i;
+
+	for (i = 0; i < BTRFS_FREE_SPACE_BUCKETS; i++) {
+		while ((pe = find_first_cache_extent(&cache->free_space[i],
+						     0))) {
+			remove_cache_extent(&cache->free_space[i], pe);
+			free_cache_extent(pe);
+		}
+	}
+	cache->free_space_buckets = 0;
 }
 
-struct btrfs_block_group_cache *btrfs_lookup_block_group(struct
-							 btrfs_fs_info *info,
-							 u64 bytenr)
+/*
+ * find the lowest offset at or after 'last' in the block group that has
+ * num free bytes behind it.  A free range that already covers 'last'
+ * comes from free_space_cache, everything that starts later from the
+ * size buckets.  In buckets that only hold ranges of num bytes or more
+ * the first range past 'last' is the answer, only the bucket num itself
+ * falls into has to be walked.
+ */
+static int free_space_search(struct btrfs_fs_info *info,
+			     struct btrfs_block_group_cache *cache,
+			     u64 last, u64 num, u64 *start_ret)
 {
-	struct extent_io_tree *block_group_cache;
-	struct btrfs_block_group_cache *block_group = NULL;
-	u64 ptr;
+	struct cache_extent *pe;
+	u64 group_end = cache->key.objectid + cache->key.offset - 1;
+	u64 best = (u64)-1;
 	u64 start;
 	u64 end;
+	u32 buckets;
+	int min_bucket = free_space_bucket(num);
+	int i;
 	int ret;
 
-	block_group_cache = &info->block_group_cache;
-	ret = find_first_extent_bit(block_group_cache,
-				    bytenr, &start, &end,
-				    BLOCK_GROUP_DATA | BLOCK_GROUP_METADATA |
-				    BLOCK_GROUP_SYSTEM);
-	if (ret) {
-		return NULL;
+	ret = find_first_extent_bit(&info->free_space_cache, last,
+				    &start, &end, EXTENT_DIRTY);
+	if (ret || start > group_end)
+		return -ENOSPC;
+	if (start <= last) {
+		if (min(end, group_end) - last + 1 >= num) {
+			*start_ret = last;
+			return 0;
+		}
+		last = end + 1;
 	}
-	ret = get_state_private(block_group_cache, start, &ptr);
-	if (ret)
-		return NULL;
 
-	block_group = (struct btrfs_block_group_cache *)(unsigned long)ptr;
-	if (block_group->key.objectid <= bytenr && bytenr <
-	    block_group->key.objectid + block_group->key.offset)
-		return block_group;
-	return NULL;
+	buckets = cache->free_space_buckets & ~((1U << min_bucket) - 1);
+	for (i = BTRFS_FREE_SPACE_BUCKETS - 1; i >= min_bucket; i--) {
+		if (!(buckets & (1U << i)))
+			continue;
+		pe = find_first_cache_extent(&cache->free_space[i], last);
+		if (pe && pe->start < last)
+			pe = next_cache_extent(pe);
+		while (pe && pe->start < best) {
+			if (pe->size >= num) {
+				best = pe->start;
+				break;
+			}
+			pe = next_cache_extent(pe);
+		}
+	}
+	if (best == (u64)-1)
+		return -ENOSPC;
+	*start_ret = best;
+	return 0;
 }
 
 static int block_group_bits(struct btrfs_block_group_cache *cache, u64 bits)
@@ -241,7 +1043,6 @@ static int noinline find_search_start(struct btrfs_root *root,
 	struct btrfs_block_group_cache *cache = *cache_ret;
 	u64 last;
 	u64 start = 0;
-	u64 end = 0;
 	u64 search_start = *start_ret;
 	int wrapped = 0;
 
@@ -258,24 +1059,11 @@ again:
 		goto new_group;
 	}
 
-	while(1) {
-		ret = find_first_extent_bit(&root->fs_info->free_space_cache,
-					    last, &start, &end, EXTENT_DIRTY);
-		if (ret) {
-			goto new_group;
-		}
-
-		start = max(last, start);
-		last = end + 1;
-		if (last - start < num) {
-			continue;
-		}
-		if (start + num > cache->key.objectid + cache->key.offset) {
-			goto new_group;
-		}
-		*start_ret = start;
-		return 0;
-	}
+	ret = free_space_search(root->fs_info, cache, last, num, &start);
+	if (ret)
+		goto new_group;
+	*start_ret = start;
+	return 0;
 out:
 	cache = btrfs_lookup_block_group(root->fs_info, search_start);
 	if (!cache) {
@@ -334,27 +1122,23 @@ struct btrfs_block_group_cache *btrfs_find_block_group(struct btrfs_root *root,
 						 int data, int owner)
 {
 	struct btrfs_block_group_cache *cache;
-	struct extent_io_tree *block_group_cache;
+	struct btrfs_block_group_index *index;
 	struct btrfs_block_group_cache *found_group = NULL;
 	struct btrfs_fs_info *info = root->fs_info;
 	u64 used;
 	u64 last = 0;
 	u64 hint_last;
-	u64 start;
-	u64 end;
 	u64 free_check;
-	u64 ptr;
 	int bit;
-	int ret;
+	int slot;
 	int full_search = 0;
 	int factor = 10;
 
-	block_group_cache = &info->block_group_cache;
-
 	if (!owner)
 		factor = 10;
 
 	bit = block_group_state_bits(data);
+	index = block_group_index_for(info, bit);
 
 	if (search_start) {
 		struct btrfs_block_group_cache *shint;
@@ -384,18 +1168,12 @@ struct btrfs_block_group_cache *btrfs_find_block_group(struct btrfs_root *root,
 		last = hint_last;
 	}
 again:
-	while(1) {
-		ret = find_first_extent_bit(block_group_cache, last,
-					    &start, &end, bit);
-		if (ret)
-			break;
-
-		ret = get_state_private(block_group_cache, start, &ptr);
-		if (ret)
-			break;
+	for (slot = block_group_index_search(index, last);
+	     slot < index->nr; slot++) {
+		cache = index->groups[slot];
+		if (!(cache->index_bits & bit))
+			continue;
 
-		cache = (struct btrfs_block_group_cache *)(unsigned long)ptr;
-		last = cache->key.objectid + cache->key.offset;
 		used = btrfs_block_group_used(&cache->item);
 
 		if (!cache->ro && block_group_bits(cache, data)) {
@@ -1034,7 +1812,8 @@ static int lookup_inline_extent_backref(struct btrfs_trans_handle *trans,
 		extra_size = btrfs_extent_inline_ref_size(want);
 	else
 		extra_size = -1;
-	ret = btrfs_search_slot(trans, root, &key, path, extra_size, 1);
+	/* the path may still hold the leaf of the previous lookup */
+	ret = btrfs_search_slot_finger(trans, root, &key, path, extra_size, 1);
 	if (ret < 0) {
 		err = ret;
 		goto out;
@@ -1042,7 +1821,6 @@ static int lookup_inline_extent_backref(struct btrfs_trans_handle *trans,
 	if (ret) {
 		printf("Failed to find [%llu, %u, %llu]\n", key.objectid, key.type, key.offset);
 		btrfs_print_leaf(root, path->nodes[0]);
-		btrfs_free_path(path);
 		return -ENOENT;
 	}
 
@@ -1373,28 +2151,30 @@ static int remove_extent_backref(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
-int btrfs_inc_extent_ref(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *root,
-			 u64 bytenr, u64 num_bytes, u64 parent,
-			 u64 root_objectid, u64 owner, u64 offset)
+/*
+ * the path is left holding the leaf of the extent item where possible, so
+ * the next update can start from there
+ */
+static int __btrfs_inc_extent_ref(struct btrfs_trans_handle *trans,
+				  struct btrfs_root *root,
+				  struct btrfs_path *path,
+				  u64 bytenr, u64 num_bytes, u64 parent,
+				  u64 root_objectid, u64 owner, u64 offset,
+				  int refs_to_add)
 {
-	struct btrfs_path *path;
 	struct extent_buffer *leaf;
 	struct btrfs_extent_item *item;
 	u64 refs;
 	int ret;
 	int err = 0;
 
-	path = btrfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
 	path->reada = 1;
 	path->leave_spinning = 1;
 
 	ret = insert_inline_extent_backref(trans, root->fs_info->extent_root,
 					   path, bytenr, num_bytes, parent,
-					   root_objectid, owner, offset, 1);
+					   root_objectid, owner, offset,
+					   refs_to_add);
 	if (ret == 0)
 		goto out;
 
@@ -1406,7 +2186,7 @@ int btrfs_inc_extent_ref(struct btrfs_trans_handle *trans,
 	leaf = path->nodes[0];
 	item = btrfs_item_ptr(leaf, path->slots[0], struct btrfs_extent_item);
 	refs = btrfs_extent_refs(leaf, item);
-	btrfs_set_extent_refs(leaf, item, refs + 1);
+	btrfs_set_extent_refs(leaf, item, refs + refs_to_add);
 
 	btrfs_mark_buffer_dirty(leaf);
 	btrfs_release_path(root->fs_info->extent_root, path);
@@ -1417,17 +2197,212 @@ int btrfs_inc_extent_ref(struct btrfs_trans_handle *trans,
 	/* now insert the actual backref */
 	ret = insert_extent_backref(trans, root->fs_info->extent_root,
 				    path, bytenr, parent, root_objectid,
-				    owner, offset, 1);
+				    owner, offset, refs_to_add);
 	if (ret)
 		err = ret;
 out:
-	btrfs_free_path(path);
 	finish_current_insert(trans, root->fs_info->extent_root);
 	del_pending_extents(trans, root->fs_info->extent_root);
 	BUG_ON(err);
 	return err;
 }
 
+static struct delayed_ref_head *find_delayed_ref_head(struct btrfs_fs_info *info,
+						     u64 bytenr)
+{
+	struct cache_extent *ce;
+
+	ce = find_cache_extent(&info->delayed_refs, bytenr, 1);
+	if (!ce)
+		return NULL;
+	BUG_ON(ce->start != bytenr);
+	return container_of(ce, struct delayed_ref_head, cache);
+}
+
+/*
+ * queue ref_mod references to the backref described by the arguments,
+ * merging it with a queued update of the same backref
+ */
+static int add_delayed_ref(struct btrfs_root *root, u64 bytenr,
+			   u64 num_bytes, u64 parent, u64 root_objectid,
+			   u64 owner, u64 offset, int ref_mod)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct delayed_ref_head *head;
+	struct delayed_ref *ref;
+	int ret;
+
+	head = find_delayed_ref_head(info, bytenr);
+	if (!head) {
+		head = kmalloc(sizeof(*head), GFP_NOFS);
+		if (!head)
+			return -ENOMEM;
+		head->cache.start = bytenr;
+		head->cache.size = num_bytes;
+		INIT_LIST_HEAD(&head->refs);
+		head->ref_mod = 0;
+		ret = insert_existing_cache_extent(&info->delayed_refs,
+						   &head->cache);
+		BUG_ON(ret);
+	}
+	BUG_ON(head->cache.size != num_bytes);
+	head->ref_mod += ref_mod;
+
+	list_for_each_entry(ref, &head->refs, list) {
+		if (ref->root == root && ref->parent == parent &&
+		    ref->root_objectid == root_objectid &&
+		    ref->owner == owner && ref->offset == offset)
+			goto found;
+	}
+
+	ref = kmalloc(sizeof(*ref), GFP_NOFS);
+	if (!ref)
+		return -ENOMEM;
+	ref->root = root;
+	ref->parent = parent;
+	ref->root_objectid = root_objectid;
+	ref->owner = owner;
+	ref->offset = offset;
+	ref->ref_mod = 0;
+	list_add_tail(&ref->list, &head->refs);
+found:
+	ref->ref_mod += ref_mod;
+	/* a tree block has at most one backref of each kind */
+	BUG_ON(owner < BTRFS_FIRST_FREE_OBJECTID &&
+	       (ref->ref_mod > 1 || ref->ref_mod < -1));
+	if (ref->ref_mod == 0) {
+		list_del(&ref->list);
+		kfree(ref);
+	}
+	if (list_empty(&head->refs)) {
+		remove_cache_extent(&info->delayed_refs, &head->cache);
+		kfree(head);
+	}
+	return 0;
+}
+
+int btrfs_inc_extent_ref(struct btrfs_trans_handle *trans,
+			 struct btrfs_root *root,
+			 u64 bytenr, u64 num_bytes, u64 parent,
+			 u64 root_objectid, u64 owner, u64 offset)
+{
+	struct btrfs_path *path;
+	int ret;
+
+	if (root == root->fs_info->extent_root) {
+		path = btrfs_alloc_path();
+		if (!path)
+			return -ENOMEM;
+		ret = __btrfs_inc_extent_ref(trans, root, path, bytenr,
+					     num_bytes, parent, root_objectid,
+					     owner, offset, 1);
+		btrfs_free_path(path);
+		return ret;
+	}
+	ret = add_delayed_ref(root, bytenr, num_bytes, parent,
+			      root_objectid, owner, offset, 1);
+	BUG_ON(ret);
+	return ret;
+}
+
+/*
+ * apply all the queued reference updates to the extent tree.  The adds
+ * for an extent go first so it never drops to zero references on the
+ * way.  Applying them changes other trees, which can queue more updates;
+ * those are run too before this returns.
+ *
+ * The heads are run in bytenr order with one path.  While the extent
+ * item of the next head is in the leaf the path still holds, its lookup
+ * is a bin_search in that leaf instead of a search from the root.
+ */
+int btrfs_run_delayed_refs(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_root *extent_root = info->extent_root;
+	struct btrfs_path *path;
+	struct delayed_ref_head *head;
+	struct delayed_ref *ref;
+	struct delayed_ref *tmp;
+	struct cache_extent *ce;
+	u64 bytenr;
+	u64 num_bytes;
+	int ret;
+	int err = 0;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	finish_current_insert(trans, extent_root);
+	while (1) {
+		ce = find_first_cache_extent(&info->delayed_refs, 0);
+		if (!ce)
+			break;
+		head = container_of(ce, struct delayed_ref_head, cache);
+		remove_cache_extent(&info->delayed_refs, ce);
+		bytenr = head->cache.start;
+		num_bytes = head->cache.size;
+
+		list_for_each_entry_safe(ref, tmp, &head->refs, list) {
+			if (ref->ref_mod < 0)
+				continue;
+			ret = __btrfs_inc_extent_ref(trans, ref->root, path,
+						     bytenr, num_bytes,
+						     ref->parent,
+						     ref->root_objectid,
+						     ref->owner, ref->offset,
+						     ref->ref_mod);
+			if (ret)
+				err = ret;
+			list_del(&ref->list);
+			kfree(ref);
+		}
+		list_for_each_entry_safe(ref, tmp, &head->refs, list) {
+			ret = __free_extent(trans, ref->root, path, bytenr,
+					    num_bytes, ref->parent,
+					    ref->root_objectid, ref->owner,
+					    ref->offset, -ref->ref_mod);
+			if (ret)
+				err = ret;
+			list_del(&ref->list);
+			kfree(ref);
+		}
+		kfree(head);
+
+		ret = del_pending_extents(trans, extent_root);
+		if (ret)
+			err = ret;
+	}
+	btrfs_free_path(path);
+	return err;
+}
+
+/*
+ * drop the updates of a transaction that is never committed
+ */
+void btrfs_free_delayed_refs(struct btrfs_fs_info *info)
+{
+	struct delayed_ref_head *head;
+	struct delayed_ref *ref;
+	struct cache_extent *ce;
+
+	while (1) {
+		ce = find_first_cache_extent(&info->delayed_refs, 0);
+		if (!ce)
+			break;
+		head = container_of(ce, struct delayed_ref_head, cache);
+		remove_cache_extent(&info->delayed_refs, ce);
+		while (!list_empty(&head->refs)) {
+			ref = list_entry(head->refs.next, struct delayed_ref,
+					 list);
+			list_del(&ref->list);
+			kfree(ref);
+		}
+		kfree(head);
+	}
+}
+
 int btrfs_extent_post_op(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *root)
 {
@@ -1445,6 +2420,7 @@ int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
 	struct btrfs_key key;
 	struct extent_buffer *l;
 	struct btrfs_extent_item *item;
+	struct delayed_ref_head *head;
 	u32 item_size;
 	u64 num_refs;
 	u64 extent_flags;
@@ -1488,6 +2464,9 @@ int btrfs_lookup_extent_info(struct btrfs_trans_handle *trans,
 		}
 		BUG_ON(num_refs == 0);
 	item = btrfs_item_ptr(l, path->slots[0], struct btrfs_extent_item);
+	head = find_delayed_ref_head(root->fs_info, bytenr);
+	if (head)
+		num_refs += head->ref_mod;
 	if (refs)
 		*refs = num_refs;
 	if (flags)
@@ -1884,6 +2863,9 @@ static int update_pinned_extents(struct btrfs_root *root,
 	if (pin) {
 		set_extent_dirty(&fs_info->pinned_extents,
 				bytenr, bytenr + num - 1, GFP_NOFS);
+		/* pinned space comes back as free space at commit */
+		clear_extent_dirty(&fs_info->free_space_cache,
+				   bytenr, bytenr + num - 1, GFP_NOFS);
 	} else {
 		clear_extent_dirty(&fs_info->pinned_extents,
 				bytenr, bytenr + num - 1, GFP_NOFS);
@@ -2034,17 +3016,17 @@ pinit:
 }
 
 /*
- * remove an extent from the root, returns 0 on success
+ * remove an extent from the root, returns 0 on success.  Like
+ * __btrfs_inc_extent_ref, the path may be left holding a leaf.
  */
 static int __free_extent(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *root,
+			 struct btrfs_root *root, struct btrfs_path *path,
 			 u64 bytenr, u64 num_bytes, u64 parent,
 			 u64 root_objectid, u64 owner_objectid,
 			 u64 owner_offset, int refs_to_drop)
 {
 
 	struct btrfs_key key;
-	struct btrfs_path *path;
 	struct btrfs_extent_ops *ops = root->fs_info->extent_ops;
 	struct btrfs_root *extent_root = root->fs_info->extent_root;
 	struct extent_buffer *leaf;
@@ -2058,10 +3040,6 @@ static int __free_extent(struct btrfs_trans_handle *trans,
 	u32 item_size;
 	u64 refs;
 
-	path = btrfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
 	path->reada = 1;
 	path->leave_spinning = 1;
 
@@ -2225,7 +3203,6 @@ static int __free_extent(struct btrfs_trans_handle *trans,
 		ret = btrfs_del_items(trans, extent_root, path, path->slots[0],
 				      num_to_del);
 		BUG_ON(ret);
-		btrfs_release_path(extent_root, path);
 
 		if (is_data) {
 			ret = btrfs_del_csums(trans, root, bytenr, num_bytes);
@@ -2236,7 +3213,6 @@ static int __free_extent(struct btrfs_trans_handle *trans,
 					 mark_free);
 		BUG_ON(ret);
 	}
-	btrfs_free_path(path);
 	finish_current_insert(trans, extent_root);
 	return ret;
 }
@@ -2256,10 +3232,15 @@ static int del_pending_extents(struct btrfs_trans_handle *trans, struct
 	struct extent_io_tree *pending_del;
 	struct extent_io_tree *extent_ins;
 	struct pending_extent_op *extent_op;
+	struct btrfs_path *path;
 
 	extent_ins = &extent_root->fs_info->extent_ins;
 	pending_del = &extent_root->fs_info->pending_del;
 
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
 	while(1) {
 		ret = find_first_extent_bit(pending_del, 0, &start, &end,
 					    EXTENT_LOCKED);
@@ -2275,7 +3256,7 @@ static int del_pending_extents(struct btrfs_trans_handle *trans, struct
 
 		if (!test_range_bit(extent_ins, start, end,
 				    EXTENT_LOCKED, 0)) {
-			ret = __free_extent(trans, extent_root,
+			ret = __free_extent(trans, extent_root, path,
 					    start, end + 1 - start, 0,
 					    extent_root->root_key.objectid,
 					    extent_op->level, 0, 1);
@@ -2298,6 +3279,7 @@ static int del_pending_extents(struct btrfs_trans_handle *trans, struct
 		if (ret)
 			err = ret;
 	}
+	btrfs_free_path(path);
 	return err;
 }
 
@@ -2311,7 +3293,6 @@ int btrfs_free_extent(struct btrfs_trans_handle *trans,
 		      u64 root_objectid, u64 owner, u64 offset)
 {
 	struct btrfs_root *extent_root = root->fs_info->extent_root;
-	int pending_ret;
 	int ret;
 
 	WARN_ON(num_bytes < root->sectorsize);
@@ -2333,10 +3314,10 @@ int btrfs_free_extent(struct btrfs_trans_handle *trans,
 				  bytenr, (unsigned long)extent_op);
 		return 0;
 	}
-	ret = __free_extent(trans, root, bytenr, num_bytes, parent,
-			    root_objectid, owner, offset, 1);
-	pending_ret = del_pending_extents(trans, root->fs_info->extent_root);
-	return ret ? ret : pending_ret;
+	ret = add_delayed_ref(root, bytenr, num_bytes, parent,
+			      root_objectid, owner, offset, -1);
+	BUG_ON(ret);
+	return ret;
 }
 
 static u64 stripe_align(struct btrfs_root *root, u64 val)
@@ -2975,17 +3956,23 @@ int btrfs_free_block_groups(struct btrfs_fs_info *info)
 	u64 end;
 	u64 ptr;
 	int ret;
+
+	btrfs_stop_caching(info);
 	while(1) {
 		ret = find_first_extent_bit(&info->block_group_cache, 0,
 					    &start, &end, (unsigned int)-1);
 		if (ret)
 			break;
 		ret = get_state_private(&info->block_group_cache, start, &ptr);
-		if (!ret)
+		if (!ret) {
+			free_space_index_release((struct btrfs_block_group_cache *)
+						 (unsigned long)ptr);
 			kfree((void *)(unsigned long)ptr);
+		}
 		clear_extent_bits(&info->block_group_cache, start,
 				  end, (unsigned int)-1, GFP_NOFS);
 	}
+	block_group_index_release(info);
 	while(1) {
 		ret = find_first_extent_bit(&info->free_space_cache, 0,
 					    &start, &end, EXTENT_DIRTY);
@@ -3104,6 +4091,9 @@ int btrfs_read_block_groups(struct btrfs_root *root)
 				bit | EXTENT_LOCKED, GFP_NOFS);
 		set_state_private(block_group_cache, found_key.objectid,
 				  (unsigned long)cache);
+		ret = block_group_index_add(info, cache, bit);
+		BUG_ON(ret);
+		free_space_index_init(info, cache);
 	}
 	ret = 0;
 error:
@@ -3147,6 +4137,9 @@ int btrfs_make_block_group(struct btrfs_trans_handle *trans,
 
 	set_state_private(block_group_cache, chunk_offset,
 			  (unsigned long)cache);
+	ret = block_group_index_add(root->fs_info, cache, bit);
+	BUG_ON(ret);
+	free_space_index_init(root->fs_info, cache);
 	ret = btrfs_insert_item(trans, extent_root, &cache->key, &cache->item,
 				sizeof(cache->item));
 	BUG_ON(ret);
@@ -3240,6 +4233,9 @@ int btrfs_make_block_groups(struct btrfs_trans_handle *trans,
 				bit | EXTENT_LOCKED, GFP_NOFS);
 		set_state_private(block_group_cache, cur_start,
 				  (unsigned long)cache);
+		ret = block_group_index_add(root->fs_info, cache, bit);
+		BUG_ON(ret);
+		free_space_index_init(root->fs_info, cache);
 		cur_start += group_size;
 	}
 	/* then insert all the items */
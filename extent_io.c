@@ -36,6 +36,7 @@ void extent_io_tree_init(struct extent_io_tree *tree)
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
 	tree->cache_size = 0;
+	tree->ops = NULL;
 }
 
 static struct extent_state *alloc_extent_state(void)
@@ -91,6 +92,20 @@ static inline void update_extent_state(struct extent_state *state)
 	state->cache_node.size = state->end + 1 - state->start;
 }
 
+static inline void link_state(struct extent_io_tree *tree,
+			      struct extent_state *state)
+{
+	if (tree->ops)
+		tree->ops->link_state(tree, state);
+}
+
+static inline void unlink_state(struct extent_io_tree *tree,
+				struct extent_state *state)
+{
+	if (tree->ops)
+		tree->ops->unlink_state(tree, state);
+}
+
 /*
  * Utility function to look for merge candidates inside a given range.
  * Any extents with matching state are merged together into a single
@@ -112,10 +127,13 @@ static int merge_state(struct extent_io_tree *tree,
 				     cache_node);
 		if (other->end == state->start - 1 &&
 		    other->state == state->state) {
+			unlink_state(tree, other);
+			unlink_state(tree, state);
 			state->start = other->start;
 			update_extent_state(state);
 			remove_cache_extent(&tree->state, &other->cache_node);
 			free_extent_state(other);
+			link_state(tree, state);
 		}
 	}
 	other_node = next_cache_extent(&state->cache_node);
@@ -124,10 +142,13 @@ static int merge_state(struct extent_io_tree *tree,
 				     cache_node);
 		if (other->start == state->end + 1 &&
 		    other->state == state->state) {
+			unlink_state(tree, state);
+			unlink_state(tree, other);
 			other->start = state->start;
 			update_extent_state(other);
 			remove_cache_extent(&tree->state, &state->cache_node);
 			free_extent_state(state);
+			link_state(tree, other);
 		}
 	}
 	return 0;
@@ -150,6 +171,7 @@ static int insert_state(struct extent_io_tree *tree,
 	update_extent_state(state);
 	ret = insert_existing_cache_extent(&tree->state, &state->cache_node);
 	BUG_ON(ret);
+	link_state(tree, state);
 	merge_state(tree, state);
 	return 0;
 }
@@ -163,6 +185,8 @@ static int split_state(struct extent_io_tree *tree, struct extent_state *orig,
 		       struct extent_state *prealloc, u64 split)
 {
 	int ret;
+
+	unlink_state(tree, orig);
 	prealloc->start = orig->start;
 	prealloc->end = split - 1;
 	prealloc->state = orig->state;
@@ -172,6 +196,8 @@ static int split_state(struct extent_io_tree *tree, struct extent_state *orig,
 	ret = insert_existing_cache_extent(&tree->state,
 					   &prealloc->cache_node);
 	BUG_ON(ret);
+	link_state(tree, prealloc);
+	link_state(tree, orig);
 	return 0;
 }
 
@@ -183,11 +209,13 @@ static int clear_state_bit(struct extent_io_tree *tree,
 {
 	int ret = state->state & bits;
 
+	unlink_state(tree, state);
 	state->state &= ~bits;
 	if (state->state == 0) {
 		remove_cache_extent(&tree->state, &state->cache_node);
 		free_extent_state(state);
 	} else {
+		link_state(tree, state);
 		merge_state(tree, state);
 	}
 	return ret;
@@ -286,6 +314,14 @@ search_again:
 	goto again;
 }
 
+static void set_state_bits(struct extent_io_tree *tree,
+			   struct extent_state *state, int bits)
+{
+	unlink_state(tree, state);
+	state->state |= bits;
+	link_state(tree, state);
+}
+
 /*
  * set some bits on a range in the tree.
  */
@@ -326,7 +362,7 @@ again:
 	 * Just lock what we found and keep going
 	 */
 	if (state->start == start && state->end <= end) {
-		state->state |= bits;
+		set_state_bits(tree, state, bits);
 		merge_state(tree, state);
 		if (last_end == (u64)-1)
 			goto out;
@@ -356,7 +392,7 @@ again:
 		if (err)
 			goto out;
 		if (state->end <= end) {
-			state->state |= bits;
+			set_state_bits(tree, state, bits);
 			start = state->end + 1;
 			merge_state(tree, state);
 			if (last_end == (u64)-1)
@@ -398,7 +434,7 @@ again:
 	err = split_state(tree, state, prealloc, end + 1);
 	BUG_ON(err == -EEXIST);
 
-	state->state |= bits;
+	set_state_bits(tree, state, bits);
 	merge_state(tree, prealloc);
 	prealloc = NULL;
 out:
@@ -417,6 +453,57 @@ int set_extent_dirty(struct extent_io_tree *tree, u64 start, u64 end,
 	return set_extent_bits(tree, start, end, EXTENT_DIRTY, mask);
 }
 
+/*
+ * set bits on an array of sorted, non-overlapping ranges.  Ranges that
+ * touch each other are joined first, and a range that neither overlaps
+ * nor touches an existing state gets a single new state linked straight
+ * into the tree.  Everything else goes through set_extent_bits.
+ */
+int set_extent_bits_ranges(struct extent_io_tree *tree,
+			   struct extent_range *ranges, int nr,
+			   int bits, gfp_t mask)
+{
+	struct extent_state *state;
+	struct cache_extent *node;
+	u64 start;
+	u64 end;
+	int ret;
+	int i = 0;
+
+	while (i < nr) {
+		start = ranges[i].start;
+		end = ranges[i].end;
+		for (i++; i < nr; i++) {
+			BUG_ON(ranges[i].start <= end);
+			if (ranges[i].start != end + 1)
+				break;
+			end = ranges[i].end;
+		}
+
+		node = find_first_cache_extent(&tree->state,
+					       start ? start - 1 : 0);
+		if (node && (end == (u64)-1 || node->start <= end + 1)) {
+			ret = set_extent_bits(tree, start, end, bits, mask);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		state = alloc_extent_state();
+		if (!state)
+			return -ENOMEM;
+		state->state = bits;
+		state->start = start;
+		state->end = end;
+		update_extent_state(state);
+		ret = insert_existing_cache_extent(&tree->state,
+						   &state->cache_node);
+		BUG_ON(ret);
+		link_state(tree, state);
+	}
+	return 0;
+}
+
 int clear_extent_dirty(struct extent_io_tree *tree, u64 start, u64 end,
 		       gfp_t mask)
 {
@@ -34,11 +34,27 @@
 #define EXTENT_CSUM (1 << 9)
 #define EXTENT_IOBITS (EXTENT_LOCKED | EXTENT_WRITEBACK)
 
+struct extent_io_tree;
+struct extent_state;
+
+/*
+ * optional hooks for trees that keep their own index of the states.
+ * link_state is called once a state is in the tree with its final range
+ * and bits, unlink_state right before they change or the state goes.
+ */
+struct extent_io_ops {
+	void (*link_state)(struct extent_io_tree *tree,
+			   struct extent_state *state);
+	void (*unlink_state)(struct extent_io_tree *tree,
+			     struct extent_state *state);
+};
+
 struct extent_io_tree {
 	struct cache_tree state;
 	struct cache_tree cache;
 	struct list_head lru;
 	u64 cache_size;
+	struct extent_io_ops *ops;
 };
 
 struct extent_state {
@@ -50,6 +66,11 @@ struct extent_state {
 	u64 private;
 };
 
+struct extent_range {
+	u64 start;
+	u64 end;
+};
+
 struct extent_buffer {
 	struct cache_extent cache_node;
 	u64 start;
@@ -74,6 +95,9 @@ int set_extent_bits(struct extent_io_tree *tree, u64 start,
 		    u64 end, int bits, gfp_t mask);
 int clear_extent_bits(struct extent_io_tree *tree, u64 start,
 		      u64 end, int bits, gfp_t mask);
+int set_extent_bits_ranges(struct extent_io_tree *tree,
+			   struct extent_range *ranges, int nr,
+			   int bits, gfp_t mask);
 int find_first_extent_bit(struct extent_io_tree *tree, u64 start,
 			  u64 *start_ret, u64 *end_ret, int bits);
 int test_range_bit(struct extent_io_tree *tree, u64 start, u64 end,
@@ -122,6 +122,57 @@ fail:
 	return err;
 }
 
+/*
+ * batch versions of btrfs_insert_file_extent and
+ * btrfs_insert_inline_extent, the items end up in the tree with
+ * btrfs_item_batch_load
+ */
+int btrfs_batch_insert_file_extent(struct btrfs_item_batch *batch,
+				   u64 objectid, u64 pos, u64 offset,
+				   u64 disk_num_bytes, u64 num_bytes)
+{
+	struct btrfs_file_extent_item *item;
+	struct btrfs_key file_key;
+
+	file_key.objectid = objectid;
+	file_key.offset = pos;
+	btrfs_set_key_type(&file_key, BTRFS_EXTENT_DATA_KEY);
+
+	item = btrfs_item_batch_add(batch, &file_key, sizeof(*item));
+	if (!item)
+		return -ENOMEM;
+	item->generation = cpu_to_le64(batch->transid);
+	item->type = BTRFS_FILE_EXTENT_REG;
+	item->disk_bytenr = cpu_to_le64(offset);
+	item->disk_num_bytes = cpu_to_le64(disk_num_bytes);
+	item->num_bytes = cpu_to_le64(num_bytes);
+	item->ram_bytes = cpu_to_le64(num_bytes);
+	return 0;
+}
+
+int btrfs_batch_insert_inline_extent(struct btrfs_item_batch *batch,
+				     u64 objectid, u64 offset,
+				     char *buffer, size_t size)
+{
+	struct btrfs_file_extent_item *item;
+	struct btrfs_key key;
+
+	key.objectid = objectid;
+	key.offset = offset;
+	btrfs_set_key_type(&key, BTRFS_EXTENT_DATA_KEY);
+
+	item = btrfs_item_batch_add(batch, &key,
+			btrfs_file_extent_calc_inline_size(size));
+	if (!item)
+		return -ENOMEM;
+	item->generation = cpu_to_le64(batch->transid);
+	item->type = BTRFS_FILE_EXTENT_INLINE;
+	item->ram_bytes = cpu_to_le64(size);
+	memcpy((char *)item + offsetof(struct btrfs_file_extent_item,
+				       disk_bytenr), buffer, size);
+	return 0;
+}
+
 struct btrfs_csum_item *btrfs_lookup_csum(struct btrfs_trans_handle *trans,
 					  struct btrfs_root *root,
 					  struct btrfs_path *path,
@@ -189,9 +240,9 @@ int btrfs_lookup_file_extent(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root, u64 alloc_end,
-			  u64 bytenr, char *data, size_t len)
+static int btrfs_csum_file_sum(struct btrfs_trans_handle *trans,
+			       struct btrfs_root *root, u64 alloc_end,
+			       u64 bytenr, char *csum)
 {
 	int ret = 0;
 	struct btrfs_key file_key;
@@ -202,7 +253,6 @@ int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 	struct btrfs_csum_item *item;
 	struct extent_buffer *leaf = NULL;
 	u64 csum_offset;
-	u32 csum_result = ~(u32)0;
 	u32 nritems;
 	u32 ins_size;
 	u16 csum_size =
@@ -317,18 +367,175 @@ csum:
 	item = (struct btrfs_csum_item *)((unsigned char *)item +
 					  csum_offset * csum_size);
 found:
+	write_extent_buffer(leaf, csum, (unsigned long)item, csum_size);
+	btrfs_mark_buffer_dirty(path->nodes[0]);
+fail:
+	btrfs_release_path(root, path);
+	btrfs_free_path(path);
+	return ret;
+}
+
+int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, u64 alloc_end,
+			  u64 bytenr, char *data, size_t len)
+{
+	u32 csum_result = ~(u32)0;
+
 	csum_result = btrfs_csum_data(root, data, csum_result, len);
 	btrfs_csum_final(csum_result, (char *)&csum_result);
 	if (csum_result == 0) {
 		printk("csum result is 0 for block %llu\n",
 		       (unsigned long long)bytenr);
 	}
+	return btrfs_csum_file_sum(trans, root, alloc_end, bytenr,
+				   (char *)&csum_result);
+}
 
-	write_extent_buffer(leaf, &csum_result, (unsigned long)item,
-			    csum_size);
-	btrfs_mark_buffer_dirty(path->nodes[0]);
-fail:
-	btrfs_release_path(root, path);
+/*
+ * returns the start of the csum item following the slot the path points
+ * to, or (u64)-1 if there is none.  When the path is past the end of
+ * its leaf the key comes from the nodes above, which avoids walking
+ * into the next leaf.
+ */
+static u64 csum_next_offset(struct btrfs_path *path)
+{
+	struct btrfs_key key;
+	int level;
+
+	if (path->slots[0] < btrfs_header_nritems(path->nodes[0])) {
+		btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+		goto found;
+	}
+	for (level = 1; level < BTRFS_MAX_LEVEL; level++) {
+		if (!path->nodes[level])
+			break;
+		if (path->slots[level] + 1 <
+		    btrfs_header_nritems(path->nodes[level])) {
+			btrfs_node_key_to_cpu(path->nodes[level], &key,
+					      path->slots[level] + 1);
+			goto found;
+		}
+	}
+	return (u64)-1;
+found:
+	if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+	    key.type != BTRFS_EXTENT_CSUM_KEY)
+		return (u64)-1;
+	return key.offset;
+}
+
+/*
+ * insert the precomputed checksums of the contiguous range
+ * [bytenr, bytenr + num_bytes), csums holds one entry per sector.
+ *
+ * Items already covering part of the range are overwritten, an item
+ * ending right at the range is grown and everything else goes into new
+ * items of up to MAX_CSUM_ITEMS.  That is one search per item, and so
+ * roughly per leaf, instead of one per sector.  The path is kept between
+ * items, so the next search usually starts in the same leaf.
+ */
+int btrfs_csum_file_blocks(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, u64 bytenr,
+			   u64 num_bytes, char *csums)
+{
+	struct btrfs_path *path;
+	struct btrfs_key key;
+	struct btrfs_key found_key;
+	struct extent_buffer *leaf;
+	unsigned long ptr;
+	u32 sectorsize = root->sectorsize;
+	u16 csum_size =
+		btrfs_super_csum_size(&root->fs_info->super_copy);
+	u64 max_items = MAX_CSUM_ITEMS(root, csum_size);
+	u64 nr = num_bytes / sectorsize;
+	u64 item_start;
+	u64 item_nr;
+	u64 count;
+	u64 next;
+	int slot;
+	int ret = 0;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+
+	while (nr > 0) {
+		key.offset = bytenr;
+		ret = btrfs_search_slot_finger(trans, root, &key, path, 0, 1);
+		if (ret < 0)
+			goto out;
+		leaf = path->nodes[0];
+		slot = path->slots[0];
+		if (ret > 0)
+			slot--;
+
+		item_start = 0;
+		item_nr = 0;
+		if (slot >= 0) {
+			btrfs_item_key_to_cpu(leaf, &found_key, slot);
+			if (found_key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+			    found_key.type == BTRFS_EXTENT_CSUM_KEY) {
+				item_start = found_key.offset;
+				item_nr = btrfs_item_size_nr(leaf, slot) /
+					  csum_size;
+			}
+		}
+
+		if (item_nr && bytenr < item_start + item_nr * sectorsize) {
+			/* overwrite what is already there */
+			count = item_nr - (bytenr - item_start) / sectorsize;
+			count = min(count, nr);
+			ptr = btrfs_item_ptr_offset(leaf, slot) +
+			      (bytenr - item_start) / sectorsize * csum_size;
+			goto write;
+		}
+
+		next = csum_next_offset(path);
+		if (item_nr && bytenr == item_start + item_nr * sectorsize &&
+		    item_nr < max_items) {
+			/* grow the item ending at bytenr */
+			count = min(nr, max_items - item_nr);
+			count = min_t(u64, count,
+				      btrfs_leaf_free_space(root, leaf) /
+				      csum_size);
+			if (next != (u64)-1)
+				count = min(count, (next - bytenr) / sectorsize);
+			if (count > 0) {
+				path->slots[0] = slot;
+				ret = btrfs_extend_item(trans, root, path,
+							count * csum_size);
+				BUG_ON(ret);
+				leaf = path->nodes[0];
+				ptr = btrfs_item_ptr_offset(leaf, slot) +
+				      item_nr * csum_size;
+				goto write;
+			}
+		}
+
+		count = min(nr, max_items);
+		if (next != (u64)-1)
+			count = min(count, (next - bytenr) / sectorsize);
+		BUG_ON(count == 0);
+		btrfs_release_path(root, path);
+		ret = btrfs_insert_empty_item(trans, root, path, &key,
+					      count * csum_size);
+		if (ret)
+			goto out;
+		leaf = path->nodes[0];
+		ptr = btrfs_item_ptr_offset(leaf, path->slots[0]);
+write:
+		write_extent_buffer(leaf, csums, ptr, count * csum_size);
+		btrfs_mark_buffer_dirty(leaf);
+
+		bytenr += count * sectorsize;
+		csums += count * csum_size;
+		nr -= count;
+	}
+	ret = 0;
+out:
 	btrfs_free_path(path);
 	return ret;
 }
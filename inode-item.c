@@ -216,3 +216,45 @@ int btrfs_insert_inode(struct btrfs_trans_handle *trans, struct btrfs_root
 				sizeof(*inode_item));
 	return ret;
 }
+
+/*
+ * batch versions of btrfs_insert_inode_ref and btrfs_insert_inode, the
+ * items end up in the tree with btrfs_item_batch_load
+ */
+int btrfs_batch_insert_inode_ref(struct btrfs_item_batch *batch,
+				 const char *name, int name_len,
+				 u64 inode_objectid, u64 ref_objectid,
+				 u64 index)
+{
+	struct btrfs_inode_ref *ref;
+	struct btrfs_key key;
+
+	key.objectid = inode_objectid;
+	key.offset = ref_objectid;
+	btrfs_set_key_type(&key, BTRFS_INODE_REF_KEY);
+
+	ref = btrfs_item_batch_add(batch, &key, sizeof(*ref) + name_len);
+	if (!ref)
+		return -ENOMEM;
+	ref->index = cpu_to_le64(index);
+	ref->name_len = cpu_to_le16(name_len);
+	memcpy(ref + 1, name, name_len);
+	return 0;
+}
+
+int btrfs_batch_insert_inode(struct btrfs_item_batch *batch, u64 objectid,
+			     struct btrfs_inode_item *inode_item)
+{
+	struct btrfs_key key;
+	void *ptr;
+
+	key.objectid = objectid;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+
+	ptr = btrfs_item_batch_add(batch, &key, sizeof(*inode_item));
+	if (!ptr)
+		return -ENOMEM;
+	memcpy(ptr, inode_item, sizeof(*inode_item));
+	return 0;
+}
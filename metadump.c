@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600
+#define __USE_XOPEN2K
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "kerncompat.h"
+#include "crc32c.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "metadump.h"
+
+struct metadump_entry {
+	u64 bytenr;
+	u64 offset;
+	u32 size;
+	u32 bufsize;
+};
+
+struct metadump_image {
+	int fd;
+	int compress;
+	u64 generation;
+	u64 base_generation;
+	u64 nritems;
+	struct metadump_entry *entries;
+
+	/* the last buffer we decompressed */
+	struct metadump_entry *cached;
+	u8 *buffer;
+	u8 *inbuf;
+};
+
+void metadump_csum_block(u8 *buf, size_t len)
+{
+	char result[BTRFS_CRC32_SIZE];
+	u32 crc = ~(u32)0;
+	crc = crc32c(crc, buf + BTRFS_CSUM_SIZE, len - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(crc, result);
+	memcpy(buf, result, BTRFS_CRC32_SIZE);
+}
+
+/*
+ * turn the super block of the dumped filesystem into one that maps the
+ * whole logical address space 1:1 onto a single device
+ */
+void metadump_update_super(u8 *buffer)
+{
+	struct btrfs_super_block *super = (struct btrfs_super_block *)buffer;
+	struct btrfs_chunk *chunk;
+	struct btrfs_disk_key *key;
+	u32 sectorsize = btrfs_super_sectorsize(super);
+	u64 flags = btrfs_super_flags(super);
+
+	flags |= BTRFS_SUPER_FLAG_METADUMP;
+	btrfs_set_super_flags(super, flags);
+
+	key = (struct btrfs_disk_key *)(super->sys_chunk_array);
+	chunk = (struct btrfs_chunk *)(super->sys_chunk_array +
+				       sizeof(struct btrfs_disk_key));
+
+	btrfs_set_disk_key_objectid(key, BTRFS_FIRST_CHUNK_TREE_OBJECTID);
+	btrfs_set_disk_key_type(key, BTRFS_CHUNK_ITEM_KEY);
+	btrfs_set_disk_key_offset(key, 0);
+
+	btrfs_set_stack_chunk_length(chunk, (u64)-1);
+	btrfs_set_stack_chunk_owner(chunk, BTRFS_EXTENT_TREE_OBJECTID);
+	btrfs_set_stack_chunk_stripe_len(chunk, 64 * 1024);
+	btrfs_set_stack_chunk_type(chunk, BTRFS_BLOCK_GROUP_SYSTEM);
+	btrfs_set_stack_chunk_io_align(chunk, sectorsize);
+	btrfs_set_stack_chunk_io_width(chunk, sectorsize);
+	btrfs_set_stack_chunk_sector_size(chunk, sectorsize);
+	btrfs_set_stack_chunk_num_stripes(chunk, 1);
+	btrfs_set_stack_chunk_sub_stripes(chunk, 0);
+	chunk->stripe.devid = super->dev_item.devid;
+	chunk->stripe.offset = cpu_to_le64(0);
+	memcpy(chunk->stripe.dev_uuid, super->dev_item.uuid, BTRFS_UUID_SIZE);
+	btrfs_set_super_sys_array_size(super, sizeof(*key) + sizeof(*chunk));
+	metadump_csum_block(buffer, 4096);
+}
+
+/*
+ * find the index footer at the end of the image, returns the offset of
+ * the index header or 0 if the image has no index
+ */
+static u64 find_index(int fd)
+{
+	struct meta_cluster_header header;
+	struct meta_index_footer footer;
+	struct stat st;
+	int ret;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size < 2 * BLOCK_SIZE)
+		return 0;
+
+	ret = pread64(fd, &header, sizeof(header), 0);
+	if (ret != sizeof(header) ||
+	    le64_to_cpu(header.magic) != HEADER_MAGIC)
+		return 0;
+
+	ret = pread64(fd, &footer, sizeof(footer), st.st_size - BLOCK_SIZE);
+	if (ret != sizeof(footer) ||
+	    le64_to_cpu(footer.magic) != INDEX_MAGIC)
+		return 0;
+	return le64_to_cpu(footer.index_bytenr);
+}
+
+/*
+ * returns 1 if fd is a metadump image, whether it is indexed or not
+ */
+int metadump_probe(int fd)
+{
+	struct meta_cluster_header header;
+	int ret;
+
+	ret = pread64(fd, &header, sizeof(header), 0);
+	if (ret != sizeof(header))
+		return 0;
+	return le64_to_cpu(header.magic) == HEADER_MAGIC;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct metadump_entry *ea = a;
+	const struct metadump_entry *eb = b;
+
+	if (ea->bytenr < eb->bytenr)
+		return -1;
+	if (ea->bytenr > eb->bytenr)
+		return 1;
+	return 0;
+}
+
+struct metadump_image *metadump_open(int fd)
+{
+	struct metadump_image *image;
+	struct meta_index_header header;
+	struct meta_index_item *items;
+	struct stat st;
+	u64 index_bytenr;
+	u64 max_items;
+	size_t size;
+	u64 i;
+	int ret;
+
+	index_bytenr = find_index(fd);
+	if (!index_bytenr || fstat(fd, &st))
+		return NULL;
+
+	ret = pread64(fd, &header, sizeof(header), index_bytenr);
+	if (ret != sizeof(header) ||
+	    le64_to_cpu(header.magic) != INDEX_MAGIC ||
+	    le64_to_cpu(header.bytenr) != index_bytenr) {
+		fprintf(stderr, "bad index in metadump image\n");
+		return NULL;
+	}
+
+	/* nritems is on disk, the items have to fit in the file */
+	max_items = 0;
+	if (st.st_size > index_bytenr + sizeof(header))
+		max_items = (st.st_size - index_bytenr - sizeof(header)) /
+			    sizeof(*items);
+	if (le64_to_cpu(header.nritems) > max_items) {
+		fprintf(stderr, "bad index in metadump image\n");
+		return NULL;
+	}
+
+	image = calloc(1, sizeof(*image));
+	if (!image)
+		return NULL;
+
+	image->compress = header.compress;
+	image->generation = le64_to_cpu(header.generation);
+	image->base_generation = le64_to_cpu(header.base_generation);
+	image->nritems = le64_to_cpu(header.nritems);
+	image->entries = calloc(image->nritems, sizeof(*image->entries));
+	size = image->nritems * sizeof(*items);
+	items = malloc(size);
+	image->buffer = malloc(MAX_PENDING_SIZE);
+	image->inbuf = malloc(compressBound(MAX_PENDING_SIZE));
+	if (!image->entries || !items || !image->buffer || !image->inbuf)
+		goto fail;
+
+	ret = pread64(fd, items, size, index_bytenr + sizeof(header));
+	if (ret != size) {
+		fprintf(stderr, "short read on metadump index\n");
+		goto fail;
+	}
+	for (i = 0; i < image->nritems; i++) {
+		image->entries[i].bytenr = le64_to_cpu(items[i].bytenr);
+		image->entries[i].offset = le64_to_cpu(items[i].offset);
+		image->entries[i].size = le32_to_cpu(items[i].size);
+		image->entries[i].bufsize = le32_to_cpu(items[i].bufsize);
+		if (image->entries[i].size > MAX_PENDING_SIZE ||
+		    image->entries[i].bufsize >
+		    compressBound(MAX_PENDING_SIZE)) {
+			fprintf(stderr, "bad index item in metadump image\n");
+			goto fail;
+		}
+	}
+	free(items);
+	qsort(image->entries, image->nritems, sizeof(*image->entries),
+	      entry_cmp);
+
+	image->fd = dup(fd);
+	if (image->fd < 0)
+		goto fail_free;
+	return image;
+fail:
+	free(items);
+fail_free:
+	free(image->entries);
+	free(image->buffer);
+	free(image->inbuf);
+	free(image);
+	return NULL;
+}
+
+void metadump_close(struct metadump_image *image)
+{
+	if (!image)
+		return;
+	close(image->fd);
+	free(image->entries);
+	free(image->buffer);
+	free(image->inbuf);
+	free(image);
+}
+
+static struct metadump_entry *lookup_entry(struct metadump_image *image,
+					   u64 bytenr)
+{
+	struct metadump_entry *entry;
+	u64 low = 0;
+	u64 high = image->nritems;
+	u64 mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		entry = image->entries + mid;
+		if (bytenr < entry->bytenr)
+			high = mid;
+		else if (bytenr >= entry->bytenr + entry->size)
+			low = mid + 1;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+static int load_entry(struct metadump_image *image,
+		      struct metadump_entry *entry)
+{
+	unsigned long size;
+	int ret;
+
+	if (image->cached == entry)
+		return 0;
+
+	image->cached = NULL;
+	ret = pread64(image->fd, image->inbuf, entry->bufsize, entry->offset);
+	if (ret != entry->bufsize)
+		return -EIO;
+
+	if (image->compress == COMPRESS_ZLIB) {
+		size = MAX_PENDING_SIZE;
+		ret = uncompress(image->buffer, &size, image->inbuf,
+				 entry->bufsize);
+		if (ret != Z_OK || size != entry->size)
+			return -EIO;
+	} else {
+		if (entry->bufsize != entry->size)
+			return -EIO;
+		memcpy(image->buffer, image->inbuf, entry->size);
+	}
+	image->cached = entry;
+	return 0;
+}
+
+u64 metadump_generation(struct metadump_image *image)
+{
+	return image->generation;
+}
+
+u64 metadump_base_generation(struct metadump_image *image)
+{
+	return image->base_generation;
+}
+
+/*
+ * returns 1 if the whole range was dumped into the image
+ */
+int metadump_has_range(struct metadump_image *image, u64 bytenr, u64 len)
+{
+	struct metadump_entry *entry;
+
+	entry = lookup_entry(image, bytenr);
+	return entry && bytenr + len <= entry->bytenr + entry->size;
+}
+
+/*
+ * copy len bytes at logical address bytenr out of the image.  The range
+ * has to be inside a single dumped buffer, which is always true for tree
+ * blocks and the super block.
+ */
+int metadump_read(struct metadump_image *image, u64 bytenr, void *buf,
+		  u32 len)
+{
+	struct metadump_entry *entry;
+	int ret;
+
+	entry = lookup_entry(image, bytenr);
+	if (!entry || bytenr + len > entry->bytenr + entry->size)
+		return -ENOENT;
+
+	ret = load_entry(image, entry);
+	if (ret)
+		return ret;
+
+	memcpy(buf, image->buffer + (bytenr - entry->bytenr), len);
+	return 0;
+}
+
+int metadump_read_super(struct metadump_image *image,
+			struct btrfs_super_block *sb)
+{
+	u8 buffer[BTRFS_SUPER_INFO_SIZE];
+	int ret;
+
+	ret = metadump_read(image, BTRFS_SUPER_INFO_OFFSET, buffer,
+			    BTRFS_SUPER_INFO_SIZE);
+	if (ret)
+		return ret;
+
+	metadump_update_super(buffer);
+	memcpy(sb, buffer, sizeof(*sb));
+	if (strncmp((char *)(&sb->magic), BTRFS_MAGIC, sizeof(sb->magic)))
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * images without an index can only be read front to back.  Walk the
+ * clusters until we find the super block, it is the first buffer of
+ * every dump so this normally stops in the first cluster.
+ */
+int metadump_scan_super(int fd, struct btrfs_super_block *sb)
+{
+	struct meta_cluster *cluster;
+	struct meta_cluster_item *item;
+	u8 *inbuf = NULL;
+	u8 buffer[BTRFS_SUPER_INFO_SIZE];
+	unsigned long size;
+	u64 bytenr = 0;
+	u64 offset;
+	u32 nritems;
+	u32 len;
+	u32 i;
+	int ret = -ENOENT;
+
+	cluster = malloc(BLOCK_SIZE);
+	if (!cluster)
+		return -ENOMEM;
+
+	while (ret == -ENOENT) {
+		if (pread64(fd, cluster, BLOCK_SIZE, bytenr) != BLOCK_SIZE ||
+		    le64_to_cpu(cluster->header.magic) != HEADER_MAGIC ||
+		    le64_to_cpu(cluster->header.bytenr) != bytenr)
+			break;
+
+		offset = bytenr + BLOCK_SIZE;
+		nritems = le32_to_cpu(cluster->header.nritems);
+		if (nritems > ITEMS_PER_CLUSTER)
+			break;
+		for (i = 0; i < nritems; i++) {
+			item = &cluster->items[i];
+			len = le32_to_cpu(item->size);
+			if (le64_to_cpu(item->bytenr) !=
+			    BTRFS_SUPER_INFO_OFFSET) {
+				offset += len;
+				continue;
+			}
+
+			ret = -EIO;
+			if (len > compressBound(BTRFS_SUPER_INFO_SIZE))
+				break;
+			inbuf = malloc(len);
+			if (!inbuf || pread64(fd, inbuf, len, offset) != len)
+				break;
+			size = BTRFS_SUPER_INFO_SIZE;
+			if (cluster->header.compress == COMPRESS_ZLIB) {
+				ret = uncompress(buffer, &size, inbuf, len);
+				if (ret != Z_OK ||
+				    size != BTRFS_SUPER_INFO_SIZE) {
+					ret = -EIO;
+					break;
+				}
+			} else if (len == BTRFS_SUPER_INFO_SIZE) {
+				memcpy(buffer, inbuf, len);
+			} else {
+				break;
+			}
+
+			metadump_update_super(buffer);
+			memcpy(sb, buffer, sizeof(*sb));
+			ret = 0;
+			if (strncmp((char *)(&sb->magic), BTRFS_MAGIC,
+				    sizeof(sb->magic)))
+				ret = -EINVAL;
+			break;
+		}
+		bytenr = (offset + BLOCK_MASK) & ~(u64)BLOCK_MASK;
+	}
+	free(inbuf);
+	free(cluster);
+	return ret;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __METADUMP__
+#define __METADUMP__
+#include "kerncompat.h"
+
+#define HEADER_MAGIC		0xbd5c25e27295668bULL
+#define INDEX_MAGIC		0xbd5c25e27295668cULL
+#define MAX_PENDING_SIZE	(256 * 1024)
+#define BLOCK_SIZE		1024
+#define BLOCK_MASK		(BLOCK_SIZE - 1)
+
+#define COMPRESS_NONE		0
+#define COMPRESS_ZLIB		1
+
+struct meta_cluster_item {
+	__le64 bytenr;
+	__le32 size;
+} __attribute__ ((__packed__));
+
+struct meta_cluster_header {
+	__le64 magic;
+	__le64 bytenr;
+	__le32 nritems;
+	u8 compress;
+} __attribute__ ((__packed__));
+
+/* cluster header + index items + buffers */
+struct meta_cluster {
+	struct meta_cluster_header header;
+	struct meta_cluster_item items[];
+} __attribute__ ((__packed__));
+
+#define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
+			   sizeof(struct meta_cluster_item))
+
+/*
+ * the optional index is written after the last cluster.  It starts on a
+ * block boundary with a header that uses INDEX_MAGIC, so sequential
+ * readers know where the clusters end, followed by one item for every
+ * buffer in the image.  The last block of the image is a footer that
+ * points back to the index header.
+ *
+ * Delta images only hold the tree blocks that are newer than
+ * base_generation and always have an index.  base_generation is zero
+ * for full images.
+ */
+struct meta_index_item {
+	__le64 bytenr;
+	__le64 offset;
+	__le32 size;
+	__le32 bufsize;
+} __attribute__ ((__packed__));
+
+struct meta_index_header {
+	__le64 magic;
+	__le64 bytenr;
+	__le64 nritems;
+	__le64 generation;
+	__le64 base_generation;
+	u8 compress;
+} __attribute__ ((__packed__));
+
+struct meta_index_footer {
+	__le64 magic;
+	__le64 index_bytenr;
+} __attribute__ ((__packed__));
+
+struct btrfs_super_block;
+struct metadump_image;
+
+void metadump_csum_block(u8 *buf, size_t len);
+void metadump_update_super(u8 *buffer);
+
+int metadump_probe(int fd);
+struct metadump_image *metadump_open(int fd);
+void metadump_close(struct metadump_image *image);
+int metadump_read(struct metadump_image *image, u64 bytenr, void *buf,
+		  u32 len);
+int metadump_read_super(struct metadump_image *image,
+			struct btrfs_super_block *sb);
+int metadump_scan_super(int fd, struct btrfs_super_block *sb);
+u64 metadump_generation(struct metadump_image *image);
+u64 metadump_base_generation(struct metadump_image *image);
+int metadump_has_range(struct metadump_image *image, u64 bytenr, u64 len);
+#endif
@@ -37,7 +37,12 @@
 #include <linux/fs.h>
 #include <ctype.h>
 #include <attr/xattr.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
 #include "kerncompat.h"
+#include "crc32c.h"
 #include "ctree.h"
 #include "disk-io.h"
 #include "volumes.h"
@@ -310,6 +315,8 @@ static void print_usage(void)
 	fprintf(stderr, "\t -n --nodesize size of btree nodes\n");
 	fprintf(stderr, "\t -s --sectorsize min block allocation\n");
 	fprintf(stderr, "\t -r --rootdir the source directory\n");
+	fprintf(stderr, "\t -D --dedup share extents of identical files in the source directory\n");
+	fprintf(stderr, "\t -c --compress compress the source directory, zlib or lzo\n");
 	fprintf(stderr, "%s\n", BTRFS_BUILD_VERSION);
 	exit(1);
 }
@@ -320,6 +327,17 @@ static void print_version(void)
 	exit(0);
 }
 
+static int parse_compress(char *s)
+{
+	if (strcmp(s, "zlib") == 0)
+		return BTRFS_COMPRESS_ZLIB;
+	if (strcmp(s, "lzo") == 0)
+		return BTRFS_COMPRESS_LZO;
+	fprintf(stderr, "Unknown compression %s\n", s);
+	print_usage();
+	return 0;
+}
+
 static u64 parse_profile(char *s)
 {
 	if (strcmp(s, "raid0") == 0) {
@@ -368,10 +386,12 @@ static struct option long_options[] = {
 	{ "data", 1, NULL, 'd' },
 	{ "version", 0, NULL, 'V' },
 	{ "rootdir", 1, NULL, 'r' },
+	{ "dedup", 0, NULL, 'D' },
+	{ "compress", 1, NULL, 'c' },
 	{ 0, 0, 0, 0}
 };
 
-static int add_directory_items(struct btrfs_trans_handle *trans,
+static int add_directory_items(struct btrfs_item_batch *batch,
 			       struct btrfs_root *root, u64 objectid,
 			       ino_t parent_inum, const char *name,
 			       struct stat *st, int *dir_index_cnt)
@@ -394,9 +414,9 @@ static int add_directory_items(struct btrfs_trans_handle *trans,
 	if (S_ISLNK(st->st_mode))
 		filetype = BTRFS_FT_SYMLINK;
 
-	ret = btrfs_insert_dir_item(trans, root, name, name_len,
-				    parent_inum, &location,
-				    filetype, index_cnt);
+	ret = btrfs_batch_insert_dir_item(batch, name, name_len,
+					  parent_inum, &location,
+					  filetype, index_cnt);
 
 	*dir_index_cnt = index_cnt;
 	index_cnt++;
@@ -408,9 +428,6 @@ static int fill_inode_item(struct btrfs_trans_handle *trans,
 			   struct btrfs_root *root,
 			   struct btrfs_inode_item *dst, struct stat *src)
 {
-	u64 blocks = 0;
-	u64 sectorsize = root->sectorsize;
-
 	/*
 	 * btrfs_inode_item has some reserved fields
 	 * and represents on-disk inode entry, so
@@ -443,15 +460,9 @@ static int fill_inode_item(struct btrfs_trans_handle *trans,
 	}
 	if (S_ISREG(src->st_mode)) {
 		btrfs_set_stack_inode_size(dst, (u64)src->st_size);
+		/* regular extents add up nbytes as they are recorded */
 		if (src->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root))
 			btrfs_set_stack_inode_nbytes(dst, src->st_size);
-		else {
-			blocks = src->st_size / sectorsize;
-			if (src->st_size % sectorsize)
-				blocks += 1;
-			blocks *= sectorsize;
-			btrfs_set_stack_inode_nbytes(dst, blocks);
-		}
 	}
 	if (S_ISLNK(src->st_mode))
 		btrfs_set_stack_inode_nbytes(dst, src->st_size + 1);
@@ -499,14 +510,18 @@ static u64 calculate_dir_inode_size(char *dirname)
 	return dir_inode_size;
 }
 
+/*
+ * fill in the inode item and add the inode ref.  The inode item itself
+ * is inserted by the caller once the file data has been recorded.
+ */
 static int add_inode_items(struct btrfs_trans_handle *trans,
 			   struct btrfs_root *root,
+			   struct btrfs_item_batch *batch,
 			   struct stat *st, char *name,
 			   u64 self_objectid, ino_t parent_inum,
 			   int dir_index_cnt, struct btrfs_inode_item *inode_ret)
 {
 	int ret;
-	struct btrfs_key inode_key;
 	struct btrfs_inode_item btrfs_inode;
 	u64 objectid;
 	u64 inode_size = 0;
@@ -521,16 +536,9 @@ static int add_inode_items(struct btrfs_trans_handle *trans,
 		btrfs_set_stack_inode_size(&btrfs_inode, inode_size);
 	}
 
-	inode_key.objectid = objectid;
-	inode_key.offset = 0;
-	btrfs_set_key_type(&inode_key, BTRFS_INODE_ITEM_KEY);
-
-	ret = btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
-	if (ret)
-		goto fail;
-
-	ret = btrfs_insert_inode_ref(trans, root, name, name_len,
-				     objectid, parent_inum, dir_index_cnt);
+	ret = btrfs_batch_insert_inode_ref(batch, name, name_len,
+					   objectid, parent_inum,
+					   dir_index_cnt);
 	if (ret)
 		goto fail;
 
@@ -539,8 +547,113 @@ fail:
 	return ret;
 }
 
-static int add_xattr_item(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root, u64 objectid,
+/*
+ * inodes with more than one link are remembered by (st_dev, st_ino).
+ * Every further name only adds a dir item and an inode ref, and the
+ * inode item is inserted after the walk with the number of links that
+ * were actually found below the source directory.
+ */
+struct hardlink_entry {
+	struct rb_node node;
+	dev_t dev;
+	ino_t ino;
+	u64 objectid;
+	u32 nlink;
+	struct btrfs_inode_item inode;
+};
+
+static int comp_hardlink(struct hardlink_entry *entry, dev_t dev, ino_t ino)
+{
+	if (entry->dev > dev)
+		return 1;
+	if (entry->dev < dev)
+		return -1;
+	if (entry->ino > ino)
+		return 1;
+	if (entry->ino < ino)
+		return -1;
+	return 0;
+}
+
+static struct hardlink_entry *lookup_hardlink(struct rb_root *root,
+					      struct stat *st)
+{
+	struct rb_node *n = root->rb_node;
+	struct hardlink_entry *entry;
+	int comp;
+
+	while (n) {
+		entry = rb_entry(n, struct hardlink_entry, node);
+		comp = comp_hardlink(entry, st->st_dev, st->st_ino);
+		if (comp < 0)
+			n = n->rb_left;
+		else if (comp > 0)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+static int add_hardlink(struct rb_root *root, struct stat *st, u64 objectid,
+			struct btrfs_inode_item *inode)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct hardlink_entry *entry;
+	int comp;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct hardlink_entry, node);
+		comp = comp_hardlink(entry, st->st_dev, st->st_ino);
+		if (comp < 0)
+			p = &(*p)->rb_left;
+		else if (comp > 0)
+			p = &(*p)->rb_right;
+		else
+			return -EEXIST;
+	}
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return -ENOMEM;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->objectid = objectid;
+	entry->nlink = 1;
+	entry->inode = *inode;
+	rb_link_node(&entry->node, parent, p);
+	rb_insert_color(&entry->node, root);
+	return 0;
+}
+
+/*
+ * insert the inode items of all hardlinked inodes and free the tree,
+ * with a NULL batch the entries are only freed
+ */
+static int flush_hardlinks(struct btrfs_item_batch *batch,
+			   struct rb_root *root)
+{
+	struct rb_node *n;
+	struct hardlink_entry *entry;
+	int ret = 0;
+
+	while ((n = rb_first(root))) {
+		entry = rb_entry(n, struct hardlink_entry, node);
+		rb_erase(n, root);
+		if (batch && !ret) {
+			btrfs_set_stack_inode_nlink(&entry->inode,
+						    entry->nlink);
+			ret = btrfs_batch_insert_inode(batch, entry->objectid,
+						       &entry->inode);
+		}
+		free(entry);
+	}
+	return ret;
+}
+
+static int add_xattr_item(struct btrfs_item_batch *batch, u64 objectid,
 			  const char *file_name)
 {
 	int ret;
@@ -576,9 +689,9 @@ static int add_xattr_item(struct btrfs_trans_handle *trans,
 			return ret;
 		}
 
-		ret = btrfs_insert_xattr_item(trans, root, cur_name,
-					      cur_name_len, cur_value,
-					      ret, objectid);
+		ret = btrfs_batch_insert_xattr_item(batch, cur_name,
+						    cur_name_len, cur_value,
+						    ret, objectid);
 		if (ret) {
 			fprintf(stderr, "insert a xattr item failed for %s\n",
 				file_name);
@@ -644,53 +757,52 @@ static int custom_alloc_extent(struct btrfs_root *root, u64 num_bytes,
 		return 0;
 	}
 fail:
-	fprintf(stderr, "not enough free space\n");
 	return -ENOSPC;
 }
 
-static int record_file_extent(struct btrfs_trans_handle *trans,
+static struct btrfs_file_extent_item *
+add_file_extent(struct btrfs_item_batch *batch, u64 objectid, u64 file_pos,
+		u64 disk_bytenr, u64 num_bytes)
+{
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key key;
+
+	key.objectid = objectid;
+	key.offset = file_pos;
+	btrfs_set_key_type(&key, BTRFS_EXTENT_DATA_KEY);
+
+	fi = btrfs_item_batch_add(batch, &key, sizeof(*fi));
+	if (!fi)
+		return NULL;
+	btrfs_set_stack_file_extent_generation(fi, batch->transid);
+	btrfs_set_stack_file_extent_type(fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_disk_bytenr(fi, disk_bytenr);
+	/* holes have no disk extent, like the kernel writes them */
+	btrfs_set_stack_file_extent_disk_num_bytes(fi,
+					disk_bytenr ? num_bytes : 0);
+	btrfs_set_stack_file_extent_num_bytes(fi, num_bytes);
+	btrfs_set_stack_file_extent_ram_bytes(fi, num_bytes);
+	return fi;
+}
+
+/* insert the extent item of a data extent and add a ref for file_pos */
+static int insert_data_extent(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
-			      struct btrfs_inode_item *inode,
 			      u64 file_pos, u64 disk_bytenr,
-			      u64 num_bytes)
+			      u64 disk_num_bytes)
 {
 	int ret;
 	struct btrfs_fs_info *info = root->fs_info;
 	struct btrfs_root *extent_root = info->extent_root;
 	struct extent_buffer *leaf;
-	struct btrfs_file_extent_item *fi;
 	struct btrfs_key ins_key;
 	struct btrfs_path path;
 	struct btrfs_extent_item *ei;
 
 	btrfs_init_path(&path);
 
-	ins_key.objectid = objectid;
-	ins_key.offset = 0;
-	btrfs_set_key_type(&ins_key, BTRFS_EXTENT_DATA_KEY);
-	ret = btrfs_insert_empty_item(trans, root, &path, &ins_key,
-				      sizeof(*fi));
-	if (ret)
-		goto fail;
-	leaf = path.nodes[0];
-	fi = btrfs_item_ptr(leaf, path.slots[0],
-			    struct btrfs_file_extent_item);
-	btrfs_set_file_extent_generation(leaf, fi, trans->transid);
-	btrfs_set_file_extent_type(leaf, fi, BTRFS_FILE_EXTENT_REG);
-	btrfs_set_file_extent_disk_bytenr(leaf, fi, disk_bytenr);
-	btrfs_set_file_extent_disk_num_bytes(leaf, fi, num_bytes);
-	btrfs_set_file_extent_offset(leaf, fi, 0);
-	btrfs_set_file_extent_num_bytes(leaf, fi, num_bytes);
-	btrfs_set_file_extent_ram_bytes(leaf, fi, num_bytes);
-	btrfs_set_file_extent_compression(leaf, fi, 0);
-	btrfs_set_file_extent_encryption(leaf, fi, 0);
-	btrfs_set_file_extent_other_encoding(leaf, fi, 0);
-	btrfs_mark_buffer_dirty(leaf);
-
-	btrfs_release_path(root, &path);
-
 	ins_key.objectid = disk_bytenr;
-	ins_key.offset = num_bytes;
+	ins_key.offset = disk_num_bytes;
 	ins_key.type = BTRFS_EXTENT_ITEM_KEY;
 
 	ret = btrfs_insert_empty_item(trans, extent_root, &path,
@@ -706,23 +818,56 @@ static int record_file_extent(struct btrfs_trans_handle *trans,
 
 		btrfs_mark_buffer_dirty(leaf);
 		ret = btrfs_update_block_group(trans, root, disk_bytenr,
-					       num_bytes, 1, 0);
+					       disk_num_bytes, 1, 0);
 		if (ret)
 			goto fail;
 	} else if (ret != -EEXIST) {
 		goto fail;
 	}
 
-	ret = btrfs_inc_extent_ref(trans, root, disk_bytenr, num_bytes, 0,
-				   root->root_key.objectid,
-				   objectid, 0);
+	ret = btrfs_inc_extent_ref(trans, root, disk_bytenr, disk_num_bytes,
+				   0, root->root_key.objectid,
+				   objectid, file_pos);
 fail:
 	btrfs_release_path(root, &path);
 	return ret;
 }
 
-static int add_symbolic_link(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root,
+/*
+ * record a regular file extent, or a hole when disk_bytenr is zero.
+ * The file extent item is returned in fi_ret if that isn't NULL.
+ */
+static int record_file_extent(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root,
+			      struct btrfs_item_batch *batch, u64 objectid,
+			      struct btrfs_inode_item *inode,
+			      u64 file_pos, u64 disk_bytenr,
+			      u64 num_bytes,
+			      struct btrfs_file_extent_item **fi_ret)
+{
+	struct btrfs_file_extent_item *fi;
+	int ret;
+
+	fi = add_file_extent(batch, objectid, file_pos, disk_bytenr,
+			     num_bytes);
+	if (!fi)
+		return -ENOMEM;
+	if (fi_ret)
+		*fi_ret = fi;
+	if (!disk_bytenr)
+		return 0;
+
+	ret = insert_data_extent(trans, root, objectid, file_pos,
+				 disk_bytenr, num_bytes);
+	if (ret)
+		return ret;
+	btrfs_set_stack_inode_nbytes(inode, num_bytes +
+				     btrfs_stack_inode_nbytes(inode));
+	return 0;
+}
+
+static int add_symbolic_link(struct btrfs_root *root,
+			     struct btrfs_item_batch *batch,
 			     u64 objectid, const char *path_name)
 {
 	int ret;
@@ -741,28 +886,804 @@ static int add_symbolic_link(struct btrfs_trans_handle *trans,
 	}
 
 	buf[ret] = '\0'; /* readlink does not do it for us */
-	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-					 buf, ret + 1);
+	ret = btrfs_batch_insert_inline_extent(batch, objectid, 0,
+					       buf, ret + 1);
 fail:
 	free(buf);
 	return ret;
 }
 
+/*
+ * file data for --rootdir is copied by a pool of reader threads.  The
+ * transaction thread allocates extents of up to COPY_MAX_EXTENT for
+ * each file, cuts them into segments and queues them.  The readers
+ * copy each segment in large chunks and checksum every sector.  Only
+ * the transaction thread touches the trees, it inserts the checksums
+ * of finished segments.
+ */
+#define COPY_READ_SIZE		(1024 * 1024)
+#define COPY_SEGMENT_SIZE	(16 * 1024 * 1024)
+#define COPY_MAX_EXTENT		(128 * 1024 * 1024)
+#define COPY_MAX_THREADS	8
+#define COPY_MAX_PENDING	128
+
+/*
+ * with --compress every 128KB of a file is a separate extent.  The
+ * readers compress it and write whatever is smaller, the unused end of
+ * the extent goes back to the free space cache when the transaction
+ * thread records the extent.
+ */
+#define COPY_COMPRESS_SIZE	(128 * 1024)
+
+#define LZO_LEN 4
+#define PAGE_CACHE_SIZE 4096
+#define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
+
+struct copy_segment {
+	struct list_head list;
+	char *path_name;
+	int fd;
+	int error;
+	u64 file_pos;
+	u64 disk_bytenr;
+	u64 num_bytes;
+	char *csums;
+
+	/* set for compressed extents, recorded once they are written */
+	struct btrfs_file_extent_item *fi;
+	u64 objectid;
+	u64 disk_num_bytes;
+	int compress;
+};
+
+/* per reader buffers */
+struct copy_work {
+	char *buf;
+	char *cbuf;
+	char *lzo_buf;
+	void *lzo_mem;
+};
+
+struct copy_ctl {
+	struct btrfs_root *root;
+	int out_fd;
+	u16 csum_size;
+	int compress;
+	int dedup;
+	struct rb_root dedup_files;
+	int num_threads;
+	int pending;
+	int stop;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct list_head todo;
+	struct list_head done;
+};
+
+/* the tail of the last sector and shrunk files read as zeros */
+static int read_source(int fd, char *buf, u64 len, u64 pos)
+{
+	ssize_t ret;
+	u64 done;
+
+	for (done = 0; done < len; done += ret) {
+		ret = pread64(fd, buf + done, len - done, pos + done);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			break;
+	}
+	memset(buf + done, 0, len - done);
+	return 0;
+}
+
+/* checksum every sector of buf and write it out at disk_bytenr */
+static int write_sectors(struct copy_ctl *ctl, char *buf, u64 len,
+			 u64 disk_bytenr, char *csums)
+{
+	u32 sectorsize = ctl->root->sectorsize;
+	ssize_t ret;
+	u64 done;
+	u64 i;
+	u32 crc;
+
+	for (i = 0; i < len; i += sectorsize) {
+		crc = btrfs_csum_data(ctl->root, buf + i, ~(u32)0, sectorsize);
+		btrfs_csum_final(crc, csums + ctl->csum_size *
+				 (i / sectorsize));
+	}
+
+	for (done = 0; done < len; done += ret) {
+		ret = pwrite64(ctl->out_fd, buf + done, len - done,
+			       disk_bytenr + done);
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+	}
+	return 0;
+}
+
+static int copy_segment_data(struct copy_ctl *ctl, struct copy_segment *seg,
+			     char *buf)
+{
+	u32 sectorsize = ctl->root->sectorsize;
+	u64 offset;
+	u64 len;
+	int ret;
+
+	for (offset = 0; offset < seg->num_bytes; offset += len) {
+		len = min_t(u64, seg->num_bytes - offset, COPY_READ_SIZE);
+		ret = read_source(seg->fd, buf, len, seg->file_pos + offset);
+		if (ret)
+			return ret;
+		ret = write_sectors(ctl, buf, len, seg->disk_bytenr + offset,
+				    seg->csums + ctl->csum_size *
+				    (offset / sectorsize));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * the compressors return -E2BIG when the output would not be smaller
+ * than max_out
+ */
+static int compress_zlib(char *in, u64 len, char *out, u64 max_out,
+			 u64 *out_len)
+{
+	z_stream strm;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit(&strm, 3) != Z_OK)
+		return -ENOMEM;
+	strm.next_in = (unsigned char *)in;
+	strm.avail_in = len;
+	strm.next_out = (unsigned char *)out;
+	strm.avail_out = max_out;
+	ret = deflate(&strm, Z_FINISH);
+	*out_len = strm.total_out;
+	deflateEnd(&strm);
+	return ret == Z_STREAM_END ? 0 : -E2BIG;
+}
+
+static inline void write_compress_length(char *buf, u32 len)
+{
+	__le32 dlen = cpu_to_le32(len);
+	memcpy(buf, &dlen, LZO_LEN);
+}
+
+/*
+ * the kernel's lzo format: the total length, then every page
+ * compressed on its own behind its length.  A length never crosses a
+ * page boundary, the rest of the page is padded instead.
+ */
+static int compress_lzo(struct copy_work *work, char *in, u64 len,
+			char *out, u64 max_out, u64 *out_len)
+{
+	u64 tot_out = LZO_LEN;
+	u64 in_pos;
+	u64 pad;
+	lzo_uint seg_len;
+	int ret;
+
+	for (in_pos = 0; in_pos < len; in_pos += PAGE_CACHE_SIZE) {
+		ret = lzo1x_1_compress((unsigned char *)in + in_pos,
+				       min_t(u64, len - in_pos,
+					     PAGE_CACHE_SIZE),
+				       (unsigned char *)work->lzo_buf,
+				       &seg_len, work->lzo_mem);
+		if (ret != LZO_E_OK)
+			return -EIO;
+
+		pad = PAGE_CACHE_SIZE - tot_out % PAGE_CACHE_SIZE;
+		if (pad >= LZO_LEN)
+			pad = 0;
+		if (tot_out + pad + LZO_LEN + seg_len > max_out)
+			return -E2BIG;
+		memset(out + tot_out, 0, pad);
+		tot_out += pad;
+		write_compress_length(out + tot_out, seg_len);
+		memcpy(out + tot_out + LZO_LEN, work->lzo_buf, seg_len);
+		tot_out += LZO_LEN + seg_len;
+	}
+	write_compress_length(out, tot_out);
+	*out_len = tot_out;
+	return 0;
+}
+
+/*
+ * compress one extent.  If that doesn't save at least a sector the
+ * data is written as is.
+ */
+static int copy_segment_compressed(struct copy_ctl *ctl,
+				   struct copy_segment *seg,
+				   struct copy_work *work)
+{
+	u32 sectorsize = ctl->root->sectorsize;
+	u64 max_out = seg->num_bytes - sectorsize;
+	u64 out_len = 0;
+	char *buf = work->buf;
+	int ret;
+
+	ret = read_source(seg->fd, work->buf, seg->num_bytes, seg->file_pos);
+	if (ret)
+		return ret;
+
+	if (ctl->compress == BTRFS_COMPRESS_ZLIB)
+		ret = compress_zlib(work->buf, seg->num_bytes, work->cbuf,
+				    max_out, &out_len);
+	else
+		ret = compress_lzo(work, work->buf, seg->num_bytes,
+				   work->cbuf, max_out, &out_len);
+
+	seg->disk_num_bytes = seg->num_bytes;
+	if (!ret) {
+		seg->disk_num_bytes = (out_len + sectorsize - 1) /
+				      sectorsize * sectorsize;
+		memset(work->cbuf + out_len, 0,
+		       seg->disk_num_bytes - out_len);
+		seg->compress = ctl->compress;
+		buf = work->cbuf;
+	}
+	return write_sectors(ctl, buf, seg->disk_num_bytes, seg->disk_bytenr,
+			     seg->csums);
+}
+
+static void *copy_thread(void *data)
+{
+	struct copy_ctl *ctl = data;
+	struct copy_segment *seg;
+	struct copy_work work;
+
+	memset(&work, 0, sizeof(work));
+	work.buf = malloc(COPY_READ_SIZE);
+	BUG_ON(!work.buf);
+	if (ctl->compress) {
+		work.cbuf = malloc(COPY_COMPRESS_SIZE);
+		work.lzo_buf = malloc(lzo1x_worst_compress(PAGE_CACHE_SIZE));
+		work.lzo_mem = malloc(LZO1X_1_MEM_COMPRESS);
+		BUG_ON(!work.cbuf || !work.lzo_buf || !work.lzo_mem);
+	}
+
+	pthread_mutex_lock(&ctl->mutex);
+	while (1) {
+		while (!ctl->stop && list_empty(&ctl->todo))
+			pthread_cond_wait(&ctl->work_cond, &ctl->mutex);
+		if (list_empty(&ctl->todo))
+			break;
+		seg = list_entry(ctl->todo.next, struct copy_segment, list);
+		list_del_init(&seg->list);
+		pthread_mutex_unlock(&ctl->mutex);
+
+		if (seg->fi)
+			seg->error = copy_segment_compressed(ctl, seg, &work);
+		else
+			seg->error = copy_segment_data(ctl, seg, work.buf);
+		close(seg->fd);
+		seg->fd = -1;
+
+		pthread_mutex_lock(&ctl->mutex);
+		list_add_tail(&seg->list, &ctl->done);
+		pthread_cond_signal(&ctl->done_cond);
+	}
+	pthread_mutex_unlock(&ctl->mutex);
+	free(work.buf);
+	free(work.cbuf);
+	free(work.lzo_buf);
+	free(work.lzo_mem);
+	return NULL;
+}
+
+static int copy_ctl_init(struct copy_ctl *ctl, struct btrfs_root *root,
+			 int out_fd, int compress, int dedup)
+{
+	long cpus;
+	int ret;
+	int i;
+
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->root = root;
+	ctl->out_fd = out_fd;
+	ctl->compress = compress;
+	ctl->dedup = dedup;
+	ctl->dedup_files = RB_ROOT;
+	ctl->csum_size = btrfs_super_csum_size(&root->fs_info->super_copy);
+	pthread_mutex_init(&ctl->mutex, NULL);
+	pthread_cond_init(&ctl->work_cond, NULL);
+	pthread_cond_init(&ctl->done_cond, NULL);
+	INIT_LIST_HEAD(&ctl->todo);
+	INIT_LIST_HEAD(&ctl->done);
+
+	if (compress == BTRFS_COMPRESS_LZO && lzo_init() != LZO_E_OK)
+		return -EINVAL;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = min_t(long, max_t(long, cpus, 1), COPY_MAX_THREADS);
+	ctl->threads = calloc(cpus, sizeof(pthread_t));
+	if (!ctl->threads)
+		return -ENOMEM;
+
+	for (i = 0; i < cpus; i++) {
+		ret = pthread_create(&ctl->threads[i], NULL, copy_thread, ctl);
+		if (ret)
+			return -ret;
+		ctl->num_threads++;
+	}
+	return 0;
+}
+
+/*
+ * a compressed extent is only recorded once we know how much of it
+ * was written.  The unused end goes back to the free space cache.
+ */
+static int record_compressed_extent(struct btrfs_trans_handle *trans,
+				    struct copy_ctl *ctl,
+				    struct copy_segment *seg)
+{
+	struct btrfs_root *root = ctl->root;
+
+	if (seg->compress) {
+		btrfs_set_stack_file_extent_disk_num_bytes(seg->fi,
+							seg->disk_num_bytes);
+		btrfs_set_stack_file_extent_compression(seg->fi,
+							seg->compress);
+		set_extent_dirty(&root->fs_info->free_space_cache,
+				 seg->disk_bytenr + seg->disk_num_bytes,
+				 seg->disk_bytenr + seg->num_bytes - 1,
+				 GFP_NOFS);
+	}
+	return insert_data_extent(trans, root, seg->objectid, seg->file_pos,
+				  seg->disk_bytenr, seg->disk_num_bytes);
+}
+
+/*
+ * insert the checksums of every finished segment.  With wait set this
+ * blocks until at least one segment is done.
+ */
+static int copy_reap(struct btrfs_trans_handle *trans, struct copy_ctl *ctl,
+		     int wait)
+{
+	struct btrfs_root *csum_root = ctl->root->fs_info->csum_root;
+	u64 csum_bytes;
+	struct copy_segment *seg;
+	struct list_head done;
+	int ret = 0;
+
+	INIT_LIST_HEAD(&done);
+	pthread_mutex_lock(&ctl->mutex);
+	while (wait && ctl->pending && list_empty(&ctl->done))
+		pthread_cond_wait(&ctl->done_cond, &ctl->mutex);
+	list_splice_init(&ctl->done, &done);
+	pthread_mutex_unlock(&ctl->mutex);
+
+	while (!list_empty(&done)) {
+		seg = list_entry(done.next, struct copy_segment, list);
+		list_del(&seg->list);
+		ctl->pending--;
+
+		if (seg->error) {
+			fprintf(stderr, "%s copy failed: %s\n",
+				seg->path_name, strerror(-seg->error));
+			ret = seg->error;
+		}
+		csum_bytes = seg->num_bytes;
+		if (!ret && seg->fi) {
+			ret = record_compressed_extent(trans, ctl, seg);
+			csum_bytes = seg->disk_num_bytes;
+		}
+		if (!ret) {
+			ret = btrfs_csum_file_blocks(trans, csum_root,
+					seg->disk_bytenr, csum_bytes,
+					seg->csums);
+			if (ret)
+				fprintf(stderr, "%s checksum failed\n",
+					seg->path_name);
+		}
+		free(seg->path_name);
+		free(seg->csums);
+		free(seg);
+	}
+	return ret;
+}
+
+static int copy_queue(struct btrfs_trans_handle *trans, struct copy_ctl *ctl,
+		      struct copy_segment *seg)
+{
+	int ret;
+
+	while (ctl->pending >= COPY_MAX_PENDING) {
+		ret = copy_reap(trans, ctl, 1);
+		if (ret)
+			return ret;
+	}
+
+	ctl->pending++;
+	pthread_mutex_lock(&ctl->mutex);
+	list_add_tail(&seg->list, &ctl->todo);
+	pthread_cond_signal(&ctl->work_cond);
+	pthread_mutex_unlock(&ctl->mutex);
+	return 0;
+}
+
+/*
+ * with --dedup, files that are byte for byte identical to a file copied
+ * earlier share its extents.  Files are grouped by size first and only
+ * read again for a checksum once a second file of the same size shows
+ * up, a match is confirmed by comparing the contents.
+ */
+struct dedup_extent {
+	u64 file_pos;
+	/* in the batch, compressed extents are only final once written */
+	struct btrfs_file_extent_item *fi;
+};
+
+struct dedup_file {
+	struct rb_node node;
+	struct dedup_file *next;
+	char *path_name;
+	u64 size;
+	u32 hash;
+	int hashed;
+	int nr;
+	int max;
+	struct dedup_extent *extents;
+};
+
+static void free_dedup_files(struct rb_root *root)
+{
+	struct rb_node *n;
+	struct dedup_file *file;
+	struct dedup_file *next;
+
+	while ((n = rb_first(root))) {
+		rb_erase(n, root);
+		file = rb_entry(n, struct dedup_file, node);
+		while (file) {
+			next = file->next;
+			free(file->path_name);
+			free(file->extents);
+			free(file);
+			file = next;
+		}
+	}
+}
+
+static struct dedup_file *lookup_dedup_size(struct rb_root *root, u64 size)
+{
+	struct rb_node *n = root->rb_node;
+	struct dedup_file *file;
+
+	while (n) {
+		file = rb_entry(n, struct dedup_file, node);
+		if (size < file->size)
+			n = n->rb_left;
+		else if (size > file->size)
+			n = n->rb_right;
+		else
+			return file;
+	}
+	return NULL;
+}
+
+static void add_dedup_file(struct rb_root *root, struct dedup_file *new)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct dedup_file *file;
+
+	while (*p) {
+		parent = *p;
+		file = rb_entry(parent, struct dedup_file, node);
+		if (new->size < file->size) {
+			p = &(*p)->rb_left;
+		} else if (new->size > file->size) {
+			p = &(*p)->rb_right;
+		} else {
+			/* same size, chain it behind the first one */
+			new->next = file->next;
+			file->next = new;
+			return;
+		}
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, root);
+}
+
+static int dedup_record(struct dedup_file *file, u64 file_pos,
+			struct btrfs_file_extent_item *fi)
+{
+	struct dedup_extent *extents;
+
+	if (!file)
+		return 0;
+	if (file->nr == file->max) {
+		file->max = max(file->max * 2, 4);
+		extents = realloc(file->extents,
+				  file->max * sizeof(*extents));
+		if (!extents)
+			return -ENOMEM;
+		file->extents = extents;
+	}
+	file->extents[file->nr].file_pos = file_pos;
+	file->extents[file->nr].fi = fi;
+	file->nr++;
+	return 0;
+}
+
+static int hash_file(int fd, u64 size, char *buf, u32 *hash_ret)
+{
+	u32 crc = ~(u32)0;
+	u64 pos;
+	ssize_t ret;
+
+	for (pos = 0; pos < size; pos += ret) {
+		ret = pread64(fd, buf, min_t(u64, size - pos,
+					     COPY_READ_SIZE), pos);
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+		crc = crc32c(crc, buf, ret);
+	}
+	*hash_ret = crc;
+	return 0;
+}
+
+static int hash_dedup_file(struct dedup_file *file, char *buf)
+{
+	int ret;
+	int fd;
+
+	if (file->hashed)
+		return 0;
+	fd = open(file->path_name, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = hash_file(fd, file->size, buf, &file->hash);
+	close(fd);
+	if (!ret)
+		file->hashed = 1;
+	return ret;
+}
+
+/* returns 1 if the contents of fd and the file at path_name match */
+static int same_contents(int fd, const char *path_name, u64 size, char *buf)
+{
+	char *buf2 = buf + COPY_READ_SIZE;
+	u64 pos;
+	ssize_t len;
+	ssize_t ret;
+	int fd2;
+	int same = 1;
+
+	fd2 = open(path_name, O_RDONLY);
+	if (fd2 < 0)
+		return 0;
+	for (pos = 0; same && pos < size; pos += len) {
+		len = min_t(u64, size - pos, COPY_READ_SIZE);
+		ret = pread64(fd, buf, len, pos);
+		if (ret != len) {
+			same = 0;
+			break;
+		}
+		ret = pread64(fd2, buf2, len, pos);
+		same = ret == len && !memcmp(buf, buf2, len);
+	}
+	close(fd2);
+	return same;
+}
+
+/*
+ * look for an earlier file with the same contents as fd.  Returns the
+ * match or NULL, errors only mean the file is copied normally.
+ */
+static struct dedup_file *find_dedup_file(struct copy_ctl *ctl, int fd,
+					  u64 size)
+{
+	struct dedup_file *file;
+	struct dedup_file *match = NULL;
+	char *buf;
+	u32 hash;
+
+	file = lookup_dedup_size(&ctl->dedup_files, size);
+	if (!file)
+		return NULL;
+
+	buf = malloc(COPY_READ_SIZE * 2);
+	if (!buf)
+		return NULL;
+	if (hash_file(fd, size, buf, &hash))
+		goto out;
+	for (; file; file = file->next) {
+		if (hash_dedup_file(file, buf) || file->hash != hash)
+			continue;
+		if (same_contents(fd, file->path_name, size, buf)) {
+			match = file;
+			break;
+		}
+	}
+out:
+	free(buf);
+	return match;
+}
+
+/*
+ * wait for the outstanding segments, insert their checksums and stop
+ * the reader threads
+ */
+static int copy_ctl_finish(struct btrfs_trans_handle *trans,
+			   struct copy_ctl *ctl)
+{
+	int ret = 0;
+	int err;
+	int i;
+
+	while (ctl->pending) {
+		err = copy_reap(trans, ctl, 1);
+		if (err && !ret)
+			ret = err;
+	}
+
+	pthread_mutex_lock(&ctl->mutex);
+	ctl->stop = 1;
+	pthread_cond_broadcast(&ctl->work_cond);
+	pthread_mutex_unlock(&ctl->mutex);
+	for (i = 0; i < ctl->num_threads; i++)
+		pthread_join(ctl->threads[i], NULL);
+	free(ctl->threads);
+
+	pthread_mutex_destroy(&ctl->mutex);
+	pthread_cond_destroy(&ctl->work_cond);
+	pthread_cond_destroy(&ctl->done_cond);
+	free_dedup_files(&ctl->dedup_files);
+	return ret;
+}
+
+static char *make_path(char *dir, char *name)
+{
+	char *path;
+
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	if (!path)
+		return NULL;
+	strcpy(path, dir);
+	if (dir[strlen(dir) - 1] != '/')
+		strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+/*
+ * find the next range with data at or after pos, rounded out to whole
+ * sectors.  Returns 1 when only holes are left.  If the source file
+ * system can't tell holes from data, everything is data.
+ */
+static int next_data_range(int fd, u64 pos, u64 end, u32 sectorsize,
+			   u64 *start_ret, u64 *end_ret)
+{
+	off_t start;
+	off_t stop;
+
+	start = lseek(fd, pos, SEEK_DATA);
+	if (start < 0) {
+		if (errno == ENXIO)
+			return 1;
+		start = pos;
+		stop = end;
+	} else {
+		stop = lseek(fd, start, SEEK_HOLE);
+		if (stop < 0)
+			stop = end;
+	}
+
+	start = start / sectorsize * sectorsize;
+	stop = (stop + sectorsize - 1) / sectorsize * sectorsize;
+	if (start >= end)
+		return 1;
+	*start_ret = start;
+	*end_ret = min_t(u64, stop, end);
+	return 0;
+}
+
+/* share the extents of an identical file copied earlier */
+static int add_dedup_extents(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root,
+			     struct btrfs_item_batch *batch,
+			     struct btrfs_inode_item *btrfs_inode,
+			     u64 objectid, struct dedup_file *file,
+			     struct copy_ctl *ctl)
+{
+	struct btrfs_file_extent_item *fi;
+	struct dedup_extent *extent;
+	u64 disk_bytenr;
+	int ret = 0;
+	int i;
+
+	/* compressed extents of the original may still be in flight */
+	while (ctl->compress && ctl->pending && !ret)
+		ret = copy_reap(trans, ctl, 1);
+
+	for (i = 0; i < file->nr && !ret; i++) {
+		extent = file->extents + i;
+		fi = add_file_extent(batch, objectid, extent->file_pos, 0, 0);
+		if (!fi)
+			return -ENOMEM;
+		*fi = *extent->fi;
+
+		disk_bytenr = btrfs_stack_file_extent_disk_bytenr(fi);
+		if (!disk_bytenr)
+			continue;
+		ret = insert_data_extent(trans, root, objectid,
+				extent->file_pos, disk_bytenr,
+				btrfs_stack_file_extent_disk_num_bytes(fi));
+		btrfs_set_stack_inode_nbytes(btrfs_inode,
+				btrfs_stack_inode_nbytes(btrfs_inode) +
+				btrfs_stack_file_extent_num_bytes(fi));
+	}
+	return ret;
+}
+
+/*
+ * queue the copy of [file_pos, file_pos + len) to disk_bytenr.  For
+ * compressed extents fi is the file extent item that gets recorded
+ * once the data is written.
+ */
+static int queue_segment(struct btrfs_trans_handle *trans,
+			 struct copy_ctl *ctl, int fd, const char *path_name,
+			 u64 objectid, u64 file_pos, u64 disk_bytenr, u64 len,
+			 struct btrfs_file_extent_item *fi)
+{
+	struct copy_segment *seg;
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return -ENOMEM;
+	seg->num_bytes = len;
+	seg->file_pos = file_pos;
+	seg->disk_bytenr = disk_bytenr;
+	seg->objectid = objectid;
+	seg->disk_num_bytes = len;
+	seg->fi = fi;
+	seg->path_name = strdup(path_name);
+	seg->csums = malloc(ctl->csum_size * (len / ctl->root->sectorsize));
+	seg->fd = dup(fd);
+	if (!seg->path_name || !seg->csums || seg->fd < 0) {
+		fprintf(stderr, "%s queueing failed\n", path_name);
+		if (seg->fd >= 0)
+			close(seg->fd);
+		free(seg->path_name);
+		free(seg->csums);
+		free(seg);
+		return -ENOMEM;
+	}
+	return copy_queue(trans, ctl, seg);
+}
+
 static int add_file_items(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root,
+			  struct btrfs_item_batch *batch,
 			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
 			  ino_t parent_inum, struct stat *st,
-			  const char *path_name, int out_fd)
+			  const char *path_name, const char *dir_path,
+			  struct copy_ctl *ctl)
 {
 	int ret = -1;
 	ssize_t ret_read;
-	u64 bytes_read = 0;
 	char *buffer = NULL;
 	struct btrfs_key key;
-	int blocks;
+	struct btrfs_file_extent_item *fi;
+	struct dedup_file *dedup = NULL;
+	struct dedup_file *match;
+	u64 blocks;
 	u32 sectorsize = root->sectorsize;
-	u64 first_block = 0;
-	u64 num_blocks = 0;
+	u64 num_bytes;
+	u64 file_pos;
+	u64 data_start;
+	u64 data_end;
+	u64 extent_len;
+	u64 offset;
+	u64 len;
 	int fd;
 
 	fd = open(path_name, O_RDONLY);
@@ -777,86 +1698,149 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 
 	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root)) {
 		buffer = malloc(st->st_size);
-		ret_read = pread64(fd, buffer, st->st_size, bytes_read);
+		ret_read = pread64(fd, buffer, st->st_size, 0);
 		if (ret_read == -1) {
 			fprintf(stderr, "%s read failed\n", path_name);
 			goto end;
 		}
 
-		ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-						 buffer, st->st_size);
+		ret = btrfs_batch_insert_inline_extent(batch, objectid, 0,
+						       buffer, st->st_size);
 		goto end;
 	}
 
-	ret = custom_alloc_extent(root, blocks * sectorsize, 0, &key);
-	if (ret)
-		goto end;
-
-	first_block = key.objectid;
-	bytes_read = 0;
-	buffer = malloc(sectorsize);
-
-	do {
-		memset(buffer, 0, sectorsize);
-		ret_read = pread64(fd, buffer, sectorsize, bytes_read);
-		if (ret_read == -1) {
-			fprintf(stderr, "%s read failed\n", path_name);
+	if (ctl->dedup) {
+		match = find_dedup_file(ctl, fd, st->st_size);
+		if (match) {
+			ret = add_dedup_extents(trans, root, batch,
+						btrfs_inode, objectid, match,
+						ctl);
 			goto end;
 		}
-
-		ret = pwrite64(out_fd, buffer, sectorsize,
-			       first_block + bytes_read);
-		if (ret != sectorsize) {
-			fprintf(stderr, "output file write failed\n");
-			goto end;
+		dedup = calloc(1, sizeof(*dedup));
+		if (dedup) {
+			dedup->size = st->st_size;
+			dedup->path_name = make_path((char *)dir_path,
+						     (char *)path_name);
+			if (!dedup->path_name) {
+				free(dedup);
+				dedup = NULL;
+			}
 		}
+	}
 
-		/* checksum for file data */
-		ret = btrfs_csum_file_block(trans, root->fs_info->csum_root,
-				first_block + (blocks * sectorsize),
-				first_block + bytes_read,
-				buffer, sectorsize);
-		if (ret) {
-			fprintf(stderr, "%s checksum failed\n", path_name);
-			goto end;
+	num_bytes = blocks * sectorsize;
+	file_pos = 0;
+	while (file_pos < num_bytes) {
+		ret = next_data_range(fd, file_pos, num_bytes, sectorsize,
+				      &data_start, &data_end);
+		if (ret)
+			data_start = data_end = num_bytes;
+
+		if (data_start > file_pos) {
+			ret = record_file_extent(trans, root, batch, objectid,
+						 btrfs_inode, file_pos, 0,
+						 data_start - file_pos, &fi);
+			if (!ret)
+				ret = dedup_record(dedup, file_pos, fi);
+			if (ret)
+				goto end;
 		}
 
-		bytes_read += ret_read;
-		num_blocks++;
-	} while (ret_read == sectorsize);
+		for (file_pos = data_start; file_pos < data_end;
+		     file_pos += extent_len) {
+			if (ctl->compress) {
+				extent_len = min_t(u64, data_end - file_pos,
+						   COPY_COMPRESS_SIZE);
+				ret = custom_alloc_extent(root, extent_len, 0,
+							  &key);
+				if (ret) {
+					fprintf(stderr,
+						"not enough free space\n");
+					goto end;
+				}
+				fi = add_file_extent(batch, objectid, file_pos,
+						     key.objectid, extent_len);
+				if (!fi) {
+					ret = -ENOMEM;
+					goto end;
+				}
+				btrfs_set_stack_inode_nbytes(btrfs_inode,
+					btrfs_stack_inode_nbytes(btrfs_inode) +
+					extent_len);
+				ret = queue_segment(trans, ctl, fd, path_name,
+						    objectid, file_pos,
+						    key.objectid, extent_len,
+						    fi);
+				if (!ret)
+					ret = dedup_record(dedup, file_pos, fi);
+				if (ret)
+					goto end;
+				continue;
+			}
+
+			/* settle for smaller extents when space is fragmented */
+			extent_len = min_t(u64, data_end - file_pos,
+					   COPY_MAX_EXTENT);
+			while (1) {
+				ret = custom_alloc_extent(root, extent_len, 0,
+							  &key);
+				if (!ret || extent_len == sectorsize)
+					break;
+				extent_len = max_t(u64, extent_len / 2 /
+						   sectorsize * sectorsize,
+						   sectorsize);
+			}
+			if (ret) {
+				fprintf(stderr, "not enough free space\n");
+				goto end;
+			}
 
-	if (num_blocks > 0) {
-		ret = record_file_extent(trans, root, objectid, btrfs_inode,
-					 first_block, first_block,
-					 blocks * sectorsize);
-		if (ret)
-			goto end;
+			for (offset = 0; offset < extent_len; offset += len) {
+				len = min_t(u64, extent_len - offset,
+					    COPY_SEGMENT_SIZE);
+				ret = queue_segment(trans, ctl, fd, path_name,
+						    objectid, file_pos + offset,
+						    key.objectid + offset, len,
+						    NULL);
+				if (ret)
+					goto end;
+			}
+
+			ret = record_file_extent(trans, root, batch, objectid,
+						 btrfs_inode, file_pos,
+						 key.objectid, extent_len, &fi);
+			if (!ret)
+				ret = dedup_record(dedup, file_pos, fi);
+			if (ret)
+				goto end;
+		}
 	}
 
+	if (dedup) {
+		add_dedup_file(&ctl->dedup_files, dedup);
+		dedup = NULL;
+	}
+	/* pick up whatever the readers finished in the meantime */
+	ret = copy_reap(trans, ctl, 0);
 end:
+	if (dedup) {
+		free(dedup->path_name);
+		free(dedup->extents);
+		free(dedup);
+	}
 	if (buffer)
 		free(buffer);
-	close(fd);
+	if (fd != -1)
+		close(fd);
 	return ret;
 }
 
-static char *make_path(char *dir, char *name)
-{
-	char *path;
-
-	path = malloc(strlen(dir) + strlen(name) + 2);
-	if (!path)
-		return NULL;
-	strcpy(path, dir);
-	if (dir[strlen(dir) - 1] != '/')
-		strcat(path, "/");
-	strcat(path, name);
-	return path;
-}
-
 static int traverse_directory(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, char *dir_name,
-			      struct directory_name_entry *dir_head, int out_fd)
+			      struct directory_name_entry *dir_head,
+			      struct btrfs_item_batch *batch,
+			      struct copy_ctl *ctl)
 {
 	int ret = 0;
 
@@ -867,6 +1851,8 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	struct stat st;
 	struct directory_name_entry *dir_entry, *parent_dir_entry;
 	struct direct *cur_file;
+	struct hardlink_entry *link;
+	struct rb_root hardlinks = RB_ROOT;
 	ino_t parent_inum, cur_inum;
 	ino_t highest_inum = 0;
 	char *parent_dir_name;
@@ -938,8 +1924,31 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 				goto fail;
 			}
 
+			link = NULL;
+			if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+				link = lookup_hardlink(&hardlinks, &st);
+			if (link) {
+				ret = add_directory_items(batch, root,
+							  link->objectid,
+							  parent_inum,
+							  cur_file->d_name,
+							  &st, &dir_index_cnt);
+				if (!ret)
+					ret = btrfs_batch_insert_inode_ref(batch,
+						cur_file->d_name,
+						strlen(cur_file->d_name),
+						link->objectid, parent_inum,
+						dir_index_cnt);
+				if (ret) {
+					fprintf(stderr, "add hardlink failed\n");
+					goto fail;
+				}
+				link->nlink++;
+				continue;
+			}
+
 			cur_inum = ++highest_inum + BTRFS_FIRST_FREE_OBJECTID;
-			ret = add_directory_items(trans, root,
+			ret = add_directory_items(batch, root,
 						  cur_inum, parent_inum,
 						  cur_file->d_name,
 						  &st, &dir_index_cnt);
@@ -948,7 +1957,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 				goto fail;
 			}
 
-			ret = add_inode_items(trans, root, &st,
+			ret = add_inode_items(trans, root, batch, &st,
 					      cur_file->d_name, cur_inum,
 					      parent_inum, dir_index_cnt,
 					      &cur_inode);
@@ -957,8 +1966,8 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 				goto fail;
 			}
 
-			ret = add_xattr_item(trans, root,
-					     cur_inum, cur_file->d_name);
+			ret = add_xattr_item(batch, cur_inum,
+					     cur_file->d_name);
 			if (ret) {
 				fprintf(stderr, "add_xattr_item failed\n");
 				if(ret != -ENOTSUP)
@@ -973,21 +1982,35 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 				dir_entry->inum = cur_inum;
 				list_add_tail(&dir_entry->list,	&dir_head->list);
 			} else if (S_ISREG(st.st_mode)) {
-				ret = add_file_items(trans, root, &cur_inode,
-						     cur_inum, parent_inum, &st,
-						     cur_file->d_name, out_fd);
+				ret = add_file_items(trans, root, batch,
+						     &cur_inode, cur_inum,
+						     parent_inum, &st,
+						     cur_file->d_name,
+						     parent_dir_entry->path,
+						     ctl);
 				if (ret) {
 					fprintf(stderr, "add_file_items failed\n");
 					goto fail;
 				}
 			} else if (S_ISLNK(st.st_mode)) {
-				ret = add_symbolic_link(trans, root,
+				ret = add_symbolic_link(root, batch,
 						        cur_inum, cur_file->d_name);
 				if (ret) {
 					fprintf(stderr, "add_symbolic_link failed\n");
 					goto fail;
 				}
 			}
+
+			if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+				ret = add_hardlink(&hardlinks, &st, cur_inum,
+						   &cur_inode);
+			else
+				ret = btrfs_batch_insert_inode(batch, cur_inum,
+							       &cur_inode);
+			if (ret) {
+				fprintf(stderr, "add inode item failed\n");
+				goto fail;
+			}
 		}
 
 		free_namelist(files, count);
@@ -998,12 +2021,18 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 
 	} while (!list_empty(&dir_head->list));
 
+	ret = flush_hardlinks(batch, &hardlinks);
+	if (ret) {
+		fprintf(stderr, "add hardlinked inode items failed\n");
+		return -1;
+	}
 	return 0;
 fail:
 	free_namelist(files, count);
 fail_no_files:
 	free(parent_dir_entry->path);
 	free(parent_dir_entry);
+	flush_hardlinks(NULL, &hardlinks);
 	return -1;
 }
 
@@ -1016,6 +2045,30 @@ static int open_target(char *output_name)
 	return output_fd;
 }
 
+/*
+ * chunks made here go straight into the free space cache, keep the
+ * super block mirrors out of it or file data ends up under them
+ */
+static void exclude_super_stripes(struct btrfs_root *root, u64 chunk_start)
+{
+	u64 *logical;
+	int stripe_len;
+	int i, nr, ret;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		ret = btrfs_rmap_block(&root->fs_info->mapping_tree,
+				       chunk_start, btrfs_sb_offset(i), 0,
+				       &logical, &nr, &stripe_len);
+		BUG_ON(ret);
+		while (nr--) {
+			clear_extent_dirty(&root->fs_info->free_space_cache,
+					   logical[nr],
+					   logical[nr] + stripe_len - 1, 0);
+		}
+		kfree(logical);
+	}
+}
+
 static int create_chunks(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *root, u64 num_of_meta_chunks,
 			 u64 size_of_data)
@@ -1038,6 +2091,7 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 		BUG_ON(ret);
 		set_extent_dirty(&root->fs_info->free_space_cache,
 				 chunk_start, chunk_start + chunk_size - 1, 0);
+		exclude_super_stripes(root, chunk_start);
 	}
 
 	if (size_of_data < minimum_data_chunk_size)
@@ -1051,10 +2105,12 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 	BUG_ON(ret);
 	set_extent_dirty(&root->fs_info->free_space_cache,
 			 chunk_start, chunk_start + size_of_data - 1, 0);
+	exclude_super_stripes(root, chunk_start);
 	return ret;
 }
 
-static int make_image(char *source_dir, struct btrfs_root *root, int out_fd)
+static int make_image(char *source_dir, struct btrfs_root *root, int out_fd,
+		      int compress, int dedup)
 {
 	int ret;
 	struct btrfs_trans_handle *trans;
@@ -1062,26 +2118,47 @@ static int make_image(char *source_dir, struct btrfs_root *root, int out_fd)
 	struct stat root_st;
 
 	struct directory_name_entry dir_head;
+	struct btrfs_item_batch batch;
+	struct copy_ctl ctl;
 
 	ret = lstat(source_dir, &root_st);
 	if (ret) {
 		fprintf(stderr, "unable to lstat the %s\n", source_dir);
-		goto fail;
+		goto fail_lstat;
 	}
 
 	INIT_LIST_HEAD(&dir_head.list);
 
 	trans = btrfs_start_transaction(root, 1);
-	ret = traverse_directory(trans, root, source_dir, &dir_head, out_fd);
+	btrfs_item_batch_init(&batch, trans->transid);
+	ret = copy_ctl_init(&ctl, root, out_fd, compress, dedup);
+	if (ret) {
+		fprintf(stderr, "unable to start the copy threads\n");
+		copy_ctl_finish(trans, &ctl);
+		goto fail;
+	}
+	ret = traverse_directory(trans, root, source_dir, &dir_head, &batch,
+				 &ctl);
+	if (copy_ctl_finish(trans, &ctl) && !ret)
+		ret = -1;
 	if (ret) {
 		fprintf(stderr, "unable to traverse_directory\n");
 		goto fail;
 	}
+
+	/* the fs tree items were collected in the batch, build the tree */
+	ret = btrfs_item_batch_load(trans, root, &batch, BTRFS_BULK_LOAD_FILL);
+	if (ret) {
+		fprintf(stderr, "unable to build the fs tree: %d\n", ret);
+		goto fail;
+	}
 	btrfs_commit_transaction(trans, root);
 
 	printf("Making image is completed.\n");
 	return 0;
 fail:
+	btrfs_item_batch_release(&batch);
+fail_lstat:
 	fprintf(stderr, "Making image is aborted.\n");
 	return -1;
 }
@@ -1119,6 +2196,8 @@ static u64 size_sourcedir(char *dir_name, u64 sectorsize,
 	remove(file_name);
 
 	dir_size *= sectorsize;
+	/* leave room for the super block mirrors inside the data chunk */
+	dir_size += BTRFS_SUPER_MIRROR_MAX * 64 * 1024;
 	*size_of_data_ret = dir_size;
 
 	num_of_meta_chunks = (dir_size / 2) / default_chunk_size;
@@ -1187,6 +2266,10 @@ int main(int ac, char **av)
 
 	char *source_dir = NULL;
 	int source_dir_set = 0;
+	int dedup = 0;
+	int compress = BTRFS_COMPRESS_NONE;
+	struct btrfs_prepare_device *devs = NULL;
+	int nr_devs = 0;
 	u64 num_of_meta_chunks = 0;
 	u64 size_of_data = 0;
 	u64 source_dir_size = 0;
@@ -1194,7 +2277,7 @@ int main(int ac, char **av)
 
 	while(1) {
 		int c;
-		c = getopt_long(ac, av, "A:b:l:n:s:m:d:L:r:VM", long_options,
+		c = getopt_long(ac, av, "A:b:l:n:s:m:d:L:r:c:VMD", long_options,
 				&option_index);
 		if (c < 0)
 			break;
@@ -1241,6 +2324,12 @@ int main(int ac, char **av)
 				source_dir = optarg;
 				source_dir_set = 1;
 				break;
+			case 'D':
+				dedup = 1;
+				break;
+			case 'c':
+				compress = parse_compress(optarg);
+				break;
 			default:
 				print_usage();
 		}
@@ -1262,24 +2351,48 @@ int main(int ac, char **av)
 	printf("WARNING! - see http://btrfs.wiki.kernel.org before using\n\n");
 
 	if (source_dir == 0) {
-		file = av[optind++];
-		ret = check_mounted(file);
-		if (ret < 0) {
-			fprintf(stderr, "error checking %s mount status\n", file);
+		nr_devs = ac;
+		devs = calloc(nr_devs, sizeof(*devs));
+		if (!devs) {
+			fprintf(stderr, "unable to allocate the device list\n");
 			exit(1);
 		}
-		if (ret == 1) {
-			fprintf(stderr, "%s is mounted\n", file);
-			exit(1);
+		for (i = 0; i < nr_devs; i++) {
+			file = av[optind + i];
+			ret = check_mounted(file);
+			if (ret < 0) {
+				fprintf(stderr,
+					"error checking %s mount status\n",
+					file);
+				exit(1);
+			}
+			if (ret == 1) {
+				fprintf(stderr, "%s is mounted\n", file);
+				exit(1);
+			}
+			fd = open(file, O_RDWR);
+			if (fd < 0) {
+				fprintf(stderr, "unable to open %s\n", file);
+				exit(1);
+			}
+			devs[i].fd = fd;
+			devs[i].file = file;
+			devs[i].zero_end = zero_end;
 		}
+
+		/* discard and zero all the devices at once */
+		ret = btrfs_prepare_devices(devs, nr_devs, &mixed);
+		for (i = 0; i < nr_devs; i++)
+			printf("prepared %s: discard %llums zero %llums\n",
+			       devs[i].file,
+			       (unsigned long long)devs[i].discard_ms,
+			       (unsigned long long)devs[i].zero_ms);
+
 		ac--;
-		fd = open(file, O_RDWR);
-		if (fd < 0) {
-			fprintf(stderr, "unable to open %s\n", file);
-			exit(1);
-		}
+		file = av[optind++];
+		fd = devs[0].fd;
 		first_file = file;
-		ret = btrfs_prepare_device(fd, file, zero_end, &dev_block_count, &mixed);
+		dev_block_count = devs[0].block_count;
 		if (block_count == 0)
 			block_count = dev_block_count;
 	} else {
@@ -1348,26 +2461,10 @@ int main(int ac, char **av)
 		return -1;
 	}
 
-	zero_end = 1;
-	while(ac-- > 0) {
-		int old_mixed = mixed;
-
-		file = av[optind++];
-		ret = check_mounted(file);
-		if (ret < 0) {
-			fprintf(stderr, "error checking %s mount status\n",
-				file);
-			exit(1);
-		}
-		if (ret == 1) {
-			fprintf(stderr, "%s is mounted\n", file);
-			exit(1);
-		}
-		fd = open(file, O_RDWR);
-		if (fd < 0) {
-			fprintf(stderr, "unable to open %s\n", file);
-			exit(1);
-		}
+	/* the other devices were prepared along with the first one */
+	for (i = 1; i < nr_devs; i++) {
+		file = devs[i].file;
+		fd = devs[i].fd;
 		ret = btrfs_device_already_in_root(root, fd,
 						   BTRFS_SUPER_INFO_OFFSET);
 		if (ret) {
@@ -1376,12 +2473,9 @@ int main(int ac, char **av)
 			close(fd);
 			continue;
 		}
-		ret = btrfs_prepare_device(fd, file, zero_end,
-					   &dev_block_count, &mixed);
-		mixed = old_mixed;
-		BUG_ON(ret);
 
-		ret = btrfs_add_to_fsid(trans, root, fd, file, dev_block_count,
+		ret = btrfs_add_to_fsid(trans, root, fd, file,
+					devs[i].block_count,
 					sectorsize, sectorsize, sectorsize);
 		BUG_ON(ret);
 		btrfs_register_one_device(file);
@@ -1404,6 +2498,13 @@ raid_groups:
 		flags |= BTRFS_FEATURE_INCOMPAT_MIXED_GROUPS;
 		btrfs_set_super_incompat_flags(super, flags);
 	}
+	if (source_dir_set && compress == BTRFS_COMPRESS_LZO) {
+		struct btrfs_super_block *super = &root->fs_info->super_copy;
+		u64 flags = btrfs_super_incompat_flags(super);
+
+		flags |= BTRFS_FEATURE_INCOMPAT_COMPRESS_LZO;
+		btrfs_set_super_incompat_flags(super, flags);
+	}
 
 	printf("fs created label %s on %s\n\tnodesize %u leafsize %u "
 	    "sectorsize %u size %s\n",
@@ -1421,13 +2522,14 @@ raid_groups:
 		BUG_ON(ret);
 		btrfs_commit_transaction(trans, root);
 
-		ret = make_image(source_dir, root, fd);
+		ret = make_image(source_dir, root, fd, compress, dedup);
 		BUG_ON(ret);
 	}
 
 	ret = close_ctree(root);
 	BUG_ON(ret);
 
+	free(devs);
 	free(label);
 	return 0;
 }
@@ -286,8 +286,8 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 
 	if (offset)
 		printf("offset is %Lu\n", offset);
-	/* we found a hole */
-	if (disk_size == 0)
+	/* a hole, whatever disk_num_bytes says */
+	if (bytenr == 0)
 		return 0;
 
 	inbuf = malloc(disk_size);
@@ -426,6 +426,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		return -1;
 	}
 	path->skip_locking = 1;
+	path->reada = 1;
 
 	ret = btrfs_lookup_inode(NULL, root, path, key, 0);
 	if (ret == 0) {
@@ -433,12 +434,12 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 				    struct btrfs_inode_item);
 		found_size = btrfs_inode_size(path->nodes[0], inode_item);
 	}
-	btrfs_release_path(root, path);
 
+	/* the file extents usually follow the inode item in the same leaf */
 	key->offset = 0;
 	key->type = BTRFS_EXTENT_DATA_KEY;
 
-	ret = btrfs_search_slot(NULL, root, key, path, 0, 0);
+	ret = btrfs_search_slot_finger(NULL, root, key, path, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching %d\n", ret);
 		btrfs_free_path(path);
@@ -551,6 +552,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 		return -1;
 	}
 	path->skip_locking = 1;
+	path->reada = 1;
 
 	key->offset = 0;
 	key->type = BTRFS_DIR_INDEX_KEY;
@@ -1137,6 +1139,19 @@ int main(int argc, char **argv)
 	}
 
 	ret = search_dir(root, &key, dir_name, "", mreg);
+	if (verbose > 1)
+		printf("finger search: %llu leaf hits, %llu node hits, "
+		       "%llu misses\n",
+		       (unsigned long long)root->fs_info->finger_leaf_hits,
+		       (unsigned long long)root->fs_info->finger_node_hits,
+		       (unsigned long long)root->fs_info->finger_misses);
+	if (verbose > 1)
+		printf("readahead: %llu blocks issued, %llu hits, %llu misses, "
+		       "window %u\n",
+		       (unsigned long long)root->fs_info->reada_issued,
+		       (unsigned long long)root->fs_info->reada_hits,
+		       (unsigned long long)root->fs_info->reada_misses,
+		       root->fs_info->reada_window);
 
 out:
 	if (mreg)
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 #include <poll.h>
 #include <sys/file.h>
 #include <uuid/uuid.h>
@@ -31,6 +32,9 @@
 #include <ctype.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "ctree.h"
 #include "ioctl.h"
@@ -38,11 +42,31 @@
 #include "utils.h"
 #include "volumes.h"
 #include "disk-io.h"
+#include "crc32c.h"
 
 #define SCRUB_DATA_FILE "/var/lib/btrfs/scrub.status"
 #define SCRUB_PROGRESS_SOCKET_PATH "/var/lib/btrfs/scrub.progress"
 #define SCRUB_FILE_VERSION_PREFIX "scrub status"
 #define SCRUB_FILE_VERSION "1"
+#define SCRUB_HISTORY_SUFFIX "history"
+#define SCRUB_HISTORY_MAGIC 0x31484255524353ULL /* "SCRUBH1" */
+#define SCRUB_HISTORY_VERSION 1
+#define SCRUB_HISTORY_FINISHED (1ULL << 0)
+#define SCRUB_HISTORY_CANCELED (1ULL << 1)
+#define SCRUB_SHM_SUFFIX "shm"
+#define SCRUB_SHM_MAGIC 0x314d485342524353ULL /* "SCRBSHM1" */
+#define SCRUB_IPC_MAGIC 0x43504953 /* "SIPC" */
+#define SCRUB_IPC_VERSION 1
+#define SCRUB_IPC_GET 1
+#define SCRUB_IPC_SUBSCRIBE 2
+#define SCRUB_IPC_PROGRESS 0x81
+#define SCRUB_IPC_ERROR 0xff
+#define SCRUB_IPC_HELLO_MS 200
+#define SCRUB_IPC_MIN_INTERVAL_MS 100
+#define SCRUB_IPC_MAX_CLIENTS 64
+#define SCRUB_RECORD_INTERVAL_MS 5000
+#define SCRUB_DEFAULT_SLICE (1024ULL * 1024 * 1024)
+#define SCRUB_MAX_BACKOFF 16
 
 struct scrub_stats {
 	time_t t_start;
@@ -52,6 +76,22 @@ struct scrub_stats {
 	u64 canceled;
 };
 
+/*
+ * paces the scrub of each device.  With a slice size the device is
+ * scrubbed by one ioctl per slice instead of a single one, and the thread
+ * sleeps between slices to stay below the target rate.  It also backs off
+ * when a slice runs much slower than the best one so far, which usually
+ * means someone else is using the disk.
+ */
+struct scrub_sched {
+	u64 rate;		/* bytes per second and device, 0 for no limit */
+	u64 slice;		/* bytes of the device per ioctl */
+	int max_running;	/* devices scrubbed at once, 0 for all */
+	int running;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
 struct scrub_progress {
 	struct btrfs_ioctl_scrub_args scrub_args;
 	int fd;
@@ -61,6 +101,10 @@ struct scrub_progress {
 	struct scrub_file_record *resumed;
 	int ioctl_errno;
 	pthread_mutex_t progress_mutex;
+	struct scrub_sched *sched;
+	u64 dev_size;
+	/* sum of the finished slices, protected by progress_mutex */
+	struct btrfs_scrub_progress done;
 };
 
 struct scrub_file_record {
@@ -74,10 +118,16 @@ struct scrub_progress_cycle {
 	int fdmnt;
 	int prg_fd;
 	int do_record;
+	int do_quiet;
 	struct btrfs_ioctl_fs_info_args *fi;
 	struct scrub_progress *progress;
 	struct scrub_progress *shared_progress;
 	pthread_mutex_t *write_mutex;
+	const char *metrics_file;
+	struct scrub_shm_header *shm;
+	struct scrub_ipc_client *clients;
+	int nr_clients;
+	u8 *ipc_buf;
 };
 
 struct scrub_fs_stat {
@@ -277,8 +327,10 @@ static void free_history(struct scrub_file_record **last_scrubs)
  * progress status before exiting.
  */
 static int cancel_fd = -1;
+static volatile sig_atomic_t cancel_requested;
 static void scrub_sigint_record_progress(int signal)
 {
+	cancel_requested = 1;
 	ioctl(cancel_fd, BTRFS_IOC_SCRUB_CANCEL, NULL);
 }
 
@@ -791,263 +843,1965 @@ out:
 	return err;
 }
 
-static void *scrub_one_dev(void *ctx)
-{
-	struct scrub_progress *sp = ctx;
-	int ret;
-	struct timeval tv;
-
-	sp->stats.canceled = 0;
-	sp->stats.duration = 0;
-	sp->stats.finished = 0;
-
-	ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
-	gettimeofday(&tv, NULL);
-	sp->ret = ret;
-	sp->stats.duration = tv.tv_sec - sp->stats.t_start;
-	sp->stats.canceled = !!ret;
-	sp->ioctl_errno = errno;
-	ret = pthread_mutex_lock(&sp->progress_mutex);
-	if (ret)
-		return ERR_PTR(-ret);
-	sp->stats.finished = 1;
-	ret = pthread_mutex_unlock(&sp->progress_mutex);
-	if (ret)
-		return ERR_PTR(-ret);
-
-	return NULL;
-}
-
-static void *progress_one_dev(void *ctx)
+/*
+ * the rate history is an append-only binary file next to the status file.
+ * Every progress cycle appends one record per running device with the
+ * cumulative counters of the current run, the final results are appended
+ * when the scrub ends.  Throughput is the difference between two records
+ * of the same run, which is identified by devid and t_start.
+ */
+struct scrub_history_header {
+	__le64 magic;
+	__le32 version;
+	__le32 record_size;
+} __attribute__ ((__packed__));
+
+struct scrub_history_record {
+	__le64 devid;
+	__le64 t_start;
+	__le64 duration;
+	__le64 data_bytes_scrubbed;
+	__le64 tree_bytes_scrubbed;
+	__le64 errors;
+	__le64 flags;
+} __attribute__ ((__packed__));
+
+static u64 scrub_error_count(struct btrfs_scrub_progress *p)
 {
-	struct scrub_progress *sp = ctx;
-
-	sp->ret = ioctl(sp->fd, BTRFS_IOC_SCRUB_PROGRESS, &sp->scrub_args);
-	sp->ioctl_errno = errno;
-
-	return NULL;
+	return p->read_errors + p->csum_errors + p->verify_errors +
+	       p->super_errors;
 }
 
-static void *scrub_progress_cycle(void *ctx)
+static int scrub_write_history(const char *fsid, struct scrub_progress *data,
+			       int n, int running_only)
 {
-	int ret;
+	char datafile[BTRFS_PATH_NAME_MAX + 1];
+	struct scrub_history_header header;
+	struct scrub_history_record *rec;
+	struct btrfs_scrub_progress *p;
+	off_t size;
+	int fd = -1;
+	int nr = 0;
 	int old;
+	int err = 0;
+	int ret;
 	int i;
-	char fsid[37];
-	struct scrub_progress *sp;
-	struct scrub_progress *sp_last;
-	struct scrub_progress *sp_shared;
-	struct timeval tv;
-	struct scrub_progress_cycle *spc = ctx;
-	int ndev = spc->fi->num_devices;
-	int this = 1;
-	int last = 0;
-	int peer_fd = -1;
-	struct pollfd accept_poll_fd = {
-		.fd = spc->prg_fd,
-		.events = POLLIN,
-		.revents = 0,
-	};
-	struct pollfd write_poll_fd = {
-		.events = POLLOUT,
-		.revents = 0,
-	};
-	struct sockaddr_un peer;
-	socklen_t peer_size = sizeof(peer);
 
-	ret = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old);
-	if (ret)
-		return ERR_PTR(-ret);
+	ret = scrub_datafile(SCRUB_DATA_FILE, fsid, SCRUB_HISTORY_SUFFIX,
+			     datafile, sizeof(datafile));
+	if (ret < 0)
+		return ret;
 
-	uuid_unparse(spc->fi->fsid, fsid);
+	rec = calloc(n, sizeof(*rec));
+	if (!rec)
+		return -ENOMEM;
 
-	for (i = 0; i < ndev; ++i) {
-		sp = &spc->progress[i];
-		sp_last = &spc->progress[i + ndev];
-		sp_shared = &spc->shared_progress[i];
-		sp->scrub_args.devid = sp_last->scrub_args.devid =
-						sp_shared->scrub_args.devid;
-		sp->fd = sp_last->fd = spc->fdmnt;
-		sp->stats.t_start = sp_last->stats.t_start =
-						sp_shared->stats.t_start;
-		sp->resumed = sp_last->resumed = sp_shared->resumed;
-		sp->skip = sp_last->skip = sp_shared->skip;
-		sp->stats.finished = sp_last->stats.finished =
-						sp_shared->stats.finished;
+	for (i = 0; i < n; ++i) {
+		if (data[i].skip)
+			continue;
+		if (running_only && data[i].stats.finished)
+			continue;
+		p = &data[i].scrub_args.progress;
+		rec[nr].devid = cpu_to_le64(data[i].scrub_args.devid);
+		rec[nr].t_start = cpu_to_le64(data[i].stats.t_start);
+		rec[nr].duration = cpu_to_le64(data[i].stats.duration);
+		rec[nr].data_bytes_scrubbed =
+			cpu_to_le64(p->data_bytes_scrubbed);
+		rec[nr].tree_bytes_scrubbed =
+			cpu_to_le64(p->tree_bytes_scrubbed);
+		rec[nr].errors = cpu_to_le64(scrub_error_count(p));
+		rec[nr].flags = cpu_to_le64(
+			(data[i].stats.finished ? SCRUB_HISTORY_FINISHED : 0) |
+			(data[i].stats.canceled ? SCRUB_HISTORY_CANCELED : 0));
+		++nr;
 	}
+	if (!nr)
+		goto out_free;
 
-	while (1) {
-		ret = poll(&accept_poll_fd, 1, 5 * 1000);
-		if (ret == -1)
-			return ERR_PTR(-errno);
-		if (ret)
-			peer_fd = accept(spc->prg_fd, (struct sockaddr *)&peer,
-					 &peer_size);
-		gettimeofday(&tv, NULL);
-		this = (this + 1)%2;
-		last = (last + 1)%2;
-		for (i = 0; i < ndev; ++i) {
-			sp = &spc->progress[this * ndev + i];
-			sp_last = &spc->progress[last * ndev + i];
-			sp_shared = &spc->shared_progress[i];
-			if (sp->stats.finished)
-				continue;
-			progress_one_dev(sp);
-			sp->stats.duration = tv.tv_sec - sp->stats.t_start;
-			if (!sp->ret)
-				continue;
-			if (sp->ioctl_errno != ENOTCONN &&
-			    sp->ioctl_errno != ENODEV)
-				return ERR_PTR(-sp->ioctl_errno);
-			/*
-			 * scrub finished or device removed, check the
-			 * finished flag. if unset, just use the last
-			 * result we got for the current write and go
-			 * on. flag should be set on next cycle, then.
-			 */
-			ret = pthread_mutex_lock(&sp_shared->progress_mutex);
-			if (ret)
-				return ERR_PTR(-ret);
-			if (!sp_shared->stats.finished) {
-				ret = pthread_mutex_unlock(
-						&sp_shared->progress_mutex);
-				if (ret)
-					return ERR_PTR(-ret);
-				memcpy(sp, sp_last, sizeof(*sp));
-				continue;
-			}
-			ret = pthread_mutex_unlock(&sp_shared->progress_mutex);
-			if (ret)
-				return ERR_PTR(-ret);
-			memcpy(sp, sp_shared, sizeof(*sp));
-			memcpy(sp_last, sp_shared, sizeof(*sp));
-		}
-		if (peer_fd != -1) {
-			write_poll_fd.fd = peer_fd;
-			ret = poll(&write_poll_fd, 1, 0);
-			if (ret == -1)
-				return ERR_PTR(-errno);
-			if (ret) {
-				ret = scrub_write_file(
-					peer_fd, fsid,
-					&spc->progress[this * ndev], ndev);
-				if (ret)
-					return ERR_PTR(ret);
-			}
-			close(peer_fd);
-			peer_fd = -1;
+	ret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	if (ret) {
+		err = -ret;
+		goto out_free;
+	}
+
+	fd = open(datafile, O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size == 0) {
+		header.magic = cpu_to_le64(SCRUB_HISTORY_MAGIC);
+		header.version = cpu_to_le32(SCRUB_HISTORY_VERSION);
+		header.record_size = cpu_to_le32(sizeof(*rec));
+		if (scrub_write_buf(fd, &header, sizeof(header))) {
+			err = -EIO;
+			goto out;
 		}
-		if (!spc->do_record)
-			continue;
-		ret = scrub_write_progress(spc->write_mutex, fsid,
-					   &spc->progress[this * ndev], ndev);
-		if (ret)
-			return ERR_PTR(ret);
 	}
+	/* one write per cycle, so readers never see half a batch */
+	if (scrub_write_buf(fd, rec, nr * sizeof(*rec)))
+		err = -EIO;
+out:
+	if (fd >= 0 && close(fd) && !err)
+		err = -errno;
+	ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+	if (ret && !err)
+		err = -ret;
+out_free:
+	free(rec);
+	return err;
 }
 
-static struct scrub_file_record *last_dev_scrub(
-		struct scrub_file_record *const *const past_scrubs, u64 devid)
-{
-	int i;
+#define _SCRUB_METRIC(f, name, type, help) \
+	fprintf(f, "# HELP btrfs_scrub_" name " " help "\n" \
+		"# TYPE btrfs_scrub_" name " " type "\n")
 
-	if (!past_scrubs || IS_ERR(past_scrubs))
-		return NULL;
+#define _SCRUB_METRIC_VAL(f, name, fsid, use, label, val) \
+	fprintf(f, "btrfs_scrub_" name "{fsid=\"%s\",devid=\"%llu\"%s} " \
+		"%llu\n", fsid, use->scrub_args.devid, label, \
+		(unsigned long long)(val))
 
-	for (i = 0; past_scrubs[i]; ++i)
-		if (past_scrubs[i]->devid == devid)
-			return past_scrubs[i];
+/*
+ * bytes per second of the last progress cycle.  Without a previous
+ * sample the average of the whole run is used, finished devices are not
+ * scrubbing anymore.
+ */
+static u64 scrub_rate(struct scrub_progress *cur, struct scrub_progress *last,
+		      u64 (*bytes)(struct btrfs_scrub_progress *p))
+{
+	u64 d;
 
-	return NULL;
+	if (cur->stats.finished)
+		return 0;
+	if (last && cur->stats.duration > last->stats.duration) {
+		d = cur->stats.duration - last->stats.duration;
+		return (bytes(&cur->scrub_args.progress) -
+			bytes(&last->scrub_args.progress)) / d;
+	}
+	if (!cur->stats.duration)
+		return 0;
+	return bytes(&cur->scrub_args.progress) / cur->stats.duration;
 }
 
-static int scrub_device_info(int fd, u64 devid,
-			     struct btrfs_ioctl_dev_info_args *di_args)
+static u64 scrub_data_bytes(struct btrfs_scrub_progress *p)
 {
-	int ret;
-
-	di_args->devid = devid;
-	memset(&di_args->uuid, '\0', sizeof(di_args->uuid));
+	return p->data_bytes_scrubbed;
+}
 
-	ret = ioctl(fd, BTRFS_IOC_DEV_INFO, di_args);
-	return ret ? -errno : 0;
+static u64 scrub_tree_bytes(struct btrfs_scrub_progress *p)
+{
+	return p->tree_bytes_scrubbed;
 }
 
-static int scrub_fs_info(int fd, char *path,
-				struct btrfs_ioctl_fs_info_args *fi_args,
-				struct btrfs_ioctl_dev_info_args **di_ret)
+/*
+ * write the progress in the Prometheus text format.  The file is replaced
+ * atomically, so a collector never reads a partial file.
+ */
+static int scrub_write_metrics(const char *path, const char *fsid,
+			       struct scrub_progress *data,
+			       struct scrub_progress *last, int n)
 {
-	int ret = 0;
-	int ndevs = 0;
-	int i = 1;
-	struct btrfs_fs_devices *fs_devices_mnt = NULL;
-	struct btrfs_ioctl_dev_info_args *di_args;
-	char mp[BTRFS_PATH_NAME_MAX + 1];
+	char tmp[BTRFS_PATH_NAME_MAX + 1];
+	struct scrub_progress *use;
+	struct scrub_progress *prev;
+	FILE *f;
+	int old;
+	int err = 0;
+	int ret;
+	int i;
 
-	memset(fi_args, 0, sizeof(*fi_args));
+	ret = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (ret >= sizeof(tmp))
+		return -EOVERFLOW;
 
-	ret = ioctl(fd, BTRFS_IOC_FS_INFO, fi_args);
-	if (ret && errno == EINVAL) {
-		/* path is no mounted btrfs. try if it's a device */
-		ret = check_mounted_where(fd, path, mp, sizeof(mp),
-						&fs_devices_mnt);
-		if (!ret)
-			return -EINVAL;
-		if (ret < 0)
-			return ret;
-		fi_args->num_devices = 1;
-		fi_args->max_id = fs_devices_mnt->latest_devid;
-		i = fs_devices_mnt->latest_devid;
-		memcpy(fi_args->fsid, fs_devices_mnt->fsid, BTRFS_FSID_SIZE);
-		close(fd);
-		fd = open_file_or_dir(mp);
-		if (fd < 0)
-			return -errno;
-	} else if (ret) {
-		return -errno;
+	ret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	if (ret)
+		return -ret;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		err = -errno;
+		goto out;
 	}
 
-	if (!fi_args->num_devices)
-		return 0;
+	_SCRUB_METRIC(f, "bytes_scrubbed", "counter",
+		      "Bytes scrubbed by the current or last scrub.");
+	for (i = 0; i < n; ++i) {
+		use = &data[i];
+		_SCRUB_METRIC_VAL(f, "bytes_scrubbed", fsid, use,
+				  ",type=\"data\"",
+				  use->scrub_args.progress.data_bytes_scrubbed);
+		_SCRUB_METRIC_VAL(f, "bytes_scrubbed", fsid, use,
+				  ",type=\"tree\"",
+				  use->scrub_args.progress.tree_bytes_scrubbed);
+	}
 
-	di_args = *di_ret = malloc(fi_args->num_devices * sizeof(*di_args));
-	if (!di_args)
-		return -errno;
+	_SCRUB_METRIC(f, "bytes_per_second", "gauge",
+		      "Scrub throughput over the last progress interval.");
+	for (i = 0; i < n; ++i) {
+		use = &data[i];
+		prev = last ? &last[i] : NULL;
+		_SCRUB_METRIC_VAL(f, "bytes_per_second", fsid, use,
+				  ",type=\"data\"",
+				  scrub_rate(use, prev, scrub_data_bytes));
+		_SCRUB_METRIC_VAL(f, "bytes_per_second", fsid, use,
+				  ",type=\"tree\"",
+				  scrub_rate(use, prev, scrub_tree_bytes));
+	}
 
-	for (; i <= fi_args->max_id; ++i) {
-		BUG_ON(ndevs >= fi_args->num_devices);
-		ret = scrub_device_info(fd, i, &di_args[ndevs]);
-		if (ret == -ENODEV)
-			continue;
-		if (ret)
-			return ret;
-		++ndevs;
+	_SCRUB_METRIC(f, "errors", "counter",
+		      "Errors found by the current or last scrub.");
+	for (i = 0; i < n; ++i) {
+		use = &data[i];
+		_SCRUB_METRIC_VAL(f, "errors", fsid, use, ",type=\"read\"",
+				  use->scrub_args.progress.read_errors);
+		_SCRUB_METRIC_VAL(f, "errors", fsid, use, ",type=\"csum\"",
+				  use->scrub_args.progress.csum_errors);
+		_SCRUB_METRIC_VAL(f, "errors", fsid, use, ",type=\"verify\"",
+				  use->scrub_args.progress.verify_errors);
+		_SCRUB_METRIC_VAL(f, "errors", fsid, use, ",type=\"super\"",
+				  use->scrub_args.progress.super_errors);
+		_SCRUB_METRIC_VAL(f, "errors", fsid, use,
+				  ",type=\"uncorrectable\"",
+				  use->scrub_args.progress.uncorrectable_errors);
+		_SCRUB_METRIC_VAL(f, "errors", fsid, use,
+				  ",type=\"corrected\"",
+				  use->scrub_args.progress.corrected_errors);
 	}
 
-	BUG_ON(ndevs == 0);
+	_SCRUB_METRIC(f, "duration_seconds", "gauge",
+		      "Run time of the current or last scrub.");
+	for (i = 0; i < n; ++i)
+		_SCRUB_METRIC_VAL(f, "duration_seconds", fsid, (&data[i]), "",
+				  data[i].stats.duration);
 
-	return 0;
+	_SCRUB_METRIC(f, "finished", "gauge",
+		      "1 if the scrub of the device has ended.");
+	for (i = 0; i < n; ++i)
+		_SCRUB_METRIC_VAL(f, "finished", fsid, (&data[i]), "",
+				  data[i].stats.finished);
+
+	if (fclose(f)) {
+		err = -errno;
+		goto out;
+	}
+	if (rename(tmp, path))
+		err = -errno;
+out:
+	ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+	if (ret && !err)
+		err = -ret;
+	return err;
 }
 
-int mkdir_p(char *path)
+/*
+ * returns all history records of the file, the number of records is
+ * stored in nr_ret
+ */
+static struct scrub_history_record *scrub_read_history(const char *fsid,
+						       int *nr_ret)
 {
-	int i;
+	char datafile[BTRFS_PATH_NAME_MAX + 1];
+	struct scrub_history_header header;
+	struct scrub_history_record *rec = NULL;
+	struct stat st;
+	u32 record_size;
+	u8 *buf = NULL;
+	int nr;
+	int fd;
 	int ret;
+	int i;
 
-	for (i = 1; i < strlen(path); ++i) {
-		if (path[i] != '/')
-			continue;
-		path[i] = '\0';
-		ret = mkdir(path, 0777);
-		if (ret && errno != EEXIST)
-			return 1;
-		path[i] = '/';
+	ret = scrub_datafile(SCRUB_DATA_FILE, fsid, SCRUB_HISTORY_SUFFIX,
+			     datafile, sizeof(datafile));
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	fd = open(datafile, O_RDONLY);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
 	}
 
-	return 0;
+	ret = read(fd, &header, sizeof(header));
+	if (ret != sizeof(header) ||
+	    le64_to_cpu(header.magic) != SCRUB_HISTORY_MAGIC) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (le32_to_cpu(header.version) != SCRUB_HISTORY_VERSION) {
+		ret = -ENOTSUP;
+		goto out;
+	}
+	record_size = le32_to_cpu(header.record_size);
+	if (record_size < sizeof(*rec)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	nr = (st.st_size - sizeof(header)) / record_size;
+	rec = calloc(nr + 1, sizeof(*rec));
+	buf = malloc(nr * record_size + 1);
+	if (!rec || !buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = read(fd, buf, nr * record_size);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+	nr = ret / record_size;
+	for (i = 0; i < nr; ++i)
+		memcpy(&rec[i], buf + i * record_size, sizeof(*rec));
+	*nr_ret = nr;
+	ret = 0;
+out:
+	free(buf);
+	close(fd);
+	if (ret) {
+		free(rec);
+		return ERR_PTR(ret);
+	}
+	return rec;
 }
 
-static int scrub_start(int argc, char **argv, int resume)
+static void print_scrub_rate_sample(u64 duration, u64 data, u64 tree,
+				    u64 errors)
+{
+	char *d = pretty_sizes(data);
+	char *t = pretty_sizes(tree);
+
+	printf("\t%8llus  data %s/s  tree %s/s  errors %llu\n",
+	       (unsigned long long)duration, d, t,
+	       (unsigned long long)errors);
+	free(d);
+	free(t);
+}
+
+/*
+ * print the throughput of the latest run on the device.  The summary
+ * shows the slowest and fastest interval, a slow or degraded disk shows
+ * up as a low minimum long before the scrub finishes.
+ */
+static void print_scrub_rate(struct btrfs_ioctl_dev_info_args *di,
+			     struct scrub_history_record *rec, int nr,
+			     int raw)
+{
+	struct scrub_history_record *prev = NULL;
+	u64 t_start = 0;
+	u64 samples = 0;
+	u64 min_rate = (u64)-1;
+	u64 max_rate = 0;
+	u64 rate = 0;
+	u64 d;
+	u64 data;
+	u64 tree;
+	u64 errors;
+	u64 bytes = 0;
+	u64 duration = 0;
+	char *s;
+	int i;
+
+	for (i = 0; i < nr; ++i)
+		if (le64_to_cpu(rec[i].devid) == di->devid)
+			t_start = max(t_start, le64_to_cpu(rec[i].t_start));
+
+	printf("scrub rate for device %s (id %llu)\n", di->path, di->devid);
+	if (!t_start) {
+		printf("\tno rate history available\n");
+		return;
+	}
+
+	for (i = 0; i < nr; ++i) {
+		if (le64_to_cpu(rec[i].devid) != di->devid ||
+		    le64_to_cpu(rec[i].t_start) != t_start)
+			continue;
+		data = le64_to_cpu(rec[i].data_bytes_scrubbed);
+		tree = le64_to_cpu(rec[i].tree_bytes_scrubbed);
+		errors = le64_to_cpu(rec[i].errors);
+		duration = le64_to_cpu(rec[i].duration);
+		bytes = data + tree;
+		d = duration;
+		if (prev) {
+			d -= le64_to_cpu(prev->duration);
+			data -= le64_to_cpu(prev->data_bytes_scrubbed);
+			tree -= le64_to_cpu(prev->tree_bytes_scrubbed);
+			errors -= le64_to_cpu(prev->errors);
+		}
+		prev = &rec[i];
+		if (!d)
+			continue;
+		rate = (data + tree) / d;
+		min_rate = min(min_rate, rate);
+		max_rate = max(max_rate, rate);
+		++samples;
+		if (raw)
+			print_scrub_rate_sample(duration, data / d, tree / d,
+						errors);
+	}
+
+	if (!samples) {
+		printf("\tno complete interval recorded yet\n");
+		return;
+	}
+	s = pretty_sizes(bytes / duration);
+	printf("\taverage %s/s over %llu seconds", s,
+	       (unsigned long long)duration);
+	free(s);
+	s = pretty_sizes(min_rate);
+	printf(", min %s/s", s);
+	free(s);
+	s = pretty_sizes(max_rate);
+	printf(", max %s/s", s);
+	free(s);
+	s = pretty_sizes(rate);
+	printf(", last %s/s\n", s);
+	free(s);
+	printf("\t%llu errors, %s\n",
+	       (unsigned long long)le64_to_cpu(prev->errors),
+	       le64_to_cpu(prev->flags) & SCRUB_HISTORY_CANCELED ?
+			"canceled" :
+	       le64_to_cpu(prev->flags) & SCRUB_HISTORY_FINISHED ?
+			"finished" : "running");
+}
+
+#define _SCRUB_ADD(dest, src, name) dest->name += src->name
+
+static void scrub_progress_add(struct btrfs_scrub_progress *dest,
+			       struct btrfs_scrub_progress *src)
+{
+	_SCRUB_ADD(dest, src, data_extents_scrubbed);
+	_SCRUB_ADD(dest, src, tree_extents_scrubbed);
+	_SCRUB_ADD(dest, src, data_bytes_scrubbed);
+	_SCRUB_ADD(dest, src, tree_bytes_scrubbed);
+	_SCRUB_ADD(dest, src, read_errors);
+	_SCRUB_ADD(dest, src, csum_errors);
+	_SCRUB_ADD(dest, src, verify_errors);
+	_SCRUB_ADD(dest, src, no_csum);
+	_SCRUB_ADD(dest, src, csum_discards);
+	_SCRUB_ADD(dest, src, super_errors);
+	_SCRUB_ADD(dest, src, malloc_errors);
+	_SCRUB_ADD(dest, src, uncorrectable_errors);
+	_SCRUB_ADD(dest, src, corrected_errors);
+	_SCRUB_ADD(dest, src, unverified_errors);
+	dest->last_physical = max(dest->last_physical, src->last_physical);
+}
+
+static void scrub_sched_get(struct scrub_sched *sched)
+{
+	if (!sched || !sched->max_running)
+		return;
+	pthread_mutex_lock(&sched->mutex);
+	while (sched->running >= sched->max_running)
+		pthread_cond_wait(&sched->cond, &sched->mutex);
+	sched->running++;
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+static void scrub_sched_put(struct scrub_sched *sched)
+{
+	if (!sched || !sched->max_running)
+		return;
+	pthread_mutex_lock(&sched->mutex);
+	sched->running--;
+	pthread_cond_signal(&sched->cond);
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+static void scrub_sleep(u64 usec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) && errno == EINTR && !cancel_requested)
+		;
+}
+
+/*
+ * scrub the device one slice at a time.  The kernel scrubs every device
+ * extent that starts before the end of the slice completely, so the next
+ * slice starts behind the last extent that was scrubbed.
+ */
+static int scrub_one_dev_sliced(struct scrub_progress *sp)
+{
+	struct scrub_sched *sched = sp->sched;
+	struct btrfs_scrub_progress *p = &sp->scrub_args.progress;
+	struct timeval t1;
+	struct timeval t2;
+	u64 cur = sp->scrub_args.start;
+	u64 stop = sp->scrub_args.end;
+	u64 best = 0;
+	u64 bytes;
+	u64 elapsed;
+	u64 rate;
+	u64 wait;
+	int backoff = 1;
+	int err = 0;
+	int ret = 0;
+
+	while (cur < stop && cur < sp->dev_size && !cancel_requested) {
+		sp->scrub_args.start = cur;
+		sp->scrub_args.end = stop - cur > sched->slice ?
+				     cur + sched->slice : stop;
+		memset(p, 0, sizeof(*p));
+		gettimeofday(&t1, NULL);
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
+		err = errno;
+		gettimeofday(&t2, NULL);
+
+		pthread_mutex_lock(&sp->progress_mutex);
+		scrub_progress_add(&sp->done, p);
+		pthread_mutex_unlock(&sp->progress_mutex);
+		if (ret)
+			break;
+		cur = max(sp->scrub_args.end, p->last_physical);
+
+		bytes = p->data_bytes_scrubbed + p->tree_bytes_scrubbed;
+		if (!bytes)
+			continue;
+		elapsed = (t2.tv_sec - t1.tv_sec) * 1000000 +
+			  t2.tv_usec - t1.tv_usec;
+		if (!elapsed)
+			elapsed = 1;
+		rate = bytes * 1000000 / elapsed;
+
+		/*
+		 * a slice at less than half the best rate means the disk is
+		 * busy, halve our duty cycle.  Recover once we are close to
+		 * the best rate again.
+		 */
+		if (rate < best / 2 && backoff < SCRUB_MAX_BACKOFF)
+			backoff *= 2;
+		else if (rate >= best / 4 * 3 && backoff > 1)
+			backoff /= 2;
+		best = max(best, rate);
+
+		wait = elapsed * (backoff - 1);
+		if (sched->rate && bytes * 1000000 / sched->rate > elapsed)
+			wait = max(wait, bytes * 1000000 / sched->rate -
+				   elapsed);
+		if (wait)
+			scrub_sleep(wait);
+	}
+
+	if (!ret && cancel_requested) {
+		ret = -1;
+		err = ECANCELED;
+	}
+	pthread_mutex_lock(&sp->progress_mutex);
+	*p = sp->done;
+	pthread_mutex_unlock(&sp->progress_mutex);
+	errno = err;
+	return ret;
+}
+
+static void *scrub_one_dev(void *ctx)
+{
+	struct scrub_progress *sp = ctx;
+	int ret;
+	int err;
+	struct timeval tv;
+
+	sp->stats.canceled = 0;
+	sp->stats.duration = 0;
+	sp->stats.finished = 0;
+
+	scrub_sched_get(sp->sched);
+	if (sp->sched && sp->sched->slice && sp->dev_size)
+		ret = scrub_one_dev_sliced(sp);
+	else
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
+	err = errno;
+	scrub_sched_put(sp->sched);
+	gettimeofday(&tv, NULL);
+	sp->ret = ret;
+	sp->stats.duration = tv.tv_sec - sp->stats.t_start;
+	sp->stats.canceled = !!ret;
+	sp->ioctl_errno = err;
+	ret = pthread_mutex_lock(&sp->progress_mutex);
+	if (ret)
+		return ERR_PTR(-ret);
+	sp->stats.finished = 1;
+	ret = pthread_mutex_unlock(&sp->progress_mutex);
+	if (ret)
+		return ERR_PTR(-ret);
+
+	return NULL;
+}
+
+static void *progress_one_dev(void *ctx)
+{
+	struct scrub_progress *sp = ctx;
+
+	sp->ret = ioctl(sp->fd, BTRFS_IOC_SCRUB_PROGRESS, &sp->scrub_args);
+	sp->ioctl_errno = errno;
+
+	return NULL;
+}
+
+/*
+ * progress protocol
+ *
+ * A client connects to the progress socket and sends a request, every
+ * message starts with a scrub_ipc_header.  SCRUB_IPC_GET is answered with
+ * one SCRUB_IPC_PROGRESS message, SCRUB_IPC_SUBSCRIBE carries an interval
+ * in milliseconds and makes the scrub push a progress message at that
+ * interval until the client unsubscribes with a zero interval or closes
+ * the connection.  A client that sends nothing within SCRUB_IPC_HELLO_MS
+ * gets the old text dump, so older scrub status binaries keep working.
+ *
+ * The scrub process also keeps the same per device records in a shared
+ * memory file next to the socket.  It is guarded by a sequence counter
+ * that is odd while the scrub updates it, scrub status reads it directly
+ * instead of talking to the scrub or parsing the status file.
+ */
+struct scrub_ipc_header {
+	__le32 magic;
+	__le16 version;
+	__le16 type;
+	__le32 len;		/* bytes following the header */
+} __attribute__ ((__packed__));
+
+struct scrub_ipc_subscribe {
+	__le32 interval_ms;
+} __attribute__ ((__packed__));
+
+struct scrub_ipc_progress {
+	u8 fsid[BTRFS_FSID_SIZE];
+	__le32 num_devices;
+	/* followed by num_devices struct scrub_ipc_dev */
+} __attribute__ ((__packed__));
+
+struct scrub_ipc_dev {
+	__le64 devid;
+	__le64 data_extents_scrubbed;
+	__le64 tree_extents_scrubbed;
+	__le64 data_bytes_scrubbed;
+	__le64 tree_bytes_scrubbed;
+	__le64 read_errors;
+	__le64 csum_errors;
+	__le64 verify_errors;
+	__le64 no_csum;
+	__le64 csum_discards;
+	__le64 super_errors;
+	__le64 malloc_errors;
+	__le64 uncorrectable_errors;
+	__le64 corrected_errors;
+	__le64 last_physical;
+	__le64 unverified_errors;
+	__le64 t_start;
+	__le64 t_resumed;
+	__le64 duration;
+	__le64 finished;
+	__le64 canceled;
+} __attribute__ ((__packed__));
+
+struct scrub_shm_header {
+	__le64 magic;
+	__le32 version;
+	__le32 num_devices;
+	__le64 pid;		/* scrub process, 0 until it runs */
+	__le64 seq;
+	/* followed by num_devices struct scrub_ipc_dev */
+} __attribute__ ((__packed__));
+
+struct scrub_ipc_client {
+	int fd;
+	int binary;		/* client sent a request */
+	u64 interval;		/* ms between updates, 0 for none */
+	u64 due;		/* ms timestamp of the next update */
+};
+
+static u64 scrub_now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (u64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+#define _SCRUB_IPC_PUT(dev, use, name) \
+	dev->name = cpu_to_le64(use->scrub_args.progress.name)
+#define _SCRUB_IPC_PUT_STATS(dev, use, name) \
+	dev->name = cpu_to_le64(use->stats.name)
+
+static void scrub_ipc_encode(struct scrub_ipc_dev *dev,
+			     struct scrub_progress *data)
+{
+	struct scrub_progress local;
+	struct scrub_progress *use;
+
+	use = scrub_resumed_stats(data, &local);
+	dev->devid = cpu_to_le64(use->scrub_args.devid);
+	_SCRUB_IPC_PUT(dev, use, data_extents_scrubbed);
+	_SCRUB_IPC_PUT(dev, use, tree_extents_scrubbed);
+	_SCRUB_IPC_PUT(dev, use, data_bytes_scrubbed);
+	_SCRUB_IPC_PUT(dev, use, tree_bytes_scrubbed);
+	_SCRUB_IPC_PUT(dev, use, read_errors);
+	_SCRUB_IPC_PUT(dev, use, csum_errors);
+	_SCRUB_IPC_PUT(dev, use, verify_errors);
+	_SCRUB_IPC_PUT(dev, use, no_csum);
+	_SCRUB_IPC_PUT(dev, use, csum_discards);
+	_SCRUB_IPC_PUT(dev, use, super_errors);
+	_SCRUB_IPC_PUT(dev, use, malloc_errors);
+	_SCRUB_IPC_PUT(dev, use, uncorrectable_errors);
+	_SCRUB_IPC_PUT(dev, use, corrected_errors);
+	_SCRUB_IPC_PUT(dev, use, last_physical);
+	_SCRUB_IPC_PUT(dev, use, unverified_errors);
+	_SCRUB_IPC_PUT_STATS(dev, use, t_start);
+	_SCRUB_IPC_PUT_STATS(dev, use, t_resumed);
+	_SCRUB_IPC_PUT_STATS(dev, use, duration);
+	_SCRUB_IPC_PUT_STATS(dev, use, finished);
+	_SCRUB_IPC_PUT_STATS(dev, use, canceled);
+}
+
+#define _SCRUB_IPC_GET(rec, dev, name) \
+	rec->p.name = le64_to_cpu(dev->name)
+#define _SCRUB_IPC_GET_STATS(rec, dev, name) \
+	rec->stats.name = le64_to_cpu(dev->name)
+
+static void scrub_ipc_decode(struct scrub_file_record *rec,
+			     struct scrub_ipc_dev *dev)
+{
+	rec->devid = le64_to_cpu(dev->devid);
+	_SCRUB_IPC_GET(rec, dev, data_extents_scrubbed);
+	_SCRUB_IPC_GET(rec, dev, tree_extents_scrubbed);
+	_SCRUB_IPC_GET(rec, dev, data_bytes_scrubbed);
+	_SCRUB_IPC_GET(rec, dev, tree_bytes_scrubbed);
+	_SCRUB_IPC_GET(rec, dev, read_errors);
+	_SCRUB_IPC_GET(rec, dev, csum_errors);
+	_SCRUB_IPC_GET(rec, dev, verify_errors);
+	_SCRUB_IPC_GET(rec, dev, no_csum);
+	_SCRUB_IPC_GET(rec, dev, csum_discards);
+	_SCRUB_IPC_GET(rec, dev, super_errors);
+	_SCRUB_IPC_GET(rec, dev, malloc_errors);
+	_SCRUB_IPC_GET(rec, dev, uncorrectable_errors);
+	_SCRUB_IPC_GET(rec, dev, corrected_errors);
+	_SCRUB_IPC_GET(rec, dev, last_physical);
+	_SCRUB_IPC_GET(rec, dev, unverified_errors);
+	_SCRUB_IPC_GET_STATS(rec, dev, t_start);
+	_SCRUB_IPC_GET_STATS(rec, dev, t_resumed);
+	_SCRUB_IPC_GET_STATS(rec, dev, duration);
+	_SCRUB_IPC_GET_STATS(rec, dev, finished);
+	_SCRUB_IPC_GET_STATS(rec, dev, canceled);
+}
+
+static size_t scrub_shm_size(int n)
+{
+	return sizeof(struct scrub_shm_header) +
+	       n * sizeof(struct scrub_ipc_dev);
+}
+
+static struct scrub_shm_header *scrub_shm_create(const char *path, int n)
+{
+	struct scrub_shm_header *shm;
+	size_t size = scrub_shm_size(n);
+	int fd;
+
+	unlink(path);
+	fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+	if (ftruncate(fd, size)) {
+		shm = ERR_PTR(-errno);
+		goto out;
+	}
+	shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		shm = ERR_PTR(-errno);
+		goto out;
+	}
+	shm->magic = cpu_to_le64(SCRUB_SHM_MAGIC);
+	shm->version = cpu_to_le32(SCRUB_IPC_VERSION);
+	shm->num_devices = cpu_to_le32(n);
+out:
+	close(fd);
+	if (IS_ERR(shm))
+		unlink(path);
+	return shm;
+}
+
+static void scrub_shm_publish(struct scrub_shm_header *shm,
+			      struct scrub_progress *data, int n)
+{
+	struct scrub_ipc_dev *dev = (struct scrub_ipc_dev *)(shm + 1);
+	u64 seq = le64_to_cpu(shm->seq);
+	int i;
+
+	shm->seq = cpu_to_le64(seq + 1);
+	__sync_synchronize();
+	for (i = 0; i < n; ++i)
+		scrub_ipc_encode(&dev[i], &data[i]);
+	__sync_synchronize();
+	shm->seq = cpu_to_le64(seq + 2);
+}
+
+/*
+ * read the progress of a running scrub from its shared memory file, the
+ * result looks like the one of scrub_read_file
+ */
+static struct scrub_file_record **scrub_shm_read(const char *fsid)
+{
+	char path[BTRFS_PATH_NAME_MAX + 1];
+	struct scrub_shm_header *shm;
+	struct scrub_ipc_dev *dev = NULL;
+	struct scrub_file_record **p = NULL;
+	struct stat st;
+	pid_t pid;
+	u64 seq;
+	int n = 0;
+	int fd;
+	int ret;
+	int i;
+	int tries;
+
+	ret = scrub_datafile(SCRUB_PROGRESS_SOCKET_PATH, fsid,
+			     SCRUB_SHM_SUFFIX, path, sizeof(path));
+	if (ret < 0)
+		return ERR_PTR(ret);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		close(fd);
+		return ERR_PTR(ret);
+	}
+	if (st.st_size < sizeof(*shm)) {
+		close(fd);
+		return ERR_PTR(-ENODATA);
+	}
+	shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return ERR_PTR(-errno);
+
+	if (le64_to_cpu(shm->magic) != SCRUB_SHM_MAGIC ||
+	    le32_to_cpu(shm->version) != SCRUB_IPC_VERSION) {
+		ret = -ENOTSUP;
+		goto out;
+	}
+	n = le32_to_cpu(shm->num_devices);
+	pid = le64_to_cpu(shm->pid);
+	if (scrub_shm_size(n) > st.st_size) {
+		ret = -ENODATA;
+		goto out;
+	}
+	/* a scrub that went away leaves a stale file behind */
+	if (!pid || (kill(pid, 0) && errno == ESRCH)) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	dev = malloc(n * sizeof(*dev));
+	p = calloc(n + 1, sizeof(*p));
+	if (!dev || !p) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (tries = 0; tries < 1000; tries++) {
+		seq = le64_to_cpu(shm->seq);
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+		memcpy(dev, shm + 1, n * sizeof(*dev));
+		__sync_synchronize();
+		if (seq == le64_to_cpu(shm->seq))
+			break;
+	}
+	if (tries == 1000 || !seq) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	for (i = 0; i < n; ++i) {
+		p[i] = calloc(1, sizeof(**p));
+		if (!p[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		uuid_parse(fsid, p[i]->fsid);
+		scrub_ipc_decode(p[i], &dev[i]);
+	}
+	ret = 0;
+out:
+	munmap(shm, st.st_size);
+	free(dev);
+	if (ret) {
+		free_history(p);
+		return ERR_PTR(ret);
+	}
+	return p;
+}
+
+static int scrub_ipc_send(int fd, u16 type, void *payload, u32 len)
+{
+	struct scrub_ipc_header *header = payload;
+
+	header->magic = cpu_to_le32(SCRUB_IPC_MAGIC);
+	header->version = cpu_to_le16(SCRUB_IPC_VERSION);
+	header->type = cpu_to_le16(type);
+	header->len = cpu_to_le32(len - sizeof(*header));
+
+	/* a client that can't keep up is dropped, scrub never waits */
+	if (send(fd, payload, len, MSG_DONTWAIT|MSG_NOSIGNAL) != len)
+		return -EIO;
+	return 0;
+}
+
+static int scrub_ipc_send_progress(struct scrub_progress_cycle *spc, int fd,
+				   struct scrub_progress *data)
+{
+	struct scrub_ipc_progress *prog;
+	struct scrub_ipc_dev *dev;
+	int n = spc->fi->num_devices;
+	int i;
+
+	prog = (struct scrub_ipc_progress *)(spc->ipc_buf +
+					     sizeof(struct scrub_ipc_header));
+	dev = (struct scrub_ipc_dev *)(prog + 1);
+	memcpy(prog->fsid, spc->fi->fsid, BTRFS_FSID_SIZE);
+	prog->num_devices = cpu_to_le32(n);
+	for (i = 0; i < n; ++i)
+		scrub_ipc_encode(&dev[i], &data[i]);
+	return scrub_ipc_send(fd, SCRUB_IPC_PROGRESS, spc->ipc_buf,
+			      (u8 *)(dev + n) - spc->ipc_buf);
+}
+
+/*
+ * handle a request of a client, returns < 0 if the client has to be
+ * dropped
+ */
+static int scrub_ipc_request(struct scrub_ipc_client *c, u64 now)
+{
+	struct scrub_ipc_header header;
+	struct scrub_ipc_subscribe sub;
+	u32 interval;
+	int ret;
+
+	ret = recv(c->fd, &header, sizeof(header), MSG_DONTWAIT);
+	if (ret != sizeof(header))
+		return -EIO;
+	if (le32_to_cpu(header.magic) != SCRUB_IPC_MAGIC)
+		return -EINVAL;
+	c->binary = 1;
+	if (le16_to_cpu(header.version) != SCRUB_IPC_VERSION) {
+		scrub_ipc_send(c->fd, SCRUB_IPC_ERROR, &header,
+			       sizeof(header));
+		return -EPROTONOSUPPORT;
+	}
+
+	switch (le16_to_cpu(header.type)) {
+	case SCRUB_IPC_GET:
+		c->due = now;
+		return 0;
+	case SCRUB_IPC_SUBSCRIBE:
+		if (le32_to_cpu(header.len) != sizeof(sub))
+			return -EINVAL;
+		ret = recv(c->fd, &sub, sizeof(sub), MSG_DONTWAIT);
+		if (ret != sizeof(sub))
+			return -EIO;
+		interval = le32_to_cpu(sub.interval_ms);
+		if (interval && interval < SCRUB_IPC_MIN_INTERVAL_MS)
+			interval = SCRUB_IPC_MIN_INTERVAL_MS;
+		c->interval = interval;
+		c->due = interval ? now : (u64)-1;
+		return 0;
+	default:
+		scrub_ipc_send(c->fd, SCRUB_IPC_ERROR, &header,
+			       sizeof(header));
+		return -EINVAL;
+	}
+}
+
+/*
+ * fetch the progress of all devices into the next buffer, the previous
+ * results stay in the other one
+ */
+static int scrub_progress_refresh(struct scrub_progress_cycle *spc,
+				  int *this, int *last)
+{
+	int ret;
+	int i;
+	struct scrub_progress *sp;
+	struct scrub_progress *sp_last;
+	struct scrub_progress *sp_shared;
+	struct timeval tv;
+	int ndev = spc->fi->num_devices;
+
+	gettimeofday(&tv, NULL);
+	*this = (*this + 1)%2;
+	*last = (*last + 1)%2;
+	for (i = 0; i < ndev; ++i) {
+		sp = &spc->progress[*this * ndev + i];
+		sp_last = &spc->progress[*last * ndev + i];
+		sp_shared = &spc->shared_progress[i];
+		if (sp->stats.finished)
+			continue;
+		progress_one_dev(sp);
+		sp->stats.duration = tv.tv_sec - sp->stats.t_start;
+		if (!sp->ret) {
+			ret = pthread_mutex_lock(&sp_shared->progress_mutex);
+			if (ret)
+				return -ret;
+			scrub_progress_add(&sp->scrub_args.progress,
+					   &sp_shared->done);
+			ret = pthread_mutex_unlock(&sp_shared->progress_mutex);
+			if (ret)
+				return -ret;
+			continue;
+		}
+		if (sp->ioctl_errno != ENOTCONN &&
+		    sp->ioctl_errno != ENODEV)
+			return -sp->ioctl_errno;
+		/*
+		 * scrub finished or device removed, check the
+		 * finished flag. if unset, just use the last
+		 * result we got for the current write and go
+		 * on. flag should be set on next cycle, then.
+		 */
+		ret = pthread_mutex_lock(&sp_shared->progress_mutex);
+		if (ret)
+			return -ret;
+		if (!sp_shared->stats.finished) {
+			ret = pthread_mutex_unlock(&sp_shared->progress_mutex);
+			if (ret)
+				return -ret;
+			memcpy(sp, sp_last, sizeof(*sp));
+			continue;
+		}
+		ret = pthread_mutex_unlock(&sp_shared->progress_mutex);
+		if (ret)
+			return -ret;
+		memcpy(sp, sp_shared, sizeof(*sp));
+		memcpy(sp_last, sp_shared, sizeof(*sp));
+	}
+
+	if (spc->shm)
+		scrub_shm_publish(spc->shm, &spc->progress[*this * ndev],
+				  ndev);
+	return 0;
+}
+
+static void scrub_ipc_drop(struct scrub_progress_cycle *spc, int i)
+{
+	close(spc->clients[i].fd);
+	spc->clients[i] = spc->clients[--spc->nr_clients];
+}
+
+/*
+ * the progress thread sleeps until a client connects or sends a request,
+ * a subscriber is due or it is time to record the progress.  The
+ * progress is only fetched from the kernel when somebody needs it.
+ */
+static void *scrub_progress_cycle(void *ctx)
+{
+	int ret;
+	int old;
+	int i;
+	int n;
+	char fsid[37];
+	struct scrub_progress *sp;
+	struct scrub_progress *sp_last;
+	struct scrub_progress *sp_shared;
+	struct scrub_progress_cycle *spc = ctx;
+	struct scrub_ipc_client *c;
+	int ndev = spc->fi->num_devices;
+	int this = 1;
+	int last = 0;
+	int peer_fd;
+	int refresh;
+	int metrics_warned = 0;
+	int history_warned = 0;
+	u64 now;
+	u64 next_record;
+	u64 timeout;
+	struct pollfd poll_fds[SCRUB_IPC_MAX_CLIENTS + 1];
+	struct sockaddr_un peer;
+	socklen_t peer_size = sizeof(peer);
+
+	ret = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old);
+	if (ret)
+		return ERR_PTR(-ret);
+
+	uuid_unparse(spc->fi->fsid, fsid);
+
+	for (i = 0; i < ndev; ++i) {
+		sp = &spc->progress[i];
+		sp_last = &spc->progress[i + ndev];
+		sp_shared = &spc->shared_progress[i];
+		sp->scrub_args.devid = sp_last->scrub_args.devid =
+						sp_shared->scrub_args.devid;
+		sp->fd = sp_last->fd = spc->fdmnt;
+		sp->stats.t_start = sp_last->stats.t_start =
+						sp_shared->stats.t_start;
+		sp->resumed = sp_last->resumed = sp_shared->resumed;
+		sp->skip = sp_last->skip = sp_shared->skip;
+		sp->stats.finished = sp_last->stats.finished =
+						sp_shared->stats.finished;
+	}
+
+	if (spc->shm)
+		spc->shm->pid = cpu_to_le64(getpid());
+
+	next_record = scrub_now_ms() + SCRUB_RECORD_INTERVAL_MS;
+	while (1) {
+		now = scrub_now_ms();
+		timeout = next_record > now ? next_record - now : 0;
+		poll_fds[0].fd = spc->prg_fd;
+		poll_fds[0].events = POLLIN;
+		for (i = 0; i < spc->nr_clients; ++i) {
+			c = &spc->clients[i];
+			if (c->due != (u64)-1)
+				timeout = min(timeout,
+					      c->due > now ? c->due - now : 0);
+			poll_fds[i + 1].fd = c->fd;
+			poll_fds[i + 1].events = POLLIN;
+		}
+		n = spc->nr_clients;
+
+		ret = poll(poll_fds, n + 1, timeout);
+		if (ret == -1 && errno != EINTR)
+			return ERR_PTR(-errno);
+		now = scrub_now_ms();
+
+		/* walk backwards, dropping a client moves the last one */
+		for (i = n - 1; ret > 0 && i >= 0; --i) {
+			if (!poll_fds[i + 1].revents)
+				continue;
+			if (scrub_ipc_request(&spc->clients[i], now) < 0)
+				scrub_ipc_drop(spc, i);
+		}
+		if (ret > 0 && poll_fds[0].revents & POLLIN) {
+			peer_fd = accept(spc->prg_fd, (struct sockaddr *)&peer,
+					 &peer_size);
+			if (peer_fd >= 0 &&
+			    spc->nr_clients == SCRUB_IPC_MAX_CLIENTS) {
+				close(peer_fd);
+			} else if (peer_fd >= 0) {
+				c = &spc->clients[spc->nr_clients++];
+				c->fd = peer_fd;
+				c->binary = 0;
+				c->interval = 0;
+				c->due = now + SCRUB_IPC_HELLO_MS;
+			}
+		}
+
+		refresh = now >= next_record;
+		for (i = 0; i < spc->nr_clients; ++i)
+			if (spc->clients[i].due <= now)
+				refresh = 1;
+		if (!refresh)
+			continue;
+
+		ret = scrub_progress_refresh(spc, &this, &last);
+		if (ret)
+			return ERR_PTR(ret);
+
+		for (i = spc->nr_clients - 1; i >= 0; --i) {
+			c = &spc->clients[i];
+			if (c->due > now)
+				continue;
+			if (!c->binary) {
+				/* no request, an old client wants text */
+				scrub_write_file(c->fd, fsid,
+						 &spc->progress[this * ndev],
+						 ndev);
+				scrub_ipc_drop(spc, i);
+				continue;
+			}
+			ret = scrub_ipc_send_progress(spc, c->fd,
+						&spc->progress[this * ndev]);
+			if (ret) {
+				scrub_ipc_drop(spc, i);
+				continue;
+			}
+			c->due = c->interval ? now + c->interval : (u64)-1;
+		}
+
+		if (now < next_record)
+			continue;
+		next_record = now + SCRUB_RECORD_INTERVAL_MS;
+		if (spc->metrics_file) {
+			ret = scrub_write_metrics(spc->metrics_file, fsid,
+						  &spc->progress[this * ndev],
+						  &spc->progress[last * ndev],
+						  ndev);
+			/* the metrics are optional, don't stop the scrub */
+			if (ret && !metrics_warned) {
+				ERR(!spc->do_quiet, "WARNING: failed to write "
+				    "metrics to %s: %s\n", spc->metrics_file,
+				    strerror(-ret));
+				metrics_warned = 1;
+			}
+		}
+		if (!spc->do_record)
+			continue;
+		ret = scrub_write_progress(spc->write_mutex, fsid,
+					   &spc->progress[this * ndev], ndev);
+		if (ret)
+			return ERR_PTR(ret);
+		ret = scrub_write_history(fsid, &spc->progress[this * ndev],
+					  ndev, 1);
+		if (ret && !history_warned) {
+			ERR(!spc->do_quiet, "WARNING: failed to write the "
+			    "scrub history: %s\n", strerror(-ret));
+			history_warned = 1;
+		}
+	}
+}
+
+static struct scrub_file_record *last_dev_scrub(
+		struct scrub_file_record *const *const past_scrubs, u64 devid)
+{
+	int i;
+
+	if (!past_scrubs || IS_ERR(past_scrubs))
+		return NULL;
+
+	for (i = 0; past_scrubs[i]; ++i)
+		if (past_scrubs[i]->devid == devid)
+			return past_scrubs[i];
+
+	return NULL;
+}
+
+static int scrub_device_info(int fd, u64 devid,
+			     struct btrfs_ioctl_dev_info_args *di_args)
+{
+	int ret;
+
+	di_args->devid = devid;
+	memset(&di_args->uuid, '\0', sizeof(di_args->uuid));
+
+	ret = ioctl(fd, BTRFS_IOC_DEV_INFO, di_args);
+	return ret ? -errno : 0;
+}
+
+static int scrub_fs_info(int fd, char *path,
+				struct btrfs_ioctl_fs_info_args *fi_args,
+				struct btrfs_ioctl_dev_info_args **di_ret)
+{
+	int ret = 0;
+	int ndevs = 0;
+	int i = 1;
+	struct btrfs_fs_devices *fs_devices_mnt = NULL;
+	struct btrfs_ioctl_dev_info_args *di_args;
+	char mp[BTRFS_PATH_NAME_MAX + 1];
+
+	memset(fi_args, 0, sizeof(*fi_args));
+
+	ret = ioctl(fd, BTRFS_IOC_FS_INFO, fi_args);
+	if (ret && errno == EINVAL) {
+		/* path is no mounted btrfs. try if it's a device */
+		ret = check_mounted_where(fd, path, mp, sizeof(mp),
+						&fs_devices_mnt);
+		if (!ret)
+			return -EINVAL;
+		if (ret < 0)
+			return ret;
+		fi_args->num_devices = 1;
+		fi_args->max_id = fs_devices_mnt->latest_devid;
+		i = fs_devices_mnt->latest_devid;
+		memcpy(fi_args->fsid, fs_devices_mnt->fsid, BTRFS_FSID_SIZE);
+		close(fd);
+		fd = open_file_or_dir(mp);
+		if (fd < 0)
+			return -errno;
+	} else if (ret) {
+		return -errno;
+	}
+
+	if (!fi_args->num_devices)
+		return 0;
+
+	di_args = *di_ret = malloc(fi_args->num_devices * sizeof(*di_args));
+	if (!di_args)
+		return -errno;
+
+	for (; i <= fi_args->max_id; ++i) {
+		BUG_ON(ndevs >= fi_args->num_devices);
+		ret = scrub_device_info(fd, i, &di_args[ndevs]);
+		if (ret == -ENODEV)
+			continue;
+		if (ret)
+			return ret;
+		++ndevs;
+	}
+
+	BUG_ON(ndevs == 0);
+
+	return 0;
+}
+
+/*
+ * offline scrub
+ *
+ * An unmounted filesystem is scrubbed with the regular tree code.  The
+ * extent tree is walked one block group at a time.  Every extent is
+ * mapped onto each of its mirrors, and the stripes are queued on the
+ * device that holds them.  One thread per device then reads its queue in
+ * physical order and checks tree block headers and data checksums.  The
+ * threads never touch the trees.  Everything they need is gathered up
+ * front, including the data checksums of the block group.
+ *
+ * Nothing is ever written, so every bad copy is counted as uncorrectable
+ * just like a read only scrub in the kernel.
+ */
+#define SCRUB_OFFLINE_READ_SIZE (1024 * 1024)
+
+struct scrub_offline_item {
+	u64 logical;
+	u64 physical;
+	u64 len;
+	u64 generation;
+	int tree;
+};
+
+struct scrub_offline_bg {
+	u64 start;
+	u64 len;
+	u32 sectorsize;
+	u16 csum_size;
+	u8 *csums;
+	u8 *have_csum;
+};
+
+struct scrub_offline_dev {
+	struct btrfs_device *device;
+	struct btrfs_fs_info *info;
+	struct scrub_offline_bg *bg;
+	struct scrub_offline_item *items;
+	int nr_items;
+	int max_items;
+	u8 *buf;
+	struct btrfs_scrub_progress p;
+	struct scrub_stats stats;
+	pthread_t t;
+	int running;
+};
+
+static int scrub_offline_queue(struct scrub_offline_dev *sdev, u64 logical,
+			       u64 physical, u64 len, u64 generation, int tree)
+{
+	struct scrub_offline_item *item;
+
+	if (sdev->nr_items == sdev->max_items) {
+		sdev->max_items = sdev->max_items ? sdev->max_items * 2 : 1024;
+		item = realloc(sdev->items,
+			       sdev->max_items * sizeof(*sdev->items));
+		if (!item)
+			return -ENOMEM;
+		sdev->items = item;
+	}
+	item = sdev->items + sdev->nr_items++;
+	item->logical = logical;
+	item->physical = physical;
+	item->len = len;
+	item->generation = generation;
+	item->tree = tree;
+	return 0;
+}
+
+static int scrub_offline_item_cmp(const void *a, const void *b)
+{
+	const struct scrub_offline_item *ia = a;
+	const struct scrub_offline_item *ib = b;
+
+	if (ia->physical < ib->physical)
+		return -1;
+	if (ia->physical > ib->physical)
+		return 1;
+	return 0;
+}
+
+static int scrub_offline_csum_ok(u8 *buf, u32 len, u8 *csum, u16 csum_size)
+{
+	char result[BTRFS_CSUM_SIZE];
+	u32 crc = ~(u32)0;
+
+	crc = crc32c(crc, buf, len);
+	btrfs_csum_final(crc, result);
+	return !memcmp(result, csum, csum_size);
+}
+
+static void scrub_offline_tree(struct scrub_offline_dev *sdev,
+			       struct scrub_offline_item *item)
+{
+	struct btrfs_header *header = (struct btrfs_header *)sdev->buf;
+	struct btrfs_scrub_progress *p = &sdev->p;
+	u16 csum_size = sdev->bg->csum_size;
+	int ret;
+
+	p->tree_extents_scrubbed++;
+	p->tree_bytes_scrubbed += item->len;
+
+	ret = pread(sdev->device->fd, sdev->buf, item->len, item->physical);
+	if (ret != item->len) {
+		p->read_errors++;
+		p->uncorrectable_errors++;
+		return;
+	}
+
+	if (le64_to_cpu(header->bytenr) != item->logical ||
+	    memcmp(header->fsid, sdev->info->fsid, BTRFS_FSID_SIZE) ||
+	    (item->generation &&
+	     le64_to_cpu(header->generation) != item->generation)) {
+		p->verify_errors++;
+		p->uncorrectable_errors++;
+		return;
+	}
+
+	if (!scrub_offline_csum_ok(sdev->buf + BTRFS_CSUM_SIZE,
+				   item->len - BTRFS_CSUM_SIZE,
+				   header->csum, csum_size)) {
+		p->csum_errors++;
+		p->uncorrectable_errors++;
+	}
+}
+
+static void scrub_offline_data(struct scrub_offline_dev *sdev,
+			       struct scrub_offline_item *item)
+{
+	struct scrub_offline_bg *bg = sdev->bg;
+	struct btrfs_scrub_progress *p = &sdev->p;
+	u32 sectorsize = bg->sectorsize;
+	u64 offset = 0;
+	u64 len;
+	u64 nr;
+	u32 i;
+	int ret;
+
+	p->data_extents_scrubbed++;
+	p->data_bytes_scrubbed += item->len;
+
+	while (offset < item->len) {
+		len = min_t(u64, item->len - offset, SCRUB_OFFLINE_READ_SIZE);
+		ret = pread(sdev->device->fd, sdev->buf, len,
+			      item->physical + offset);
+		if (ret != len) {
+			p->read_errors += len / sectorsize;
+			p->uncorrectable_errors += len / sectorsize;
+			offset += len;
+			continue;
+		}
+		nr = (item->logical + offset - bg->start) / sectorsize;
+		for (i = 0; i < len / sectorsize; i++, nr++) {
+			if (!bg->have_csum[nr]) {
+				p->no_csum++;
+				continue;
+			}
+			if (!scrub_offline_csum_ok(sdev->buf + i * sectorsize,
+						   sectorsize,
+						   bg->csums + nr * bg->csum_size,
+						   bg->csum_size)) {
+				p->csum_errors++;
+				p->uncorrectable_errors++;
+			}
+		}
+		offset += len;
+	}
+}
+
+static void *scrub_offline_one_dev(void *ctx)
+{
+	struct scrub_offline_dev *sdev = ctx;
+	struct scrub_offline_item *item;
+	int i;
+
+	qsort(sdev->items, sdev->nr_items, sizeof(*sdev->items),
+	      scrub_offline_item_cmp);
+
+	for (i = 0; i < sdev->nr_items; i++) {
+		item = sdev->items + i;
+		if (item->tree)
+			scrub_offline_tree(sdev, item);
+		else
+			scrub_offline_data(sdev, item);
+		sdev->p.last_physical = max(sdev->p.last_physical,
+					    item->physical + item->len);
+	}
+	sdev->nr_items = 0;
+	return NULL;
+}
+
+static void scrub_offline_supers(struct scrub_offline_dev *sdev)
+{
+	struct btrfs_super_block *super = &sdev->info->super_copy;
+	struct btrfs_super_block *sb = (struct btrfs_super_block *)sdev->buf;
+	u64 bytenr;
+	int ret;
+	int i;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		bytenr = btrfs_sb_offset(i);
+		if (bytenr + BTRFS_SUPER_INFO_SIZE >
+		    sdev->device->total_bytes)
+			break;
+		ret = pread(sdev->device->fd, sdev->buf,
+			      BTRFS_SUPER_INFO_SIZE, bytenr);
+		if (ret != BTRFS_SUPER_INFO_SIZE) {
+			sdev->p.super_errors++;
+			continue;
+		}
+		if (btrfs_super_bytenr(sb) != bytenr ||
+		    btrfs_super_generation(sb) !=
+		    btrfs_super_generation(super) ||
+		    memcmp(sb->fsid, super->fsid, BTRFS_FSID_SIZE) ||
+		    !scrub_offline_csum_ok(sdev->buf + BTRFS_CSUM_SIZE,
+				BTRFS_SUPER_INFO_SIZE - BTRFS_CSUM_SIZE,
+				sb->csum, btrfs_super_csum_size(super)))
+			sdev->p.super_errors++;
+	}
+}
+
+/*
+ * copy the data checksums that fall into the block group out of the
+ * csum tree
+ */
+static int scrub_offline_load_csums(struct btrfs_root *root,
+				    struct scrub_offline_bg *bg)
+{
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	unsigned long ptr;
+	u64 nr_sectors = bg->len / bg->sectorsize;
+	u64 end = bg->start + bg->len;
+	u64 bytenr;
+	u32 nritems;
+	u32 i;
+	int ret;
+
+	bg->csums = calloc(nr_sectors, bg->csum_size);
+	bg->have_csum = calloc(nr_sectors, 1);
+	path = btrfs_alloc_path();
+	if (!bg->csums || !bg->have_csum || !path) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = bg->start;
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+	if (ret > 0 && path->slots[0] > 0)
+		path->slots[0]--;
+
+	while (1) {
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, path);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY) {
+			if (key.objectid > BTRFS_EXTENT_CSUM_OBJECTID)
+				break;
+			path->slots[0]++;
+			continue;
+		}
+		if (key.offset >= end)
+			break;
+
+		ptr = btrfs_item_ptr_offset(leaf, path->slots[0]);
+		nritems = btrfs_item_size_nr(leaf, path->slots[0]) /
+			  bg->csum_size;
+		for (i = 0; i < nritems; i++) {
+			bytenr = key.offset + (u64)i * bg->sectorsize;
+			if (bytenr < bg->start)
+				continue;
+			if (bytenr >= end)
+				break;
+			bytenr = (bytenr - bg->start) / bg->sectorsize;
+			read_extent_buffer(leaf, bg->csums +
+					   bytenr * bg->csum_size,
+					   ptr + i * bg->csum_size,
+					   bg->csum_size);
+			bg->have_csum[bytenr] = 1;
+		}
+		path->slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_free_path(path);
+	return ret;
+}
+
+static struct scrub_offline_dev *scrub_offline_find_dev(
+		struct scrub_offline_dev *sdevs, int ndev,
+		struct btrfs_device *device)
+{
+	int i;
+
+	for (i = 0; i < ndev; i++)
+		if (sdevs[i].device == device)
+			return &sdevs[i];
+	return NULL;
+}
+
+/*
+ * queue every mirror of an extent on the devices that hold it.  A stripe
+ * boundary splits the extent into one item per stripe.
+ */
+static int scrub_offline_map_extent(struct btrfs_fs_info *info,
+				    struct scrub_offline_dev *sdevs, int ndev,
+				    u64 bytenr, u64 num_bytes, u64 generation,
+				    int tree)
+{
+	struct btrfs_mapping_tree *map_tree = &info->mapping_tree;
+	struct btrfs_multi_bio *multi = NULL;
+	struct scrub_offline_dev *sdev;
+	u64 cur;
+	u64 len;
+	int num_copies;
+	int mirror;
+	int ret;
+
+	num_copies = btrfs_num_copies(map_tree, bytenr, num_bytes);
+	for (mirror = 1; mirror <= num_copies; mirror++) {
+		cur = bytenr;
+		while (cur < bytenr + num_bytes) {
+			len = bytenr + num_bytes - cur;
+			ret = btrfs_map_block(map_tree, READ, cur, &len,
+					      &multi, mirror);
+			if (ret)
+				return ret;
+			len = min(len, bytenr + num_bytes - cur);
+			sdev = scrub_offline_find_dev(sdevs, ndev,
+						      multi->stripes[0].dev);
+			if (sdev) {
+				ret = scrub_offline_queue(sdev, cur,
+						multi->stripes[0].physical,
+						len, generation, tree);
+				if (ret) {
+					kfree(multi);
+					return ret;
+				}
+			}
+			kfree(multi);
+			multi = NULL;
+			cur += len;
+		}
+	}
+	return 0;
+}
+
+static int scrub_offline_block_group(struct btrfs_fs_info *info,
+				     struct btrfs_block_group_cache *cache,
+				     struct scrub_offline_dev *sdevs, int ndev)
+{
+	struct btrfs_root *root = info->extent_root;
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_extent_item *ei;
+	struct btrfs_key key;
+	struct scrub_offline_bg bg;
+	u64 end = cache->key.objectid + cache->key.offset;
+	u64 generation;
+	int tree;
+	int ret;
+	int i;
+
+	memset(&bg, 0, sizeof(bg));
+	bg.start = cache->key.objectid;
+	bg.len = cache->key.offset;
+	bg.sectorsize = root->sectorsize;
+	bg.csum_size = btrfs_super_csum_size(&info->super_copy);
+
+	if (cache->flags & BTRFS_BLOCK_GROUP_DATA) {
+		ret = scrub_offline_load_csums(info->csum_root, &bg);
+		if (ret)
+			goto out_bg;
+	}
+
+	path = btrfs_alloc_path();
+	if (!path) {
+		ret = -ENOMEM;
+		goto out_bg;
+	}
+
+	key.objectid = bg.start;
+	key.type = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	while (1) {
+		leaf = path->nodes[0];
+		if (path->slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, path);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if (key.objectid >= end)
+			break;
+		if (key.type != BTRFS_EXTENT_ITEM_KEY) {
+			path->slots[0]++;
+			continue;
+		}
+
+		if (btrfs_item_size_nr(leaf, path->slots[0]) >= sizeof(*ei)) {
+			ei = btrfs_item_ptr(leaf, path->slots[0],
+					    struct btrfs_extent_item);
+			tree = !!(btrfs_extent_flags(leaf, ei) &
+				  BTRFS_EXTENT_FLAG_TREE_BLOCK);
+			generation = tree ? btrfs_extent_generation(leaf, ei) :
+				     0;
+		} else {
+			/* v0 extent items don't say what they are */
+			tree = !(cache->flags & BTRFS_BLOCK_GROUP_DATA);
+			generation = 0;
+		}
+
+		ret = scrub_offline_map_extent(info, sdevs, ndev, key.objectid,
+					       key.offset, generation, tree);
+		if (ret)
+			goto out;
+		path->slots[0]++;
+	}
+	btrfs_release_path(root, path);
+
+	for (i = 0; i < ndev; i++) {
+		sdevs[i].bg = &bg;
+		if (!sdevs[i].nr_items)
+			continue;
+		ret = pthread_create(&sdevs[i].t, NULL, scrub_offline_one_dev,
+				     &sdevs[i]);
+		if (ret) {
+			/* scrub this device from here instead */
+			scrub_offline_one_dev(&sdevs[i]);
+			continue;
+		}
+		sdevs[i].running = 1;
+	}
+	for (i = 0; i < ndev; i++) {
+		if (sdevs[i].running)
+			pthread_join(sdevs[i].t, NULL);
+		sdevs[i].running = 0;
+	}
+	ret = 0;
+out:
+	btrfs_free_path(path);
+out_bg:
+	free(bg.csums);
+	free(bg.have_csum);
+	return ret;
+}
+
+static int scrub_offline(char *path, int do_quiet, int print_raw,
+			 int do_stats_per_dev, int do_record,
+			 const char *metrics_file)
+{
+	struct btrfs_root *root;
+	struct btrfs_fs_info *info;
+	struct btrfs_device *device;
+	struct btrfs_block_group_cache *cache;
+	struct btrfs_ioctl_dev_info_args di;
+	struct scrub_offline_dev *sdevs = NULL;
+	struct scrub_progress *sp = NULL;
+	struct scrub_fs_stat fs_stat;
+	pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+	struct timeval tv;
+	char fsid[37];
+	u64 last = 0;
+	int ndev = 0;
+	int err = 0;
+	int e_uncorrectable = 0;
+	int ret;
+	int i;
+
+	ret = check_mounted(path);
+	if (ret < 0) {
+		ERR(!do_quiet, "ERROR: could not check mount status of %s: "
+		    "%s\n", path, strerror(-ret));
+		return 1;
+	}
+	if (ret) {
+		ERR(!do_quiet, "ERROR: %s is mounted, scrub it online\n",
+		    path);
+		return 1;
+	}
+
+	root = open_ctree(path, 0, 0);
+	if (!root) {
+		ERR(!do_quiet, "ERROR: unable to open %s\n", path);
+		return 1;
+	}
+	info = root->fs_info;
+	uuid_unparse(info->fsid, fsid);
+
+	list_for_each_entry(device, &info->fs_devices->devices, dev_list) {
+		if (device->fd < 0 || !device->name) {
+			ERR(!do_quiet, "WARNING: device %llu is missing, "
+			    "skipping it\n", (unsigned long long)device->devid);
+			continue;
+		}
+		ndev++;
+	}
+	sdevs = calloc(ndev, sizeof(*sdevs));
+	sp = calloc(ndev, sizeof(*sp));
+	if (!sdevs || !sp) {
+		ERR(!do_quiet, "ERROR: scrub failed: %s\n", strerror(errno));
+		err = 1;
+		goto out;
+	}
+
+	gettimeofday(&tv, NULL);
+	i = 0;
+	list_for_each_entry(device, &info->fs_devices->devices, dev_list) {
+		if (device->fd < 0 || !device->name)
+			continue;
+		sdevs[i].device = device;
+		sdevs[i].info = info;
+		sdevs[i].stats.t_start = tv.tv_sec;
+		sdevs[i].buf = malloc(SCRUB_OFFLINE_READ_SIZE);
+		if (!sdevs[i].buf) {
+			ERR(!do_quiet, "ERROR: scrub failed: %s\n",
+			    strerror(errno));
+			err = 1;
+			goto out;
+		}
+		scrub_offline_supers(&sdevs[i]);
+		i++;
+	}
+
+	if (!do_quiet)
+		printf("offline scrub started on %s, fsid %s\n", path, fsid);
+
+	while ((cache = btrfs_lookup_first_block_group(info, last))) {
+		last = cache->key.objectid + cache->key.offset;
+		ret = scrub_offline_block_group(info, cache, sdevs, ndev);
+		if (ret) {
+			ERR(!do_quiet, "ERROR: scrubbing block group %llu "
+			    "failed: %s\n",
+			    (unsigned long long)cache->key.objectid,
+			    strerror(-ret));
+			err = 1;
+			break;
+		}
+	}
+
+	gettimeofday(&tv, NULL);
+	for (i = 0; i < ndev; i++) {
+		sdevs[i].stats.duration = tv.tv_sec - sdevs[i].stats.t_start;
+		sdevs[i].stats.finished = 1;
+		sdevs[i].stats.canceled = err;
+		sp[i].scrub_args.devid = sdevs[i].device->devid;
+		sp[i].scrub_args.progress = sdevs[i].p;
+		sp[i].stats = sdevs[i].stats;
+		if (sdevs[i].p.uncorrectable_errors ||
+		    sdevs[i].p.super_errors)
+			e_uncorrectable++;
+	}
+
+	if (!do_quiet) {
+		if (!do_stats_per_dev)
+			init_fs_stat(&fs_stat);
+		for (i = 0; i < ndev; i++) {
+			if (do_stats_per_dev) {
+				memset(&di, 0, sizeof(di));
+				di.devid = sdevs[i].device->devid;
+				strncpy((char *)di.path, sdevs[i].device->name,
+					sizeof(di.path) - 1);
+				print_scrub_dev(&di, &sdevs[i].p, print_raw,
+						err ? "canceled" : "done",
+						&sdevs[i].stats);
+			} else {
+				add_to_fs_stat(&sdevs[i].p, &sdevs[i].stats,
+					       &fs_stat);
+			}
+		}
+		if (!do_stats_per_dev) {
+			printf("scrub %s for %s\n", err ? "canceled" : "done",
+			       fsid);
+			print_fs_stat(&fs_stat, print_raw);
+		}
+	}
+
+	if (do_record) {
+		ret = scrub_write_progress(&write_mutex, fsid, sp, ndev);
+		if (!ret)
+			ret = scrub_write_history(fsid, sp, ndev, 0);
+		if (ret)
+			ERR(!do_quiet, "ERROR: failed to record the result: "
+			    "%s\n", strerror(-ret));
+	}
+	if (metrics_file) {
+		ret = scrub_write_metrics(metrics_file, fsid, sp, NULL, ndev);
+		if (ret)
+			ERR(!do_quiet, "ERROR: failed to write metrics to %s: "
+			    "%s\n", metrics_file, strerror(-ret));
+	}
+
+out:
+	if (sdevs) {
+		for (i = 0; i < ndev; i++) {
+			free(sdevs[i].items);
+			free(sdevs[i].buf);
+		}
+	}
+	free(sdevs);
+	free(sp);
+	close_ctree(root);
+
+	if (err)
+		return 1;
+	if (e_uncorrectable)
+		return 8;
+	return 0;
+}
+
+int mkdir_p(char *path)
+{
+	int i;
+	int ret;
+
+	for (i = 1; i < strlen(path); ++i) {
+		if (path[i] != '/')
+			continue;
+		path[i] = '\0';
+		ret = mkdir(path, 0777);
+		if (ret && errno != EEXIST)
+			return 1;
+		path[i] = '/';
+	}
+
+	return 0;
+}
+
+static void scrub_start_usage(void)
+{
+	fprintf(stderr, "ERROR: scrub args invalid.\n"
+			" -b  max bytes per second and device\n"
+			" -j  max devices scrubbed at once\n"
+			" -s  bytes of a device per slice\n"
+			" -B  do not background\n"
+			" -d  stats per device (-B only)\n"
+			" -m  write metrics to <file>\n"
+			" -o  scrub an unmounted device\n"
+			" -q  quiet\n"
+			" -r  read only mode\n");
+}
+
+static int scrub_start(int argc, char **argv, int resume)
 {
 	int fdmnt;
 	int prg_fd = -1;
@@ -1061,6 +2815,7 @@ static int scrub_start(int argc, char **argv, int resume)
 	int e_correctable = 0;
 	int print_raw = 0;
 	char *path;
+	char *metrics_file = NULL;
 	int do_background = 1;
 	int do_wait = 0;
 	int do_print = 0;
@@ -1068,6 +2823,7 @@ static int scrub_start(int argc, char **argv, int resume)
 	int do_record = 1;
 	int readonly = 0;
 	int do_stats_per_dev = 0;
+	int do_offline = 0;
 	int n_start = 0;
 	int n_skip = 0;
 	int n_resume = 0;
@@ -1087,14 +2843,49 @@ static int scrub_start(int argc, char **argv, int resume)
 	char *datafile = strdup(SCRUB_DATA_FILE);
 	char fsid[37];
 	char sock_path[BTRFS_PATH_NAME_MAX + 1] = "";
+	char shm_path[BTRFS_PATH_NAME_MAX + 1] = "";
 	struct scrub_progress_cycle spc;
 	pthread_mutex_t spc_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+	struct scrub_sched sched = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
 	void *terr;
 	u64 devid;
+	u64 count;
+	char *end;
 
 	optind = 1;
-	while ((c = getopt(argc, argv, "BdqrR")) != -1) {
+	while ((c = getopt(argc, argv, "b:Bdj:m:oqrRs:")) != -1) {
 		switch (c) {
+		case 'b':
+			if (parse_size(optarg, &sched.rate) || !sched.rate) {
+				fprintf(stderr, "ERROR: invalid rate '%s'\n",
+					optarg);
+				scrub_start_usage();
+				return 1;
+			}
+			break;
+		case 'j':
+			errno = 0;
+			count = strtoull(optarg, &end, 10);
+			if (!isdigit(optarg[0]) || errno || *end || !count ||
+			    count > INT_MAX) {
+				fprintf(stderr, "ERROR: invalid number of "
+					"devices '%s'\n", optarg);
+				scrub_start_usage();
+				return 1;
+			}
+			sched.max_running = count;
+			break;
+		case 's':
+			if (parse_size(optarg, &sched.slice) || !sched.slice) {
+				fprintf(stderr, "ERROR: invalid slice size "
+					"'%s'\n", optarg);
+				scrub_start_usage();
+				return 1;
+			}
+			break;
 		case 'B':
 			do_background = 0;
 			do_wait = 1;
@@ -1103,6 +2894,12 @@ static int scrub_start(int argc, char **argv, int resume)
 		case 'd':
 			do_stats_per_dev = 1;
 			break;
+		case 'm':
+			metrics_file = optarg;
+			break;
+		case 'o':
+			do_offline = 1;
+			break;
 		case 'q':
 			do_quiet = 1;
 			break;
@@ -1114,11 +2911,7 @@ static int scrub_start(int argc, char **argv, int resume)
 			break;
 		case '?':
 		default:
-			fprintf(stderr, "ERROR: scrub args invalid.\n"
-					" -B  do not background\n"
-					" -d  stats per device (-B only)\n"
-					" -q  quiet\n"
-					" -r  read only mode\n");
+			scrub_start_usage();
 			return 1;
 		}
 	}
@@ -1132,9 +2925,16 @@ static int scrub_start(int argc, char **argv, int resume)
 	}
 
 	spc.progress = NULL;
+	spc.shm = NULL;
+	spc.clients = NULL;
+	spc.nr_clients = 0;
+	spc.ipc_buf = NULL;
 	if (do_quiet && do_print)
 		do_print = 0;
 
+	if (sched.rate && !sched.slice)
+		sched.slice = SCRUB_DEFAULT_SLICE;
+
 	if (mkdir_p(datafile)) {
 		ERR(!do_quiet, "WARNING: cannot create scrub data "
 			       "file, mkdir %s failed: %s. Status recording "
@@ -1145,6 +2945,17 @@ static int scrub_start(int argc, char **argv, int resume)
 
 	path = argv[optind];
 
+	if (do_offline) {
+		if (resume) {
+			ERR(!do_quiet, "ERROR: offline scrub cannot be "
+			    "resumed\n");
+			return 1;
+		}
+		return scrub_offline(path, do_quiet, print_raw,
+				     do_stats_per_dev, do_record,
+				     metrics_file);
+	}
+
 	fdmnt = open_file_or_dir(path);
 	if (fdmnt < 0) {
 		ERR(!do_quiet, "ERROR: can't access '%s'\n", path);
@@ -1180,8 +2991,13 @@ static int scrub_start(int argc, char **argv, int resume)
 	t_devs = malloc(fi_args.num_devices * sizeof(*t_devs));
 	sp = calloc(fi_args.num_devices, sizeof(*sp));
 	spc.progress = calloc(fi_args.num_devices * 2, sizeof(*spc.progress));
+	spc.clients = calloc(SCRUB_IPC_MAX_CLIENTS, sizeof(*spc.clients));
+	spc.ipc_buf = malloc(sizeof(struct scrub_ipc_header) +
+			     sizeof(struct scrub_ipc_progress) +
+			     fi_args.num_devices *
+			     sizeof(struct scrub_ipc_dev));
 
-	if (!t_devs || !sp || !spc.progress) {
+	if (!t_devs || !sp || !spc.progress || !spc.clients || !spc.ipc_buf) {
 		ERR(!do_quiet, "ERROR: scrub failed: %s", strerror(errno));
 		err = 1;
 		goto out;
@@ -1207,6 +3023,8 @@ static int scrub_start(int argc, char **argv, int resume)
 		last_scrub = last_dev_scrub(past_scrubs, devid);
 		sp[i].scrub_args.devid = devid;
 		sp[i].fd = fdmnt;
+		sp[i].sched = &sched;
+		sp[i].dev_size = di_args[i].total_bytes;
 		if (resume && last_scrub && (last_scrub->stats.canceled ||
 					     !last_scrub->stats.finished)) {
 			++n_resume;
@@ -1301,6 +3119,8 @@ static int scrub_start(int argc, char **argv, int resume)
 		if (pid) {
 			int stat;
 			scrub_handle_sigint_parent();
+			/* the socket belongs to the scrub process now */
+			sock_path[0] = '\0';
 			if (!do_quiet)
 				printf("scrub %s on %s, fsid %s (pid=%d)\n",
 				       n_start ? "started" : "resumed",
@@ -1328,6 +3148,18 @@ static int scrub_start(int argc, char **argv, int resume)
 
 	scrub_handle_sigint_child(fdmnt);
 
+	ret = scrub_datafile(SCRUB_PROGRESS_SOCKET_PATH, fsid, SCRUB_SHM_SUFFIX,
+			     shm_path, sizeof(shm_path));
+	if (!ret) {
+		spc.shm = scrub_shm_create(shm_path, fi_args.num_devices);
+		if (IS_ERR(spc.shm)) {
+			ERR(do_print, "WARNING: failed to create the progress "
+			    "memory at %s: %s\n", shm_path,
+			    strerror(-PTR_ERR(spc.shm)));
+			spc.shm = NULL;
+		}
+	}
+
 	for (i = 0; i < fi_args.num_devices; ++i) {
 		if (sp[i].skip) {
 			sp[i].scrub_args.progress = sp[i].resumed->p;
@@ -1354,7 +3186,9 @@ static int scrub_start(int argc, char **argv, int resume)
 	spc.fdmnt = fdmnt;
 	spc.prg_fd = prg_fd;
 	spc.do_record = do_record;
+	spc.do_quiet = do_quiet;
 	spc.write_mutex = &spc_write_mutex;
+	spc.metrics_file = metrics_file;
 	spc.shared_progress = sp;
 	spc.fi = &fi_args;
 	ret = pthread_create(&t_prog, &t_attr, scrub_progress_cycle, &spc);
@@ -1443,12 +3277,24 @@ static int scrub_start(int argc, char **argv, int resume)
 	if (do_record) {
 		ret = scrub_write_progress(&spc_write_mutex, fsid, sp,
 					   fi_args.num_devices);
+		if (!ret)
+			ret = scrub_write_history(fsid, sp,
+						  fi_args.num_devices, 0);
 		if (ret && do_print) {
 			fprintf(stderr, "ERROR: failed to record the result: "
 				"%s\n", strerror(-ret));
 		}
 	}
 
+	if (metrics_file) {
+		ret = scrub_write_metrics(metrics_file, fsid, sp, NULL,
+					  fi_args.num_devices);
+		if (ret && do_print) {
+			fprintf(stderr, "ERROR: failed to write metrics to "
+				"%s: %s\n", metrics_file, strerror(-ret));
+		}
+	}
+
 	scrub_handle_sigint_child(-1);
 
 out:
@@ -1457,6 +3303,14 @@ out:
 	free(t_devs);
 	free(sp);
 	free(spc.progress);
+	for (i = 0; i < spc.nr_clients; ++i)
+		close(spc.clients[i].fd);
+	free(spc.clients);
+	free(spc.ipc_buf);
+	if (spc.shm) {
+		munmap(spc.shm, scrub_shm_size(fi_args.num_devices));
+		unlink(shm_path);
+	}
 	if (prg_fd > -1) {
 		close(prg_fd);
 		if (sock_path[0])
@@ -1546,12 +3400,20 @@ int do_scrub_status(int argc, char **argv)
 	optind = 1;
 	int print_raw = 0;
 	int do_stats_per_dev = 0;
-	char c;
+	int do_rate = 0;
+	int c;
 	char fsid[37];
 	int fdres = -1;
 	int err = 0;
+	int nr_history = 0;
+	struct scrub_history_record *history = NULL;
+	static struct option long_options[] = {
+		{ "rate", 0, NULL, 'r' },
+		{ 0, 0, 0, 0 }
+	};
 
-	while ((c = getopt(argc, argv, "dR")) != -1) {
+	while ((c = getopt_long(argc, argv, "dR", long_options,
+				NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			do_stats_per_dev = 1;
@@ -1559,10 +3421,15 @@ int do_scrub_status(int argc, char **argv)
 		case 'R':
 			print_raw = 1;
 			break;
+		case 'r':
+			do_rate = 1;
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "ERROR: scrub status args invalid.\n"
-					" -d  stats per device\n");
+					" -d      stats per device\n"
+					" --rate  throughput of the last "
+					"scrub\n");
 			return 1;
 		}
 	}
@@ -1596,6 +3463,12 @@ int do_scrub_status(int argc, char **argv)
 
 	uuid_unparse(fi_args.fsid, fsid);
 
+	/* a running scrub publishes its progress in shared memory */
+	past_scrubs = scrub_shm_read(fsid);
+	if (!IS_ERR(past_scrubs))
+		goto print;
+	past_scrubs = NULL;
+
 	fdres = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fdres == -1) {
 		fprintf(stderr, "ERROR: failed to create socket to "
@@ -1626,6 +3499,7 @@ int do_scrub_status(int argc, char **argv)
 				strerror(-PTR_ERR(past_scrubs)));
 	}
 
+print:
 	printf("scrub status for %s\n", fsid);
 
 	if (do_stats_per_dev) {
@@ -1655,8 +3529,23 @@ int do_scrub_status(int argc, char **argv)
 		print_fs_stat(&fs_stat, print_raw);
 	}
 
+	if (do_rate) {
+		history = scrub_read_history(fsid, &nr_history);
+		if (IS_ERR(history)) {
+			if (PTR_ERR(history) != -ENOENT)
+				fprintf(stderr, "WARNING: failed to read rate "
+					"history: %s\n",
+					strerror(-PTR_ERR(history)));
+			history = NULL;
+		}
+		for (i = 0; i < fi_args.num_devices; ++i)
+			print_scrub_rate(&di_args[i], history, nr_history,
+					 print_raw);
+	}
+
 out:
 	free_history(past_scrubs);
+	free(history);
 	free(di_args);
 	close(fdmnt);
 	if (fdres > -1)
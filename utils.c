@@ -26,6 +26,7 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <uuid/uuid.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -35,6 +36,8 @@
 #include <linux/major.h>
 #include <linux/kdev_t.h>
 #include <limits.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
 #include "ctree.h"
@@ -53,6 +56,12 @@ static inline int ioctl(int fd, int define, u64 *size) { return 0; }
 #ifndef BLKDISCARD
 #define BLKDISCARD	_IO(0x12,119)
 #endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+
+/* not declared with _XOPEN_SOURCE */
+extern int fallocate(int fd, int mode, off_t offset, off_t len);
 
 static int
 discard_blocks(int fd, u64 start, u64 len)
@@ -425,12 +434,29 @@ static u64 device_size(int fd, struct stat *st)
 	return 0;
 }
 
+/*
+ * let the device zero the range, or punch it out of an image file.
+ * Only when neither works the zeros are written out.
+ */
 static int zero_blocks(int fd, off_t start, size_t len)
 {
-	char *buf = malloc(len);
+	u64 range[2] = { start, len };
+	struct stat st;
+	char *buf;
 	int ret = 0;
 	ssize_t written;
 
+	if (fstat(fd, &st) == 0) {
+		if (S_ISBLK(st.st_mode) &&
+		    ioctl(fd, BLKZEROOUT, &range) == 0)
+			return 0;
+		if (S_ISREG(st.st_mode) && start + len <= st.st_size &&
+		    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      start, len) == 0)
+			return 0;
+	}
+
+	buf = malloc(len);
 	if (!buf)
 		return -ENOMEM;
 	memset(buf, 0, len);
@@ -501,6 +527,7 @@ int btrfs_add_to_fsid(struct btrfs_trans_handle *trans,
 	device->total_bytes = block_count;
 	device->bytes_used = 0;
 	device->total_ios = 0;
+	device->reada_depth = 0;
 	device->dev_root = root->fs_info->dev_root;
 
 	ret = btrfs_add_device(trans, root, device);
@@ -536,62 +563,138 @@ int btrfs_add_to_fsid(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
-int btrfs_prepare_device(int fd, char *file, int zero_end, u64 *block_count_ret,
-			 int *mixed)
+static u64 prepare_now_ms(void)
 {
-	u64 block_count;
-	u64 bytenr;
-	struct stat st;
-	int i, ret;
+	struct timeval tv;
 
-	ret = fstat(fd, &st);
-	if (ret < 0) {
-		fprintf(stderr, "unable to stat %s\n", file);
-		exit(1);
-	}
+	gettimeofday(&tv, NULL);
+	return (u64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
 
-	block_count = device_size(fd, &st);
-	if (block_count == 0) {
-		fprintf(stderr, "unable to find %s size\n", file);
-		exit(1);
-	}
-	zero_end = 1;
+struct prepare_worker {
+	pthread_t thread;
+	int started;
+};
 
-	if (block_count < 1024 * 1024 * 1024 && !(*mixed)) {
-		printf("SMALL VOLUME: forcing mixed metadata/data groups\n");
-		*mixed = 1;
-	}
+/* discard and zero one device, errors are left in dev->ret */
+static void *prepare_thread(void *data)
+{
+	struct btrfs_prepare_device *dev = data;
+	u64 start;
+	u64 bytenr;
+	int i;
 
+	start = prepare_now_ms();
 	/*
 	 * We intentionally ignore errors from the discard ioctl.  It is
 	 * not necessary for the mkfs functionality but just an optimization.
 	 */
-	discard_blocks(fd, 0, block_count);
+	discard_blocks(dev->fd, 0, dev->block_count);
+	dev->discard_ms = prepare_now_ms() - start;
 
-	ret = zero_dev_start(fd);
-	if (ret) {
-		fprintf(stderr, "failed to zero device start %d\n", ret);
-		exit(1);
+	start = prepare_now_ms();
+	dev->ret = zero_dev_start(dev->fd);
+	if (dev->ret) {
+		dev->error = "device start";
+		return NULL;
 	}
 
 	for (i = 0 ; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
-		if (bytenr >= block_count)
+		if (bytenr >= dev->block_count)
 			break;
-		zero_blocks(fd, bytenr, BTRFS_SUPER_INFO_SIZE);
+		zero_blocks(dev->fd, bytenr, BTRFS_SUPER_INFO_SIZE);
 	}
 
-	if (zero_end) {
-		ret = zero_dev_end(fd, block_count);
-		if (ret) {
-			fprintf(stderr, "failed to zero device end %d\n", ret);
+	if (dev->zero_end) {
+		dev->ret = zero_dev_end(dev->fd, dev->block_count);
+		if (dev->ret) {
+			dev->error = "device end";
+			return NULL;
+		}
+	}
+	dev->zero_ms = prepare_now_ms() - start;
+	return NULL;
+}
+
+/*
+ * find the size of every device and discard and zero them all at the
+ * same time, one thread per device.  The first device decides if the
+ * filesystem gets mixed block groups.
+ */
+int btrfs_prepare_devices(struct btrfs_prepare_device *devs, int nr,
+			  int *mixed)
+{
+	struct btrfs_prepare_device *dev;
+	struct prepare_worker *workers;
+	struct stat st;
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		dev = devs + i;
+		ret = fstat(dev->fd, &st);
+		if (ret < 0) {
+			fprintf(stderr, "unable to stat %s\n", dev->file);
+			exit(1);
+		}
+
+		dev->block_count = device_size(dev->fd, &st);
+		if (dev->block_count == 0) {
+			fprintf(stderr, "unable to find %s size\n", dev->file);
+			exit(1);
+		}
+		dev->zero_end = 1;
+		dev->ret = 0;
+		dev->error = NULL;
+	}
+
+	if (devs[0].block_count < 1024 * 1024 * 1024 && !(*mixed)) {
+		printf("SMALL VOLUME: forcing mixed metadata/data groups\n");
+		*mixed = 1;
+	}
+
+	/* the calling thread takes the first device */
+	workers = calloc(nr, sizeof(*workers));
+	for (i = 1; workers && i < nr; i++) {
+		ret = pthread_create(&workers[i].thread, NULL, prepare_thread,
+				     devs + i);
+		workers[i].started = !ret;
+	}
+	for (i = 0; i < nr; i++) {
+		if (!workers || !workers[i].started)
+			prepare_thread(devs + i);
+	}
+	for (i = 1; workers && i < nr; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
+
+	for (i = 0; i < nr; i++) {
+		dev = devs + i;
+		if (dev->ret) {
+			fprintf(stderr, "failed to zero %s %s %d\n",
+				dev->file, dev->error, dev->ret);
 			exit(1);
 		}
 	}
-	*block_count_ret = block_count;
 	return 0;
 }
 
+int btrfs_prepare_device(int fd, char *file, int zero_end, u64 *block_count_ret,
+			 int *mixed)
+{
+	struct btrfs_prepare_device dev;
+	int ret;
+
+	dev.fd = fd;
+	dev.file = file;
+	dev.zero_end = zero_end;
+	ret = btrfs_prepare_devices(&dev, 1, mixed);
+	*block_count_ret = dev.block_count;
+	return ret;
+}
+
 int btrfs_make_root_dir(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, u64 objectid)
 {
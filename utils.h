@@ -26,6 +26,24 @@ int make_btrfs(int fd, const char *device, const char *label,
 	       u32 leafsize, u32 sectorsize, u32 stripesize);
 int btrfs_make_root_dir(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, u64 objectid);
+
+/*
+ * a device for btrfs_prepare_devices.  Discarding and zeroing the
+ * device took discard_ms and zero_ms milliseconds.
+ */
+struct btrfs_prepare_device {
+	int fd;
+	char *file;
+	int zero_end;
+	u64 block_count;
+	u64 discard_ms;
+	u64 zero_ms;
+	int ret;
+	const char *error;
+};
+
+int btrfs_prepare_devices(struct btrfs_prepare_device *devs, int nr,
+			  int *mixed);
 int btrfs_prepare_device(int fd, char *file, int zero_end,
 			 u64 *block_count_ret, int *mixed);
 int btrfs_add_to_fsid(struct btrfs_trans_handle *trans,
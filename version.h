@@ -0,0 +1,4 @@
+#ifndef __BUILD_VERSION
+#define __BUILD_VERSION
+#define BTRFS_BUILD_VERSION "Btrfs Btrfs v0.19-dirty"
+#endif
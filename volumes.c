@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <uuid/uuid.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -169,6 +170,39 @@ again:
 	return 0;
 }
 
+/*
+ * read nr_requests for the disk behind fd out of sysfs.  For image files
+ * this is the disk holding the file.  Returns 0 if it can't be found.
+ */
+static u32 device_queue_depth(int fd)
+{
+	struct stat st;
+	char path[64];
+	unsigned int depth;
+	dev_t dev;
+	FILE *f;
+
+	if (fstat(fd, &st) < 0)
+		return 0;
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/nr_requests",
+		 major(dev), minor(dev));
+	f = fopen(path, "r");
+	if (!f) {
+		/* partitions share the queue of the whole disk */
+		snprintf(path, sizeof(path),
+			 "/sys/dev/block/%u:%u/../queue/nr_requests",
+			 major(dev), minor(dev));
+		f = fopen(path, "r");
+	}
+	if (!f)
+		return 0;
+	if (fscanf(f, "%u", &depth) != 1)
+		depth = 0;
+	fclose(f);
+	return depth;
+}
+
 int btrfs_open_devices(struct btrfs_fs_devices *fs_devices, int flags)
 {
 	int fd;
@@ -193,6 +227,7 @@ int btrfs_open_devices(struct btrfs_fs_devices *fs_devices, int flags)
 		if (device->devid == fs_devices->lowest_devid)
 			fs_devices->lowest_bdev = fd;
 		device->fd = fd;
+		device->reada_depth = device_queue_depth(fd);
 		if (flags == O_RDWR)
 			device->writeable = 1;
 	}
@@ -238,6 +273,21 @@ error:
 	return ret;
 }
 
+/*
+ * register the single device of a btrfs-image dump, disk_super is the
+ * super block after the dump's chunk mapping was applied
+ */
+int btrfs_scan_metadump_device(const char *path,
+			       struct btrfs_super_block *disk_super,
+			       struct btrfs_fs_devices **fs_devices_ret,
+			       u64 *total_devs)
+{
+	u64 devid = le64_to_cpu(disk_super->dev_item.devid);
+
+	*total_devs = 1;
+	return device_list_add(path, disk_super, devid, fs_devices_ret);
+}
+
 /*
  * this uses a pretty simple search, the expectation is that it is
  * called very infrequently and that a given device has a small number
@@ -1460,6 +1510,7 @@ static int read_one_dev(struct btrfs_root *root,
 		if (!device)
 			return -ENOMEM;
 		device->total_ios = 0;
+		device->reada_depth = 0;
 		list_add(&device->dev_list,
 			 &root->fs_info->fs_devices->devices);
 	}
@@ -25,6 +25,9 @@ struct btrfs_device {
 
 	u64 total_ios;
 
+	/* requests the disk queues, 0 if unknown.  Caps readahead batches */
+	u32 reada_depth;
+
 	int fd;
 
 	int writeable;
@@ -134,6 +137,10 @@ int btrfs_update_device(struct btrfs_trans_handle *trans,
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset);
+int btrfs_scan_metadump_device(const char *path,
+			       struct btrfs_super_block *disk_super,
+			       struct btrfs_fs_devices **fs_devices_ret,
+			       u64 *total_devs);
 int btrfs_num_copies(struct btrfs_mapping_tree *map_tree, u64 logical, u64 len);
 int btrfs_bootstrap_super_map(struct btrfs_mapping_tree *map_tree,
 			      struct btrfs_fs_devices *fs_devices);